@@ -69,6 +69,17 @@ int tpcancel(int cd);
 
 void tpreturn(int rval, long rcode, char *data, long len, long flags);
 
+// Deferred replies: tpdetach takes the request being served away from the
+// dispatch thread, the service routine returns and the reply is sent later
+// from any thread by tpreturn_ctx, which releases ctx. The request buffer
+// (svcinfo->data) and buffers allocated by the service before or after
+// tpdetach belong to the service until passed to tpreturn_ctx or tpfree.
+// Buffers of other requests served later must not be passed to it.
+typedef struct tpsvcctx_t TPSVCCTX;
+TPSVCCTX *tpdetach(long flags);
+int tpreturn_ctx(TPSVCCTX *ctx, int rval, long rcode, char *data, long len,
+                 long flags);
+
 int tpbegin(unsigned long timeout, long flags);
 int tpabort(long flags);
 int tpcommit(long flags);
@@ -88,6 +99,13 @@ int tpgetrply(int *cd, char **data, long *len, long flags);
 #define TPBLK_MILLISECOND 0x10
 int tpsblktime(int blktime, long flags);
 int tpgblktime(long flags);
+// Priority 1..100 of the next request, relative to the service's PRIO
+// unless flags is TPABSOLUTE
+int tpsprio(int prio, long flags);
+// Priority of the last request sent or received
+int tpgprio(void);
+// Sends requests held back for services with LINGER in UBBCONFIG
+int tpflush(long flags);
 
 #ifdef __cplusplus
 }
@@ -110,6 +110,11 @@ void Fboolpr32(char *tree, FILE *iop);
 int Fboolev32(FBFR32 *fbfr, char *tree);
 double Ffloatev32(FBFR32 *fbfr, char *tree);
 
+// Fuxedo extension: boolean expressions compiled to C by mkboolfn32
+typedef int (*FBOOLFN32)(FBFR32 *fbfr);
+int Fboolreg32(const char *name, FBOOLFN32 fn);
+FBOOLFN32 Fboolfn32(const char *name);
+
 char *CFfind32(FBFR32 *fbfr, FLDID32 fieldid, FLDOCC32 oc, FLDLEN32 *len,
                int type);
 int CFadd32(FBFR32 *fbfr, FLDID32 fieldid, char *value, FLDLEN32 len, int type);
@@ -0,0 +1,40 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TMTYPELEN 8
+#define TMSTYPELEN 16
+
+#define TMENCODE 1
+#define TMDECODE 2
+
+/* Buffer type switch entry, a subset of Tuxedo's tmtype_sw_t. Any of the
+ * functions may be NULL.
+ *
+ * initbuf, reinitbuf, uninitbuf return 1 on success and -1 on error.
+ * presend returns the number of bytes of ptr to send.
+ * postrecv returns the length of data or -1 on error.
+ * encdec converts between obj and encobj and returns the length of output.
+ * If the output does not fit into elen (TMENCODE) or olen (TMDECODE) bytes
+ * nothing is written and the caller retries with a bigger buffer. */
+struct tmtype_sw_t {
+  char type[TMTYPELEN];
+  char subtype[TMSTYPELEN];
+  long dfltsize;
+  int (*initbuf)(char *ptr, long mdlen);
+  int (*reinitbuf)(char *ptr, long mdlen);
+  int (*uninitbuf)(char *ptr, long mdlen);
+  long (*presend)(char *ptr, long dlen, long mdlen);
+  void (*postsend)(char *ptr, long dlen, long mdlen);
+  long (*postrecv)(char *ptr, long dlen, long mdlen);
+  long (*encdec)(int op, char *encobj, long elen, char *obj, long olen);
+};
+
+/* Adds a buffer type at runtime, returns -1 and sets tperrno on error */
+int tpregtype(const struct tmtype_sw_t *sw);
+
+#ifdef __cplusplus
+}
+#endif
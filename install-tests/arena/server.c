@@ -0,0 +1,22 @@
+#include <atmi.h>
+#include <string.h>
+#include <userlog.h>
+
+// Replies with buffers from the arena, which are not freed explicitly
+void SERVICE_TPSUCCESS(TPSVCINFO *svcinfo) {
+  userlog(":TEST: %s called", __func__);
+  char *scratch = tpalloc("STRING", NULL, 4096);
+  char *reply = tpalloc("STRING", NULL, svcinfo->len);
+  if (scratch == NULL || reply == NULL) {
+    tpreturn(TPFAIL, 0, svcinfo->data, 0, 0);
+  }
+  memcpy(reply, svcinfo->data, svcinfo->len);
+  tpreturn(TPSUCCESS, 1, reply, 0, 0);
+}
+
+void SERVICE_TPFAIL(TPSVCINFO *svcinfo) {
+  userlog(":TEST: %s called", __func__);
+  char *reply = tpalloc("STRING", NULL, svcinfo->len);
+  reply = tprealloc(reply, svcinfo->len * 2);
+  tpreturn(TPFAIL, 2, svcinfo->data, 0, 0);
+}
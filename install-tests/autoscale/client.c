@@ -0,0 +1,34 @@
+#include <assert.h>
+#include <atmi.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  char *buf = tpalloc("STRING", NULL, 6);
+  assert(buf != NULL);
+  strcpy(buf, "HELLO");
+  long len;
+
+  // One server would take 12 seconds, BBL starts more while requests wait
+  time_t start = time(NULL);
+  int cds[12];
+  for (int i = 0; i < 12; i++) {
+    cds[i] = tpacall("SLOW", buf, 0, 0);
+    assert(cds[i] > 0);
+  }
+  for (int i = 0; i < 12; i++) {
+    assert(tpgetrply(&cds[i], &buf, &len, 0) != -1);
+  }
+  time_t elapsed = time(NULL) - start;
+  fprintf(stderr, "12 calls took %ld seconds\n", (long)elapsed);
+  assert(elapsed < 10);
+
+  // Extra servers stop after the cool-down, the service is still there
+  sleep(6);
+  assert(tpcall("SLOW", buf, 0, &buf, &len, 0) != -1);
+
+  tpfree(buf);
+  return 0;
+}
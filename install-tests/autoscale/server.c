@@ -0,0 +1,13 @@
+#include <atmi.h>
+#include <unistd.h>
+#include <userlog.h>
+
+int tpsvrinit(int argc, char **argv) {
+  userlog(":TEST: %s called", __func__);
+  return 0;
+}
+
+void SLOW(TPSVCINFO *svcinfo) {
+  sleep(1);
+  tpreturn(TPSUCCESS, 0, svcinfo->data, 0, 0);
+}
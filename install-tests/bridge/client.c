@@ -0,0 +1,58 @@
+#include <assert.h>
+#include <atmi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  char *sndbuf = tpalloc("STRING", NULL, 6);
+  assert(sndbuf != NULL);
+  strcpy(sndbuf, "HELLO");
+
+  char *rcvbuf = tpalloc("STRING", NULL, 6);
+  assert(rcvbuf != NULL);
+
+  // Bridges need a moment to connect and exchange services
+  long rcvlen = 6;
+  int ret;
+  for (int i = 0; i < 100; i++) {
+    ret = tpcall("SERVICE_TPSUCCESS", sndbuf, 0, &rcvbuf, &rcvlen, 0);
+    if (ret != -1 || tperrno != TPENOENT) {
+      break;
+    }
+    usleep(100000);
+  }
+  if (ret == -1) {
+    fprintf(stderr, "%s\n", tpstrerror(tperrno));
+  }
+  assert(ret != -1);
+  assert(tpurcode == 1);
+  assert(strcmp(rcvbuf, "HELLO") == 0);
+
+  ret = tpcall("SERVICE_TPFAIL", sndbuf, 0, &rcvbuf, &rcvlen, 0);
+  assert(ret == -1);
+  assert(tperrno == TPESVCFAIL);
+  assert(tpurcode == 2);
+  assert(strcmp(rcvbuf, "HELLO") == 0);
+
+  // Many calls share one connection
+  int cds[20];
+  for (int i = 0; i < 20; i++) {
+    cds[i] = tpacall("SERVICE_TPSUCCESS", sndbuf, 0, 0);
+    assert(cds[i] != -1);
+  }
+  for (int i = 19; i >= 0; i--) {
+    ret = tpgetrply(&cds[i], &rcvbuf, &rcvlen, 0);
+    assert(ret != -1);
+    assert(strcmp(rcvbuf, "HELLO") == 0);
+  }
+
+  ret = tpcall("NO_SUCH_SERVICE", sndbuf, 0, &rcvbuf, &rcvlen, 0);
+  assert(ret == -1);
+  assert(tperrno == TPENOENT);
+
+  tpfree(sndbuf);
+  tpfree(rcvbuf);
+  return 0;
+}
@@ -0,0 +1,33 @@
+#include <assert.h>
+#include <atmi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void call(long len) {
+  char *sndbuf = tpalloc("STRING", NULL, len + 1);
+  assert(sndbuf != NULL);
+  for (long i = 0; i < len; i++) {
+    sndbuf[i] = "COMPRESS ME "[i % 12];
+  }
+  sndbuf[len] = '\0';
+
+  char *rcvbuf = tpalloc("STRING", NULL, 6);
+  assert(rcvbuf != NULL);
+  long rcvlen = 6;
+
+  int rc = tpcall("SERVICE", sndbuf, 0, &rcvbuf, &rcvlen, 0);
+  assert(rc != -1);
+  assert(strcmp(rcvbuf, sndbuf) == 0);
+
+  tpfree(sndbuf);
+  tpfree(rcvbuf);
+}
+
+int main(int argc, char *argv[]) {
+  // Below the limit, just above it and bigger than a System V message
+  call(5);
+  call(1100);
+  call(200000);
+  return 0;
+}
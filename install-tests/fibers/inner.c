@@ -0,0 +1,9 @@
+#include <atmi.h>
+#include <string.h>
+#include <unistd.h>
+
+void INNER(TPSVCINFO *svcinfo) {
+  sleep(1);
+  strcpy(svcinfo->data, "WORLD");
+  tpreturn(TPSUCCESS, 0, svcinfo->data, 0, 0);
+}
@@ -0,0 +1,24 @@
+#include <atmi.h>
+#include <string.h>
+#include <userlog.h>
+
+void OUTER(TPSVCINFO *svcinfo) {
+  char *buf = tpalloc("STRING", NULL, 6);
+  long len;
+  // Other fibers of the thread wait for their own replies meanwhile
+  int cd = tpacall("INNER", svcinfo->data, 0, 0);
+  if (cd == -1) {
+    userlog(":TEST: tpacall failed: %s", tpstrerror(tperrno));
+    tpreturn(TPFAIL, 0, buf, 0, 0);
+  }
+  int any;
+  if (tpgetrply(&any, &buf, &len, TPGETANY) == -1 || any != cd) {
+    userlog(":TEST: TPGETANY failed: %s", tpstrerror(tperrno));
+    tpreturn(TPFAIL, 0, buf, 0, 0);
+  }
+  if (tpcall("INNER", svcinfo->data, 0, &buf, &len, 0) == -1) {
+    userlog(":TEST: tpcall failed: %s", tpstrerror(tperrno));
+    tpreturn(TPFAIL, 0, buf, 0, 0);
+  }
+  tpreturn(TPSUCCESS, 0, buf, 0, 0);
+}
@@ -0,0 +1,43 @@
+#include <assert.h>
+#include <atmi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[]) {
+  char *sndbuf = tpalloc("STRING", NULL, 6);
+  assert(sndbuf != NULL);
+  strcpy(sndbuf, "HELLO");
+
+  char *rcvbuf = tpalloc("STRING", NULL, 6);
+  assert(rcvbuf != NULL);
+
+  long rcvlen = 6;
+  int ret = tpcall("SERVICEA", sndbuf, 0, &rcvbuf, &rcvlen, 0);
+  assert(ret != -1);
+  assert(strcmp(rcvbuf, "HELLO") == 0);
+
+  ret = tpcall("FAILSERVICE", sndbuf, 0, &rcvbuf, &rcvlen, 0);
+  assert(ret == -1);
+  assert(tperrno == TPESVCERR);
+
+  ret = tpcall("LOCALSERVICE", sndbuf, 0, &rcvbuf, &rcvlen, 0);
+  assert(ret != -1);
+  assert(strcmp(rcvbuf, "HELLO") == 0);
+
+  // Bigger than a System V message, passed through the heap both ways
+  long biglen = 200000;
+  char *bigbuf = tpalloc("STRING", NULL, biglen);
+  assert(bigbuf != NULL);
+  memset(bigbuf, 'x', biglen - 1);
+  bigbuf[biglen - 1] = '\0';
+  ret = tpcall("SERVICEA", bigbuf, 0, &bigbuf, &biglen, 0);
+  assert(ret != -1);
+  assert(strlen(bigbuf) == 199999);
+  assert(strspn(bigbuf, "x") == 199999);
+
+  tpfree(bigbuf);
+  tpfree(sndbuf);
+  tpfree(rcvbuf);
+  return 0;
+}
@@ -0,0 +1,30 @@
+#include <assert.h>
+#include <atmi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[]) {
+  char *buf = tpalloc("STRING", NULL, 6);
+  assert(buf != NULL);
+  strcpy(buf, "HELLO");
+  long len;
+
+  int stall = tpacall("STALL", buf, 0, 0);
+  assert(stall > 0);
+
+  // Some of them go to the queue of the stalled server
+  assert(tpsblktime(1, TPBLK_ALL) == 0);
+  for (int i = 0; i < 20; i++) {
+    int ret = tpcall("FAST", buf, 0, &buf, &len, 0);
+    if (ret == -1) {
+      fprintf(stderr, "FAST %d: %s\n", i, tpstrerror(tperrno));
+    }
+    assert(ret != -1);
+  }
+
+  assert(tpsblktime(10, TPBLK_NEXT) == 0);
+  assert(tpgetrply(&stall, &buf, &len, 0) != -1);
+  tpfree(buf);
+  return 0;
+}
@@ -0,0 +1,15 @@
+#include <atmi.h>
+#include <unistd.h>
+#include <userlog.h>
+
+// Blocks one server of the set, requests in its queue must be taken by
+// the others
+void STALL(TPSVCINFO *svcinfo) {
+  sleep(3);
+  tpreturn(TPSUCCESS, 0, svcinfo->data, 0, 0);
+}
+
+void FAST(TPSVCINFO *svcinfo) {
+  userlog(":TEST: %s called", __func__);
+  tpreturn(TPSUCCESS, 0, svcinfo->data, 0, 0);
+}
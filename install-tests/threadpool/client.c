@@ -0,0 +1,29 @@
+#include <assert.h>
+#include <atmi.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+int main(int argc, char *argv[]) {
+  char *buf = tpalloc("STRING", NULL, 6);
+  assert(buf != NULL);
+  strcpy(buf, "HELLO");
+  long len;
+
+  // One thread would take 8 seconds, the pool grows up to 4
+  time_t start = time(NULL);
+  int cds[8];
+  for (int i = 0; i < 8; i++) {
+    cds[i] = tpacall("SLOW", buf, 0, 0);
+    assert(cds[i] > 0);
+  }
+  for (int i = 0; i < 8; i++) {
+    assert(tpgetrply(&cds[i], &buf, &len, 0) != -1);
+  }
+  time_t elapsed = time(NULL) - start;
+  fprintf(stderr, "8 calls took %ld seconds\n", (long)elapsed);
+  assert(elapsed < 6);
+
+  tpfree(buf);
+  return 0;
+}
@@ -0,0 +1,50 @@
+#include <atmi.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <userlog.h>
+
+struct deferred {
+  TPSVCCTX *ctx;
+  char *data;
+};
+
+static void *complete(void *arg) {
+  struct deferred *d = arg;
+  sleep(1);
+  // Either the request buffer or one allocated from the arena before tpdetach
+  int fail = strcmp(d->data, "FAIL") == 0;
+  if (!fail) {
+    strcpy(d->data, "WORLD");
+  }
+  if (tpreturn_ctx(d->ctx, fail ? TPFAIL : TPSUCCESS, 42, d->data, 0, 0) ==
+      -1) {
+    userlog(":TEST: tpreturn_ctx failed: %s", tpstrerror(tperrno));
+  }
+  free(d);
+  return NULL;
+}
+
+void DEFER(TPSVCINFO *svcinfo) {
+  struct deferred *d = malloc(sizeof(*d));
+  d->data = svcinfo->data;
+  if (strcmp(svcinfo->data, "FAIL") == 0) {
+    d->data = tpalloc("STRING", NULL, 5);
+    strcpy(d->data, "FAIL");
+  }
+  d->ctx = tpdetach(0);
+  if (d->ctx == NULL) {
+    free(d);
+    tpreturn(TPFAIL, 0, NULL, 0, 0);
+  }
+  if (tpdetach(0) != NULL || tperrno != TPEPROTO) {
+    userlog(":TEST: second tpdetach did not fail");
+  }
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, complete, d);
+  pthread_detach(thread);
+  // Nothing is sent to the caller, buffers stay with the thread
+  tpreturn(TPSUCCESS, 0, NULL, 0, 0);
+}
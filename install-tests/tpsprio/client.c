@@ -0,0 +1,79 @@
+#include <assert.h>
+#include <atmi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int call(char *svc, char *buf) {
+  int cd = tpacall(svc, buf, 0, 0);
+  assert(cd > 0);
+  return cd;
+}
+
+int main(int argc, char *argv[]) {
+  char *buf = tpalloc("STRING", NULL, 6);
+  assert(buf != NULL);
+  strcpy(buf, "HELLO");
+  long len;
+
+  assert(tpsprio(0, 0) == 0);
+  int slow = call("SLOW", buf);
+  assert(tpgprio() == 50);
+
+  // Queued behind SLOW in this order
+  int bulk[5];
+  for (int i = 0; i < 5; i++) {
+    bulk[i] = call("BULK", buf);
+    assert(tpgprio() == 20);
+  }
+  int urgent = call("URGENT", buf);
+  assert(tpgprio() == 80);
+  assert(tpsprio(95, TPABSOLUTE) == 0);
+  int boosted = call("BULK", buf);
+  assert(tpgprio() == 95);
+  assert(tpsprio(-15, 0) == 0);
+  int lowered = call("URGENT", buf);
+  assert(tpgprio() == 65);
+  assert(tpsprio(1, 12345) == -1);
+  assert(tperrno == TPEINVAL);
+
+  int expected[] = {slow, boosted, urgent, lowered,
+                    bulk[0], bulk[1], bulk[2], bulk[3], bulk[4]};
+  long prios[] = {50, 95, 80, 65, 20, 20, 20, 20, 20};
+  for (int i = 0; i < 9; i++) {
+    int cd;
+    int ret = tpgetrply(&cd, &buf, &len, TPGETANY);
+    if (ret == -1) {
+      fprintf(stderr, "%s\n", tpstrerror(tperrno));
+    }
+    assert(ret != -1);
+    if (cd != expected[i] || tpurcode != prios[i]) {
+      fprintf(stderr, "reply %d: cd=%d prio=%ld, expected cd=%d prio=%ld\n",
+              i, cd, tpurcode, expected[i], prios[i]);
+      return 1;
+    }
+  }
+
+  // Urgent requests queued after a bulk one take it along before long
+  assert(tpsprio(0, 0) == 0);
+  slow = call("SLOW", buf);
+  int late = call("BULK", buf);
+  for (int i = 0; i < 12; i++) {
+    call("URGENT", buf);
+  }
+  int pos = -1;
+  for (int i = 0; i < 14; i++) {
+    int cd;
+    assert(tpgetrply(&cd, &buf, &len, TPGETANY) != -1);
+    if (cd == late) {
+      pos = i;
+    }
+  }
+  if (pos < 1 || pos > 10) {
+    fprintf(stderr, "BULK reply %d of 14\n", pos + 1);
+    return 1;
+  }
+
+  tpfree(buf);
+  return 0;
+}
@@ -0,0 +1,19 @@
+#include <atmi.h>
+#include <unistd.h>
+#include <userlog.h>
+
+// Keeps the server busy while the client queues requests
+void SLOW(TPSVCINFO *svcinfo) {
+  usleep(500000);
+  tpreturn(TPSUCCESS, tpgprio(), svcinfo->data, 0, 0);
+}
+
+void URGENT(TPSVCINFO *svcinfo) {
+  userlog(":TEST: %s called with priority %d", __func__, tpgprio());
+  tpreturn(TPSUCCESS, tpgprio(), svcinfo->data, 0, 0);
+}
+
+void BULK(TPSVCINFO *svcinfo) {
+  userlog(":TEST: %s called with priority %d", __func__, tpgprio());
+  tpreturn(TPSUCCESS, tpgprio(), svcinfo->data, 0, 0);
+}
@@ -0,0 +1,60 @@
+#include <assert.h>
+#include <atmi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CALLS 100
+
+int main(int argc, char *argv[]) {
+  char *sndbuf = tpalloc("STRING", NULL, 6);
+  assert(sndbuf != NULL);
+  strcpy(sndbuf, "HELLO");
+
+  char *rcvbuf = tpalloc("STRING", NULL, 6);
+  assert(rcvbuf != NULL);
+
+  long rcvlen = 6;
+  int ret = tpcall("SERVICE_TPSUCCESS", sndbuf, 0, &rcvbuf, &rcvlen, 0);
+  if (ret == -1) {
+    fprintf(stderr, "%s\n", tpstrerror(tperrno));
+  }
+  assert(ret != -1);
+  assert(tpurcode == 1);
+  assert(strcmp(rcvbuf, "HELLO") == 0);
+
+  memset(rcvbuf, 0, rcvlen);
+  ret = tpcall("SERVICE_TPFAIL", sndbuf, 0, &rcvbuf, &rcvlen, 0);
+  assert(ret == -1);
+  assert(tperrno == TPESVCFAIL);
+  assert(tpurcode == 2);
+  assert(strcmp(rcvbuf, "HELLO") == 0);
+
+  ret = tpcall("NO_SUCH_SERVICE", sndbuf, 0, &rcvbuf, &rcvlen, 0);
+  assert(ret == -1);
+  assert(tperrno == TPENOENT);
+
+  // Many calls in flight over the same connection
+  int cds[CALLS];
+  for (int i = 0; i < CALLS; i++) {
+    cds[i] = tpacall("SERVICE_TPSUCCESS", sndbuf, 0, 0);
+    assert(cds[i] > 0);
+  }
+  for (int i = CALLS - 1; i >= 0; i--) {
+    ret = tpgetrply(&cds[i], &rcvbuf, &rcvlen, 0);
+    assert(ret != -1);
+    assert(strcmp(rcvbuf, "HELLO") == 0);
+  }
+  for (int i = 0; i < CALLS; i++) {
+    assert(tpacall("SERVICE_TPSUCCESS", sndbuf, 0, 0) > 0);
+  }
+  for (int i = 0; i < CALLS; i++) {
+    int cd;
+    ret = tpgetrply(&cd, &rcvbuf, &rcvlen, TPGETANY);
+    assert(ret != -1);
+  }
+
+  tpfree(sndbuf);
+  tpfree(rcvbuf);
+  return 0;
+}
@@ -1,12 +1,17 @@
 // This file is part of Fuxedo
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
+#include <sys/wait.h>
 #include <xa.h>
 #include <algorithm>
+#include <map>
+#include <set>
 
 #include "fields.h"
 #include "fux.h"
+#include "ipc.h"
 #include "mib.h"
+#include "shmheap.h"
 
 #include <atmi.h>
 #include <stdio.h>
@@ -65,6 +70,10 @@ static void monitor_servers() {
   mib &m = getmib();
   auto servers = m.servers();
 
+  // Servers started by the autoscaler
+  while (waitpid(-1, nullptr, WNOHANG) > 0) {
+  }
+
   for (int i = servers->len - 1; i >= 0; i--) {
     auto &server = servers[i];
     if (server.pid == 0) {
@@ -95,13 +104,143 @@ static void monitor_clients() {
   }
 }
 
+// Blocks of dead processes and of messages in removed queues
+static void monitor_buffers() {
+  if (auto heap = fux::mem::shmheap::current()) {
+    auto n = heap->reclaim(fux::ipc::qexists);
+    if (n > 0) {
+      userlog("Reclaimed %zu shared heap blocks", n);
+    }
+  }
+}
+
+// Seconds requests must keep waiting before another server is started
+constexpr int scaleup_samples = 3;
+
+struct scale_state {
+  int high = 0;  // consecutive samples over the threshold
+  std::chrono::steady_clock::time_point calm_since =
+      std::chrono::steady_clock::now();
+};
+
+// Servers of a SERVERS entry by GRPNO and first SRVID
+static std::map<std::pair<uint16_t, uint16_t>, scale_state> scale_states;
+
+static void stop_server(mib &m, size_t idx) {
+  auto &srv = m.servers().at(idx);
+  auto &queue = m.queues().at(srv.rqaddr);
+
+  fux::fml32buf buf;
+  buf.put(FUX_SRVID, 0, srv.srvid);
+  buf.put(FUX_GRPNO, 0, srv.grpno);
+  fux::ipc::msg req;
+  req.set_data(reinterpret_cast<char *>(*buf.ptrptr()), 0);
+  req->cat = fux::ipc::admin;
+  {
+    // No new requests for it, the ones already waiting are served first
+    auto lock = m.data_lock();
+    m.unadvertise(idx);
+    req->mtype = queue.mtype--;
+  }
+  userlog("Stopping %s -g %d -i %d, load is gone", srv.servername, srv.grpno,
+          srv.srvid);
+  fux::ipc::qsend(srv.subq != -1 ? srv.subq : queue.msqid, req, 0,
+                  fux::ipc::flags::notime);
+}
+
+// Starts servers from slots above MIN while all running servers of the
+// entry are busy and at least SCALEUP requests per server keep waiting.
+// They are stopped one at a time after COOLDOWN seconds without waiting
+// requests.
+static void autoscale() {
+  mib &m = getmib();
+  auto servers = m.servers();
+  auto now = std::chrono::steady_clock::now();
+
+  std::map<std::pair<uint16_t, uint16_t>, std::vector<size_t>> sets;
+  for (size_t i = 0; i < servers->len; i++) {
+    auto &srv = servers[i];
+    if (srv.scaleup > 0) {
+      sets[{srv.grpno, srv.basesrvid}].push_back(i);
+    }
+  }
+
+  for (auto &[key, slots] : sets) {
+    auto &state = scale_states[key];
+    auto &first = servers[slots.front()];
+
+    std::set<int> queues;
+    size_t running = 0;
+    bool busy = true;
+    bool extra_busy = false;
+    ssize_t idle_slot = -1, extra = -1;
+    for (auto i : slots) {
+      auto &srv = servers[i];
+      if (srv.pid == 0) {
+        if (!srv.autostart && idle_slot == -1) {
+          idle_slot = i;
+        }
+        continue;
+      }
+      running++;
+      queues.insert(srv.subq != -1 ? srv.subq
+                                   : m.queues().at(srv.rqaddr).msqid);
+      busy = busy && srv.threads > 0 && srv.busy_threads >= srv.threads;
+      if (!srv.autostart) {
+        extra = i;
+        extra_busy = extra_busy || srv.busy_threads > 0;
+      }
+    }
+    if (running == 0) {
+      continue;
+    }
+
+    size_t waiting = 0;
+    for (auto msqid : queues) {
+      try {
+        waiting += fux::ipc::qlength(msqid);
+      } catch (const std::system_error &) {
+        // Not created yet or removed by tmshutdown
+      }
+    }
+
+    if (busy && waiting >= first.scaleup * running) {
+      state.high++;
+    } else {
+      state.high = 0;
+    }
+    if (waiting > 0 || extra_busy) {
+      state.calm_since = now;
+    }
+
+    if (state.high >= scaleup_samples && idle_slot != -1) {
+      auto &srv = servers[idle_slot];
+      srv.state = state_t::inactive;
+      auto pid = exec_server(srv);
+      if (pid > 0) {
+        srv.pid = pid;
+        userlog("Started %s -g %d -i %d, %zu requests waiting", srv.servername,
+                srv.grpno, srv.srvid, waiting);
+      }
+      state.high = 0;
+      state.calm_since = now;
+    } else if (extra != -1 &&
+               now - state.calm_since >= std::chrono::seconds(first.cooldown)) {
+      stop_server(m, extra);
+      state.calm_since = now;
+    }
+  }
+}
+
 static void run_watchdog() {
   while (true) {
     std::this_thread::sleep_for(std::chrono::seconds(1));
 
     handle_blocktime();
     monitor_servers();
+    autoscale();
     monitor_clients();
+    monitor_buffers();
   }
 }
 
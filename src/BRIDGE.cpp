@@ -0,0 +1,820 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atmi.h>
+#include <userlog.h>
+#include <clara.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ipc.h"
+#include "mib.h"
+#include "misc.h"
+#include "net.h"
+#include "svcrepo.h"
+
+// Bridge between machines of a domain. Services of other machines are
+// advertised on the bridge queue. Requests for them go over a TCP
+// connection to the bridge of that machine which sends them to the local
+// server with its own queue as the reply queue. Replies take the same way
+// back. Each connection carries calls of all clients, frames are appended
+// to the connection's send buffer and written in batches by the epoll
+// thread. The epoll thread never blocks on a local queue, messages for a
+// full queue wait in the bridge and are sent when there is room.
+
+namespace {
+
+using fux::net::frame_kind;
+
+constexpr uint64_t listen_id = 0;
+constexpr uint64_t wakeup_id = 1;
+// Calls without a reply are forgotten after this many BLOCKTIMEs, callers
+// have given up on them unless they set a much longer block time
+constexpr long call_expiry = 4;
+// Milliseconds between attempts to send to full local queues
+constexpr long retry_interval = 10;
+// Messages waiting for one full local queue before requests fail
+constexpr size_t max_waiting = 4096;
+
+struct connection : fux::net::connection {
+  using fux::net::connection::connection;
+  std::string lmid;  // empty until hello is received
+  bool connecting;
+  std::set<std::string> services;  // advertised by the other side
+};
+
+// Call waiting for a reply
+struct call {
+  uint64_t conn;
+  int cd;
+  int replyq;
+  std::chrono::steady_clock::time_point started;
+};
+
+struct peer {
+  std::string naddr;
+  bool logged;  // connection failure reported
+};
+
+class bridge {
+ public:
+  bridge(mib &m, size_t mib_server, ubbconfig &u)
+      : m_(m),
+        mib_server_(mib_server),
+        repo_(m, mib_server),
+        next_conn_(wakeup_id + 1),
+        next_cd_(0),
+        round_robin_(0),
+        wakeup_pending_(false),
+        stop_(false) {
+    {
+      auto lock = m_.data_lock();
+      requestq_ = m_.make_service_rqaddr(mib_server_);
+      auto accesser = m_.make_accesser(getpid());
+      replyq_ = m_.accessers().at(accesser).rpid =
+          fux::ipc::qcreate(m_.mach().transport);
+      lmid_ = m_.mach().lmid;
+      expiry_ = std::chrono::milliseconds(call_expiry * m_.mach().blocktime);
+    }
+
+    std::string naddr;
+    for (auto &net : u.network) {
+      if (net.first == lmid_) {
+        naddr = net.second["NADDR"];
+      } else if (net.first > lmid_) {
+        // Only one side connects
+        peers_[net.first] = {net.second["NADDR"], false};
+      }
+    }
+    if (naddr.empty()) {
+      throw std::out_of_range("NADDR required for LMID " + lmid_);
+    }
+
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ == -1) {
+      throw std::system_error(errno, std::system_category(),
+                              "epoll_create1 failed");
+    }
+    wakeupfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeupfd_ == -1) {
+      throw std::system_error(errno, std::system_category(),
+                              "eventfd failed");
+    }
+    watch(wakeupfd_, wakeup_id, EPOLLIN);
+    listen(naddr);
+  }
+
+  ~bridge() {
+    for (auto &c : conns_) {
+      close(c.second->fd);
+    }
+    close(listenfd_);
+    close(wakeupfd_);
+    close(epfd_);
+  }
+
+  void run() {
+    std::thread(&bridge::receive_requests, this).detach();
+    std::thread(&bridge::receive_replies, this).detach();
+
+    auto next_tick = std::chrono::steady_clock::now();
+    while (!stop_) {
+      auto now = std::chrono::steady_clock::now();
+      if (now >= next_tick) {
+        tick();
+        next_tick = now + std::chrono::milliseconds(500);
+      }
+      auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         next_tick - now)
+                         .count();
+      if (!waiting_.empty()) {
+        timeout = std::min(timeout, retry_interval);
+      }
+
+      epoll_event events[64];
+      int n = epoll_wait(epfd_, events, 64, timeout);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::system_error(errno, std::system_category(),
+                                "epoll_wait failed");
+      }
+      for (int i = 0; i < n; i++) {
+        auto id = events[i].data.u64;
+        if (id == listen_id) {
+          accept_all();
+        } else if (id == wakeup_id) {
+          uint64_t value;
+          (void)!read(wakeupfd_, &value, sizeof(value));
+          std::lock_guard<std::mutex> lock(mutex_);
+          wakeup_pending_ = false;
+          for (auto &c : conns_) {
+            flush(*c.second);
+          }
+        } else {
+          handle_events(id, events[i].events);
+        }
+      }
+      close_failed();
+      send_waiting();
+    }
+  }
+
+ private:
+  void watch(int fd, uint64_t id, uint32_t events) {
+    epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = id;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      throw std::system_error(errno, std::system_category(),
+                              "epoll_ctl failed");
+    }
+  }
+
+  void listen(const std::string &naddr) {
+    listenfd_ = fux::net::listen(naddr);
+    watch(listenfd_, listen_id, EPOLLIN);
+    userlog("BRIDGE %s listening on %s", lmid_.c_str(), naddr.c_str());
+  }
+
+  connection &add_connection(int fd, const std::string &lmid,
+                             bool connecting) {
+    auto id = next_conn_++;
+    auto c = std::make_unique<connection>(id, fd);
+    c->lmid = lmid;
+    c->connecting = connecting;
+    c->writing = connecting;
+    watch(fd, c->id, connecting ? EPOLLIN | EPOLLOUT : EPOLLIN);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    return *conns_.emplace(id, std::move(c)).first->second;
+  }
+
+  void accept_all() {
+    while (true) {
+      int fd = accept4(listenfd_, nullptr, nullptr,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          userlog("accept failed: %s", strerror(errno));
+        }
+        return;
+      }
+      established(add_connection(fd, "", false));
+    }
+  }
+
+  void connect_peer(const std::string &lmid, peer &p) {
+    int fd = fux::net::connect(p.naddr, SOCK_NONBLOCK);
+    if (fd == -1) {
+      if (!p.logged) {
+        userlog("Failed to connect to %s at %s: %s", lmid.c_str(),
+                p.naddr.c_str(), strerror(errno));
+        p.logged = true;
+      }
+      return;
+    }
+    add_connection(fd, lmid, true);
+  }
+
+  // Both sides introduce themselves and tell what they have
+  void established(connection &c) {
+    if (!c.lmid.empty()) {
+      peers_[c.lmid].logged = false;
+      userlog("Connected to %s", c.lmid.c_str());
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    c.append(frame_kind::hello, lmid_.data(), lmid_.size());
+    c.append(frame_kind::services, exported_.data(), exported_.size());
+    flush(c);
+  }
+
+  void handle_events(uint64_t id, uint32_t events) {
+    auto it = conns_.find(id);
+    if (it == conns_.end()) {
+      return;
+    }
+    auto &c = *it->second;
+    try {
+      if (c.connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+          auto &p = peers_[c.lmid];
+          if (!p.logged) {
+            userlog("Failed to connect to %s at %s: %s", c.lmid.c_str(),
+                    p.naddr.c_str(), strerror(err));
+            p.logged = true;
+          }
+          failed_.push_back(c.id);
+          return;
+        }
+        if (events & EPOLLOUT) {
+          c.connecting = false;
+          established(c);
+        }
+      }
+      if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        c.receive([&](frame_kind kind, const char *data, size_t len) {
+          handle_frame(c, kind, data, len);
+        });
+      }
+      if (events & EPOLLOUT) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flush(c);
+      }
+    } catch (const std::exception &e) {
+      userlog("Connection to %s failed: %s", c.lmid.c_str(), e.what());
+      failed_.push_back(c.id);
+    }
+  }
+
+  // Called by the epoll thread with mutex_ held
+  void flush(connection &c) {
+    if (!c.connecting && !c.flush(epfd_)) {
+      userlog("Connection to %s failed: %s", c.lmid.c_str(), strerror(errno));
+      failed_.push_back(c.id);
+    }
+  }
+
+  void wakeup() {
+    if (!wakeup_pending_) {
+      wakeup_pending_ = true;
+      uint64_t value = 1;
+      (void)!write(wakeupfd_, &value, sizeof(value));
+    }
+  }
+
+  void handle_frame(connection &c, frame_kind kind, const char *data,
+                    size_t len) {
+    if (kind == frame_kind::hello) {
+      if (c.lmid.empty()) {
+        c.lmid.assign(data, len);
+        userlog("Connected to %s", c.lmid.c_str());
+      }
+      return;
+    } else if (kind == frame_kind::services) {
+      std::set<std::string> services;
+      for (size_t pos = 0; pos < len;) {
+        auto end = std::find(data + pos, data + len, '\0');
+        services.emplace(data + pos, end);
+        pos = end - data + 1;
+      }
+      update_services(c, services);
+      return;
+    } else if (kind != frame_kind::request && kind != frame_kind::reply) {
+      throw std::runtime_error("unknown frame");
+    }
+
+    frame_.resize(len);
+    std::copy_n(data, len, frame_.buf());
+    if (len < sizeof(fux::ipc::msgmem) || frame_->heapoff != -1) {
+      throw std::runtime_error("invalid message");
+    }
+    frame_->cat = fux::ipc::application;
+    if (kind == frame_kind::request) {
+      call_local(c, frame_);
+    } else {
+      return_local(frame_);
+    }
+  }
+
+  // Request from another machine to a server of this machine
+  void call_local(connection &c, fux::ipc::msg &req) {
+    auto cd = req->cd;
+    bool reply = req->replyq != -1;
+    int msqid;
+    try {
+      msqid =
+          repo_.get_queue(-1, req->servicename, nullptr, &req->service);
+    } catch (const std::out_of_range &) {
+      return fail_remote(c, req, cd, reply, TPENOENT);
+    }
+
+    int id = 0;
+    if (reply) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = next_cd();
+      incoming_[id] = {c.id, cd, -1, std::chrono::steady_clock::now()};
+      req->cd = id;
+      req->replyq = replyq_;
+    }
+    try {
+      if (send_local(msqid, req)) {
+        return;
+      }
+      userlog("Failed to send request for %s: queue full", req->servicename);
+    } catch (const std::system_error &e) {
+      userlog("Failed to send request for %s: %s", req->servicename,
+              e.what());
+    }
+    if (reply) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      incoming_.erase(id);
+    }
+    fail_remote(c, req, cd, reply, TPESVCERR);
+  }
+
+  // Sends to a local queue or keeps the message until there is room,
+  // returns false if too many messages wait for the queue already. Called
+  // by the epoll thread.
+  bool send_local(int msqid, fux::ipc::msg &m) {
+    auto it = waiting_.find(msqid);
+    if (it == waiting_.end()) {
+      if (fux::ipc::qsend(msqid, m, 0, fux::ipc::flags::noblock)) {
+        return true;
+      }
+      it = waiting_.emplace(msqid, std::deque<fux::ipc::msg>()).first;
+    } else if (it->second.size() >= max_waiting) {
+      return false;
+    }
+    it->second.emplace_back();
+    it->second.back().swap(m);
+    return true;
+  }
+
+  // Sends messages kept by send_local in order
+  void send_waiting() {
+    for (auto it = waiting_.begin(); it != waiting_.end();) {
+      auto &msgs = it->second;
+      try {
+        while (!msgs.empty() && fux::ipc::qsend(it->first, msgs.front(), 0,
+                                                fux::ipc::flags::noblock)) {
+          msgs.pop_front();
+        }
+      } catch (const std::system_error &e) {
+        userlog("Dropped %zu messages for %0x: %s", msgs.size(), it->first,
+                e.what());
+        msgs.clear();
+      }
+      it = msgs.empty() ? waiting_.erase(it) : std::next(it);
+    }
+  }
+
+  // Returns the request to the caller as a failed reply
+  void fail_remote(connection &c, fux::ipc::msg &req, int cd, bool reply,
+                   int rval) {
+    if (!reply) {
+      return;
+    }
+    req->cd = cd;
+    req->rval = rval;
+    req->rcode = 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    c.append(frame_kind::reply, req.buf(), req.size());
+    wakeup();
+  }
+
+  // Reply from another machine to a client of this machine
+  void return_local(fux::ipc::msg &res) {
+    call caller;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = outgoing_.find(res->cd);
+      if (it == outgoing_.end()) {
+        return;
+      }
+      caller = it->second;
+      outgoing_.erase(it);
+    }
+    res->cd = caller.cd;
+    res->mtype = caller.cd;
+    try {
+      if (!send_local(caller.replyq, res)) {
+        userlog("Failed to send reply to %0x: queue full", caller.replyq);
+      }
+    } catch (const std::system_error &e) {
+      userlog("Failed to send reply to %0x: %s", caller.replyq, e.what());
+    }
+  }
+
+  // Requests from this machine to services of other machines
+  void receive_requests() {
+    fux::ipc::msg req, frame;
+    try {
+      while (true) {
+        fux::ipc::qrecv(requestq_, req, 0, 0);
+        if (req->ttype == fux::ipc::frames) {
+          size_t pos = 0;
+          while (fux::ipc::qnext(req, pos, frame)) {
+            call_remote(frame);
+          }
+        } else if (req->cat == fux::ipc::admin) {
+          userlog("Received admin message, shutting down");
+          break;
+        } else {
+          call_remote(req);
+        }
+      }
+    } catch (const std::exception &e) {
+      userlog("Failed to receive requests: %s", e.what());
+    }
+    stop();
+  }
+
+  void call_remote(fux::ipc::msg &req) {
+    if (req->flags & TPTRAN) {
+      // Transaction tables are local to the machine
+      return fail_local(req, TPETRAN);
+    }
+    // Service slots are local to the machine, the other side needs the name
+    if (req->service != -1) {
+      checked_copy(m_.services().at(req->service).servicename,
+                   req->servicename);
+      req->service = -1;
+    }
+    try {
+      req.unshare();
+    } catch (const std::runtime_error &e) {
+      userlog("Dropped request for %s: %s", req->servicename, e.what());
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (auto c = provider(req->servicename)) {
+        if (req->replyq != -1) {
+          auto id = next_cd();
+          outgoing_[id] = {c->id, req->cd, req->replyq,
+                           std::chrono::steady_clock::now()};
+          req->cd = id;
+        }
+        c->append(frame_kind::request, req.buf(), req.size());
+        wakeup();
+        return;
+      }
+    }
+    fail_local(req, TPENOENT);
+  }
+
+  // Returns the request to the caller as a failed reply
+  void fail_local(fux::ipc::msg &req, int rval) {
+    if (req->replyq == -1) {
+      return;
+    }
+    req->rval = rval;
+    req->rcode = 0;
+    req->mtype = req->cd;
+    try {
+      fux::ipc::qsend(req->replyq, req, 0, fux::ipc::flags::notime);
+    } catch (const std::system_error &e) {
+      userlog("Failed to send reply to %0x: %s", req->replyq, e.what());
+    }
+  }
+
+  // Replies of servers of this machine to other machines
+  void receive_replies() {
+    fux::ipc::msg res, frame;
+    try {
+      while (true) {
+        fux::ipc::qrecv(replyq_, res, 0, 0);
+        if (res->ttype == fux::ipc::frames) {
+          size_t pos = 0;
+          while (fux::ipc::qnext(res, pos, frame)) {
+            return_remote(frame);
+          }
+        } else {
+          return_remote(res);
+        }
+      }
+    } catch (const std::exception &e) {
+      userlog("Failed to receive replies: %s", e.what());
+    }
+    stop();
+  }
+
+  void return_remote(fux::ipc::msg &res) {
+    try {
+      res.unshare();
+    } catch (const std::runtime_error &e) {
+      userlog("Dropped reply: %s", e.what());
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = incoming_.find(res->cd);
+    if (it == incoming_.end()) {
+      return;
+    }
+    auto c = conns_.find(it->second.conn);
+    res->cd = it->second.cd;
+    incoming_.erase(it);
+    if (c != conns_.end()) {
+      c->second->append(frame_kind::reply, res.buf(), res.size());
+      wakeup();
+    }
+  }
+
+  void stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    wakeup_pending_ = false;
+    wakeup();
+  }
+
+  // Connection to one of the machines advertising the service, mutex_ must
+  // be held
+  connection *provider(const char *servicename) {
+    auto it = providers_.find(servicename);
+    if (it == providers_.end() || it->second.empty()) {
+      return nullptr;
+    }
+    auto &conns = it->second;
+    return conns_.at(conns[round_robin_++ % conns.size()]).get();
+  }
+
+  int next_cd() {
+    next_cd_ = next_cd_ == INT_MAX ? 1 : next_cd_ + 1;
+    return next_cd_;
+  }
+
+  void update_services(connection &c, const std::set<std::string> &services) {
+    std::vector<std::string> added, removed;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto &name : c.services) {
+        if (services.count(name) == 0) {
+          auto &conns = providers_[name];
+          conns.erase(std::remove(conns.begin(), conns.end(), c.id),
+                      conns.end());
+          if (conns.empty()) {
+            providers_.erase(name);
+            removed.push_back(name);
+          }
+        }
+      }
+      for (auto &name : services) {
+        if (c.services.count(name) == 0) {
+          auto &conns = providers_[name];
+          conns.push_back(c.id);
+          if (conns.size() == 1) {
+            added.push_back(name);
+          }
+        }
+      }
+      c.services = services;
+    }
+
+    auto lock = m_.data_lock();
+    auto rqaddr = m_.servers().at(mib_server_).rqaddr;
+    for (auto &name : removed) {
+      try {
+        m_.unadvertise(name, rqaddr, mib_server_);
+      } catch (const std::exception &e) {
+        userlog("Failed to unadvertise %s: %s", name.c_str(), e.what());
+      }
+    }
+    for (auto &name : added) {
+      try {
+        m_.advertise(name, rqaddr, mib_server_);
+      } catch (const std::exception &e) {
+        userlog("Failed to advertise %s: %s", name.c_str(), e.what());
+      }
+    }
+  }
+
+  // Services of servers on this machine, separated by '\0'
+  std::string local_services() {
+    std::set<std::string> names;
+    {
+      auto lock = m_.data_lock();
+      auto adv = m_.advertisements();
+      for (size_t i = 0; i < adv->len; i++) {
+        auto &a = adv.at(i);
+        if (a.service != mib::badoff && a.server != mib_server_) {
+          names.insert(m_.services().at(a.service).servicename);
+        }
+      }
+    }
+    std::string result;
+    for (auto &name : names) {
+      result.append(name.c_str(), name.size() + 1);
+    }
+    return result;
+  }
+
+  // Replies to these calls got lost or will never come
+  void expire_calls() {
+    // Callers wait without a timeout
+    if (expiry_.count() <= 0) {
+      return;
+    }
+    auto oldest = std::chrono::steady_clock::now() - expiry_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t expired = 0;
+    for (auto calls : {&outgoing_, &incoming_}) {
+      for (auto i = calls->begin(); i != calls->end();) {
+        if (i->second.started < oldest) {
+          i = calls->erase(i);
+          expired++;
+        } else {
+          i++;
+        }
+      }
+    }
+    if (expired > 0) {
+      userlog("Forgot %zu calls without reply", expired);
+    }
+  }
+
+  void tick() {
+    expire_calls();
+    auto services = local_services();
+    if (services != exported_) {
+      exported_ = services;
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto &c : conns_) {
+        if (!c.second->connecting) {
+          c.second->append(frame_kind::services, exported_.data(),
+                           exported_.size());
+        }
+      }
+      wakeup();
+    }
+
+    for (auto &p : peers_) {
+      auto it = std::find_if(conns_.begin(), conns_.end(), [&](auto &c) {
+        return c.second->lmid == p.first;
+      });
+      if (it == conns_.end()) {
+        connect_peer(p.first, p.second);
+      }
+    }
+  }
+
+  void close_failed() {
+    for (auto id : failed_) {
+      auto it = conns_.find(id);
+      if (it == conns_.end()) {
+        continue;
+      }
+      auto &c = *it->second;
+      update_services(c, {});
+
+      std::vector<call> lost;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto i = outgoing_.begin(); i != outgoing_.end();) {
+          if (i->second.conn == id) {
+            lost.push_back(i->second);
+            i = outgoing_.erase(i);
+          } else {
+            i++;
+          }
+        }
+      }
+      if (!c.connecting) {
+        userlog("Disconnected from %s, %zu calls without reply",
+                c.lmid.c_str(), lost.size());
+      }
+      // Callers do not have to wait for the timeout
+      for (auto &caller : lost) {
+        fux::ipc::msg res;
+        res->cd = caller.cd;
+        res->mtype = caller.cd;
+        res->rval = TPESVCERR;
+        try {
+          send_local(caller.replyq, res);
+        } catch (const std::system_error &e) {
+          userlog("Failed to send reply to %0x: %s", caller.replyq, e.what());
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      epoll_ctl(epfd_, EPOLL_CTL_DEL, c.fd, nullptr);
+      close(c.fd);
+      conns_.erase(it);
+    }
+    failed_.clear();
+  }
+
+  mib &m_;
+  size_t mib_server_;
+  service_repository repo_;
+  int requestq_;
+  int replyq_;
+  std::string lmid_;
+  std::chrono::milliseconds expiry_;
+  std::map<std::string, peer> peers_;
+
+  int epfd_;
+  int listenfd_;
+  int wakeupfd_;
+  std::vector<uint64_t> failed_;
+  std::map<int, std::deque<fux::ipc::msg>> waiting_;  // for full queues
+  fux::ipc::msg frame_;
+  std::string exported_;
+
+  // Shared with queue threads
+  std::mutex mutex_;
+  std::map<uint64_t, std::unique_ptr<connection>> conns_;
+  uint64_t next_conn_;
+  std::map<std::string, std::vector<uint64_t>> providers_;
+  std::map<int, call> outgoing_;  // calls waiting for other machines
+  std::map<int, call> incoming_;  // calls of other machines
+  int next_cd_;
+  size_t round_robin_;
+  bool wakeup_pending_;
+  std::atomic<bool> stop_;
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bool show_help = false;
+  bool all = false;
+  int grpno = 0;
+  int srvid = -1;
+
+  auto parser =
+      clara::Help(show_help) |
+      clara::Opt(srvid, "SRVID")["-i"]("server's SRVID in TUXCONFIG") |
+      clara::Opt(grpno, "GRPNO")["-g"]("server's GRPNO in TUXCONFIG") |
+      clara::Opt(all)["-A"]("advertise all services");
+
+  auto result = parser.parse(clara::Args(argc, argv));
+  if (!result) {
+    std::cerr << parser;
+    return -1;
+  }
+  if (show_help) {
+    std::cout << parser;
+    return 0;
+  }
+
+  try {
+    mib &m = getmib();
+    ubbconfig u;
+    getconfig(&u);
+
+    auto srv = m.find_server(srvid, grpno);
+    if (srv == mib::badoff) {
+      throw std::out_of_range("Server not found in TUXCONFIG");
+    }
+    bridge b(m, srv, u);
+    m.servers().at(srv).state = state_t::active;
+    b.run();
+  } catch (const std::exception &e) {
+    userlog("BRIDGE failed: %s", e.what());
+    return -1;
+  }
+  return 0;
+}
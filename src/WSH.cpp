@@ -0,0 +1,499 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atmi.h>
+#include <userlog.h>
+#include <clara.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ipc.h"
+#include "mib.h"
+#include "misc.h"
+#include "net.h"
+#include "shmheap.h"
+#include "svcrepo.h"
+
+// Workstation handler started by WSL. WSL passes accepted connections of
+// workstation clients over the control socket. Requests of all clients are
+// sent to servers with the handler's queue as the reply queue, replies are
+// appended to send buffers of sessions and written by the epoll thread.
+
+namespace {
+
+using fux::net::frame_kind;
+
+constexpr uint64_t control_id = 0;
+constexpr uint64_t wakeup_id = 1;
+// Calls without a reply are forgotten after this many BLOCKTIMEs, clients
+// have given up on them by then
+constexpr long call_expiry = 4;
+// Milliseconds between attempts to send to full server queues
+constexpr long retry_interval = 10;
+// Requests waiting for one full server queue before new ones fail
+constexpr size_t max_waiting = 4096;
+
+using session = fux::net::connection;
+
+// Call waiting for a reply
+struct call {
+  uint64_t session;
+  int cd;
+  std::chrono::steady_clock::time_point started;
+};
+
+class handler {
+ public:
+  handler(mib &m, int controlfd)
+      : m_(m),
+        repo_(m),
+        controlfd_(controlfd),
+        next_session_(wakeup_id + 1),
+        next_cd_(0),
+        wakeup_pending_(false),
+        stop_(false) {
+    {
+      auto lock = m_.data_lock();
+      auto accesser = m_.make_accesser(getpid());
+      replyq_ = m_.accessers().at(accesser).rpid =
+          fux::ipc::qcreate(m_.mach().transport);
+      blocktime_ = m_.mach().blocktime;
+    }
+    max_request_ = max_request();
+
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ == -1) {
+      throw std::system_error(errno, std::system_category(),
+                              "epoll_create1 failed");
+    }
+    wakeupfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeupfd_ == -1) {
+      throw std::system_error(errno, std::system_category(),
+                              "eventfd failed");
+    }
+    watch(controlfd_, control_id);
+    watch(wakeupfd_, wakeup_id);
+  }
+
+  ~handler() {
+    for (auto &s : sessions_) {
+      close(s.second->fd);
+    }
+    close(wakeupfd_);
+    close(epfd_);
+  }
+
+  void run() {
+    std::thread(&handler::receive_replies, this).detach();
+
+    auto next_tick = std::chrono::steady_clock::now();
+    while (!stop_) {
+      auto now = std::chrono::steady_clock::now();
+      if (now >= next_tick) {
+        expire_calls();
+        next_tick = now + std::chrono::milliseconds(500);
+      }
+      auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         next_tick - now)
+                         .count();
+      if (!waiting_.empty()) {
+        timeout = std::min(timeout, retry_interval);
+      }
+
+      epoll_event events[64];
+      int n = epoll_wait(epfd_, events, 64, timeout);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::system_error(errno, std::system_category(),
+                                "epoll_wait failed");
+      }
+      for (int i = 0; i < n; i++) {
+        auto id = events[i].data.u64;
+        if (id == control_id) {
+          add_session();
+        } else if (id == wakeup_id) {
+          uint64_t value;
+          (void)!read(wakeupfd_, &value, sizeof(value));
+          std::lock_guard<std::mutex> lock(mutex_);
+          wakeup_pending_ = false;
+          for (auto &s : sessions_) {
+            flush(*s.second);
+          }
+        } else {
+          handle_events(id, events[i].events);
+        }
+      }
+      close_failed();
+      send_waiting();
+    }
+  }
+
+ private:
+  // Largest request a client may send, bigger ones would not fit in the
+  // shared heap that passes messages above qmsgmax
+  static uint32_t max_request() {
+    size_t limit = fux::ipc::qmsgmax();
+    if (auto heap = fux::mem::shmheap::current()) {
+      limit = std::max(limit, heap->statistics().capacity);
+    }
+    return uint32_t(std::min(limit, size_t(fux::net::max_frame)));
+  }
+
+  void watch(int fd, uint64_t id) {
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = id;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      throw std::system_error(errno, std::system_category(),
+                              "epoll_ctl failed");
+    }
+  }
+
+  void add_session() {
+    int fd = fux::net::recv_fd(controlfd_);
+    if (fd == -1) {
+      // WSL is gone
+      stop_ = true;
+      return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    auto id = next_session_++;
+    watch(fd, id);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &s = *sessions_.emplace(id, std::make_unique<session>(id, fd))
+                   .first->second;
+    s.max_len = max_request_;
+    s.append(frame_kind::hello, reinterpret_cast<char *>(&blocktime_),
+             sizeof(blocktime_));
+    flush(s);
+  }
+
+  void handle_events(uint64_t id, uint32_t events) {
+    auto it = sessions_.find(id);
+    if (it == sessions_.end()) {
+      return;
+    }
+    auto &s = *it->second;
+    try {
+      if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        s.receive([&](frame_kind kind, const char *data, size_t len) {
+          handle_frame(s, kind, data, len);
+        });
+      }
+      if (events & EPOLLOUT) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flush(s);
+      }
+    } catch (const std::exception &e) {
+      failed_.push_back(s.id);
+    }
+  }
+
+  // Called by the epoll thread with mutex_ held
+  void flush(session &s) {
+    if (!s.flush(epfd_)) {
+      failed_.push_back(s.id);
+    }
+  }
+
+  void wakeup() {
+    if (!wakeup_pending_) {
+      wakeup_pending_ = true;
+      uint64_t value = 1;
+      (void)!write(wakeupfd_, &value, sizeof(value));
+    }
+  }
+
+  void handle_frame(session &s, frame_kind kind, const char *data,
+                    size_t len) {
+    if (kind != frame_kind::request) {
+      throw std::runtime_error("unknown frame");
+    }
+    frame_.resize(len);
+    std::copy_n(data, len, frame_.buf());
+    // Workstation clients have no access to the shared heap
+    if (len < sizeof(fux::ipc::msgmem) || frame_->heapoff != -1 ||
+        frame_->ttype != fux::ipc::queue) {
+      throw std::runtime_error("invalid message");
+    }
+    // Servers trust the size of compressed data
+    if (frame_->rawlen != 0) {
+      if (frame_->rawlen < 0 || frame_->rawlen > long(max_request_)) {
+        throw std::runtime_error("invalid message");
+      }
+      raw_.resize(frame_->rawlen);
+      if (lzdecompress(frame_->data, len - sizeof(fux::ipc::msgmem),
+                       raw_.data(), raw_.size()) != raw_.size()) {
+        throw std::runtime_error("invalid compressed message");
+      }
+    }
+    frame_->servicename[sizeof(frame_->servicename) - 1] = '\0';
+    frame_->cat = fux::ipc::application;
+    frame_->flags = 0;
+    frame_->gttid = fux::bad_gttid;
+    call_local(s, frame_);
+  }
+
+  void call_local(session &s, fux::ipc::msg &req) {
+    auto cd = req->cd;
+    bool reply = req->replyq != -1;
+    int msqid;
+    service_options options;
+    try {
+      msqid = repo_.get_queue(-1, req->servicename, &options,
+                              &req->service);
+    } catch (const std::out_of_range &) {
+      return fail(s, req, cd, reply, TPENOENT);
+    }
+    if (req->mtype < fux::ipc::priority_mtype(fux::ipc::max_priority) ||
+        req->mtype > fux::ipc::priority_mtype(fux::ipc::min_priority)) {
+      req->mtype = fux::ipc::priority_mtype(options.prio);
+    }
+
+    int id = 0;
+    if (reply) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = next_cd();
+      calls_[id] = {s.id, cd, std::chrono::steady_clock::now()};
+      req->cd = id;
+      req->replyq = replyq_;
+    }
+    try {
+      if (send_local(msqid, req)) {
+        return;
+      }
+      userlog("Failed to send request for %s: queue full", req->servicename);
+    } catch (const std::system_error &e) {
+      userlog("Failed to send request for %s: %s", req->servicename,
+              e.what());
+    }
+    if (reply) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      calls_.erase(id);
+    }
+    fail(s, req, cd, reply, TPESVCERR);
+  }
+
+  // Sends to a server queue or keeps the request until there is room, one
+  // full queue must not stall the other sessions. Returns false if too many
+  // requests wait for the queue already.
+  bool send_local(int msqid, fux::ipc::msg &m) {
+    auto it = waiting_.find(msqid);
+    if (it == waiting_.end()) {
+      if (fux::ipc::qsend(msqid, m, 0, fux::ipc::flags::noblock)) {
+        return true;
+      }
+      it = waiting_.emplace(msqid, std::deque<fux::ipc::msg>()).first;
+    } else if (it->second.size() >= max_waiting) {
+      return false;
+    }
+    it->second.emplace_back();
+    it->second.back().swap(m);
+    return true;
+  }
+
+  // Sends requests kept by send_local in order
+  void send_waiting() {
+    for (auto it = waiting_.begin(); it != waiting_.end();) {
+      auto &msgs = it->second;
+      try {
+        while (!msgs.empty() && fux::ipc::qsend(it->first, msgs.front(), 0,
+                                                fux::ipc::flags::noblock)) {
+          msgs.pop_front();
+        }
+      } catch (const std::system_error &e) {
+        userlog("Dropped %zu requests for %0x: %s", msgs.size(), it->first,
+                e.what());
+        msgs.clear();
+      }
+      it = msgs.empty() ? waiting_.erase(it) : std::next(it);
+    }
+  }
+
+  // Replies to these calls got lost or will never come
+  void expire_calls() {
+    if (blocktime_ <= 0) {
+      return;
+    }
+    auto oldest = std::chrono::steady_clock::now() -
+                  std::chrono::milliseconds(call_expiry * blocktime_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t expired = 0;
+    for (auto i = calls_.begin(); i != calls_.end();) {
+      if (i->second.started < oldest) {
+        i = calls_.erase(i);
+        expired++;
+      } else {
+        i++;
+      }
+    }
+    if (expired > 0) {
+      userlog("Forgot %zu calls without reply", expired);
+    }
+  }
+
+  // Returns the request to the client as a failed reply
+  void fail(session &s, fux::ipc::msg &req, int cd, bool reply, int rval) {
+    if (!reply) {
+      return;
+    }
+    req->cd = cd;
+    req->rval = rval;
+    req->rcode = 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    s.append(frame_kind::reply, req.buf(), req.size());
+    flush(s);
+  }
+
+  void receive_replies() {
+    fux::ipc::msg res, frame;
+    try {
+      while (true) {
+        fux::ipc::qrecv(replyq_, res, 0, 0);
+        if (res->ttype == fux::ipc::frames) {
+          size_t pos = 0;
+          while (fux::ipc::qnext(res, pos, frame)) {
+            return_remote(frame);
+          }
+        } else if (res->cat == fux::ipc::application) {
+          return_remote(res);
+        }
+      }
+    } catch (const std::exception &e) {
+      userlog("Failed to receive replies: %s", e.what());
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    wakeup_pending_ = false;
+    wakeup();
+  }
+
+  void return_remote(fux::ipc::msg &res) {
+    try {
+      res.unshare();
+    } catch (const std::runtime_error &e) {
+      userlog("Dropped reply: %s", e.what());
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = calls_.find(res->cd);
+    if (it == calls_.end()) {
+      return;
+    }
+    auto s = sessions_.find(it->second.session);
+    res->cd = it->second.cd;
+    calls_.erase(it);
+    if (s != sessions_.end()) {
+      s->second->append(frame_kind::reply, res.buf(), res.size());
+      wakeup();
+    }
+  }
+
+  int next_cd() {
+    next_cd_ = next_cd_ == INT_MAX ? 1 : next_cd_ + 1;
+    return next_cd_;
+  }
+
+  void close_failed() {
+    for (auto id : failed_) {
+      auto it = sessions_.find(id);
+      if (it == sessions_.end()) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto i = calls_.begin(); i != calls_.end();) {
+        if (i->second.session == id) {
+          i = calls_.erase(i);
+        } else {
+          i++;
+        }
+      }
+      epoll_ctl(epfd_, EPOLL_CTL_DEL, it->second->fd, nullptr);
+      close(it->second->fd);
+      sessions_.erase(it);
+    }
+    failed_.clear();
+  }
+
+  mib &m_;
+  service_repository repo_;
+  int controlfd_;
+  int replyq_;
+  long blocktime_;
+  uint32_t max_request_;
+
+  int epfd_;
+  int wakeupfd_;
+  std::vector<uint64_t> failed_;
+  std::map<int, std::deque<fux::ipc::msg>> waiting_;  // for full queues
+  fux::ipc::msg frame_;
+  std::vector<char> raw_;
+
+  // Shared with the reply thread
+  std::mutex mutex_;
+  std::map<uint64_t, std::unique_ptr<session>> sessions_;
+  uint64_t next_session_;
+  std::map<int, call> calls_;
+  int next_cd_;
+  bool wakeup_pending_;
+  std::atomic<bool> stop_;
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bool show_help = false;
+  int controlfd = -1;
+
+  auto parser =
+      clara::Help(show_help) |
+      clara::Opt(controlfd, "FD")["-f"]("socket passing connections from WSL");
+
+  auto result = parser.parse(clara::Args(argc, argv));
+  if (!result) {
+    std::cerr << parser;
+    return -1;
+  }
+  if (show_help) {
+    std::cout << parser;
+    return 0;
+  }
+  if (controlfd == -1) {
+    std::cerr << parser;
+    return -1;
+  }
+
+  try {
+    mib &m = getmib();
+    handler h(m, controlfd);
+    h.run();
+  } catch (const std::exception &e) {
+    userlog("WSH failed: %s", e.what());
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,164 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atmi.h>
+#include <userlog.h>
+#include <clara.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ipc.h"
+#include "mib.h"
+#include "misc.h"
+#include "net.h"
+
+// Workstation listener. Accepts connections of workstation clients and
+// passes them round-robin to WSH processes, each of them serves many
+// clients. Options come after -- in CLOPT:
+//   -n NADDR  address to listen on, //host:port
+//   -m NUM    number of WSH processes, 1 by default
+
+namespace {
+
+struct wsh {
+  pid_t pid;
+  int sock;  // connections are passed over it
+};
+
+wsh start_handler() {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+    throw std::system_error(errno, std::system_category(),
+                            "socketpair failed");
+  }
+  auto pid = fork();
+  if (pid == -1) {
+    throw std::system_error(errno, std::system_category(), "fork failed");
+  } else if (pid == 0) {
+    fcntl(sv[1], F_SETFD, 0);
+    auto fd = std::to_string(sv[1]);
+    execlp("WSH", "WSH", "-f", fd.c_str(), nullptr);
+    _exit(-1);
+  }
+  close(sv[1]);
+  return {pid, sv[0]};
+}
+
+void accept_clients(int listenfd, const std::vector<wsh> &handlers) {
+  size_t next = 0;
+  while (true) {
+    int fd = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        userlog("accept failed: %s", strerror(errno));
+      }
+      continue;
+    }
+    try {
+      fux::net::send_fd(handlers[next++ % handlers.size()].sock, fd);
+    } catch (const std::system_error &e) {
+      userlog("Failed to pass connection to WSH: %s", e.what());
+    }
+    close(fd);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bool show_help = false;
+  bool all = false;
+  int grpno = 0;
+  int srvid = -1;
+
+  auto parser =
+      clara::Help(show_help) |
+      clara::Opt(srvid, "SRVID")["-i"]("server's SRVID in TUXCONFIG") |
+      clara::Opt(grpno, "GRPNO")["-g"]("server's GRPNO in TUXCONFIG") |
+      clara::Opt(all)["-A"]("advertise all services");
+
+  auto result = parser.parse(clara::Args(argc, argv));
+  if (!result) {
+    std::cerr << parser;
+    return -1;
+  }
+  if (show_help) {
+    std::cout << parser;
+    return 0;
+  }
+
+  try {
+    mib &m = getmib();
+    auto srv = m.find_server(srvid, grpno);
+    if (srv == mib::badoff) {
+      throw std::out_of_range("Server not found in TUXCONFIG");
+    }
+
+    std::string naddr;
+    int nhandlers = 1;
+    auto wsparser =
+        clara::Opt(naddr, "NADDR")["-n"]("address to listen on") |
+        clara::Opt(nhandlers, "NUM")["-m"]("number of WSH processes");
+    auto clopt = fux::split(m.servers().at(srv).clopt, " ");
+    auto sep = std::find(clopt.begin(), clopt.end(), "--");
+    std::vector<char *> args = {argv[0]};
+    for (auto it = sep == clopt.end() ? sep : sep + 1; it != clopt.end();
+         ++it) {
+      if (!it->empty()) {
+        args.push_back(&(*it)[0]);
+      }
+    }
+    if (auto r = wsparser.parse(clara::Args(args.size(), &args[0])); !r) {
+      throw std::invalid_argument("Invalid CLOPT: " + r.errorMessage());
+    }
+    if (naddr.empty() || nhandlers < 1) {
+      throw std::invalid_argument("CLOPT requires -n NADDR and -m > 0");
+    }
+
+    int listenfd = fux::net::listen(naddr);
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) & ~O_NONBLOCK);
+
+    std::vector<wsh> handlers;
+    for (int i = 0; i < nhandlers; i++) {
+      handlers.push_back(start_handler());
+    }
+    int requestq;
+    {
+      auto lock = m.data_lock();
+      requestq = m.make_service_rqaddr(srv);
+    }
+    userlog("WSL listening on %s with %d WSH", naddr.c_str(), nhandlers);
+    std::thread(accept_clients, listenfd, handlers).detach();
+    m.servers().at(srv).state = state_t::active;
+
+    fux::ipc::msg req;
+    while (true) {
+      fux::ipc::qrecv(requestq, req, 0, 0);
+      if (req->cat == fux::ipc::admin) {
+        break;
+      }
+    }
+
+    // Handlers exit when the socket is closed
+    for (auto &h : handlers) {
+      close(h.sock);
+    }
+    for (auto &h : handlers) {
+      waitpid(h.pid, nullptr, 0);
+    }
+  } catch (const std::exception &e) {
+    userlog("WSL failed: %s", e.what());
+    return -1;
+  }
+  return 0;
+}
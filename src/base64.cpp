@@ -5,31 +5,51 @@
 #include <string.h>
 #include <stdexcept>
 
-size_t base64encode(const void *ibuf, size_t ilen, char *obuf, size_t olen) {
-  static const char encoding[] =
-      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+#include "misc.h"
 
-  auto blocks = ilen / 3;
-  auto padded = ilen % 3;
-  if (olen < (blocks * 4 + (padded > 0 ? 4 : 0))) {
-    throw std::range_error("Not enough space for " + std::to_string(ilen) +
-                           " bytes");
-  }
+#if defined(__x86_64__) || defined(__i386__)
+#define FUX_BASE64_X86
+#include <immintrin.h>
+#endif
 
-  auto *bytes = reinterpret_cast<const uint8_t *>(ibuf);
-  size_t ipos = 0, opos = 0;
+static const char encoding[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const uint8_t decoding[] = {
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 62,  128,
+    128, 128, 63,  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  128, 128,
+    128, 128, 128, 128, 128, 0,   1,   2,   3,   4,   5,   6,   7,   8,   9,
+    10,  11,  12,  13,  14,  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,
+    25,  128, 128, 128, 128, 128, 128, 26,  27,  28,  29,  30,  31,  32,  33,
+    34,  35,  36,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48,
+    49,  50,  51,  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128};
 
-  for (size_t i = 0; i < blocks; i++) {
-    auto n = ((uint32_t)bytes[ipos++]) << 16;
-    n += ((uint32_t)bytes[ipos++]) << 8;
-    n += bytes[ipos++];
+// Scalar code handles whatever SIMD kernels leave over, ipos and opos are
+// positions where they stopped
+static size_t encode_tail(const uint8_t *bytes, size_t ipos, size_t ilen,
+                          char *obuf, size_t opos) {
+  for (; ipos + 3 <= ilen; ipos += 3) {
+    auto n = ((uint32_t)bytes[ipos]) << 16;
+    n += ((uint32_t)bytes[ipos + 1]) << 8;
+    n += bytes[ipos + 2];
 
     obuf[opos++] = encoding[(n >> 18) & 63];
     obuf[opos++] = encoding[(n >> 12) & 63];
     obuf[opos++] = encoding[(n >> 6) & 63];
     obuf[opos++] = encoding[n & 63];
   }
-  if (padded > 0) {
+  if (ipos < ilen) {
     auto n = ((uint32_t)bytes[ipos]) << 16;
     if (ipos + 1 < ilen) {
       n += ((uint32_t)bytes[ipos + 1]) << 8;
@@ -49,43 +69,12 @@ size_t base64encode(const void *ibuf, size_t ilen, char *obuf, size_t olen) {
   return opos;
 }
 
-size_t base64decode(const char *ibuf, size_t ilen, void *obuf, size_t olen) {
-  static const uint8_t decoding[] = {
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 62,  128,
-      128, 128, 63,  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  128, 128,
-      128, 128, 128, 128, 128, 0,   1,   2,   3,   4,   5,   6,   7,   8,   9,
-      10,  11,  12,  13,  14,  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,
-      25,  128, 128, 128, 128, 128, 128, 26,  27,  28,  29,  30,  31,  32,  33,
-      34,  35,  36,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48,
-      49,  50,  51,  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
-      128};
-
-  auto blocks = ilen / 4;
-  if (olen < blocks * 3) {
-    throw std::range_error("Not enough space for " + std::to_string(ilen) +
-                           " chars");
-  }
-  if (ilen % 4) {
-    throw std::logic_error("Invalid input length or no padding");
-  }
-
-  const auto *ibytes = reinterpret_cast<const uint8_t *>(ibuf);
-  auto *obytes = reinterpret_cast<uint8_t *>(obuf);
-  size_t ipos = 0, opos = 0;
+static size_t decode_tail(const uint8_t *ibytes, size_t ipos, size_t ilen,
+                          uint8_t *obytes, size_t opos) {
   uint8_t c0, c1, c2, c3, err = 0;
 
   // All blocks except the last one
-  for (size_t i = 1; i < blocks; i++) {
+  for (; ipos + 4 < ilen;) {
     err |= c0 = decoding[ibytes[ipos++]];
     err |= c1 = decoding[ibytes[ipos++]];
     err |= c2 = decoding[ibytes[ipos++]];
@@ -126,3 +115,300 @@ size_t base64decode(const char *ibuf, size_t ilen, void *obuf, size_t olen) {
   }
   return opos;
 }
+
+#ifdef FUX_BASE64_X86
+// Kernels based on Wojciech Mula's SIMD base64 work. Encoding spreads 3 bytes
+// into 4 6-bit indices with multiplies and maps indices to characters with
+// a 16-entry shift table. Decoding maps characters back with range compares
+// and packs 4 6-bit values into 3 bytes with multiply-adds.
+#define FUX_SSE41 __attribute__((target("sse4.1")))
+#define FUX_AVX2 __attribute__((target("avx2")))
+
+FUX_SSE41 static inline __m128i enc_split(__m128i in) {
+  in = _mm_shuffle_epi8(
+      in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  auto t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  auto t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  auto t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  auto t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+FUX_SSE41 static inline __m128i enc_lookup(__m128i idx) {
+  // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+  auto r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  auto less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+  r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+  auto shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                             '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  return _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx);
+}
+
+FUX_SSE41 static size_t encode_sse41(const uint8_t *bytes, size_t ilen,
+                                     char *obuf) {
+  size_t ipos = 0, opos = 0;
+  // Loads 16 bytes but uses only 12 of them
+  for (; ipos + 16 <= ilen; ipos += 12, opos += 16) {
+    auto in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + ipos));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(obuf + opos),
+                     enc_lookup(enc_split(in)));
+  }
+  return encode_tail(bytes, ipos, ilen, obuf, opos);
+}
+
+FUX_SSE41 static inline __m128i dec_lookup(__m128i in, int &valid) {
+  auto upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+                             _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+  auto lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+                             _mm_cmplt_epi8(in, _mm_set1_epi8('z' + 1)));
+  auto digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+                             _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+  auto plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+  auto slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+
+  auto shift = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+  shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+  shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+  shift = _mm_or_si128(shift, _mm_and_si128(plus, _mm_set1_epi8(62 - '+')));
+  shift = _mm_or_si128(shift, _mm_and_si128(slash, _mm_set1_epi8(63 - '/')));
+
+  auto ok = _mm_or_si128(_mm_or_si128(upper, lower),
+                         _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+  valid &= _mm_movemask_epi8(ok) == 0xffff;
+  return _mm_add_epi8(in, shift);
+}
+
+FUX_SSE41 static inline __m128i dec_pack(__m128i values) {
+  auto ab_cd = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  auto abcd = _mm_madd_epi16(ab_cd, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(abcd, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14,
+                                              13, 12, -1, -1, -1, -1));
+}
+
+FUX_SSE41 static size_t decode_sse41(const uint8_t *ibytes, size_t ilen,
+                                     uint8_t *obytes, size_t olen) {
+  size_t ipos = 0, opos = 0;
+  int valid = 1;
+  // Last block may be padded and is left for the scalar code. Stores 16
+  // bytes but only 12 of them are used.
+  for (; ipos + 16 < ilen && opos + 16 <= olen; ipos += 16, opos += 12) {
+    auto in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ibytes + ipos));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(obytes + opos),
+                     dec_pack(dec_lookup(in, valid)));
+  }
+  if (!valid) {
+    throw std::invalid_argument("Not a valid base64 encoding");
+  }
+  return decode_tail(ibytes, ipos, ilen, obytes, opos);
+}
+
+FUX_AVX2 static inline __m256i enc_split(__m256i in) {
+  in = _mm256_shuffle_epi8(
+      in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1, 10,
+                          11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  auto t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+  auto t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+  auto t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+  auto t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+  return _mm256_or_si256(t1, t3);
+}
+
+FUX_AVX2 static inline __m256i enc_lookup(__m256i idx) {
+  auto r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+  auto less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+  r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+  auto shift = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  return _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), idx);
+}
+
+FUX_AVX2 static size_t encode_avx2(const uint8_t *bytes, size_t ilen,
+                                   char *obuf) {
+  size_t ipos = 0, opos = 0;
+  // Each lane loads 16 bytes but uses only 12 of them
+  for (; ipos + 28 <= ilen; ipos += 24, opos += 32) {
+    auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + ipos));
+    auto hi =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + ipos + 12));
+    auto in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(obuf + opos),
+                        enc_lookup(enc_split(in)));
+  }
+  return encode_tail(bytes, ipos, ilen, obuf, opos);
+}
+
+FUX_AVX2 static inline __m256i dec_range(__m256i in, char lo, char hi) {
+  return _mm256_and_si256(
+      _mm256_cmpgt_epi8(in, _mm256_set1_epi8(lo - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), in));
+}
+
+FUX_AVX2 static inline __m256i dec_lookup(__m256i in, int &valid) {
+  auto upper = dec_range(in, 'A', 'Z');
+  auto lower = dec_range(in, 'a', 'z');
+  auto digit = dec_range(in, '0', '9');
+  auto plus = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('+'));
+  auto slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+
+  auto shift = _mm256_and_si256(upper, _mm256_set1_epi8(-'A'));
+  shift = _mm256_or_si256(
+      shift, _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a')));
+  shift = _mm256_or_si256(
+      shift, _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')));
+  shift = _mm256_or_si256(
+      shift, _mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')));
+  shift = _mm256_or_si256(
+      shift, _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')));
+
+  auto ok = _mm256_or_si256(_mm256_or_si256(upper, lower),
+                            _mm256_or_si256(digit, _mm256_or_si256(plus, slash)));
+  valid &= _mm256_movemask_epi8(ok) == -1;
+  return _mm256_add_epi8(in, shift);
+}
+
+FUX_AVX2 static inline __m256i dec_pack(__m256i values) {
+  auto ab_cd = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+  auto abcd = _mm256_madd_epi16(ab_cd, _mm256_set1_epi32(0x00011000));
+  auto packed = _mm256_shuffle_epi8(
+      abcd, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1,
+                             -1, 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1,
+                             -1, -1));
+  // 12 bytes from each lane next to each other
+  return _mm256_permutevar8x32_epi32(packed,
+                                     _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+}
+
+FUX_AVX2 static size_t decode_avx2(const uint8_t *ibytes, size_t ilen,
+                                   uint8_t *obytes, size_t olen) {
+  size_t ipos = 0, opos = 0;
+  int valid = 1;
+  // Stores 32 bytes but only 24 of them are used
+  for (; ipos + 32 < ilen && opos + 32 <= olen; ipos += 32, opos += 24) {
+    auto in =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ibytes + ipos));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(obytes + opos),
+                        dec_pack(dec_lookup(in, valid)));
+  }
+  if (!valid) {
+    throw std::invalid_argument("Not a valid base64 encoding");
+  }
+  return decode_tail(ibytes, ipos, ilen, obytes, opos);
+}
+#endif
+
+bool base64supported(base64isa isa) {
+  switch (isa) {
+    case base64isa::scalar:
+      return true;
+#ifdef FUX_BASE64_X86
+    case base64isa::sse41:
+      return __builtin_cpu_supports("sse4.1");
+    case base64isa::avx2:
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+static base64isa best() {
+  static const base64isa isa = [] {
+    if (base64supported(base64isa::avx2)) {
+      return base64isa::avx2;
+    } else if (base64supported(base64isa::sse41)) {
+      return base64isa::sse41;
+    }
+    return base64isa::scalar;
+  }();
+  return isa;
+}
+
+size_t base64encode(base64isa isa, const void *ibuf, size_t ilen, char *obuf,
+                    size_t olen) {
+  if (olen < base64chars(ilen)) {
+    throw std::range_error("Not enough space for " + std::to_string(ilen) +
+                           " bytes");
+  }
+  if (!base64supported(isa)) {
+    throw std::invalid_argument("Unsupported instruction set");
+  }
+
+  auto *bytes = reinterpret_cast<const uint8_t *>(ibuf);
+  switch (isa) {
+#ifdef FUX_BASE64_X86
+    case base64isa::avx2:
+      return encode_avx2(bytes, ilen, obuf);
+    case base64isa::sse41:
+      return encode_sse41(bytes, ilen, obuf);
+#endif
+    default:
+      return encode_tail(bytes, 0, ilen, obuf, 0);
+  }
+}
+
+size_t base64decode(base64isa isa, const char *ibuf, size_t ilen, void *obuf,
+                    size_t olen) {
+  auto blocks = ilen / 4;
+  if (olen < blocks * 3) {
+    throw std::range_error("Not enough space for " + std::to_string(ilen) +
+                           " chars");
+  }
+  if (ilen % 4) {
+    throw std::logic_error("Invalid input length or no padding");
+  }
+  if (!base64supported(isa)) {
+    throw std::invalid_argument("Unsupported instruction set");
+  }
+
+  const auto *ibytes = reinterpret_cast<const uint8_t *>(ibuf);
+  auto *obytes = reinterpret_cast<uint8_t *>(obuf);
+  switch (isa) {
+#ifdef FUX_BASE64_X86
+    case base64isa::avx2:
+      return decode_avx2(ibytes, ilen, obytes, olen);
+    case base64isa::sse41:
+      return decode_sse41(ibytes, ilen, obytes, olen);
+#endif
+    default:
+      return decode_tail(ibytes, 0, ilen, obytes, 0);
+  }
+}
+
+size_t base64encode(const void *ibuf, size_t ilen, char *obuf, size_t olen) {
+  return base64encode(best(), ibuf, ilen, obuf, olen);
+}
+
+size_t base64decode(const char *ibuf, size_t ilen, void *obuf, size_t olen) {
+  return base64decode(best(), ibuf, ilen, obuf, olen);
+}
+
+void base64stream::write(const void *ibuf, size_t ilen) {
+  auto *bytes = reinterpret_cast<const uint8_t *>(ibuf);
+  if (npending_ > 0) {
+    while (npending_ < 3 && ilen > 0) {
+      pending_[npending_++] = *bytes++;
+      ilen--;
+    }
+    if (npending_ < 3) {
+      return;
+    }
+    opos_ += base64encode(pending_, 3, obuf_ + opos_, olen_ - opos_);
+    npending_ = 0;
+  }
+
+  auto whole = ilen / 3 * 3;
+  opos_ += base64encode(bytes, whole, obuf_ + opos_, olen_ - opos_);
+  for (; whole < ilen; whole++) {
+    pending_[npending_++] = bytes[whole];
+  }
+}
+
+size_t base64stream::finish() {
+  opos_ += base64encode(pending_, npending_, obuf_ + opos_, olen_ - opos_);
+  npending_ = 0;
+  return opos_;
+}
@@ -0,0 +1,179 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include "batch.h"
+
+#include <userlog.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <thread>
+
+namespace fux::ipc {
+
+// Batches are tried again after this while their queue is full or their
+// batcher is busy sending
+constexpr auto linger_retry = std::chrono::milliseconds(1);
+
+// Thread sending batches of all batchers of the process when their linger
+// is over. It is started by the first batch and lives until the process
+// exits.
+class linger_timer {
+ public:
+  static linger_timer &instance() {
+    // Never destroyed, the detached thread may run during exit
+    static auto timer = new linger_timer();
+    return *timer;
+  }
+
+  // Called with the batcher's mutex held
+  void schedule(batcher *b, batcher::clock::time_point at) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &due = due_.try_emplace(b, at).first->second;
+    due = std::min(due, at);
+    if (!started_) {
+      std::thread(&linger_timer::run, this).detach();
+      started_ = true;
+    }
+    cv_.notify_one();
+  }
+
+  // Batches are sent with mutex_ held, so the batcher is not used after this
+  void cancel(batcher *b) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    due_.erase(b);
+  }
+
+ private:
+  linger_timer() : started_(false) {}
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      auto next = batcher::clock::time_point::max();
+      auto now = batcher::clock::now();
+      for (auto it = due_.begin(); it != due_.end();) {
+        if (it->second <= now) {
+          // try_lock in expire() keeps this from waiting for a batcher
+          it->second = it->first->expire();
+        }
+        if (it->second == batcher::clock::time_point::max()) {
+          it = due_.erase(it);
+        } else {
+          next = std::min(next, it->second);
+          it++;
+        }
+      }
+      if (next == batcher::clock::time_point::max()) {
+        cv_.wait(lock);
+      } else {
+        cv_.wait_until(lock, next);
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<batcher *, batcher::clock::time_point> due_;
+  bool started_;
+};
+
+batcher::~batcher() {
+  linger_timer::instance().cancel(this);
+  try {
+    flush();
+  } catch (const std::exception &e) {
+    userlog("Failed to send batch: %s", e.what());
+  }
+}
+
+bool batcher::add(int msqid, msg &data,
+                  std::chrono::microseconds linger) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &p =
+      pending_.try_emplace(msqid, pending{batch(replies_), {}}).first->second;
+  if (p.frames.add(msqid, data)) {
+    if (p.frames.frames() == 1) {
+      p.deadline = clock::now() + linger;
+    }
+  } else {
+    if (p.frames.frames() == 0) {
+      return false;
+    }
+    send(msqid, p);
+    if (!p.frames.add(msqid, data)) {
+      return false;
+    }
+    p.deadline = clock::now() + linger;
+  }
+
+  if (p.frames.frames() == 1) {
+    linger_timer::instance().schedule(this, p.deadline);
+  }
+  return true;
+}
+
+void batcher::flush(int msqid) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = pending_.find(msqid);
+  if (it != pending_.end()) {
+    send(msqid, it->second);
+  }
+}
+
+void batcher::flush() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &it : pending_) {
+    send(it.first, it.second);
+  }
+}
+
+bool batcher::empty() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &it : pending_) {
+    if (it.second.frames.frames() > 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void batcher::send(int msqid, pending &p) {
+  try {
+    p.frames.send(msqid, 0, fux::ipc::flags::notime);
+  } catch (...) {
+    // Do not send the same messages again
+    p.frames.clear();
+    throw;
+  }
+}
+
+batcher::clock::time_point batcher::expire() {
+  auto now = clock::now();
+  std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return now + linger_retry;
+  }
+  auto next = clock::time_point::max();
+  for (auto &it : pending_) {
+    auto &p = it.second;
+    if (p.frames.frames() == 0) {
+      continue;
+    }
+    if (p.deadline > now) {
+      next = std::min(next, p.deadline);
+      continue;
+    }
+    try {
+      if (!p.frames.send(it.first, 0, fux::ipc::flags::noblock)) {
+        next = std::min(next, now + linger_retry);
+      }
+    } catch (const std::exception &e) {
+      userlog("Failed to send batch: %s", e.what());
+      p.frames.clear();
+    }
+  }
+  return next;
+}
+
+}  // namespace fux::ipc
@@ -0,0 +1,51 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+
+#include "ipc.h"
+
+namespace fux::ipc {
+
+class linger_timer;
+
+// Batches of messages for several queues. A batch is sent when the next
+// message does not fit, when its first message has waited for linger or on
+// flush(). add() and flush() send blocking, like qsend with notime. Batches
+// whose linger is over are sent by one thread of the process that never
+// blocks on a full queue and tries again shortly.
+class batcher {
+ public:
+  // See batch for replies
+  explicit batcher(bool replies = false) : replies_(replies) {}
+  ~batcher();
+
+  // Adds a copy of data to the batch for msqid, returns false if data can't
+  // be batched and must be sent on its own after flush(msqid)
+  bool add(int msqid, msg &data, std::chrono::microseconds linger);
+  void flush(int msqid);
+  void flush();
+  bool empty();
+
+ private:
+  friend class linger_timer;
+  using clock = std::chrono::steady_clock;
+  struct pending {
+    batch frames;
+    clock::time_point deadline;
+  };
+
+  void send(int msqid, pending &p);
+  // Sends batches past their deadline without blocking, returns when to
+  // look again or time_point::max() if nothing is pending
+  clock::time_point expire();
+
+  std::mutex mutex_;
+  std::map<int, pending> pending_;
+  const bool replies_;
+};
+
+}  // namespace fux::ipc
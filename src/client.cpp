@@ -13,18 +13,24 @@
 #include <memory>
 #include <vector>
 
+#include "batch.h"
 #include "ipc.h"
 #include "mib.h"
 #include "misc.h"
 #include "trx.h"
 
-#include "resp.h"
+#include "client.h"
 #include "svcrepo.h"
 
 #include <thread>
 
 namespace fux {
 bool is_server();
+bool in_fiber();
+uint64_t fiber_id();
+void park_fiber(int cd, std::chrono::steady_clock::time_point deadline);
+
+thread_local int last_priority = fux::ipc::default_priority;
 
 struct suspend_guard {
   suspend_guard(bool suspend = true) : suspended(false) {
@@ -43,37 +49,161 @@ struct suspend_guard {
 
 }  // namespace fux
 
-class client {
+int client_base::tpcancel(int cd) {
+  if (cds.release(cd) == -1) {
+    return -1;
+  }
+  // TPETRAN
+  fux::atmi::reset_tperrno();
+  return 0;
+}
+
+int client_base::tpsblktime(int blktime, long flags) {
+  long units = flags & 0xf0;
+  long what = flags - units;
+  long timeout;
+
+  if (units == TPBLK_SECOND) {
+    timeout = blktime * 1000;
+  } else if (units == TPBLK_MILLISECOND) {
+    timeout = blktime;
+  } else {
+    TPERROR(TPEINVAL, "Invalid flags passed to tpsblktime(..., %ld)", flags);
+    return -1;
+  }
+
+  if (what == TPBLK_NEXT) {
+    blocktime_next = timeout;
+  } else if (what == TPBLK_ALL) {
+    blocktime_all = timeout;
+  } else {
+    TPERROR(TPEINVAL, "Invalid flags passed to tpsblktime(..., %ld)", flags);
+    return -1;
+  }
+
+  fux::atmi::reset_tperrno();
+  return 0;
+}
+
+int client_base::tpgblktime(long flags) {
+  long units = flags & 0xf0;
+  long what = flags - units;
+  long timeout;
+
+  if (what == 0) {
+    timeout = 0;
+  } else if (what == TPBLK_NEXT) {
+    timeout = blocktime_next;
+  } else if (what == TPBLK_ALL) {
+    timeout = blocktime_all;
+  } else {
+    TPERROR(TPEINVAL, "Invalid flags passed to tpgblktime(%ld)", flags);
+    return -1;
+  }
+
+  if (units == TPBLK_SECOND) {
+    timeout /= 1000;
+  } else if (units == TPBLK_MILLISECOND) {
+    timeout /= 1;
+  } else {
+    TPERROR(TPEINVAL, "Invalid flags passed to tpgblktime(%ld)", flags);
+    return -1;
+  }
+
+  fux::atmi::reset_tperrno();
+  return timeout;
+}
+
+long client_base::next_blocktime() {
+  long blocktime = 0;
+  if (blocktime_next != 0) {
+    blocktime = blocktime_next;
+    blocktime_next = 0;
+  } else if (blocktime_all != 0) {
+    blocktime = blocktime_all;
+  } else {
+    blocktime = default_blocktime();
+  }
+  return blocktime;
+}
+
+int client_base::tpsprio(int prio, long flags) {
+  if (flags != 0 && flags != TPABSOLUTE) {
+    TPERROR(TPEINVAL, "Invalid flags passed to tpsprio(..., %ld)", flags);
+    return -1;
+  }
+  prio_next = prio;
+  prio_flags = flags;
+  prio_set = true;
+  fux::atmi::reset_tperrno();
+  return 0;
+}
+
+long client_base::next_mtype(long prio) {
+  if (prio_set) {
+    prio = prio_flags == TPABSOLUTE ? prio_next : prio + prio_next;
+    prio_set = false;
+  }
+  prio = std::clamp(prio, fux::ipc::min_priority, fux::ipc::max_priority);
+  fux::last_priority = prio;
+  return fux::ipc::priority_mtype(prio);
+}
+
+int client_base::complete(fux::ipc::msg &res, int *cd, char **data,
+                          long *len) {
+  res.get_data(data);
+  tpurcode = res->rcode;
+  *cd = res->cd;
+  cds.release(*cd);
+  if (len != nullptr) {
+    *len = res.size_data();
+  }
+  if (res->rval == TPMINVAL) {
+    fux::atmi::reset_tperrno();
+    return 0;
+  }
+  TPERROR(res->rval, "Service failed with %d", res->rval);
+  return -1;
+}
+
+class client : public client_base {
  public:
-  client(mib &mibcon)
-      : mibcon_(mibcon), repo_(mibcon), blocktime_next(0), blocktime_all(0) {
+  client(mib &mibcon) : mibcon_(mibcon), repo_(mibcon) {
     auto lock = mibcon_.data_lock();
     client_ = mibcon_.make_accesser(getpid());
-    rpid = mibcon_.accessers().at(client_).rpid = fux::ipc::qcreate();
+    rpid = mibcon_.accessers().at(client_).rpid =
+        fux::ipc::qcreate(mibcon_.mach().transport);
   }
 
   ~client() {
+    try {
+      batches_.flush();
+    } catch (const std::exception &e) {
+      userlog("Failed to send batched requests: %s", e.what());
+    }
     auto lock = mibcon_.data_lock();
     fux::ipc::qdelete(mibcon_.accessers().at(client_).rpid);
     mibcon_.accessers().at(client_).invalidate();
   }
 
   int tpacall(int grpno, const char *svc, char *data, long len,
-              long flags) try {
+              long flags) override try {
     if (tptypes(data, nullptr, nullptr) == -1) {
       return -1;
     }
 
-    int msqid = repo_.get_queue(grpno, svc);
+    service_options options;
+    int msqid = repo_.get_queue(grpno, svc, &options, &rq->service);
 
-    rq.set_data(data, len);
+    rq.set_data(data, len, options.cmplimit);
+    rq->mtype = next_mtype(options.prio);
     checked_copy(svc, rq->servicename);
     if (flags & TPNOREPLY) {
       rq->replyq = -1;
       rq->cd = 0;
     } else {
       rq->replyq = rpid;
-      rq->cd = cds.allocate();
+      rq->cd = cds.allocate(fux::fiber_id());
       if (rq->cd == -1) {
         return -1;
       }
@@ -86,6 +216,13 @@ class client {
       rq->gttid = fux::bad_gttid;
     }
 
+    if (options.linger > 0 && !(flags & TPNOBLOCK) &&
+        batches_.add(msqid, rq, std::chrono::microseconds(options.linger))) {
+      fux::atmi::reset_tperrno();
+      return rq->cd;
+    }
+    // Keep the order of requests
+    batches_.flush(msqid);
     if (fux::ipc::qsend(msqid, rq, next_blocktime(), to_flags(flags))) {
       fux::atmi::reset_tperrno();
       return rq->cd;
@@ -106,7 +243,7 @@ class client {
     return -1;
   }
 
-  int tpgetrply(int *cd, char **data, long *len, long flags) {
+  int tpgetrply(int *cd, char **data, long *len, long flags) override {
     if (data == nullptr) {
       TPERROR(TPEINVAL, "data is null");
     }
@@ -114,15 +251,32 @@ class client {
       return -1;
     }
 
+    // Replies will not come before requests are sent
+    batches_.flush();
+
+    // A fiber lets the dispatch thread serve other requests while waiting,
+    // the thread receives replies for it. Transaction context belongs to
+    // the thread. Fibers of a thread share its descriptors, TPGETANY takes
+    // only replies to calls of the caller.
+    auto owner = fux::fiber_id();
+    bool park = fux::in_fiber() && !fux::tx::transactional();
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (park) {
+      if (auto blocktime = next_blocktime(); blocktime > 0) {
+        deadline = std::chrono::steady_clock::now() +
+                   std::chrono::milliseconds(blocktime);
+      }
+    }
+
+    auto &res = rs;
     while (true) {
-      fux::ipc::msg res;
 
       // Lookup buffered responses first
       bool has_res = false;
       if (flags & TPGETANY) {
-        int c = cds.any_buffered();
+        int c = cds.any_buffered(owner);
         if (c != -1) {
-          res = std::move(cds.buffered(c));
+          res.swap(cds.buffered(c));
           has_res = true;
         }
       } else {
@@ -130,11 +284,20 @@ class client {
           return -1;
         }
         if (cds.is_buffered(*cd)) {
-          res = std::move(cds.buffered(*cd));
+          res.swap(cds.buffered(*cd));
           has_res = true;
         }
       }
 
+      if (!has_res && park) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+          TPERROR(TPETIME, "Timeout waiting for reply");
+          return -1;
+        }
+        fux::park_fiber(flags & TPGETANY ? 0 : *cd, deadline);
+        continue;
+      }
+
       if (!has_res) {
         mibcon_.accessers().at(client_).rpid_timeout =
             std::chrono::steady_clock::now() +
@@ -142,6 +305,19 @@ class client {
         fux::ipc::qrecv(rpid, res, 0, 0);
         mibcon_.accessers().at(client_).rpid_timeout = INVALID_TIME;
         userlog("%s received on %0x", __func__, rpid);
+
+        if (res->ttype == fux::ipc::frames) {
+          size_t pos = 0;
+          while (fux::ipc::qnext(res, pos, frame)) {
+            cds.buffer(frame);
+          }
+          continue;
+        }
+      }
+
+      // Wakes the dispatch thread of a server with fibers
+      if (res->cat == fux::ipc::admin) {
+        continue;
       }
 
       if (res->cat == fux::ipc::unblock) {
@@ -155,108 +331,54 @@ class client {
       }
 
       // Did not receive the correct response, try again
-      if (!(flags & TPGETANY)) {
-        if (*cd != res->cd) {
-          cds.buffer(std::move(res));
-          continue;
-        }
+      if (!(flags & TPGETANY) ? *cd != res->cd : !cds.owned(res->cd, owner)) {
+        cds.buffer(res);
+        continue;
       }
 
-      res.get_data(data);
-      tpurcode = res->rcode;
-      *cd = res->cd;
-      cds.release(*cd);
-      if (len != nullptr) {
-        *len = res.size_data();
-      }
-      if (res->rval == TPMINVAL) {
-        fux::atmi::reset_tperrno();
-        return 0;
-      }
-      TPERROR(res->rval, "Service failed with %d", res->rval);
-      return -1;
-    }
-  }
-
-  int tpcancel(int cd) {
-    if (cds.release(cd) == -1) {
-      return -1;
+      return complete(res, cd, data, len);
     }
-    // TPETRAN
-    fux::atmi::reset_tperrno();
-    return 0;
   }
 
-  int tpsblktime(int blktime, long flags) {
-    long units = flags & 0xf0;
-    long what = flags - units;
-    long timeout;
-
-    if (units == TPBLK_SECOND) {
-      timeout = blktime * 1000;
-    } else if (units == TPBLK_MILLISECOND) {
-      timeout = blktime;
-    } else {
-      TPERROR(TPEINVAL, "Invalid flags passed to tpsblktime(..., %ld)", flags);
+  int tpflush(long flags) override {
+    if (flags != 0) {
+      TPERROR(TPEINVAL, "Invalid flags passed to tpflush(%ld)", flags);
       return -1;
     }
-
-    if (what == TPBLK_NEXT) {
-      blocktime_next = timeout;
-    } else if (what == TPBLK_ALL) {
-      blocktime_all = timeout;
-    } else {
-      TPERROR(TPEINVAL, "Invalid flags passed to tpsblktime(..., %ld)", flags);
-      return -1;
-    }
-
+    batches_.flush();
     fux::atmi::reset_tperrno();
     return 0;
   }
 
-  int tpgblktime(long flags) {
-    long units = flags & 0xf0;
-    long what = flags - units;
-    long timeout;
-
-    if (what == 0) {
-      timeout = 0;
-    } else if (what == TPBLK_NEXT) {
-      timeout = blocktime_next;
-    } else if (what == TPBLK_ALL) {
-      timeout = blocktime_all;
-    } else {
-      TPERROR(TPEINVAL, "Invalid flags passed to tpgblktime(%ld)", flags);
-      return -1;
+  // Keeps replies for tpgetrply of fibers, see fux::await_reply
+  bool await_reply(long msec, std::vector<int> &received) {
+    batches_.flush();
+    try {
+      fux::ipc::qrecv(rpid, rs, 0, 0, msec);
+    } catch (const std::system_error &e) {
+      if (e.code().value() != ENOMSG) {
+        throw;
+      }
+      return false;
     }
-
-    if (units == TPBLK_SECOND) {
-      timeout /= 1000;
-    } else if (units == TPBLK_MILLISECOND) {
-      timeout /= 1;
-    } else {
-      TPERROR(TPEINVAL, "Invalid flags passed to tpgblktime(%ld)", flags);
-      return -1;
+    if (rs->ttype == fux::ipc::frames) {
+      size_t pos = 0;
+      while (fux::ipc::qnext(rs, pos, frame)) {
+        received.push_back(frame->cd);
+        cds.buffer(frame);
+      }
+    } else if (rs->cat == fux::ipc::application) {
+      received.push_back(rs->cd);
+      cds.buffer(rs);
     }
-
-    fux::atmi::reset_tperrno();
-    return timeout;
+    return true;
   }
 
-  long next_blocktime() {
-    long blocktime = 0;
-    if (blocktime_next != 0) {
-      blocktime = blocktime_next;
-      blocktime_next = 0;
-    } else if (blocktime_all != 0) {
-      blocktime = blocktime_all;
-    } else {
-      blocktime = mibcon_.mach().blocktime;
-    }
-    return blocktime;
+  int get_queue(const char *svc, service_options *options, int *service) {
+    return repo_.get_queue(-1, svc, options, service);
   }
 
-  int get_queue(const char *svc) { return repo_.get_queue(-1, svc); }
+  int reply_queue() const { return rpid; }
 
  private:
   fux::ipc::flags to_flags(long flags) {
@@ -269,20 +391,27 @@ class client {
     }
   }
 
+  long default_blocktime() override { return mibcon_.mach().blocktime; }
+
   mib &mibcon_;
   size_t client_;
   service_repository repo_;
   fux::ipc::msg rq;
+  fux::ipc::msg rs;
+  fux::ipc::msg frame;
+  fux::ipc::batcher batches_;
   int rpid;
-  long blocktime_next;
-  long blocktime_all;
-  responses cds;
 };
 
-static thread_local std::shared_ptr<client> current_client;
-static client &getclient() {
+static thread_local std::shared_ptr<client_base> current_client;
+static client_base &getclient() {
   if (!current_client.get()) {
-    current_client = std::make_shared<client>(getmib());
+    auto wsnaddr = fux::util::getenv("WSNADDR", "");
+    if (!wsnaddr.empty() && !fux::is_server()) {
+      current_client = make_wsclient(wsnaddr);
+    } else {
+      current_client = std::make_shared<client>(getmib());
+    }
   }
   return *current_client;
 }
@@ -348,9 +477,39 @@ int tpsblktime(int blktime, long flags) {
       [&] { return getclient().tpsblktime(blktime, flags); }, -1);
 }
 
+int tpflush(long flags) {
+  return fux::atmi::exception_boundary(
+      [&] { return getclient().tpflush(flags); }, -1);
+}
+
 int tpgblktime(long flags) {
   return fux::atmi::exception_boundary(
       [&] { return getclient().tpgblktime(flags); }, -1);
 }
 
-int get_queue(const char *svc) { return getclient().get_queue(svc); }
+int tpsprio(int prio, long flags) {
+  return fux::atmi::exception_boundary(
+      [&] { return getclient().tpsprio(prio, flags); }, -1);
+}
+
+int tpgprio() {
+  fux::atmi::reset_tperrno();
+  return fux::last_priority;
+}
+
+int get_queue(const char *svc, service_options *options, int *service) {
+  // Servers are always native clients
+  return static_cast<client &>(getclient()).get_queue(svc, options, service);
+}
+
+namespace fux {
+// Waits up to msec (0 for no limit) for replies to calls of the thread,
+// keeps them for tpgetrply and appends their cds. Returns false if nothing
+// came.
+bool await_reply(long msec, std::vector<int> &cds) {
+  // Servers are always native clients
+  return static_cast<client &>(getclient()).await_reply(msec, cds);
+}
+
+int reply_queue() { return static_cast<client &>(getclient()).reply_queue(); }
+}  // namespace fux
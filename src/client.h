@@ -0,0 +1,51 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <memory>
+#include <string>
+
+#include "ipc.h"
+#include "resp.h"
+
+// XATMI calls of clients. Native clients are attached to the MIB,
+// workstation clients (WSNADDR environment variable) call services through
+// WSH over TCP.
+class client_base {
+ public:
+  client_base()
+      : blocktime_next(0), blocktime_all(0), prio_next(0), prio_set(false) {}
+  virtual ~client_base() = default;
+
+  virtual int tpacall(int grpno, const char *svc, char *data, long len,
+                      long flags) = 0;
+  virtual int tpgetrply(int *cd, char **data, long *len, long flags) = 0;
+  virtual int tpflush(long flags) = 0;
+  int tpcancel(int cd);
+  int tpsblktime(int blktime, long flags);
+  int tpgblktime(long flags);
+  int tpsprio(int prio, long flags);
+
+ protected:
+  // Milliseconds when tpsblktime was not called
+  virtual long default_blocktime() = 0;
+  long next_blocktime();
+  // mtype of the next request to a service with default priority prio
+  long next_mtype(long prio);
+  // Returns the reply to the caller of tpgetrply
+  int complete(fux::ipc::msg &res, int *cd, char **data, long *len);
+
+  long blocktime_next;
+  long blocktime_all;
+  int prio_next;
+  long prio_flags;
+  bool prio_set;
+  responses cds;
+};
+
+namespace fux {
+// Of the last request sent or received by the thread
+extern thread_local int last_priority;
+}  // namespace fux
+
+std::unique_ptr<client_base> make_wsclient(const std::string &wsnaddr);
@@ -8,44 +8,16 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 
 #include <fml32.h>
 #include "basic_parser.h"
+#include "expr.h"
 #include "misc.h"
 
 #include <iostream>
 
-// unary plus is recognized and ignored
-enum tree_op {
-  first_invalid = 0,
-  const_long,
-  const_double,
-  const_string,
-  field,
-  field_any,
-  unary_minus,
-  logical_negation,
-  bitwise_negation,
-  multiplication,
-  division,
-  modulus,
-  addition,
-  substraction,
-  exclusive_or,
-  logical_and,
-  logical_or,
-  less_than,
-  greater_than,
-  less_or_equal,
-  greater_or_equal,
-  equal,
-  not_equal,
-  matches,
-  not_matches,
-  last_invalid,
-};
-
 const char *tree_ops[] = {
     "inv", "long", "double", "string", "field", "field_any", "-",  "!",  "~",
     "*",   "/",    "%",      "+",      "-",     "^",         "&&", "||", "<",
@@ -436,9 +408,9 @@ void Fboolpr32(char *tree, FILE *iop) {
 class eval_value {
  public:
   char *tree;
-  long l;
-  double d;
-  const char *s;
+  long l = 0;
+  double d = 0;
+  const char *s = nullptr;
 
   eval_value(char *tree, int value)
       : tree(tree), l(value), type_(eval_type::is_long) {}
@@ -451,6 +423,13 @@ class eval_value {
         s(value),
         type_(eval_type::is_string),
         is_const_(is_const) {}
+  // Keeps a copy of converted value because CFfind32 reuses the buffer
+  eval_value(char *tree, std::shared_ptr<std::string> value)
+      : tree(tree),
+        s(value->c_str()),
+        type_(eval_type::is_string),
+        is_const_(false),
+        owned_(std::move(value)) {}
 
   bool is_long() const { return type_ == eval_type::is_long; }
   bool is_double() const { return type_ == eval_type::is_double; }
@@ -493,7 +472,8 @@ class eval_value {
 
  private:
   enum class eval_type { is_long, is_double, is_string } type_;
-  bool is_const_;
+  bool is_const_ = false;
+  std::shared_ptr<std::string> owned_;
 };
 
 template <template <class> class Op>
@@ -529,13 +509,20 @@ static eval_value boolev_field(FBFR32 *fbfr, char *tree, FLDID32 fieldid,
         return eval_value(tree, 0.0);
       }
     }
+    case FLD_STRING: {
+      auto value = Ffind32(fbfr, fieldid, oc, nullptr);
+      if (value != nullptr) {
+        return eval_value(tree, value);
+      } else {
+        return eval_value(tree, "");
+      }
+    }
     case FLD_CHAR:
-    case FLD_STRING:
     case FLD_CARRAY: {
       auto value = reinterpret_cast<char *>(
           CFfind32(fbfr, fieldid, oc, nullptr, FLD_STRING));
       if (value != nullptr) {
-        return eval_value(tree, value);
+        return eval_value(tree, std::make_shared<std::string>(value));
       } else {
         return eval_value(tree, "");
       }
@@ -703,3 +690,37 @@ double Ffloatev32(FBFR32 *fbfr, char *tree) {
   auto v = boolev(fbfr, tree + 4);
   return v.to_double();
 }
+
+static auto &boolfns() {
+  static std::map<std::string, FBOOLFN32> fns;
+  return fns;
+}
+static std::mutex boolfns_mutex;
+
+int Fboolreg32(const char *name, FBOOLFN32 fn) {
+  if (name == nullptr || *name == '\0') {
+    FERROR(FEINVAL, "name is NULL or empty");
+    return -1;
+  }
+  if (fn == nullptr) {
+    FERROR(FEINVAL, "fn is NULL");
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(boolfns_mutex);
+  boolfns()[name] = fn;
+  return 0;
+}
+
+FBOOLFN32 Fboolfn32(const char *name) {
+  if (name == nullptr) {
+    FERROR(FEINVAL, "name is NULL");
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(boolfns_mutex);
+  auto it = boolfns().find(name);
+  if (it == boolfns().end()) {
+    FERROR(FBADNAME, "unknown function %s", name);
+    return nullptr;
+  }
+  return it->second;
+}
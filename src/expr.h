@@ -0,0 +1,45 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+// Opcodes of the compiled boolean expression tree, shared between the
+// interpreter and mkboolfn32.
+//
+// Tree layout: 4 bytes of length followed by nodes in prefix order.
+// Each node is one opcode byte followed by
+//   const_long:   long
+//   const_double: double
+//   const_string: null-terminated string
+//   field:        FLDID32 and FLDOCC32
+//   field_any:    FLDID32
+//   unary:        operand node
+//   binary:       left and right operand nodes
+// Unary plus is recognized and ignored.
+enum tree_op {
+  first_invalid = 0,
+  const_long,
+  const_double,
+  const_string,
+  field,
+  field_any,
+  unary_minus,
+  logical_negation,
+  bitwise_negation,
+  multiplication,
+  division,
+  modulus,
+  addition,
+  substraction,
+  exclusive_or,
+  logical_and,
+  logical_or,
+  less_than,
+  greater_than,
+  less_or_equal,
+  greater_or_equal,
+  equal,
+  not_equal,
+  matches,
+  not_matches,
+  last_invalid,
+};
@@ -2,12 +2,17 @@
 // This file is part of Fuxedo
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
+#include <algorithm>
+#include <atomic>
 #include <map>
-#include <shared_mutex>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #include <fml32.h>
 #include "extreader.h"
 #include "fieldtbl32.h"
+#include "fieldtbl32bin.h"
 #include "misc.h"
 
 #include <iostream>
@@ -25,13 +30,35 @@ void reset_Ferror32();
 }  // namespace fux
 
 struct Fbfr32fields {
-  std::shared_timed_mutex mutex;
-  std::map<FLDID32, std::string> id_to_name;
-  std::map<std::string, FLDID32, std::less<>> name_to_id;
-  std::atomic<bool> id_to_name_loaded;
-  std::atomic<bool> name_to_id_loaded;
-
-  Fbfr32fields() : id_to_name_loaded(false), name_to_id_loaded(false) {}
+  // Loaded field tables, never modified after publishing so lookups don't
+  // take any locks
+  struct tables {
+    struct table {
+      std::unique_ptr<fux::fml32::fldtbl32_file> compiled;
+      std::map<FLDID32, std::string> id_to_name;
+      std::map<std::string, FLDID32, std::less<>> name_to_id;
+    };
+    std::vector<std::shared_ptr<const table>> files;
+  };
+
+  // A field table file as it was when read, reused while it does not change
+  struct loaded_file {
+    dev_t dev;
+    ino_t ino;
+    timespec mtime;
+    off_t size;
+    std::shared_ptr<const tables::table> table;
+  };
+
+  std::mutex mutex;
+  std::atomic<tables *> current;
+  // Lookups in progress, unloaded tables are freed when there are none
+  std::atomic<int> readers;
+  // Tables loaded since they were last freed, including the current one
+  std::vector<std::unique_ptr<tables>> retired;
+  std::map<std::string, loaded_file> loaded;
+
+  Fbfr32fields() : current(nullptr), readers(0) {}
 
   static constexpr bool valid_fldtype32(int type) {
     if (type != FLD_SHORT && type != FLD_LONG && type != FLD_CHAR &&
@@ -59,85 +86,170 @@ struct Fbfr32fields {
   static constexpr long Fldno32(FLDID32 fieldid) { return fieldid & 0xffffff; }
 
   char *name(FLDID32 fieldid) {
-    if (!id_to_name_loaded) {
-      load_fieldtbls32();
+    reading guard(readers);
+    tables *t;
+    if (!get(t)) {
+      return nullptr;
     }
-    std::shared_lock<std::shared_timed_mutex> lock(mutex);
-    auto it = id_to_name.find(fieldid);
-    if (it != id_to_name.end()) {
-      return const_cast<char *>(it->second.c_str());
+    if (t != nullptr) {
+      for (auto &f : t->files) {
+        if (f->compiled) {
+          if (auto name = f->compiled->view().name(fieldid)) {
+            return const_cast<char *>(name);
+          }
+        } else {
+          auto it = f->id_to_name.find(fieldid);
+          if (it != f->id_to_name.end()) {
+            return const_cast<char *>(it->second.c_str());
+          }
+        }
+      }
     }
     Ferror32 = FBADFLD;
     return nullptr;
   }
 
   FLDID32 fldid(const char *name) {
-    if (!name_to_id_loaded) {
-      load_fieldtbls32();
+    reading guard(readers);
+    tables *t;
+    if (!get(t)) {
+      return BADFLDID;
     }
-    std::shared_lock<std::shared_timed_mutex> lock(mutex);
-    auto it = name_to_id.find(name);
-    if (it != name_to_id.end()) {
-      return it->second;
+    if (t != nullptr) {
+      for (auto &f : t->files) {
+        if (f->compiled) {
+          auto fieldid = f->compiled->view().fldid(name);
+          if (fieldid != BADFLDID) {
+            return fieldid;
+          }
+        } else {
+          auto it = f->name_to_id.find(name);
+          if (it != f->name_to_id.end()) {
+            return it->second;
+          }
+        }
+      }
     }
     Ferror32 = FBADNAME;
     return BADFLDID;
   }
 
-  void idnm_unload() {
-    std::unique_lock<std::shared_timed_mutex> lock(mutex);
-    id_to_name.clear();
-    id_to_name_loaded = false;
+  void idnm_unload() { unload(); }
+  void nmid_unload() { unload(); }
+
+ private:
+  // Returns false with Ferror32 set when field tables can't be loaded
+  bool get(tables *&t) {
+    t = current.load();
+    if (t == nullptr) {
+      try {
+        t = load_fieldtbls32();
+      } catch (const std::system_error &e) {
+        FERROR32(FFTOPEN, "%s", e.what());
+        return false;
+      } catch (const std::exception &e) {
+        FERROR32(FFTSYNTAX, "%s", e.what());
+        return false;
+      }
+    }
+    return true;
   }
 
-  void nmid_unload() {
-    std::unique_lock<std::shared_timed_mutex> lock(mutex);
-    name_to_id.clear();
-    name_to_id_loaded = false;
+  // Counts a lookup, which must not use the tables after it ends
+  struct reading {
+    explicit reading(std::atomic<int> &readers) : readers(readers) {
+      readers.fetch_add(1);
+    }
+    ~reading() { readers.fetch_sub(1); }
+    std::atomic<int> &readers;
+  };
+
+  // Frees the tables if no lookup can still see them, otherwise they are
+  // freed by a later unload. Like in Tuxedo, Fname32 results become invalid.
+  // Files that don't change are reused by the next load.
+  void unload() {
+    std::lock_guard<std::mutex> lock(mutex);
+    current.store(nullptr);
+    if (readers.load() == 0) {
+      retired.clear();
+    }
   }
 
- private:
-  bool read_fld32_file(const std::string &fname) {
-    std::ifstream fields(fname);
-    if (!fields) {
-      return false;
+  std::shared_ptr<const tables::table> read_fld32_file(
+      const std::string &fname) {
+    struct stat st;
+    if (stat(fname.c_str(), &st) == -1) {
+      return nullptr;
     }
+    auto it = loaded.find(fname);
+    if (it != loaded.end()) {
+      auto &l = it->second;
+      if (l.dev == st.st_dev && l.ino == st.st_ino &&
+          l.mtime.tv_sec == st.st_mtim.tv_sec &&
+          l.mtime.tv_nsec == st.st_mtim.tv_nsec && l.size == st.st_size) {
+        return l.table;
+      }
+    }
+
+    auto t = std::make_shared<tables::table>();
+    if (fux::fml32::fldtbl32_file::is_compiled(fname)) {
+      t->compiled = std::make_unique<fux::fml32::fldtbl32_file>(fname);
+    } else {
+      std::ifstream fields(fname);
+      if (!fields) {
+        return nullptr;
+      }
 
-    field_table_parser p(fields);
-    p.parse();
-    for (auto field : p.fields()) {
-      id_to_name.insert(make_pair(field.fieldid, field.name));
-      name_to_id.insert(make_pair(field.name, field.fieldid));
+      field_table_parser p(fields);
+      p.parse();
+      for (auto field : p.fields()) {
+        t->id_to_name.insert(make_pair(field.fieldid, field.name));
+        t->name_to_id.insert(make_pair(field.name, field.fieldid));
+      }
     }
 
-    return true;
+    loaded[fname] = {st.st_dev, st.st_ino, st.st_mtim, st.st_size, t};
+    return t;
   }
 
-  void load_fieldtbls32() {
+  tables *load_fieldtbls32() {
     auto fieldtbls32 = getenv("FIELDTBLS32");
     auto fldtbldir32 = getenv("FLDTBLDIR32");
 
     if (fieldtbls32 == nullptr || fldtbldir32 == nullptr) {
-      return;
+      return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (auto t = current.load(std::memory_order_acquire)) {
+      return t;
     }
 
     auto files = fux::split(fieldtbls32, ",");
     auto dirs = fux::split(fldtbldir32, ":");
 
-    std::unique_lock<std::shared_timed_mutex> lock(mutex);
-
-    id_to_name.clear();
-    name_to_id.clear();
-
-    id_to_name_loaded = true;
-    name_to_id_loaded = true;
-
+    auto t = std::make_unique<tables>();
     for (auto &fname : files) {
       for (auto &dname : dirs) {
-        if (read_fld32_file(dname + "/" + fname)) {
+        if (auto table = read_fld32_file(dname + "/" + fname)) {
+          t->files.push_back(std::move(table));
           break;
         }
       }
     }
+
+    // Forget files no longer used, they are freed with the tables
+    for (auto it = loaded.begin(); it != loaded.end();) {
+      if (std::find(t->files.begin(), t->files.end(), it->second.table) ==
+          t->files.end()) {
+        it = loaded.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    retired.push_back(std::move(t));
+    current.store(retired.back().get(), std::memory_order_release);
+    return retired.back().get();
   }
 };
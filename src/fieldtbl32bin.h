@@ -0,0 +1,297 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fml32.h>
+
+// Compiled field table written by "mkfldhdr32 -b" and mapped read-only by
+// the runtime. Everything is addressed by offsets from the start of file so
+// the same pages are shared by all processes using the table.
+//
+//   header
+//   byid[nids]       sorted by fieldid for Fname32
+//   byname[nnames]   indexed by perfect hash slot for Fldid32
+//   disp[nnames]     hash-and-displace table
+//   names            null-terminated strings
+namespace fux::fml32 {
+
+constexpr char fldtbl32_magic[8] = {'F', 'U', 'X', 'F', 'L', 'D', '3', '2'};
+constexpr uint32_t fldtbl32_version = 1;
+
+struct fldtbl32_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;
+  uint32_t nids;
+  uint32_t nnames;
+  uint32_t byid;
+  uint32_t byname;
+  uint32_t disp;
+  uint32_t names;
+};
+
+struct fldtbl32_entry {
+  FLDID32 fieldid;
+  uint32_t name;
+};
+
+// FNV-1a with a seed and murmur3 finalizer for better avalanche
+inline uint32_t fldtbl32_hash(std::string_view s, uint32_t seed) {
+  uint32_t h = 0x811c9dc5 ^ seed;
+  for (auto c : s) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 0x01000193;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+// Read-only view of a compiled field table
+class fldtbl32_view {
+ public:
+  fldtbl32_view(const char *data, size_t size) : data_(data) {
+    if (size < sizeof(fldtbl32_header)) {
+      throw std::invalid_argument("field table too short");
+    }
+    header_ = reinterpret_cast<const fldtbl32_header *>(data);
+    if (memcmp(header_->magic, fldtbl32_magic, sizeof(fldtbl32_magic)) != 0 ||
+        header_->version != fldtbl32_version || header_->size != size) {
+      throw std::invalid_argument("invalid field table header");
+    }
+    auto within = [&](uint64_t off, uint64_t len) {
+      return off + len <= size;
+    };
+    if (!within(header_->byid,
+                uint64_t(header_->nids) * sizeof(fldtbl32_entry)) ||
+        !within(header_->byname,
+                uint64_t(header_->nnames) * sizeof(fldtbl32_entry)) ||
+        !within(header_->disp, uint64_t(header_->nnames) * sizeof(int32_t)) ||
+        !within(header_->names, 0) || size == 0 || data[size - 1] != '\0') {
+      throw std::invalid_argument("invalid field table offsets");
+    }
+    byid_ = reinterpret_cast<const fldtbl32_entry *>(data + header_->byid);
+    byname_ = reinterpret_cast<const fldtbl32_entry *>(data + header_->byname);
+    disp_ = reinterpret_cast<const int32_t *>(data + header_->disp);
+    for (uint32_t i = 0; i < header_->nids; i++) {
+      if (header_->names + uint64_t(byid_[i].name) >= size) {
+        throw std::invalid_argument("invalid field table names");
+      }
+    }
+    for (uint32_t i = 0; i < header_->nnames; i++) {
+      if (header_->names + uint64_t(byname_[i].name) >= size) {
+        throw std::invalid_argument("invalid field table names");
+      }
+    }
+  }
+
+  const char *name(FLDID32 fieldid) const {
+    auto end = byid_ + header_->nids;
+    auto it = std::lower_bound(
+        byid_, end, fieldid,
+        [](const fldtbl32_entry &e, FLDID32 id) { return e.fieldid < id; });
+    if (it != end && it->fieldid == fieldid) {
+      return names() + it->name;
+    }
+    return nullptr;
+  }
+
+  FLDID32 fldid(std::string_view name) const {
+    auto n = header_->nnames;
+    if (n == 0) {
+      return BADFLDID;
+    }
+    auto d = disp_[fldtbl32_hash(name, 0) % n];
+    auto slot = d < 0 ? uint32_t(-d - 1) : fldtbl32_hash(name, d) % n;
+    if (slot < n && names() + byname_[slot].name == name) {
+      return byname_[slot].fieldid;
+    }
+    return BADFLDID;
+  }
+
+ private:
+  const char *names() const { return data_ + header_->names; }
+
+  const char *data_;
+  const fldtbl32_header *header_;
+  const fldtbl32_entry *byid_;
+  const fldtbl32_entry *byname_;
+  const int32_t *disp_;
+};
+
+// Builds a compiled field table, first definition of a name or an id wins
+inline std::string fldtbl32_build(
+    const std::vector<std::pair<std::string, FLDID32>> &fields) {
+  std::vector<std::pair<std::string, FLDID32>> names;
+  std::map<std::string_view, size_t> seen;
+  std::map<FLDID32, std::string_view> ids;
+  for (auto &f : fields) {
+    if (seen.emplace(f.first, names.size()).second) {
+      names.push_back(f);
+    }
+    ids.emplace(f.second, f.first);
+  }
+
+  std::string pool;
+  std::map<std::string_view, uint32_t> offsets;
+  for (auto &f : names) {
+    offsets[f.first] = pool.size();
+    pool += f.first;
+    pool += '\0';
+  }
+
+  // Hash and displace: place the biggest buckets first, search for a
+  // displacement that moves all keys of a bucket to free slots, place
+  // single-key buckets directly into remaining free slots.
+  uint32_t n = names.size();
+  std::vector<int32_t> disp(n, 0);
+  std::vector<int64_t> slots(n, -1);
+  std::vector<std::vector<uint32_t>> buckets(n);
+  for (uint32_t i = 0; i < n; i++) {
+    buckets[fldtbl32_hash(names[i].first, 0) % n].push_back(i);
+  }
+  std::vector<uint32_t> order(n);
+  for (uint32_t i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  size_t b = 0;
+  for (; b < order.size() && buckets[order[b]].size() > 1; b++) {
+    auto &bucket = buckets[order[b]];
+    for (int32_t d = 1;; d++) {
+      if (d == std::numeric_limits<int32_t>::max()) {
+        throw std::runtime_error("can't build perfect hash");
+      }
+      std::vector<uint32_t> placed;
+      for (auto i : bucket) {
+        auto slot = fldtbl32_hash(names[i].first, d) % n;
+        if (slots[slot] != -1 ||
+            std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+          break;
+        }
+        placed.push_back(slot);
+      }
+      if (placed.size() == bucket.size()) {
+        for (size_t j = 0; j < bucket.size(); j++) {
+          slots[placed[j]] = bucket[j];
+        }
+        disp[order[b]] = d;
+        break;
+      }
+    }
+  }
+  uint32_t free_slot = 0;
+  for (; b < order.size() && buckets[order[b]].size() == 1; b++) {
+    while (slots[free_slot] != -1) {
+      free_slot++;
+    }
+    slots[free_slot] = buckets[order[b]][0];
+    disp[order[b]] = -int32_t(free_slot) - 1;
+  }
+
+  fldtbl32_header header;
+  memcpy(header.magic, fldtbl32_magic, sizeof(header.magic));
+  header.version = fldtbl32_version;
+  header.nids = ids.size();
+  header.nnames = n;
+  header.byid = sizeof(header);
+  header.byname = header.byid + header.nids * sizeof(fldtbl32_entry);
+  header.disp = header.byname + header.nnames * sizeof(fldtbl32_entry);
+  header.names = header.disp + header.nnames * sizeof(int32_t);
+  header.size = header.names + pool.size();
+  if (pool.empty()) {
+    // names must be null-terminated even without any
+    pool += '\0';
+    header.size++;
+  }
+
+  std::string out;
+  out.append(reinterpret_cast<char *>(&header), sizeof(header));
+  for (auto &id : ids) {
+    fldtbl32_entry e = {id.first, offsets[id.second]};
+    out.append(reinterpret_cast<char *>(&e), sizeof(e));
+  }
+  for (auto slot : slots) {
+    auto &f = names[slot];
+    fldtbl32_entry e = {f.second, offsets[f.first]};
+    out.append(reinterpret_cast<char *>(&e), sizeof(e));
+  }
+  out.append(reinterpret_cast<char *>(disp.data()), n * sizeof(int32_t));
+  out += pool;
+  return out;
+}
+
+// Memory-mapped compiled field table file
+class fldtbl32_file {
+ public:
+  // Returns false if the file is not a compiled field table
+  static bool is_compiled(const std::string &fname) {
+    char magic[sizeof(fldtbl32_magic)];
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return false;
+    }
+    auto n = ::read(fd, magic, sizeof(magic));
+    close(fd);
+    return n == sizeof(magic) && memcmp(magic, fldtbl32_magic, n) == 0;
+  }
+
+  explicit fldtbl32_file(const std::string &fname)
+      : data_(nullptr), size_(0) {
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category(), fname);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      close(fd);
+      throw std::system_error(errno, std::system_category(), fname);
+    }
+    size_ = st.st_size;
+    data_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data_ == MAP_FAILED) {
+      throw std::system_error(errno, std::system_category(), fname);
+    }
+    try {
+      view_ = std::make_unique<fldtbl32_view>(static_cast<char *>(data_),
+                                              size_);
+    } catch (...) {
+      munmap(data_, size_);
+      throw;
+    }
+  }
+  ~fldtbl32_file() { munmap(data_, size_); }
+  fldtbl32_file(const fldtbl32_file &) = delete;
+  fldtbl32_file &operator=(const fldtbl32_file &) = delete;
+
+  const fldtbl32_view &view() const { return *view_; }
+
+ private:
+  void *data_;
+  size_t size_;
+  std::unique_ptr<fldtbl32_view> view_;
+};
+}  // namespace fux::fml32
@@ -5,9 +5,12 @@
 #include <fml32.h>
 #include <xatmi.h>
 
+#include <cstring>
 #include <functional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 
 namespace fux {
 
@@ -107,6 +110,45 @@ struct identity {
   typedef T type;
 };
 
+// Value of FLD_CARRAY field, distinct from std::string_view used for
+// FLD_STRING
+class carray_view : public std::string_view {
+ public:
+  using std::string_view::string_view;
+  constexpr carray_view() = default;
+  constexpr carray_view(std::string_view s) : std::string_view(s) {}
+};
+
+template <typename T>
+struct fldtype;
+template <>
+struct fldtype<short> : std::integral_constant<int, FLD_SHORT> {};
+template <>
+struct fldtype<long> : std::integral_constant<int, FLD_LONG> {};
+template <>
+struct fldtype<char> : std::integral_constant<int, FLD_CHAR> {};
+template <>
+struct fldtype<float> : std::integral_constant<int, FLD_FLOAT> {};
+template <>
+struct fldtype<double> : std::integral_constant<int, FLD_DOUBLE> {};
+template <>
+struct fldtype<std::string_view> : std::integral_constant<int, FLD_STRING> {};
+template <>
+struct fldtype<carray_view> : std::integral_constant<int, FLD_CARRAY> {};
+template <>
+struct fldtype<FBFR32 *> : std::integral_constant<int, FLD_FML32> {};
+
+// Typed field descriptor generated by "mkfldhdr32 -c". Converts to FLDID32
+// for use with the C API.
+template <typename T, FLDID32 ID>
+struct fld {
+  static_assert(static_cast<int>(ID >> 24) == fldtype<T>::value,
+                "C++ type does not match field type");
+  typedef T type;
+  static constexpr FLDID32 id = ID;
+  constexpr operator FLDID32() const { return ID; }
+};
+
 class fml32buf {
  public:
   fml32buf() {}
@@ -146,6 +188,56 @@ class fml32buf {
     return *this;
   }
 
+  // Typed fields are read in place without conversion. Strings, carrays and
+  // embedded buffers point into the buffer and are valid until it changes.
+  template <typename U = void, typename T, FLDID32 ID>
+  T get(fld<T, ID> f, FLDOCC32 oc) {
+    static_assert(std::is_void<U>::value || std::is_same<U, T>::value,
+                  "requested type does not match field type");
+    T ret;
+    if (find(f, oc, ret)) {
+      return ret;
+    }
+    throw fml32buf_error();
+  }
+  template <typename U = void, typename T, FLDID32 ID, typename D>
+  T get(fld<T, ID> f, FLDOCC32 oc, const D &default_value) {
+    static_assert(std::is_void<U>::value || std::is_same<U, T>::value,
+                  "requested type does not match field type");
+    static_assert(std::is_convertible<const D &, T>::value,
+                  "default value type does not match field type");
+    T ret;
+    if (find(f, oc, ret)) {
+      return ret;
+    }
+    return default_value;
+  }
+
+  template <typename T, FLDID32 ID, typename U>
+  fml32buf &put(fld<T, ID>, FLDOCC32 oc, const U &value) {
+    static_assert(std::is_convertible<const U &, T>::value,
+                  "value type does not match field type");
+    if constexpr (std::is_same<T, std::string_view>::value) {
+      // Fchg32 needs a null-terminated string
+      if constexpr (std::is_convertible<const U &, const char *>::value) {
+        chg(ID, oc, static_cast<const char *>(value), 0);
+      } else if constexpr (std::is_same<U, std::string>::value) {
+        chg(ID, oc, value.c_str(), 0);
+      } else {
+        chg(ID, oc, std::string(std::string_view(value)).c_str(), 0);
+      }
+    } else if constexpr (std::is_same<T, carray_view>::value) {
+      carray_view v = value;
+      chg(ID, oc, v.data(), v.size());
+    } else if constexpr (std::is_same<T, FBFR32 *>::value) {
+      chg(ID, oc, reinterpret_cast<const char *>(value), 0);
+    } else {
+      T v = value;
+      chg(ID, oc, reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+    return *this;
+  }
+
   FLDOCC32 count(FLDID32 fieldid) { return Foccur32(ptr(), fieldid); }
 
   FBFR32 *ptr() const { return buf_.ptr(); }
@@ -154,6 +246,31 @@ class fml32buf {
  private:
   fml32ptr buf_;
 
+  void chg(FLDID32 fieldid, FLDOCC32 oc, const char *value, FLDLEN32 len) {
+    buf_.mutate([&](FBFR32 *fbfr) {
+      return Fchg32(fbfr, fieldid, oc, const_cast<char *>(value), len);
+    });
+  }
+
+  template <typename T, FLDID32 ID>
+  bool find(fld<T, ID>, FLDOCC32 oc, T &ret) {
+    FLDLEN32 len;
+    auto value = Ffind32(ptr(), ID, oc, &len);
+    if (value == nullptr) {
+      return false;
+    }
+    if constexpr (std::is_same<T, std::string_view>::value) {
+      ret = std::string_view(value, len > 0 ? len - 1 : 0);
+    } else if constexpr (std::is_same<T, carray_view>::value) {
+      ret = carray_view(value, len);
+    } else if constexpr (std::is_same<T, FBFR32 *>::value) {
+      ret = reinterpret_cast<FBFR32 *>(value);
+    } else {
+      memcpy(&ret, value, sizeof(ret));
+    }
+    return true;
+  }
+
   long get(FLDID32 fieldid, FLDOCC32 oc, identity<long>) {
     long ret;
     if (CFget32(ptr(), fieldid, oc, reinterpret_cast<char *>(&ret), nullptr,
@@ -10,13 +10,22 @@
 
 #include "ipc.h"
 #include "misc.h"
+#include "qbackend.h"
+#include "shmheap.h"
 
 #include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 #include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <cstring>
 #include <iostream>
+#include <limits>
+#include <mutex>
 
 namespace fux::ipc {
 
@@ -122,101 +131,412 @@ namespace fux::ipc {
         std::string(__FILE__) + ":" + std::to_string(__LINE__)); \
   }
 
-int qcreate() {
-  int msqid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
-  if (msqid == -1) {
-    throw std::system_error(errno, std::system_category(),
-                            "Failed to create IPC queue");
-  }
-  return msqid;
+// Queues hold msgmnb bytes (msg_qbytes of every queue created here), with
+// messages up to msgmax at least a few of them fit
+constexpr size_t msgs_per_queue = 4;
+
+size_t qmsgmax() {
+  static const size_t value = [] {
+    struct msginfo info;
+    if (msgctl(0, IPC_INFO, reinterpret_cast<struct msqid_ds *>(&info)) ==
+        -1) {
+      return size_t(16384) / msgs_per_queue;  // Linux default msgmnb
+    }
+    return std::min(size_t(info.msgmax), size_t(info.msgmnb) / msgs_per_queue);
+  }();
+  return value;
 }
 
-static const size_t MAX_QUEUE_MSG_SIZE = 4000;
+// glibc before 2.36 has only the internal name of the field
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// Blocking msgsnd and msgrcv with a timeout. A per-thread timer signal
+// interrupts the call at the deadline and keeps repeating every millisecond
+// in case it arrives just before the call goes to sleep.
+class queue_timer {
+ public:
+  queue_timer() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+      // Any handler interrupts System V IPC calls, even with SA_RESTART, so
+      // one installed by the application is kept. Otherwise the signal
+      // would terminate the process or be ignored.
+      struct sigaction sa;
+      sigaction(signo(), nullptr, &sa);
+      if (!(sa.sa_flags & SA_SIGINFO) &&
+          (sa.sa_handler == SIG_DFL || sa.sa_handler == SIG_IGN)) {
+        sa.sa_handler = [](int) {};
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        sigaction(signo(), &sa, nullptr);
+      }
+    });
+
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = signo();
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_MONOTONIC, &sev, &timer_) == -1) {
+      throw std::system_error(errno, std::system_category(),
+                              "timer_create failed");
+    }
+  }
+  ~queue_timer() { timer_delete(timer_); }
+
+  // Repeats op until it succeeds, fails with something else than EINTR or
+  // msec pass. Returns the result of op, -1 with errno EINTR on timeout.
+  template <typename F>
+  ssize_t run(F &&op, long msec) {
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(msec);
+
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, signo());
+    pthread_sigmask(SIG_UNBLOCK, &set, &old);
+    settime(msec);
+
+    ssize_t n;
+    int e;
+    do {
+      n = op();
+      e = errno;
+    } while (n == -1 && e == EINTR &&
+             std::chrono::steady_clock::now() < deadline);
+
+    settime(0);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    errno = e;
+    return n;
+  }
 
-static bool msgsnd_timed(int msqid, void *ptr, size_t len, enum flags flag,
-                         long msec) {
-  if (flag == fux::ipc::notime) {
-    int n = msgsnd(msqid, ptr, len - sizeof(long), 0);
-    if (n != -1) {
-      return true;
-    } else {
-      throw std::system_error(errno, std::system_category());
+ private:
+  static int signo() { return SIGRTMIN + 2; }
+
+  void settime(long msec) {
+    struct itimerspec its;
+    its.it_value.tv_sec = msec / 1000;
+    its.it_value.tv_nsec = (msec % 1000) * 1000000;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = msec > 0 ? 1000000 : 0;
+    timer_settime(timer_, 0, &its, nullptr);
+  }
+
+  timer_t timer_;
+};
+
+class msgq : public qbackend {
+ public:
+  int create() override {
+    int msqid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+    if (msqid == -1) {
+      throw std::system_error(errno, std::system_category(),
+                              "Failed to create IPC queue");
     }
-  } else if (flag == fux::ipc::noblock) {
-    int n = msgsnd(msqid, ptr, len - sizeof(long), IPC_NOWAIT);
-    if (n != -1) {
-      return true;
-    } else {
-      if (errno == EAGAIN) {
-        return false;
-      }
+    return msqid;
+  }
+
+  void remove(int id) override { msgctl(id, IPC_RMID, NULL); }
+
+  bool exists(int id) override {
+    struct msqid_ds ds;
+    return msgctl(id, IPC_STAT, &ds) == 0 ||
+           (errno != EINVAL && errno != EIDRM);
+  }
+
+  size_t msgmax() override { return qmsgmax(); }
+
+  size_t length(int id) override {
+    struct msqid_ds ds;
+    if (msgctl(id, IPC_STAT, &ds) == -1) {
       throw std::system_error(errno, std::system_category());
     }
-  } else {  // noflags
-    const long interval_msec = 100;
-    int times = msec / interval_msec + 2;
+    return ds.msg_qnum;
+  }
 
-    for (int i = 0; i < times; i++) {
-      int n = msgsnd(msqid, ptr, len - sizeof(long), IPC_NOWAIT);
+  bool send(int id, const void *ptr, size_t len, enum flags flag,
+            long msec) override {
+    auto p = const_cast<void *>(ptr);
+    if (flag == fux::ipc::notime) {
+      int n = msgsnd(id, p, len, 0);
+      if (n != -1) {
+        return true;
+      } else {
+        throw std::system_error(errno, std::system_category());
+      }
+    } else if (flag == fux::ipc::noblock) {
+      int n = msgsnd(id, p, len, IPC_NOWAIT);
+      if (n != -1) {
+        return true;
+      } else {
+        if (errno == EAGAIN) {
+          return false;
+        }
+        throw std::system_error(errno, std::system_category());
+      }
+    } else {  // noflags
+      int n = msgsnd(id, p, len, IPC_NOWAIT);
       if (n != -1) {
         return true;
       } else if (errno != EAGAIN) {
-        fprintf(stderr, "ERROR %d %s\n", errno, strerror(errno));
         throw std::system_error(errno, std::system_category());
       }
-      if (i == 0) {
-        // Immediate retry
-        continue;
+      // Without a timeout a full queue fails at once, like a ring queue
+      if (msec <= 0) {
+        return false;
+      }
+      if (timer().run([&] { return msgsnd(id, p, len, 0); }, msec) != -1) {
+        return true;
+      } else if (errno == EINTR) {
+        return false;
       }
+      throw std::system_error(errno, std::system_category());
+    }
+  }
 
-      struct timespec req = {0, interval_msec * 1000000};
-      if (nanosleep(&req, nullptr) == -1) {
-        fprintf(stderr, "!!ERROR %d %s\n", errno, strerror(errno));
-        throw std::system_error(errno, std::system_category());
+  size_t recv(int id, void *ptr, size_t len, long msgtype, int flags,
+              long msec) override {
+    ssize_t n;
+    if (msec > 0 && !(flags & IPC_NOWAIT)) {
+      n = timer().run([&] { return msgrcv(id, ptr, len, msgtype, flags); },
+                      msec);
+      if (n == -1 && errno == EINTR) {
+        errno = ENOMSG;
       }
+    } else {
+      n = msgrcv(id, ptr, len, msgtype, flags);
+    }
+    if (n == -1) {
+      throw std::system_error(errno, std::system_category());
     }
+    return n;
   }
-  return false;
+
+ private:
+  static queue_timer &timer() {
+    thread_local queue_timer t;
+    return t;
+  }
+};
+
+qbackend &msgq_backend() {
+  static msgq q;
+  return q;
 }
 
-bool qsend(int msqid, msg &data, long timeout, enum flags flags) {
-  if (data.size() > MAX_QUEUE_MSG_SIZE) {
-    char tmpname[] = "/tmp/msgbase-XXXXXX";
-    int fd = mkstemp(tmpname);
-    fail_if(fd == -1);
-    fail_if(write(fd, data.buf() + sizeof(msgbase),
-                  data.size() - sizeof(msgbase)) !=
-            data.size() - sizeof(msgbase));
-    fail_if(close(fd) == -1);
+int qcreate(enum backend b) {
+  return b == backend::ring ? ring_backend().create()
+                            : msgq_backend().create();
+}
 
-    msgfile fmsg;
-    fmsg.mtype = data->mtype;
-    fmsg.ttype = fux::ipc::file;
-    std::copy_n(tmpname, sizeof(tmpname), fmsg.filename);
-    auto len = sizeof(msgbase) + sizeof(tmpname);
+bool qexists(int msqid) { return backend_of(msqid).exists(msqid); }
 
-    if (!msgsnd_timed(msqid, &fmsg, len, flags, timeout)) {
-      unlink(tmpname);
-      return false;
-    }
-    return true;
-  } else {
+size_t qlength(int msqid) { return backend_of(msqid).length(msqid); }
+
+static bool msgsnd_timed(int msqid, void *ptr, size_t len, enum flags flag,
+                         long msec) {
+  return backend_of(msqid).send(msqid, ptr, len - sizeof(long), flag, msec);
+}
+
+template <typename T, typename V>
+static bool fits(V value) {
+  return value >= std::numeric_limits<T>::min() &&
+         value <= std::numeric_limits<T>::max();
+}
+
+// Returns false if some field does not fit msgcompact or the service name
+// can't be dropped
+static bool compactable(msgmem &mem) {
+  return mem.ttype != fux::ipc::frames && mem.heapoff == -1 &&
+         mem.rawlen == 0 && mem.gttid == fux::bad_gttid &&
+         fits<int16_t>(mem.service) && fits<uint16_t>(mem.flags) &&
+         fits<int32_t>(mem.rcode) &&
+         (mem.service != -1 || mem.servicename[0] == '\0');
+}
+
+// Sends the message with msgcompact header written in place in front of
+// the data, the end of msgmem it covers is restored afterwards
+static bool qsend_compact(int msqid, msg &data, long timeout,
+                          enum flags flags) {
+  // msgmem is not standard-layout, its data starts at sizeof(msgmem) as the
+  // rest of this file assumes
+  static_assert(offsetof(msgcompact, data) == sizeof(msgcompact));
+  auto &mem = data.as_msgmem();
+  msgcompact cmsg;
+  cmsg.mtype = mem.mtype;
+  cmsg.ttype = fux::ipc::compact;
+  cmsg.cat = mem.cat;
+  cmsg.version = compact_version;
+  cmsg.reserved = 0;
+  cmsg.service = mem.service;
+  cmsg.flags = mem.flags;
+  cmsg.cd = mem.cd;
+  cmsg.replyq = mem.replyq;
+  cmsg.rval = mem.rval;
+  cmsg.rcode = mem.rcode;
+
+  auto header = data.buf() + sizeof(msgmem) - sizeof(msgcompact);
+  char saved[sizeof(msgcompact)];
+  std::copy_n(header, sizeof(msgcompact), saved);
+  std::copy_n(reinterpret_cast<char *>(&cmsg), sizeof(msgcompact), header);
+  auto restore = [&] { std::copy_n(saved, sizeof(msgcompact), header); };
+  bool sent;
+  try {
+    sent = msgsnd_timed(msqid, header,
+                        data.size() - sizeof(msgmem) + sizeof(msgcompact),
+                        flags, timeout);
+  } catch (...) {
+    restore();
+    throw;
+  }
+  restore();
+  return sent;
+}
+
+// Expands a received msgcompact message into msgmem in place
+static void unpack_compact(msg &data) {
+  if (data.size() < sizeof(msgcompact)) {
+    throw std::runtime_error("Invalid compact message");
+  }
+  auto cmsg = *reinterpret_cast<msgcompact *>(data.buf());
+  if (cmsg.version != compact_version) {
+    throw std::runtime_error("Unsupported message header version " +
+                             std::to_string(cmsg.version));
+  }
+  auto len = data.size() - sizeof(msgcompact);
+  data.resize(sizeof(msgmem) + len);
+  std::copy_backward(data.buf() + sizeof(msgcompact),
+                     data.buf() + sizeof(msgcompact) + len,
+                     data.buf() + sizeof(msgmem) + len);
+
+  auto &mem = data.as_msgmem();
+  mem.mtype = cmsg.mtype;
+  mem.ttype = fux::ipc::queue;
+  mem.cat = cmsg.cat;
+  mem.servicename[0] = '\0';
+  mem.gttid = fux::bad_gttid;
+  mem.flags = cmsg.flags;
+  mem.cd = cmsg.cd;
+  mem.replyq = cmsg.replyq;
+  mem.rval = cmsg.rval;
+  mem.service = cmsg.service;
+  mem.rcode = cmsg.rcode;
+  mem.heapoff = -1;
+  mem.heaplen = 0;
+  mem.rawlen = 0;
+}
+
+// Bigger messages go through the shared heap, or a file if the process
+// does not have the heap or it is full
+static bool qsend_bytes(int msqid, msg &data, long timeout,
+                        enum flags flags) {
+  if (compactable(data.as_msgmem()) &&
+      data.size() - sizeof(msgmem) + sizeof(msgcompact) - sizeof(long) <=
+          backend_of(msqid).msgmax()) {
+    return qsend_compact(msqid, data, timeout, flags);
+  }
+  if (data.size() - sizeof(long) <= backend_of(msqid).msgmax()) {
     data->ttype = fux::ipc::queue;
     return msgsnd_timed(msqid, data.buf(), data.size(), flags, timeout);
   }
+
+  const size_t len = data.size() - sizeof(msgbase);
+  auto heap = fux::mem::shmheap::current();
+  if (auto ptr = heap != nullptr ? heap->allocate(len) : nullptr) {
+    std::copy_n(data.buf() + sizeof(msgbase), len, static_cast<char *>(ptr));
+
+    msgshm smsg;
+    smsg.mtype = data->mtype;
+    smsg.ttype = fux::ipc::shm;
+    smsg.cat = data->cat;
+    smsg.off = heap->offset(ptr);
+    smsg.len = len;
+
+    heap->enqueue(ptr, msqid);
+    bool sent;
+    try {
+      sent = msgsnd_timed(msqid, &smsg, sizeof(smsg), flags, timeout);
+    } catch (...) {
+      heap->deallocate(ptr);
+      throw;
+    }
+    if (!sent) {
+      heap->deallocate(ptr);
+    }
+    return sent;
+  }
+
+  char tmpname[] = "/tmp/msgbase-XXXXXX";
+  int fd = mkstemp(tmpname);
+  fail_if(fd == -1);
+  fail_if(write(fd, data.buf() + sizeof(msgbase), len) != ssize_t(len));
+  fail_if(close(fd) == -1);
+
+  msgfile fmsg;
+  fmsg.mtype = data->mtype;
+  fmsg.ttype = fux::ipc::file;
+  fmsg.cat = data->cat;
+  std::copy_n(tmpname, sizeof(tmpname), fmsg.filename);
+  auto flen = sizeof(msgbase) + sizeof(tmpname);
+
+  if (!msgsnd_timed(msqid, &fmsg, flen, flags, timeout)) {
+    unlink(tmpname);
+    return false;
+  }
+  return true;
 }
 
-// IPC_NOWAIT
-void qrecv(int msqid, msg &data, long msgtype, int flags) {
-  data.resize(MAX_QUEUE_MSG_SIZE);
+bool qsend(int msqid, msg &data, long timeout, enum flags flags) {
+  if (data->heapoff == -1) {
+    return qsend_bytes(msqid, data, timeout, flags);
+  }
+  if (!data.shared_) {
+    throw std::logic_error("Shared heap buffer already taken");
+  }
 
-  // MSGMAX
-  ssize_t n = msgrcv(msqid, data.buf(), MAX_QUEUE_MSG_SIZE, msgtype, flags);
-  if (n == -1) {
-    throw std::system_error(errno, std::system_category());
+  // Receiver owns the buffer as soon as the message is in the queue
+  auto heap = fux::mem::shmheap::current();
+  auto ptr = heap->pointer(data->heapoff);
+  heap->enqueue(ptr, msqid);
+  bool sent;
+  try {
+    sent = qsend_bytes(msqid, data, timeout, flags);
+  } catch (...) {
+    heap->hold(ptr);
+    throw;
   }
+  if (sent) {
+    data.shared_ = false;
+  } else {
+    heap->hold(ptr);
+  }
+  return sent;
+}
+
+// IPC_NOWAIT
+void qrecv(int msqid, msg &data, long msgtype, int flags, long timeout) {
+  data.release();
+  auto &q = backend_of(msqid);
+  data.resize(sizeof(long) + q.msgmax());
+
+  ssize_t n = q.recv(msqid, data.buf(), q.msgmax(), msgtype, flags, timeout);
   data.resize(n + sizeof(long));
-  if (data->ttype == fux::ipc::file) {
+  if (data->ttype == fux::ipc::shm) {
+    auto smsg = data.as_msgshm();
+    auto heap = fux::mem::shmheap::current();
+    if (heap == nullptr) {
+      throw std::runtime_error("Shared heap not attached");
+    }
+    auto ptr = heap->pointer(smsg.off);
+    heap->hold(ptr);
+    data.resize(sizeof(msgbase) + smsg.len);
+    std::copy_n(static_cast<char *>(ptr), smsg.len,
+                data.buf() + sizeof(msgbase));
+    heap->deallocate(ptr);
+  } else if (data->ttype == fux::ipc::file) {
     char filename[n];
     strcpy(filename, data.as_msgfile().filename);
     struct stat st;
@@ -227,25 +547,226 @@ void qrecv(int msqid, msg &data, long msgtype, int flags) {
     fail_if(read(fd, data.buf() + sizeof(msgbase), st.st_size) != st.st_size);
     fail_if(close(fd) == -1);
     fail_if(unlink(filename) == -1);
+  } else if (data->ttype == fux::ipc::compact) {
+    unpack_compact(data);
+  }
+  // Messages of a batch are not in the shared heap
+  data.shared_ = data->ttype != fux::ipc::frames && data->heapoff != -1;
+}
+
+void qdelete(int msqid) { backend_of(msqid).remove(msqid); }
+
+// Each frame is the message length followed by the message, aligned to 8
+static size_t frame_size(size_t len) {
+  return (sizeof(uint64_t) + len + 7) & ~size_t(7);
+}
+
+bool batch::add(int msqid, msg &data) {
+  if (data->heapoff != -1 ||
+      (frames_ > 0 && ((!replies_ && buf_->mtype != data->mtype) ||
+                       buf_->cat != data->cat))) {
+    return false;
+  }
+  size_t used = frames_ > 0 ? buf_.size() : sizeof(msgframes);
+  size_t needed = used + frame_size(data.size());
+  if (needed - sizeof(long) > backend_of(msqid).msgmax()) {
+    return false;
+  }
+
+  buf_.resize(needed);
+  if (frames_ == 0) {
+    buf_->mtype = data->mtype;
+    buf_->ttype = fux::ipc::frames;
+    buf_->cat = data->cat;
+  }
+  uint64_t len = data.size();
+  std::copy_n(reinterpret_cast<char *>(&len), sizeof(len), buf_.buf() + used);
+  std::copy_n(data.buf(), len, buf_.buf() + used + sizeof(len));
+  frames_++;
+  return true;
+}
+
+bool batch::send(int msqid, long timeout, enum flags flags) {
+  if (frames_ == 0) {
+    return true;
+  }
+  if (!msgsnd_timed(msqid, buf_.buf(), buf_.size(), flags, timeout)) {
+    return false;
+  }
+  frames_ = 0;
+  return true;
+}
+
+bool qnext(msg &data, size_t &pos, msg &out) {
+  if (pos == 0) {
+    pos = sizeof(msgframes);
+  }
+  if (pos + sizeof(uint64_t) > data.size()) {
+    pos = 0;
+    return false;
+  }
+  uint64_t len;
+  std::copy_n(data.buf() + pos, sizeof(len), reinterpret_cast<char *>(&len));
+  if (len < sizeof(msgmem) || pos + sizeof(len) + len > data.size()) {
+    throw std::runtime_error("Invalid batch message");
+  }
+  out.release();
+  out.resize(len);
+  std::copy_n(data.buf() + pos + sizeof(len), len, out.buf());
+  pos += frame_size(len);
+  return true;
+}
+
+const msgmem *qpeek(msg &data, size_t pos) {
+  if (pos == 0) {
+    pos = sizeof(msgframes);
   }
+  if (pos + sizeof(uint64_t) + sizeof(msgmem) > data.size()) {
+    return nullptr;
+  }
+  return reinterpret_cast<const msgmem *>(data.buf() + pos + sizeof(uint64_t));
+}
+
+void msg::grow(size_t n) {
+  auto capacity = std::max(n, capacity_ * 2);
+  auto bytes = std::unique_ptr<char[]>(new char[capacity]);
+  std::copy_n(bytes_.get(), size_, bytes.get());
+  bytes_ = std::move(bytes);
+  capacity_ = capacity;
+}
+
+void msg::share(long off, long used) {
+  resize_data(0);
+  (*this)->rawlen = 0;
+  (*this)->heapoff = off;
+  (*this)->heaplen = used;
+  shared_ = true;
+}
+
+void msg::release() {
+  if (shared_) {
+    auto heap = fux::mem::shmheap::current();
+    heap->deallocate(heap->pointer((*this)->heapoff));
+    shared_ = false;
+  }
+}
+
+// Exported and decompressed buffers are kept here while compressing and
+// after decompressing
+static msg &scratch() {
+  static thread_local msg raw;
+  return raw;
 }
 
-void qdelete(int msqid) { msgctl(msqid, IPC_RMID, NULL); }
+// Exports data into the data part of m, needed is the size estimate
+static long export_data(msg &m, char *data, long len, long needed) {
+  m.resize_data(needed);
+  if (tpexport(data, len, m->data, &needed, 0) == -1) {
+    // Encoded buffer types may need more than bufsize
+    if (tperrno != TPELIMIT) {
+      throw std::runtime_error("tpexport failed");
+    }
+    m.resize_data(needed);
+    if (tpexport(data, len, m->data, &needed, 0) == -1) {
+      throw std::runtime_error("tpexport failed");
+    }
+  }
+  m.resize_data(needed);
+  return needed;
+}
 
-void msg::set_data(char *data, long len) {
+void msg::set_data(char *data, long len, long cmplimit) {
+  release();
+  (*this)->heapoff = -1;
+  (*this)->rawlen = 0;
   if (data == nullptr) {
     resize_data(0);
     return;
   }
+  long used;
+  auto off = fux::mem::share(data, len, used);
+  if (off != -1) {
+    share(off, used);
+    return;
+  }
+
   auto needed = fux::mem::bufsize(data, len);
+  if (needed == -1) {
+    throw std::runtime_error("bufsize failed");
+  }
+  if (cmplimit <= 0 || needed < cmplimit) {
+    export_data(*this, data, len, needed);
+    return;
+  }
+
+  auto &raw = scratch();
+  needed = export_data(raw, data, len, needed);
+  // Not worth it unless at least 1/8 is saved
   resize_data(needed);
-  if (tpexport(data, len, (*this)->data, &needed, 0) == -1) {
-    throw std::runtime_error("tpexport failed");
+  auto n = lzcompress(raw->data, needed, (*this)->data, needed - needed / 8);
+  if (n == 0) {
+    std::copy_n(raw->data, needed, (*this)->data);
+  } else {
+    (*this)->rawlen = needed;
+    resize_data(n);
+  }
+}
+
+bool msg::give_data(char *data, long len, long cmplimit) {
+  if (data != nullptr) {
+    long used;
+    auto off = fux::mem::give(data, len, used);
+    if (off != -1) {
+      release();
+      share(off, used);
+      return true;
+    }
   }
+  set_data(data, len, cmplimit);
+  return false;
+}
+
+void msg::unshare() {
+  if ((*this)->heapoff == -1) {
+    return;
+  }
+  char *data = nullptr;
+  get_data(&data);
+  (*this)->heapoff = -1;
+  (*this)->rawlen = 0;
+  try {
+    auto needed = fux::mem::bufsize(data, 0);
+    if (needed == -1) {
+      throw std::runtime_error("bufsize failed");
+    }
+    export_data(*this, data, 0, needed);
+  } catch (...) {
+    tpfree(data);
+    throw;
+  }
+  tpfree(data);
 }
 
 void msg::get_data(char **data) {
-  if (tpimport((*this)->data, size_data(), data, 0, 0) == -1) {
+  if ((*this)->heapoff != -1) {
+    if (!shared_) {
+      throw std::logic_error("Shared heap buffer already taken");
+    }
+    shared_ = false;
+    fux::mem::adopt((*this)->heapoff, (*this)->heaplen, data);
+    return;
+  }
+  auto ibuf = (*this)->data;
+  if ((*this)->rawlen != 0) {
+    auto &raw = scratch();
+    raw.resize_data((*this)->rawlen);
+    if (lzdecompress((*this)->data, size() - sizeof(msgmem), raw->data,
+                     (*this)->rawlen) != size_t((*this)->rawlen)) {
+      throw std::runtime_error("Invalid compressed message");
+    }
+    ibuf = raw->data;
+  }
+  if (tpimport(ibuf, size_data(), data, 0, 0) == -1) {
     throw std::runtime_error("tpimport failed");
   }
 }
@@ -11,8 +11,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <memory>
 #include <system_error>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include <atmidefs.h>
@@ -46,10 +50,21 @@ class scoped_semlock {
 
 namespace ipc {
 
-enum transport : char { queue, file };
+enum transport : char { queue, file, shm, frames, compact };
 enum category : char { application, admin, unblock };
 enum flags : char { noflags = 0, noblock, notime };
 
+// Requests carry their priority as mtype, receiving with a negative mtype
+// takes the lowest mtype so higher priorities get lower mtypes. Admin
+// messages use mtypes above all of them.
+constexpr long min_priority = 1;
+constexpr long max_priority = 100;
+constexpr long default_priority = 50;
+inline long priority_mtype(long prio) { return max_priority + 1 - prio; }
+inline long mtype_priority(long mtype) {
+  return std::clamp(max_priority + 1 - mtype, min_priority, max_priority);
+}
+
 struct msgbase {
   long mtype;
   enum transport ttype;
@@ -60,6 +75,17 @@ struct msgfile : msgbase {
   char filename[PATH_MAX];
 };
 
+// Message body is a sequence of messages, see batch
+struct msgframes : msgbase {
+  char data[0];
+};
+
+// Message body is in a shared heap block
+struct msgshm : msgbase {
+  long off;
+  long len;
+};
+
 struct msgmem : msgbase {
   char servicename[XATMI_SERVICE_NAME_LENGTH];
   fux::gttid gttid;
@@ -67,36 +93,175 @@ struct msgmem : msgbase {
   int cd;
   int replyq;
   int rval;
+  int service;  // MIB service slot of servicename, -1 if not resolved
   long rcode;
+  // Data is a typed buffer in the shared heap if heapoff is not -1
+  long heapoff;
+  long heaplen;
+  // Data is compressed with lzcompress if not 0, size before compression
+  long rawlen;
   char data[0];
 };
 
+// Header sent instead of msgmem when data is inline, there is no
+// transaction and all fields fit. Requests name the service by its MIB
+// slot only, the receiver gets a msgmem with an empty servicename.
+struct msgcompact {
+  long mtype;
+  enum transport ttype;
+  enum category cat;
+  uint8_t version;
+  uint8_t reserved;
+  int16_t service;
+  uint16_t flags;
+  int32_t cd;
+  int32_t replyq;
+  int32_t rval;
+  int32_t rcode;
+  char data[0];
+};
+static_assert(sizeof(msgcompact) == 32);
+constexpr uint8_t compact_version = 1;
+
+// Message buffer is not zero-filled when it grows and keeps its capacity,
+// reuse msg objects to avoid allocations on every request
 class msg {
  public:
-  msg() {
-    bytes_.resize(sizeof(msgmem));
+  msg() : size_(0), capacity_(0), shared_(false) {
+    resize(sizeof(msgmem));
+    std::fill_n(buf(), sizeof(msgmem), 0);
     as_msgmem().mtype = 1;
+    as_msgmem().heapoff = -1;
+    as_msgmem().service = -1;
+  }
+  ~msg() { release(); }
+  msg(msg &&other)
+      : bytes_(std::move(other.bytes_)),
+        size_(other.size_),
+        capacity_(other.capacity_),
+        shared_(other.shared_) {
+    other.size_ = other.capacity_ = 0;
+    other.shared_ = false;
+  }
+  msg &operator=(msg &&other) {
+    if (this != &other) {
+      release();
+      bytes_ = std::move(other.bytes_);
+      size_ = other.size_;
+      capacity_ = other.capacity_;
+      shared_ = other.shared_;
+      other.size_ = other.capacity_ = 0;
+      other.shared_ = false;
+    }
+    return *this;
+  }
+  void swap(msg &other) {
+    std::swap(bytes_, other.bytes_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(shared_, other.shared_);
   }
+
   msgfile &as_msgfile() { return *reinterpret_cast<msgfile *>(buf()); }
+  msgshm &as_msgshm() { return *reinterpret_cast<msgshm *>(buf()); }
   msgmem &as_msgmem() { return *reinterpret_cast<msgmem *>(buf()); }
   msgmem *operator->() { return reinterpret_cast<msgmem *>(buf()); }
-  char *buf() { return &bytes_[0]; }
-  size_t size() { return bytes_.size(); }
-  void resize(size_t n) { bytes_.resize(n); }
-  void resize_data(size_t n) { bytes_.resize(n + sizeof(msgmem)); }
-  size_t size() const { return bytes_.size(); }
-  size_t size_data() const { return bytes_.size() - sizeof(msgmem); }
-
-  void set_data(char *data, long len);
+  char *buf() { return bytes_.get(); }
+  size_t size() { return size_; }
+  // Contents up to the old size are kept, the rest is not initialized
+  void resize(size_t n) {
+    if (n > capacity_) {
+      grow(n);
+    }
+    size_ = n;
+  }
+  void resize_data(size_t n) { resize(n + sizeof(msgmem)); }
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  size_t size_data() const {
+    auto mem = reinterpret_cast<const msgmem *>(bytes_.get());
+    if (mem->heapoff != -1) {
+      return mem->heaplen;
+    } else if (mem->rawlen != 0) {
+      return mem->rawlen;
+    }
+    return size_ - sizeof(msgmem);
+  }
+
+  // Sends a copy of data, compressed if it takes at least cmplimit bytes
+  void set_data(char *data, long len, long cmplimit = 0);
+  // Hands over data if it is in the shared heap and returns true, otherwise
+  // sends a copy and the caller still owns data
+  bool give_data(char *data, long len, long cmplimit = 0);
   void get_data(char **data);
+  // Copies the shared heap buffer into the message for receivers on other
+  // machines
+  void unshare();
+
+ private:
+  friend bool qsend(int msqid, msg &data, long timeout, enum flags flags);
+  friend void qrecv(int msqid, msg &data, long msgtype, int flags,
+                    long timeout);
+  friend bool qnext(msg &data, size_t &pos, msg &out);
+
+  void grow(size_t n);
+  void share(long off, long used);
+  // Frees the shared heap buffer if it was not sent or received
+  void release();
+
+  std::unique_ptr<char[]> bytes_;
+  size_t size_;
+  size_t capacity_;
+  bool shared_;  // heap buffer at heapoff belongs to this message
+  msg(const msg &) = delete;
+  msg &operator=(const msg &) = delete;
+};
+
+// Packs several messages for one queue into a single message. Only
+// messages with the same mtype and category and without shared heap
+// buffers are packed together.
+class batch {
+ public:
+  // Requests are received by priority and a batch of them has the mtype of
+  // all its messages. Replies are received with msgtype 0 and told apart by
+  // cd, a batch of them takes any mtype.
+  explicit batch(bool replies = false) : frames_(0), replies_(replies) {}
+
+  // Appends a copy of data, returns false if it does not fit
+  bool add(int msqid, msg &data);
+  size_t frames() const { return frames_; }
+  // Sends the batch and clears it if sent
+  bool send(int msqid, long timeout, enum flags flags);
+  void clear() { frames_ = 0; }
 
  private:
-  std::vector<char> bytes_;
+  msg buf_;
+  size_t frames_;
+  bool replies_;
 };
 
-int qcreate();
+// Copies the next message of a received batch to out, pos must be 0 for
+// the first one. Returns false after the last one.
+bool qnext(msg &data, size_t &pos, msg &out);
+// Header of the message qnext would copy next, nullptr after the last one
+const msgmem *qpeek(msg &data, size_t pos);
+
+// Queue implementations, see qbackend.h
+enum class backend : char { msgq, ring };
+
+int qcreate(enum backend b = backend::msgq);
+bool qexists(int msqid);
+// Largest message size in bytes that goes through the queue itself, at
+// most a quarter of the queue size
+size_t qmsgmax();
+// Number of messages waiting in the queue
+size_t qlength(int msqid);
+// Returns false if the queue is full: at once with noblock or a timeout of
+// 0, after timeout milliseconds with noflags. notime waits for room.
 bool qsend(int msqid, msg &data, long timeout, enum flags flags);
-void qrecv(int msqid, msg &data, long msgtype, int flags);
+// Waits up to timeout milliseconds if not 0, throws ENOMSG if nothing
+// arrives
+void qrecv(int msqid, msg &data, long msgtype, int flags, long timeout = 0);
 void qdelete(int msqid);
 
 }  // namespace ipc
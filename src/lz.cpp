@@ -0,0 +1,179 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <string.h>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#include "misc.h"
+
+// Byte-aligned LZ77 in the spirit of LZ4 block format. Every sequence is a
+// token with literal length in the high and match length - 4 in the low
+// nibble, length 15 continues in the following bytes. Then come literals,
+// 2 byte little-endian match offset and the rest of match length. The last
+// sequence has literals only.
+
+constexpr size_t min_match = 4;
+constexpr size_t max_offset = 65535;
+constexpr int hash_bits = 14;
+// Matches do not start in the last bytes so the decoder can stop on literals
+constexpr size_t tail_literals = 12;
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+// Worst case size of a sequence
+static size_t sequence_size(size_t nlit, size_t mlen) {
+  return 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1;
+}
+
+static uint8_t *write_length(uint8_t *op, size_t n) {
+  for (; n >= 255; n -= 255) {
+    *op++ = 255;
+  }
+  *op++ = n;
+  return op;
+}
+
+static uint8_t *sequence(uint8_t *op, const uint8_t *lit, size_t nlit,
+                         size_t offset, size_t mlen) {
+  auto token = op++;
+  *token = (nlit < 15 ? nlit : 15) << 4;
+  if (nlit >= 15) {
+    op = write_length(op, nlit - 15);
+  }
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen == 0) {
+    return op;
+  }
+  mlen -= min_match;
+  *token |= mlen < 15 ? mlen : 15;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (mlen >= 15) {
+    op = write_length(op, mlen - 15);
+  }
+  return op;
+}
+
+size_t lzcompress(const void *ibuf, size_t ilen, void *obuf, size_t olen) {
+  auto in = static_cast<const uint8_t *>(ibuf);
+  auto out = static_cast<uint8_t *>(obuf);
+  auto op = out;
+  auto oend = out + olen;
+  uint32_t table[1 << hash_bits];
+  std::fill_n(table, 1 << hash_bits, 0);
+
+  size_t anchor = 0;
+  size_t ip = 1;
+  while (ilen > tail_literals && ip < ilen - tail_literals) {
+    auto h = hash(read32(in + ip));
+    size_t ref = table[h];
+    table[h] = ip;
+    if (ref == 0 || ip - ref > max_offset ||
+        read32(in + ref) != read32(in + ip)) {
+      // Skip faster through data that does not compress
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    size_t mlen = min_match;
+    const size_t limit = ilen - tail_literals / 2 - ip;
+    while (mlen < limit && in[ref + mlen] == in[ip + mlen]) {
+      mlen++;
+    }
+    if (size_t(oend - op) < sequence_size(ip - anchor, mlen)) {
+      return 0;
+    }
+    op = sequence(op, in + anchor, ip - anchor, ip - ref, mlen);
+    ip += mlen;
+    anchor = ip;
+    if (ip < ilen - tail_literals) {
+      table[hash(read32(in + ip - 2))] = ip - 2;
+    }
+  }
+  if (size_t(oend - op) < sequence_size(ilen - anchor, 0)) {
+    return 0;
+  }
+  op = sequence(op, in + anchor, ilen - anchor, 0, 0);
+  return op - out;
+}
+
+static size_t read_length(const uint8_t *&ip, const uint8_t *end, size_t n) {
+  if (n != 15) {
+    return n;
+  }
+  uint8_t b;
+  do {
+    if (ip == end) {
+      throw std::invalid_argument("Truncated LZ input");
+    }
+    b = *ip++;
+    n += b;
+  } while (b == 255);
+  return n;
+}
+
+size_t lzdecompress(const void *ibuf, size_t ilen, void *obuf, size_t olen) {
+  auto ip = static_cast<const uint8_t *>(ibuf);
+  auto end = ip + ilen;
+  auto out = static_cast<uint8_t *>(obuf);
+  size_t op = 0;
+
+  while (ip < end) {
+    auto token = *ip++;
+    auto nlit = read_length(ip, end, token >> 4);
+    if (nlit <= 16 && end - ip >= 16 && olen - op >= 16) {
+      // Copying more than needed is cheaper than exact length
+      memcpy(out + op, ip, 16);
+    } else {
+      if (size_t(end - ip) < nlit) {
+        throw std::invalid_argument("Truncated LZ input");
+      }
+      if (olen - op < nlit) {
+        throw std::range_error("Not enough space for decompressed data");
+      }
+      memcpy(out + op, ip, nlit);
+    }
+    ip += nlit;
+    op += nlit;
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      throw std::invalid_argument("Truncated LZ input");
+    }
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    auto mlen = read_length(ip, end, token & 15) + min_match;
+    if (offset == 0 || offset > op) {
+      throw std::invalid_argument("Invalid LZ match offset");
+    }
+    auto src = out + op - offset;
+    if (offset >= 16 && olen - op >= mlen + 16) {
+      for (size_t i = 0; i < mlen; i += 16) {
+        memcpy(out + op + i, src + i, 16);
+      }
+    } else {
+      if (olen - op < mlen) {
+        throw std::range_error("Not enough space for decompressed data");
+      }
+      // Overlapping copy repeats the last offset bytes
+      for (size_t i = 0; i < mlen; i++) {
+        out[op + i] = src[i];
+      }
+    }
+    op += mlen;
+  }
+  return op;
+}
@@ -1,12 +1,18 @@
 // This file is part of Fuxedo
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
+#include <tmtypes.h>
 #include <xatmi.h>
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstring>
+#include <mutex>
+#include <set>
+#include <vector>
 
 #include "misc.h"
+#include "shmheap.h"
 
 void fml32init(void *, size_t);
 void fml32reinit(void *, size_t);
@@ -15,48 +21,539 @@ size_t fml32used(void *);
 
 namespace fux::mem {
 
-struct tptype {
-  char type[8];
-  char subtype[16];
-  int default_size;
-  void (*init)(void *mem, size_t size);
-  void (*reinit)(void *mem, size_t size);
-  void (*finit)(void *mem);
-  size_t (*used)(void *mem);
-};
-
-size_t strused(void *ptr) { return strlen(reinterpret_cast<char *>(ptr)) + 1; }
-
-static tptype _tptypes[] = {
-    tptype{"CARRAY", "*", 0, nullptr, nullptr, nullptr, nullptr},
-    tptype{"STRING", "*", 512, nullptr, nullptr, nullptr, strused},
-    tptype{"FML32", "*", 512, fml32init, fml32reinit, fml32finit, fml32used}};
+static int fml32_initbuf(char *ptr, long mdlen) {
+  fml32init(ptr, mdlen);
+  return 1;
+}
+static int fml32_reinitbuf(char *ptr, long mdlen) {
+  fml32reinit(ptr, mdlen);
+  return 1;
+}
+static int fml32_uninitbuf(char *ptr, long) {
+  fml32finit(ptr);
+  return 1;
+}
+static long fml32_presend(char *ptr, long, long) { return fml32used(ptr); }
+static long string_presend(char *ptr, long, long) { return strlen(ptr) + 1; }
+
+// Type switch, entries are only appended so an index stored in the buffer
+// header stays valid and can be read without locks
+constexpr int max_types = 64;
+static tmtype_sw_t _tptypes[max_types] = {
+    {"CARRAY", "*", 0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+     nullptr},
+    {"STRING", "*", 512, nullptr, nullptr, nullptr, string_presend, nullptr,
+     nullptr, nullptr},
+    {"FML32", "*", 512, fml32_initbuf, fml32_reinitbuf, fml32_uninitbuf,
+     fml32_presend, nullptr, nullptr, nullptr}};
+static std::atomic<int> _ntypes{3};
+static std::mutex _tptypes_mutex;
 
 struct tpmem {
   long size;
   char **owner;
-  char type[8];
-  char subtype[16];
+  int sclass;
+  int typeidx;
+  char type[TMTYPELEN];
+  char subtype[TMSTYPELEN];
   char data[];
 };
 
+// Size of type and subtype in exported buffers
+constexpr long exphdr = sizeof(tpmem) - offsetof(tpmem, type);
+
+arena::~arena() {
+  reset();
+  for (auto c : chunks_) {
+    free(c);
+  }
+}
+
+void *arena::allocate(size_t size) {
+  size = align(size);
+  if (size > chunk_size) {
+    auto p = static_cast<char *>(malloc(size));
+    if (p == nullptr) {
+      throw std::bad_alloc();
+    }
+    large_.push_back(p);
+    return p;
+  }
+
+  if (top_ == nullptr || size > size_t(end_ - top_)) {
+    if (top_ != nullptr) {
+      current_++;
+    }
+    if (current_ == chunks_.size()) {
+      auto c = static_cast<char *>(malloc(chunk_size));
+      if (c == nullptr) {
+        throw std::bad_alloc();
+      }
+      chunks_.push_back(c);
+    }
+    top_ = chunks_[current_];
+    end_ = top_ + chunk_size;
+  }
+
+  auto p = top_;
+  top_ += size;
+  return p;
+}
+
+// Only the most recent allocation in the current chunk can be given back
+bool arena::last(char *p, size_t size) const {
+  return top_ != nullptr && p >= end_ - chunk_size && p + align(size) == top_;
+}
+
+void arena::deallocate(void *ptr, size_t size) {
+  if (last(static_cast<char *>(ptr), size)) {
+    top_ = static_cast<char *>(ptr);
+  }
+}
+
+bool arena::grow(void *ptr, size_t size, size_t newsize) {
+  auto p = static_cast<char *>(ptr);
+  if (last(p, size) && align(newsize) <= size_t(end_ - p)) {
+    top_ = p + align(newsize);
+    return true;
+  }
+  return false;
+}
+
+void arena::reset() {
+  for (auto p : large_) {
+    free(p);
+  }
+  large_.clear();
+  current_ = 0;
+  top_ = nullptr;
+  end_ = nullptr;
+}
+
+static thread_local arena *tarena = nullptr;
+
+void use_arena(arena *a) { tarena = a; }
+
+// Typed buffers come from power-of-two size classes. Each thread keeps a
+// small cache of free blocks per class and exchanges batches of blocks with
+// a global depot, so most tpalloc/tpfree calls don't take any locks.
+// Set FUXMALLOC=y to use malloc/realloc/free directly for debugging.
+namespace pool {
+constexpr int min_shift = 7;   // 128 bytes
+constexpr int max_shift = 20;  // 1 MiB, bigger buffers use malloc
+constexpr int nclasses = max_shift - min_shift + 1;
+constexpr long no_class = -1;
+constexpr long arena_class = -2;
+constexpr long shm_class = -3;
+constexpr size_t cache_limit = 32;  // blocks per class in a thread cache
+constexpr size_t batch_size = cache_limit / 2;
+constexpr size_t depot_limit = 32;  // batches per class in the depot
+
+static size_t class_size(long sclass) { return size_t(1) << (sclass + min_shift); }
+
+static long size_class(size_t size) {
+  if (size > class_size(nclasses - 1)) {
+    return no_class;
+  }
+  if (size <= class_size(0)) {
+    return 0;
+  }
+  return (sizeof(unsigned long) * 8 - __builtin_clzl(size - 1)) - min_shift;
+}
+
+static bool use_malloc() {
+  static const bool value = fux::util::getenv("FUXMALLOC", "n") == "y";
+  return value;
+}
+
+struct block {
+  block *next;
+};
+
+struct batch {
+  block *head;
+  size_t count;
+};
+
+struct counters {
+  std::atomic<uint64_t> allocs{0};
+  std::atomic<uint64_t> frees{0};
+  std::atomic<uint64_t> cache_hits{0};
+  std::atomic<uint64_t> depot_gets{0};
+  std::atomic<uint64_t> depot_puts{0};
+  std::atomic<uint64_t> system_allocs{0};
+  std::atomic<uint64_t> system_frees{0};
+  std::atomic<uint64_t> inplace_grows{0};
+
+  // Only the owning thread writes, no need for atomic read-modify-write
+  static void inc(std::atomic<uint64_t> &c, uint64_t n = 1) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  void add_to(pool_stats &s) const {
+    s.allocs += allocs.load(std::memory_order_relaxed);
+    s.frees += frees.load(std::memory_order_relaxed);
+    s.cache_hits += cache_hits.load(std::memory_order_relaxed);
+    s.depot_gets += depot_gets.load(std::memory_order_relaxed);
+    s.depot_puts += depot_puts.load(std::memory_order_relaxed);
+    s.system_allocs += system_allocs.load(std::memory_order_relaxed);
+    s.system_frees += system_frees.load(std::memory_order_relaxed);
+    s.inplace_grows += inplace_grows.load(std::memory_order_relaxed);
+  }
+};
+
+static void release(batch b, counters &c) {
+  while (b.head != nullptr) {
+    auto next = b.head->next;
+    free(b.head);
+    b.head = next;
+  }
+  counters::inc(c.system_frees, b.count);
+}
+
+class depot {
+ public:
+  bool get(long sclass, batch &b) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &batches = batches_[sclass];
+    if (batches.empty()) {
+      return false;
+    }
+    b = batches.back();
+    batches.pop_back();
+    return true;
+  }
+
+  // Returns false if the depot is full and the batch must be released
+  bool put(long sclass, batch b) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &batches = batches_[sclass];
+    if (batches.size() >= depot_limit) {
+      return false;
+    }
+    batches.push_back(b);
+    return true;
+  }
+
+  void attach(const counters *c) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    threads_.insert(c);
+  }
+
+  void detach(const counters *c) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    threads_.erase(c);
+    c->add_to(exited_);
+  }
+
+  pool_stats stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pool_stats s = exited_;
+    for (auto c : threads_) {
+      c->add_to(s);
+    }
+    return s;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<batch> batches_[nclasses];
+  std::set<const counters *> threads_;
+  pool_stats exited_ = {};
+};
+
+// Never destroyed, thread caches may outlive static destructors
+static depot &getdepot() {
+  static auto d = new depot();
+  return *d;
+}
+
+class cache {
+ public:
+  cache() : heads_{}, counts_{} { getdepot().attach(&counters_); }
+  ~cache() {
+    for (long sclass = 0; sclass < nclasses; sclass++) {
+      if (counts_[sclass] > 0) {
+        flush(sclass, counts_[sclass]);
+      }
+    }
+    getdepot().detach(&counters_);
+  }
+
+  tpmem *allocate(size_t size) {
+    auto sclass = use_malloc() ? no_class : size_class(size);
+    counters::inc(counters_.allocs);
+    if (sclass == no_class) {
+      counters::inc(counters_.system_allocs);
+      auto mem = static_cast<tpmem *>(malloc(size));
+      if (mem == nullptr) {
+        throw std::bad_alloc();
+      }
+      mem->sclass = no_class;
+      return mem;
+    }
+
+    if (heads_[sclass] != nullptr) {
+      counters::inc(counters_.cache_hits);
+    } else {
+      batch b;
+      if (getdepot().get(sclass, b)) {
+        counters::inc(counters_.depot_gets);
+        heads_[sclass] = b.head;
+        counts_[sclass] = b.count;
+      } else {
+        counters::inc(counters_.system_allocs);
+        auto mem = static_cast<tpmem *>(malloc(class_size(sclass)));
+        if (mem == nullptr) {
+          throw std::bad_alloc();
+        }
+        mem->sclass = sclass;
+        return mem;
+      }
+    }
+
+    auto blk = heads_[sclass];
+    heads_[sclass] = blk->next;
+    counts_[sclass]--;
+    auto mem = reinterpret_cast<tpmem *>(blk);
+    mem->sclass = sclass;
+    return mem;
+  }
+
+  void deallocate(tpmem *mem) {
+    counters::inc(counters_.frees);
+    auto sclass = mem->sclass;
+    if (sclass == no_class) {
+      counters::inc(counters_.system_frees);
+      free(mem);
+      return;
+    }
+
+    auto blk = reinterpret_cast<block *>(mem);
+    blk->next = heads_[sclass];
+    heads_[sclass] = blk;
+    if (++counts_[sclass] > cache_limit) {
+      flush(sclass, batch_size);
+    }
+  }
+
+  // Returns block big enough for size, in place if possible
+  tpmem *reallocate(tpmem *mem, size_t size) {
+    if (mem->sclass == no_class) {
+      if (use_malloc() || size_class(size) == no_class) {
+        auto newmem = static_cast<tpmem *>(realloc(mem, size));
+        if (newmem == nullptr) {
+          throw std::bad_alloc();
+        }
+        return newmem;
+      }
+    } else if (size <= class_size(mem->sclass)) {
+      counters::inc(counters_.inplace_grows);
+      return mem;
+    }
+
+    auto newmem = allocate(size);
+    auto sclass = newmem->sclass;
+    std::copy_n(reinterpret_cast<char *>(mem),
+                std::min(size, sizeof(tpmem) + mem->size),
+                reinterpret_cast<char *>(newmem));
+    newmem->sclass = sclass;
+    deallocate(mem);
+    return newmem;
+  }
+
+ private:
+  // Moves n blocks to the depot
+  void flush(long sclass, size_t n) {
+    batch b = {heads_[sclass], n};
+    auto tail = heads_[sclass];
+    for (size_t i = 1; i < n; i++) {
+      tail = tail->next;
+    }
+    heads_[sclass] = tail->next;
+    tail->next = nullptr;
+    counts_[sclass] -= n;
+
+    if (getdepot().put(sclass, b)) {
+      counters::inc(counters_.depot_puts);
+    } else {
+      release(b, counters_);
+    }
+  }
+
+  block *heads_[nclasses];
+  size_t counts_[nclasses];
+  counters counters_;
+};
+
+// Thread cache is created on first use and destroyed with other
+// thread_local objects. Buffers freed after that go straight to free().
+static thread_local cache *tcache = nullptr;
+static thread_local bool tcache_destroyed = false;
+
+struct cache_guard {
+  ~cache_guard() {
+    delete tcache;
+    tcache = nullptr;
+    tcache_destroyed = true;
+  }
+};
+
+static cache *getcache() {
+  if (tcache == nullptr && !tcache_destroyed) {
+    static thread_local cache_guard guard;
+    tcache = new cache();
+  }
+  return tcache;
+}
+
+static tpmem *allocate(size_t size) {
+  if (tarena != nullptr) {
+    auto mem = static_cast<tpmem *>(tarena->allocate(size));
+    mem->sclass = arena_class;
+    return mem;
+  }
+  // Falls back to the pool when the shared heap is full
+  if (auto heap = shmheap::buffers()) {
+    if (auto mem = static_cast<tpmem *>(heap->allocate(size))) {
+      mem->sclass = shm_class;
+      return mem;
+    }
+  }
+  if (auto c = getcache()) {
+    return c->allocate(size);
+  }
+  auto mem = static_cast<tpmem *>(malloc(size));
+  if (mem == nullptr) {
+    throw std::bad_alloc();
+  }
+  mem->sclass = no_class;
+  return mem;
+}
+
+static void deallocate(tpmem *mem) {
+  if (mem->sclass == arena_class) {
+    // Memory is released by arena::reset()
+    if (tarena != nullptr) {
+      tarena->deallocate(mem, sizeof(tpmem) + mem->size);
+    }
+  } else if (mem->sclass == shm_class) {
+    shmheap::current()->deallocate(mem);
+  } else if (auto c = getcache()) {
+    c->deallocate(mem);
+  } else {
+    free(mem);
+  }
+}
+
+static tpmem *reallocate(tpmem *mem, size_t size) {
+  if (mem->sclass == arena_class) {
+    size_t oldsize = sizeof(tpmem) + mem->size;
+    if (tarena != nullptr && tarena->grow(mem, oldsize, size)) {
+      return mem;
+    }
+    // Moves to a new arena block or to the pool if the arena is not active
+    auto newmem = allocate(size);
+    auto sclass = newmem->sclass;
+    std::copy_n(reinterpret_cast<char *>(mem), std::min(size, oldsize),
+                reinterpret_cast<char *>(newmem));
+    newmem->sclass = sclass;
+    return newmem;
+  }
+  if (mem->sclass == shm_class) {
+    auto heap = shmheap::current();
+    if (size <= heap->capacity(mem)) {
+      return mem;
+    }
+    auto newmem = allocate(size);
+    auto sclass = newmem->sclass;
+    std::copy_n(reinterpret_cast<char *>(mem), sizeof(tpmem) + mem->size,
+                reinterpret_cast<char *>(newmem));
+    newmem->sclass = sclass;
+    heap->deallocate(mem);
+    return newmem;
+  }
+  if (auto c = getcache()) {
+    return c->reallocate(mem, size);
+  }
+  auto newmem = static_cast<tpmem *>(realloc(mem, size));
+  if (newmem == nullptr) {
+    throw std::bad_alloc();
+  }
+  newmem->sclass = no_class;
+  return newmem;
+}
+}  // namespace pool
+
+pool_stats stats() { return pool::getdepot().stats(); }
+
 static tpmem *memptr(char *ptr) {
   return (tpmem *)(ptr - offsetof(struct tpmem, data));
 }
 
-static const tptype *typeptr(const char *type, const char *subtype) {
-  const auto &tptype = std::find_if(
-      std::cbegin(_tptypes), std::cend(_tptypes), [&](const auto &t) {
-        return (strncmp(t.type, type, sizeof(t.type)) == 0 &&
-                (subtype == nullptr || subtype[0] == '\0' ||
-                 strncmp(t.subtype, subtype, sizeof(t.subtype)) == 0));
-      });
-  if (tptype == std::end(_tptypes)) {
-    TPERROR(TPENOENT, "unknown type [%s] and subtype[%s]", type,
-            subtype == nullptr ? "" : subtype);
+// Exported part of the buffer starting with type and subtype
+static char *expptr(tpmem *mem) {
+  return reinterpret_cast<char *>(mem) + offsetof(tpmem, type);
+}
+
+static int typeindex(const char *type, const char *subtype) {
+  auto n = _ntypes.load(std::memory_order_acquire);
+  for (int i = 0; i < n; i++) {
+    const auto &t = _tptypes[i];
+    if (strncmp(t.type, type, sizeof(t.type)) == 0 &&
+        (subtype == nullptr || subtype[0] == '\0' ||
+         strncmp(t.subtype, subtype, sizeof(t.subtype)) == 0)) {
+      return i;
+    }
+  }
+  TPERROR(TPENOENT, "unknown type [%.8s] and subtype[%.16s]", type,
+          subtype == nullptr ? "" : subtype);
+  return -1;
+}
+
+// Type name is checked as well to catch pointers not from tpalloc
+static const tmtype_sw_t *typeptr(const tpmem *mem) {
+  if (mem->typeidx < 0 ||
+      mem->typeidx >= _ntypes.load(std::memory_order_acquire) ||
+      strncmp(_tptypes[mem->typeidx].type, mem->type, sizeof(mem->type)) !=
+          0) {
+    TPERROR(TPENOENT, "unknown type [%.8s] and subtype[%.16s]", mem->type,
+            mem->subtype);
     return nullptr;
   }
-  return &(*tptype);
+  return &_tptypes[mem->typeidx];
+}
+
+int tpregtype(const tmtype_sw_t *sw) {
+  if (sw == nullptr || sw->type[0] == '\0') {
+    TPERROR(TPEINVAL, "type is empty");
+    return -1;
+  }
+  if (sw->dfltsize < 0) {
+    TPERROR(TPEINVAL, "invalid dfltsize");
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(_tptypes_mutex);
+  auto n = _ntypes.load(std::memory_order_relaxed);
+  for (int i = 0; i < n; i++) {
+    const auto &t = _tptypes[i];
+    if (strncmp(t.type, sw->type, sizeof(t.type)) == 0 &&
+        strncmp(t.subtype, sw->subtype, sizeof(t.subtype)) == 0) {
+      TPERROR(TPEMATCH, "type [%.8s] and subtype[%.16s] already registered",
+              sw->type, sw->subtype);
+      return -1;
+    }
+  }
+  if (n == max_types) {
+    TPERROR(TPELIMIT, "too many buffer types");
+    return -1;
+  }
+  _tptypes[n] = *sw;
+  _ntypes.store(n + 1, std::memory_order_release);
+
+  fux::atmi::reset_tperrno();
+  return 0;
 }
 
 char *tpalloc(char *type, char *subtype, long size) {
@@ -65,13 +562,14 @@ char *tpalloc(char *type, char *subtype, long size) {
     return nullptr;
   }
 
-  const auto tptype = typeptr(type, subtype);
-  if (tptype == nullptr) {
+  const auto typeidx = typeindex(type, subtype);
+  if (typeidx == -1) {
     return nullptr;
   }
+  const auto &tptype = _tptypes[typeidx];
 
-  size = size >= tptype->default_size ? size : tptype->default_size;
-  auto mem = (tpmem *)malloc(sizeof(tpmem) + size);
+  size = size >= tptype.dfltsize ? size : tptype.dfltsize;
+  auto mem = pool::allocate(sizeof(tpmem) + size);
   strncpy(mem->type, type, sizeof(mem->type));
   if (subtype != nullptr) {
     strncpy(mem->subtype, subtype, sizeof(mem->subtype));
@@ -80,8 +578,11 @@ char *tpalloc(char *type, char *subtype, long size) {
   }
   mem->size = size;
   mem->owner = nullptr;
-  if (tptype->init != nullptr) {
-    tptype->init(mem->data, size);
+  mem->typeidx = typeidx;
+  if (tptype.initbuf != nullptr && tptype.initbuf(mem->data, size) == -1) {
+    pool::deallocate(mem);
+    TPERROR(TPESYSTEM, "initbuf failed for type [%s]", type);
+    return nullptr;
   }
 
   fux::atmi::reset_tperrno();
@@ -95,20 +596,23 @@ char *tprealloc(char *ptr, long size) {
   }
 
   auto mem = memptr(ptr);
-  const auto tptype = typeptr(mem->type, mem->subtype);
+  const auto tptype = typeptr(mem);
   if (tptype == nullptr) {
     return nullptr;
   }
 
-  size = (size >= tptype->default_size) ? size : tptype->default_size;
-  mem = (tpmem *)realloc(mem, sizeof(tpmem) + size);
-  if (tptype->reinit != nullptr) {
-    tptype->reinit(mem->data, size);
-  }
+  size = (size >= tptype->dfltsize) ? size : tptype->dfltsize;
+  mem = pool::reallocate(mem, sizeof(tpmem) + size);
+  mem->size = size;
 
   if (mem->owner != nullptr && *(mem->owner) == ptr) {
     *(mem->owner) = mem->data;
   }
+  if (tptype->reinitbuf != nullptr &&
+      tptype->reinitbuf(mem->data, size) == -1) {
+    TPERROR(TPESYSTEM, "reinitbuf failed for type [%.8s]", mem->type);
+    return nullptr;
+  }
   fux::atmi::reset_tperrno();
   return mem->data;
 }
@@ -116,17 +620,17 @@ void tpfree(char *ptr) {
   if (ptr != nullptr) {
     // Inside service routines do not free buffer passed into a service routine
     auto mem = memptr(ptr);
-    const auto tptype = typeptr(mem->type, mem->subtype);
+    const auto tptype = typeptr(mem);
     if (tptype == nullptr) {
       return;
     }
-    if (tptype->finit != nullptr) {
-      tptype->finit(ptr);
+    if (tptype->uninitbuf != nullptr) {
+      tptype->uninitbuf(ptr, mem->size);
     }
     if (mem->owner != nullptr && *(mem->owner) == ptr) {
       *(mem->owner) = nullptr;
     }
-    free(mem);
+    pool::deallocate(mem);
   }
   fux::atmi::reset_tperrno();
 }
@@ -138,8 +642,7 @@ long tptypes(char *ptr, char *type, char *subtype) {
   }
 
   auto mem = memptr(ptr);
-  const auto tptype = typeptr(mem->type, mem->subtype);
-  if (tptype == nullptr) {
+  if (typeptr(mem) == nullptr) {
     TPERROR(TPEINVAL, "Buffer not fielded");
     return -1;
   }
@@ -168,43 +671,101 @@ int tpimport(char *istr, long ilen, char **obuf, long *olen, long flags) {
     flags |= TPEX_STRING;
   }
 
-  long needed = sizeof(tpmem);
+  // Header and payload are decoded separately, header is a whole number of
+  // base64 blocks
+  static_assert(exphdr % 3 == 0);
+  char hdr[exphdr];
+  const char *body;
+  long bodylen;
+  long outlen = ilen;
   if (flags & TPEX_STRING) {
     ilen = strlen(istr);
     if (ilen % 4) {
       TPERROR(TPEPROTO, "Invalid base64 string");
       return -1;
     }
-    needed += ilen / 4 * 3;
+    outlen = ilen;
+    if (ilen < long(base64chars(exphdr))) {
+      TPERROR(TPEINVAL, "Invalid exported buffer");
+      return -1;
+    }
+    base64decode(istr, base64chars(exphdr), hdr, sizeof(hdr));
+    body = istr + base64chars(exphdr);
+    bodylen = ilen - base64chars(exphdr);
   } else {
-    needed += ilen;
+    if (ilen < exphdr) {
+      TPERROR(TPEINVAL, "Invalid exported buffer");
+      return -1;
+    }
+    std::copy_n(istr, exphdr, hdr);
+    body = istr + exphdr;
+    bodylen = ilen - exphdr;
+  }
+
+  char type[TMTYPELEN + 1] = {0}, subtype[TMSTYPELEN + 1] = {0};
+  std::copy_n(hdr, TMTYPELEN, type);
+  std::copy_n(hdr + TMTYPELEN, TMSTYPELEN, subtype);
+  const auto typeidx = typeindex(type, subtype);
+  if (typeidx == -1) {
+    return -1;
+  }
+  const auto &tptype = _tptypes[typeidx];
+
+  std::vector<char> decoded;
+  if (tptype.encdec != nullptr && (flags & TPEX_STRING)) {
+    decoded.resize(bodylen / 4 * 3);
+    bodylen = base64decode(body, bodylen, decoded.data(), decoded.size());
+    body = decoded.data();
+  }
+
+  long size;
+  if (tptype.encdec != nullptr) {
+    size = tptype.encdec(TMDECODE, const_cast<char *>(body), bodylen, nullptr,
+                         0);
+    if (size < 0) {
+      TPERROR(TPESYSTEM, "encdec failed for type [%s]", type);
+      return -1;
+    }
+    outlen = size;
+  } else if (flags & TPEX_STRING) {
+    size = bodylen / 4 * 3;
+  } else {
+    size = bodylen;
   }
 
   auto omem = memptr(*obuf);
-  if (needed > omem->size) {
-    *obuf = tprealloc(*obuf, needed);
+  if (size > omem->size) {
+    *obuf = tprealloc(*obuf, size);
     omem = memptr(*obuf);
   }
 
-  if (flags & TPEX_STRING) {
-    (void)base64decode(istr, ilen,
-                       reinterpret_cast<char *>(omem) + offsetof(tpmem, type),
-                       ilen);
+  if (tptype.encdec != nullptr) {
+    if (tptype.encdec(TMDECODE, const_cast<char *>(body), bodylen, omem->data,
+                      omem->size) != size) {
+      TPERROR(TPESYSTEM, "encdec failed for type [%s]", type);
+      return -1;
+    }
+  } else if (flags & TPEX_STRING) {
+    size = base64decode(body, bodylen, omem->data, omem->size);
   } else {
-    std::copy_n(istr, ilen,
-                reinterpret_cast<char *>(omem) + offsetof(tpmem, type));
+    std::copy_n(body, bodylen, omem->data);
   }
+  std::copy_n(hdr, exphdr, expptr(omem));
+  omem->typeidx = typeidx;
 
-  const auto tptype = typeptr(omem->type, omem->subtype);
-  if (tptype == nullptr) {
+  if (tptype.reinitbuf != nullptr &&
+      tptype.reinitbuf(omem->data, omem->size) == -1) {
+    TPERROR(TPESYSTEM, "reinitbuf failed for type [%s]", type);
     return -1;
   }
-  if (tptype->reinit != nullptr) {
-    tptype->reinit(omem->data, omem->size);
+  if (tptype.postrecv != nullptr &&
+      tptype.postrecv(omem->data, size, omem->size) == -1) {
+    TPERROR(TPESYSTEM, "postrecv failed for type [%s]", type);
+    return -1;
   }
 
   if (olen != nullptr) {
-    *olen = ilen;
+    *olen = outlen;
   }
   fux::atmi::reset_tperrno();
   return 0;
@@ -221,11 +782,44 @@ int tpexport(char *ibuf, long ilen, char *ostr, long *olen, long flags) {
   }
 
   auto mem = memptr(ibuf);
+  const auto tptype = typeptr(mem);
+  if (tptype == nullptr) {
+    return -1;
+  }
   long used = fux::mem::bufsize(ibuf, ilen);
   if (used == -1) {
     return -1;
   }
 
+  const long datalen = used - exphdr;
+  const char *payload = mem->data;
+  long paylen = datalen;
+  std::vector<char> encoded;
+  if (tptype->encdec != nullptr) {
+    if (flags & TPEX_STRING) {
+      paylen = tptype->encdec(TMENCODE, nullptr, 0, mem->data, datalen);
+      if (paylen >= 0) {
+        encoded.resize(paylen);
+        if (tptype->encdec(TMENCODE, encoded.data(), paylen, mem->data,
+                           datalen) != paylen) {
+          paylen = -1;
+        }
+      }
+      payload = encoded.data();
+    } else {
+      // Encode straight into the output if it fits
+      long avail = std::max(*olen - exphdr, 0L);
+      paylen = tptype->encdec(TMENCODE, avail > 0 ? ostr + exphdr : nullptr,
+                              avail, mem->data, datalen);
+      payload = paylen <= avail ? ostr + exphdr : nullptr;
+    }
+    if (paylen < 0) {
+      TPERROR(TPESYSTEM, "encdec failed for type [%.8s]", mem->type);
+      return -1;
+    }
+    used = exphdr + paylen;
+  }
+
   long needed;
   if (flags & TPEX_STRING) {
     needed = base64chars(used) + 1;
@@ -240,12 +834,19 @@ int tpexport(char *ibuf, long ilen, char *ostr, long *olen, long flags) {
   }
 
   if (flags & TPEX_STRING) {
-    auto n = base64encode(reinterpret_cast<char *>(mem) + offsetof(tpmem, type),
-                          used, ostr, *olen);
-    ostr[n] = '\0';
+    base64stream out(ostr, *olen);
+    out.write(expptr(mem), exphdr);
+    out.write(payload, paylen);
+    ostr[out.finish()] = '\0';
   } else {
-    std::copy_n(reinterpret_cast<char *>(mem) + offsetof(tpmem, type), used,
-                ostr);
+    std::copy_n(expptr(mem), exphdr, ostr);
+    if (payload != ostr + exphdr) {
+      std::copy_n(payload, paylen, ostr + exphdr);
+    }
+  }
+
+  if (tptype->postsend != nullptr) {
+    tptype->postsend(mem->data, datalen, mem->size);
   }
 
   *olen = needed;
@@ -255,23 +856,113 @@ int tpexport(char *ibuf, long ilen, char *ostr, long *olen, long flags) {
 
 void setowner(char *ptr, char **owner) { memptr(ptr)->owner = owner; }
 
+long share(char *ptr, long len, long &used) {
+  auto heap = shmheap::buffers();
+  if (heap == nullptr) {
+    return -1;
+  }
+  auto mem = memptr(ptr);
+  const auto tptype = typeptr(mem);
+  if (tptype == nullptr) {
+    return -1;
+  }
+  used = bufsize(ptr, len);
+  if (used == -1) {
+    return -1;
+  }
+  auto copy = static_cast<tpmem *>(heap->allocate(sizeof(tpmem) + mem->size));
+  if (copy == nullptr) {
+    return -1;
+  }
+  const long datalen = std::min(used - exphdr, mem->size);
+  std::copy_n(reinterpret_cast<char *>(mem), sizeof(tpmem) + datalen,
+              reinterpret_cast<char *>(copy));
+  copy->sclass = pool::shm_class;
+  copy->owner = nullptr;
+  if (tptype->postsend != nullptr) {
+    tptype->postsend(mem->data, datalen, mem->size);
+  }
+  return heap->offset(copy);
+}
+
+long give(char *ptr, long len, long &used) {
+  auto mem = memptr(ptr);
+  const auto tptype = typeptr(mem);
+  if (tptype == nullptr || mem->sclass != pool::shm_class) {
+    return -1;
+  }
+  used = bufsize(ptr, len);
+  if (used == -1) {
+    return -1;
+  }
+  if (tptype->postsend != nullptr) {
+    tptype->postsend(mem->data, used - exphdr, mem->size);
+  }
+  if (mem->owner != nullptr && *(mem->owner) == ptr) {
+    *(mem->owner) = nullptr;
+  }
+  mem->owner = nullptr;
+  return shmheap::current()->offset(mem);
+}
+
+void adopt(long off, long used, char **data) {
+  auto heap = shmheap::current();
+  if (heap == nullptr) {
+    throw std::runtime_error("Shared heap not attached");
+  }
+  auto mem = static_cast<tpmem *>(heap->pointer(off));
+  heap->hold(mem);
+  // Type indexes are local to each process
+  mem->typeidx = typeindex(mem->type, mem->subtype);
+  if (mem->typeidx == -1) {
+    heap->deallocate(mem);
+    throw std::runtime_error("Unknown buffer type in shared heap");
+  }
+  mem->owner = nullptr;
+
+  if (*data != nullptr) {
+    auto old = memptr(*data);
+    if (old->owner == data) {
+      mem->owner = data;
+    }
+    tpfree(*data);
+  }
+  *data = mem->data;
+
+  const auto &tptype = _tptypes[mem->typeidx];
+  if (tptype.postrecv != nullptr &&
+      tptype.postrecv(mem->data, used - exphdr, mem->size) == -1) {
+    throw std::runtime_error("postrecv failed");
+  }
+}
+
 long bufsize(char *ptr, long used) {
   auto mem = memptr(ptr);
-  const auto tptype = typeptr(mem->type, mem->subtype);
+  const auto tptype = typeptr(mem);
   if (tptype == nullptr) {
     return -1;
   }
-  if (tptype->used != nullptr) {
-    return tptype->used(mem->data) + sizeof(*mem) - offsetof(tpmem, type);
+  if (tptype->presend != nullptr) {
+    auto n = tptype->presend(mem->data, used, mem->size);
+    if (n < 0) {
+      TPERROR(TPESYSTEM, "presend failed for type [%.8s]", mem->type);
+      return -1;
+    }
+    return n + exphdr;
   } else if (used != -1) {
-    return used + sizeof(*mem) - offsetof(tpmem, type);
+    return used + exphdr;
   } else {
-    return mem->size - offsetof(tpmem, type);
+    return mem->size + exphdr;
   }
 }
 
 }  // namespace fux::mem
 
+int tpregtype(const struct tmtype_sw_t *sw) {
+  return fux::atmi::exception_boundary(
+      [&] { return fux::mem::tpregtype(sw); }, -1);
+}
+
 char *tpalloc(char *type, char *subtype, long size) {
   return fux::atmi::exception_boundary(
       [&] { return fux::mem::tpalloc(type, subtype, size); }, nullptr);
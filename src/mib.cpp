@@ -11,7 +11,9 @@
 #include <stdexcept>
 #include <string>
 
+#include <fcntl.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <iterator>
@@ -21,6 +23,7 @@
 #include "ubbreader.h"
 
 #include "misc.h"
+#include "shmheap.h"
 #include "trx.h"
 
 #ifdef HAVE_CXX_FILESYSTEM
@@ -111,6 +114,7 @@ size_t mib::needed(const tuxconfig &cfg) {
 }
 
 void mib::init_memory() {
+  mem_->heapid = -1;
   auto off = nearest64(sizeof(mibmem));
   off += init(mem_->servers, cfg_.maxservers, off - offsetof(mibmem, servers));
   off += init(mem_->queues, cfg_.maxqueues, off - offsetof(mibmem, queues));
@@ -184,6 +188,18 @@ void mib::unadvertise(const std::string &servicename, size_t queue,
   services().at(service).modified();
 }
 
+void mib::unadvertise(size_t server) {
+  auto adv = advertisements();
+  for (size_t i = 0; i < adv->len; i++) {
+    auto &advertisement = adv.at(i);
+    if (advertisement.server == server) {
+      services().at(advertisement.service).modified();
+      advertisement.service = advertisement.queue = advertisement.server =
+          badoff;
+    }
+  }
+}
+
 size_t mib::find_queue(const std::string &rqaddr) {
   for (size_t i = 0; i < queues()->len; i++) {
     if (rqaddr == queues().at(i).rqaddr) {
@@ -202,6 +218,8 @@ size_t mib::make_queue(const std::string &rqaddr) {
   checked_copy(rqaddr, queue.rqaddr);
   queue.msqid = -1;
   queue.mtype = std::numeric_limits<long>::max();
+  queue.backend = mach().transport;
+  queue.subqueues = false;
 
   return queues()->len++;
 }
@@ -256,6 +274,13 @@ size_t mib::make_server(uint16_t srvid, uint16_t grpno,
   server.grpno = grpno;
   checked_copy(servername, server.servername);
   checked_copy(clopt, server.clopt);
+  server.subq = -1;
+  server.min_threads = server.max_threads = default_dispatch_threads;
+  server.stacksize = 0;
+  server.basesrvid = srvid;
+  server.scaleup = 0;
+  server.cooldown = default_cooldown;
+  server.threads = server.busy_threads = 0;
 
   server.rqaddr = find_queue(rqaddr);
   if (server.rqaddr == badoff) {
@@ -300,13 +325,14 @@ size_t mib::make_service(const std::string &servicename) {
 
   auto &service = services().at(services()->len);
   checked_copy(servicename, service.servicename);
+  service.options = {0, 0, fux::ipc::default_priority};
   return services()->len++;
 }
 
 int mib::make_service_rqaddr(size_t server) {
   auto &queue = queues().at(servers().at(server).rqaddr);
   if (queue.msqid == -1) {
-    queue.msqid = fux::ipc::qcreate();
+    queue.msqid = fux::ipc::qcreate(queue.backend);
     if (queue.msqid == -1) {
       throw std::system_error(errno, std::system_category());
     }
@@ -314,6 +340,18 @@ int mib::make_service_rqaddr(size_t server) {
   return queue.msqid;
 }
 
+int mib::make_server_subq(size_t server) {
+  auto &srv = servers().at(server);
+  auto &queue = queues().at(srv.rqaddr);
+  if (!queue.subqueues) {
+    return -1;
+  }
+  if (srv.subq == -1 || !fux::ipc::qexists(srv.subq)) {
+    srv.subq = fux::ipc::qcreate(queue.backend);
+  }
+  return srv.subq;
+}
+
 void mib::remove() {
   std::vector<int> q, m, s;
   collect(q, m, s);
@@ -324,17 +362,27 @@ void mib::collect(std::vector<int> &q, std::vector<int> &m,
                   std::vector<int> &s) {
   for (size_t i = 0; i < queues()->len; i++) {
     auto msqid = queues().at(i).msqid;
-    if (msqid != -1) {
+    // Rings live in the shared heap and go away with it
+    if (msqid >= 0) {
       q.push_back(msqid);
     }
   }
+  for (size_t i = 0; i < servers()->len; i++) {
+    auto subq = servers().at(i).subq;
+    if (subq >= 0) {
+      q.push_back(subq);
+    }
+  }
   for (size_t i = 0; i < accessers()->len; i++) {
     auto &acc = accessers().at(i);
-    if (acc.rpid != -1) {
+    if (acc.rpid >= 0) {
       q.push_back(acc.rpid);
     }
   }
   s.push_back(mem_->mainsem);
+  if (mem_->heapid != -1) {
+    m.push_back(mem_->heapid);
+  }
   m.push_back(shmid_);
 }
 
@@ -372,6 +420,32 @@ mib &getmib() {
   return *mibcon.get();
 }
 
+pid_t exec_server(const server &srv) {
+  auto grpno = std::to_string(srv.grpno);
+  auto srvid = std::to_string(srv.srvid);
+  const char *argv[] = {srv.servername, "-g", grpno.c_str(), "-i",
+                        srvid.c_str(),  "-A", nullptr};
+
+  auto pid = fork();
+  if (pid == 0) {
+    // BBL has other threads, the child may only make async-signal-safe
+    // calls until exec
+    auto redirect = [](const char *path, int flags, int fd) {
+      int f = open(path, flags, 0644);
+      return f != -1 && (f == fd || (dup2(f, fd) != -1 && close(f) == 0));
+    };
+    if (!redirect("/dev/null", O_RDONLY, STDIN_FILENO) ||
+        !redirect("stdout", O_WRONLY | O_CREAT | O_APPEND, STDOUT_FILENO) ||
+        !redirect("stderr", O_WRONLY | O_CREAT | O_APPEND, STDERR_FILENO)) {
+      _exit(-1);
+    }
+
+    execvp(srv.servername, const_cast<char *const *>(argv));
+    _exit(-1);
+  }
+  return pid;
+}
+
 mib::mib(const tuxconfig &cfg) : cfg_(cfg) {
   shmid_ = shmget(cfg_.ipckey, needed(cfg_), 0600 | IPC_CREAT);
   if (shmid_ == -1) {
@@ -388,12 +462,19 @@ mib::mib(const tuxconfig &cfg) : cfg_(cfg) {
     mem_->mainsem = fux::ipc::seminit(IPC_PRIVATE, 1);
     mem_->conf = cfg_;
     init_memory();
+    mem_->heapid = fux::mem::shmheap::create(
+        cfg_.shmheap > 0 ? size_t(cfg_.shmheap) * 1024
+                         : fux::mem::shmheap::default_size);
     mem_->state = 2;
   }
 
   while (mem_->state != 2) {
     std::this_thread::yield();
   }
+
+  if (mem_->heapid != -1) {
+    fux::mem::shmheap::attach(mem_->heapid, mem_->conf.shmheap > 0);
+  }
 }
 
 mib::mib(const tuxconfig &cfg, fux::mib::in_heap) : cfg_(cfg) {
@@ -46,6 +46,7 @@ struct machine {
   char ulogpfx[256];
   char tlogdevice[256];
   long blocktime;
+  fux::ipc::backend transport;  // default for queues
 };
 
 struct group {
@@ -58,6 +59,9 @@ struct group {
 
 enum struct state_t { active, inactive };
 
+constexpr uint16_t default_dispatch_threads = 3;
+constexpr uint32_t default_cooldown = 60;
+
 struct server {
   uint16_t srvid;
   uint16_t grpno;
@@ -65,7 +69,20 @@ struct server {
   pid_t pid;
   time_t last_alive_time;
   size_t rqaddr;
+  int subq;  // own queue of a server in a set with subqueues, -1 if none
   state_t state;
+  // Dispatch threads of a multithreaded server
+  uint16_t min_threads;
+  uint16_t max_threads;
+  size_t stacksize;  // bytes, 0 for the default
+  // BBL starts more servers of the SERVERS entry up to MAX while requests
+  // wait and stops them when the load is gone
+  uint16_t basesrvid;  // first SRVID of the entry
+  uint16_t scaleup;    // waiting requests per running server, 0 never
+  uint32_t cooldown;   // seconds without waiting requests before stopping
+  // Statistics updated by the running server
+  uint16_t threads;
+  uint16_t busy_threads;
   char servername[128];
   char clopt[1024];
 };
@@ -74,11 +91,23 @@ struct queue {
   char rqaddr[32];
   int msqid;
   long mtype;
+  fux::ipc::backend backend;
+  // Each server of the set receives from its own queue and takes requests
+  // from queues of the others when idle
+  bool subqueues;
+};
+
+// Settings from the SERVICES section
+struct service_options {
+  long linger;    // microseconds requests and replies wait for a batch
+  long cmplimit;  // messages of at least this size are compressed, 0 never
+  long prio;      // default priority of requests
 };
 
 struct service {
   char servicename[XATMI_SERVICE_NAME_LENGTH];
   uint64_t revision;
+  service_options options;
   void modified() { revision++; }
 };
 
@@ -122,6 +151,7 @@ class mibarrptr {
 struct mibmem {
   std::atomic<int> state;
   int mainsem;
+  int heapid;  // shared heap segment, see shmheap.h
 
   uint32_t host;
   uint32_t counter __attribute__((aligned(64)));
@@ -205,6 +235,8 @@ class mib {
 
   void advertise(const std::string &servicename, size_t queue, size_t server);
   void unadvertise(const std::string &servicename, size_t queue, size_t server);
+  // Removes all advertisements of the server
+  void unadvertise(size_t server);
 
   size_t find_queue(const std::string &rqaddr);
   size_t make_queue(const std::string &rqaddr);
@@ -233,6 +265,9 @@ class mib {
   size_t make_accesser(pid_t pid);
 
   int make_service_rqaddr(size_t server);
+  // Own queue of the server if its set has subqueues, -1 otherwise. A
+  // restarted server gets the queue it had before.
+  int make_server_subq(size_t server);
 
   fux::ipc::scoped_semlock data_lock() {
     return fux::ipc::scoped_semlock(mem_->mainsem, 0);
@@ -253,6 +288,8 @@ class mib {
 };
 
 mib &getmib();
+// Forks and executes the server process like tmboot, returns its pid
+pid_t exec_server(const server &srv);
 std::string getubb();
 namespace fux::tx {
 extern uint16_t grpno;
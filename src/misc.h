@@ -5,11 +5,14 @@
 #include <xatmi.h>
 
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <mutex>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <signal.h>
@@ -123,6 +126,15 @@ std::string join(const T &container, const std::string &sep) {
 size_t base64encode(const void *ibuf, size_t ilen, char *obuf, size_t olen);
 size_t base64decode(const char *ibuf, size_t ilen, void *obuf, size_t olen);
 
+// Functions above use the best instruction set supported by CPU, scalar
+// code is the reference implementation
+enum class base64isa { scalar, sse41, avx2 };
+bool base64supported(base64isa isa);
+size_t base64encode(base64isa isa, const void *ibuf, size_t ilen, char *obuf,
+                    size_t olen);
+size_t base64decode(base64isa isa, const char *ibuf, size_t ilen, void *obuf,
+                    size_t olen);
+
 constexpr size_t base64chars(size_t ilen) {
   auto blocks = ilen / 3;
   auto needed = blocks * 4;
@@ -132,6 +144,30 @@ constexpr size_t base64chars(size_t ilen) {
   return needed;
 }
 
+// Fast LZ77 compression for IPC messages. lzcompress returns 0 if the
+// result does not fit into olen bytes, lzdecompress throws on invalid input.
+size_t lzcompress(const void *ibuf, size_t ilen, void *obuf, size_t olen);
+size_t lzdecompress(const void *ibuf, size_t ilen, void *obuf, size_t olen);
+
+// Encodes input given in pieces into one base64 string, the same as
+// base64encode of all pieces put together
+class base64stream {
+ public:
+  base64stream(char *obuf, size_t olen)
+      : obuf_(obuf), olen_(olen), opos_(0), npending_(0) {}
+
+  void write(const void *ibuf, size_t ilen);
+  // Writes padding, returns the number of characters written
+  size_t finish();
+
+ private:
+  char *obuf_;
+  size_t olen_;
+  size_t opos_;
+  uint8_t pending_[3];
+  size_t npending_;
+};
+
 struct cmp_cstr {
   bool operator()(char const *a, char const *b) const {
     return std::strcmp(a, b) < 0;
@@ -142,6 +178,77 @@ namespace fux {
 namespace mem {
 void setowner(char *ptr, char **owner);
 long bufsize(char *ptr, long used = -1);
+
+// Typed buffer pool counters summed over all threads
+struct pool_stats {
+  uint64_t allocs;          // blocks handed out by tpalloc/tprealloc
+  uint64_t frees;           // blocks returned by tpfree/tprealloc
+  uint64_t cache_hits;      // allocations served from the thread cache
+  uint64_t depot_gets;      // batches moved from the global depot
+  uint64_t depot_puts;      // batches moved to the global depot
+  uint64_t system_allocs;   // blocks allocated with malloc
+  uint64_t system_frees;    // blocks released with free
+  uint64_t inplace_grows;   // tprealloc calls that fit in the same block
+};
+pool_stats stats();
+
+// Bump allocator for typed buffers allocated inside a service routine. All
+// buffers are released at once by reset(), tpfree only gives space back if
+// it was the most recent allocation. Buffers are not moved to the heap when
+// they escape, keeping one past the call (e.g. in a static) is a bug.
+class arena {
+ public:
+  static constexpr size_t chunk_size = 64 * 1024;
+
+  arena() : current_(0), top_(nullptr), end_(nullptr) {}
+  ~arena();
+  arena(const arena &) = delete;
+  arena &operator=(const arena &) = delete;
+  // Takes over all memory of other, which is left empty
+  arena(arena &&other) noexcept
+      : chunks_(std::move(other.chunks_)),
+        large_(std::move(other.large_)),
+        current_(other.current_),
+        top_(other.top_),
+        end_(other.end_) {
+    other.chunks_.clear();
+    other.large_.clear();
+    other.current_ = 0;
+    other.top_ = nullptr;
+    other.end_ = nullptr;
+  }
+
+  void *allocate(size_t size);
+  void deallocate(void *ptr, size_t size);
+  // Grows the most recent allocation in place, returns false if not possible
+  bool grow(void *ptr, size_t size, size_t newsize);
+  void reset();
+
+ private:
+  static size_t align(size_t size) {
+    return (size + alignof(std::max_align_t) - 1) &
+           ~(alignof(std::max_align_t) - 1);
+  }
+  bool last(char *p, size_t size) const;
+
+  std::vector<char *> chunks_;
+  std::vector<char *> large_;
+  size_t current_;
+  char *top_;
+  char *end_;
+};
+
+// Makes tpalloc in the calling thread use the arena, nullptr to stop
+void use_arena(arena *a);
+
+// Passing typed buffers through the shared heap. share() copies the buffer
+// into a new heap block, give() hands over a buffer already in the heap and
+// clears its owner. Both return the block offset and set used to the
+// exported size or return -1 if the heap can't be used.
+long share(char *ptr, long len, long &used);
+long give(char *ptr, long len, long &used);
+// Replaces *data with the received heap block, *data may be nullptr
+void adopt(long off, long used, char **data);
 }  // namespace mem
 }  // namespace fux
 
@@ -0,0 +1,624 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <regex.h>
+#include <clara.hpp>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fml32.h>
+#include "expr.h"
+#include "misc.h"
+
+// Generates C functions from boolean expressions. Each function evaluates
+// the expression the same way Fboolev32 interprets the compiled tree but with
+// field identifiers, types and regular expressions resolved at build time.
+// && and || evaluate their right hand side only when it decides the result.
+
+static const char *helpers[][2] = {
+    {"_fux_short",
+     R"(static long _fux_short(const char *p) {
+  short v = 0;
+  if (p != NULL) memcpy(&v, p, sizeof(v));
+  return v;
+}
+)"},
+    {"_fux_long",
+     R"(static long _fux_long(const char *p) {
+  long v = 0;
+  if (p != NULL) memcpy(&v, p, sizeof(v));
+  return v;
+}
+)"},
+    {"_fux_float",
+     R"(static double _fux_float(const char *p) {
+  float v = 0;
+  if (p != NULL) memcpy(&v, p, sizeof(v));
+  return v;
+}
+)"},
+    {"_fux_double",
+     R"(static double _fux_double(const char *p) {
+  double v = 0;
+  if (p != NULL) memcpy(&v, p, sizeof(v));
+  return v;
+}
+)"},
+    {"_fux_str",
+     R"(static const char *_fux_str(const char *p, FLDLEN32 *len) {
+  if (p == NULL) {
+    *len = 1;
+    return "";
+  }
+  return p;
+}
+)"},
+    {"_fux_strcmp",
+     R"(static int _fux_strcmp(const char *a, FLDLEN32 alen, const char *b,
+                       FLDLEN32 blen) {
+  FLDLEN32 i;
+  for (i = 0;; i++) {
+    int ca = i < alen ? (unsigned char)a[i] : 0;
+    int cb = i < blen ? (unsigned char)b[i] : 0;
+    if (ca != cb || ca == 0) return ca - cb;
+  }
+}
+)"},
+    {"_fux_cstr",
+     R"(static const char *_fux_cstr(const char *p, FLDLEN32 len, char *buf,
+                             size_t bufsize, char **heap) {
+  char *s;
+  *heap = NULL;
+  if (memchr(p, 0, len) != NULL) return p;
+  s = len < bufsize ? buf : (*heap = (char *)malloc(len + 1));
+  if (s == NULL) return "";
+  memcpy(s, p, len);
+  s[len] = '\0';
+  return s;
+}
+)"},
+    {"_fux_atol",
+     R"(static long _fux_atol(const char *p, FLDLEN32 len) {
+  char buf[64], *heap;
+  long v = atol(_fux_cstr(p, len, buf, sizeof(buf), &heap));
+  free(heap);
+  return v;
+}
+)"},
+    {"_fux_atof",
+     R"(static double _fux_atof(const char *p, FLDLEN32 len) {
+  char buf[64], *heap;
+  double v = atof(_fux_cstr(p, len, buf, sizeof(buf), &heap));
+  free(heap);
+  return v;
+}
+)"},
+    {"_fux_match",
+     R"(static int _fux_match(const regex_t *re, const char *p, FLDLEN32 len,
+                      int negate) {
+  const char *end = (const char *)memchr(p, 0, len);
+  regmatch_t m[1];
+  int r;
+  m[0].rm_so = 0;
+  m[0].rm_eo = end != NULL ? end - p : (regoff_t)len;
+  r = regexec(re, p, 1, m, REG_STARTEND);
+  if (negate) return r == REG_NOMATCH || m[0].rm_so != 0;
+  return r == 0 && m[0].rm_so == 0;
+}
+)"},
+};
+
+// Helpers used by other helpers
+static const char *helper_deps[][2] = {
+    {"_fux_atol", "_fux_cstr"},
+    {"_fux_atof", "_fux_cstr"},
+};
+
+struct value {
+  enum class vtype { l, d, s } t;
+  std::string v;  // C variable or literal of type long, double or char *
+  std::string n;  // length of string including null terminator if any
+  bool cstr;      // string is null-terminated
+  bool is_const;  // string literal
+};
+
+static std::string c_string(const char *s) {
+  std::string out = "\"";
+  for (; *s != '\0'; s++) {
+    auto c = static_cast<unsigned char>(*s);
+    if (c == '\\' || c == '"' || c == '?') {
+      out += '\\';
+      out += c;
+    } else if (c >= 0x20 && c < 0x7f) {
+      out += c;
+    } else {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\%03o", c);
+      out += buf;
+    }
+  }
+  return out + "\"";
+}
+
+static std::string c_comment(std::string s) {
+  for (size_t pos = 0; (pos = s.find_first_of("*/", pos)) != std::string::npos;
+       pos++) {
+    if (pos + 1 < s.size() && s[pos + 1] == (s[pos] == '*' ? '/' : '*')) {
+      s.insert(pos + 1, " ");
+    }
+  }
+  return s;
+}
+
+template <typename T>
+static T take(char *&tree) {
+  T value;
+  std::copy_n(tree, sizeof(value), reinterpret_cast<char *>(&value));
+  tree += sizeof(value);
+  return value;
+}
+
+class generator {
+ public:
+  void function(const std::string &name, const std::string &expression) {
+    auto tree = Fboolco32(const_cast<char *>(expression.c_str()));
+    if (tree == nullptr) {
+      throw std::invalid_argument(name + ": " + Fstrerror32(Ferror32));
+    }
+    std::unique_ptr<char, decltype(&free)> guard(tree, &free);
+
+    name_ = name;
+    tmp_ = 0;
+    body_.str("");
+    body_ << "int " << name << "(FBFR32 *fbfr) {\n";
+    body_ << "  /* " << c_comment(expression) << " */\n";
+    auto root = tree + 4;
+    if (skip(root) != nullptr) {
+      body_ << "  (void)fbfr;\n";
+    }
+    auto v = gen(root, "  ");
+    body_ << "  return " << as_long(v) << " != 0;\n";
+    body_ << "}\n\n";
+
+    functions_.push_back(name);
+    code_ += body_.str();
+  }
+
+  void write(FILE *fout, const std::string &source) {
+    fprintf(fout, "/* Generated by mkboolfn32 from %s, do not edit */\n",
+            c_comment(source).c_str());
+    fprintf(fout,
+            R"(#include <fml32.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+)");
+    for (const auto &name : functions_) {
+      fprintf(fout, "int %s(FBFR32 *fbfr);\n", name.c_str());
+    }
+    fprintf(fout, R"(#if defined(__cplusplus)
+}
+#endif
+
+)");
+    if (!regexes_.empty()) {
+      fprintf(fout, "static regex_t _fux_re[%zu];\n\n", regexes_.size());
+    }
+    for (const auto &dep : helper_deps) {
+      if (used_.count(dep[0]) > 0) {
+        used_.insert(dep[1]);
+      }
+    }
+    for (const auto &helper : helpers) {
+      if (used_.count(helper[0]) > 0) {
+        fprintf(fout, "%s\n", helper[1]);
+      }
+    }
+    fprintf(fout, "%s", code_.c_str());
+
+    fprintf(fout, R"(static void _fux_boolfn_init(void) __attribute__((constructor));
+static void _fux_boolfn_init(void) {
+)");
+    for (size_t i = 0; i < regexes_.size(); i++) {
+      fprintf(fout, "  regcomp(&_fux_re[%zu], %s, 0);\n", i,
+              c_string(regexes_[i].c_str()).c_str());
+    }
+    for (const auto &name : functions_) {
+      fprintf(fout, "  Fboolreg32(\"%s\", %s);\n", name.c_str(),
+              name.c_str());
+    }
+    fprintf(fout, "}\n");
+  }
+
+ private:
+  std::string tmp() { return "v" + std::to_string(tmp_++); }
+
+  std::string use(const char *helper) {
+    used_.insert(helper);
+    return helper;
+  }
+
+  [[noreturn]] void fail(const std::string &what) {
+    throw std::invalid_argument(name_ + ": " + what);
+  }
+
+  std::string as_long(const value &v) {
+    if (v.t == value::vtype::l) {
+      return v.v;
+    } else if (v.t == value::vtype::d) {
+      return "(long)" + v.v;
+    } else if (v.cstr) {
+      return "atol(" + v.v + ")";
+    }
+    return use("_fux_atol") + "(" + v.v + ", " + v.n + ")";
+  }
+
+  std::string as_double(const value &v) {
+    if (v.t == value::vtype::l) {
+      return "(double)" + v.v;
+    } else if (v.t == value::vtype::d) {
+      return v.v;
+    } else if (v.cstr) {
+      return "atof(" + v.v + ")";
+    }
+    return use("_fux_atof") + "(" + v.v + ", " + v.n + ")";
+  }
+
+  value as_string(const value &v, const std::string &indent) {
+    if (v.t == value::vtype::s) {
+      return v;
+    }
+    auto name = tmp();
+    body_ << indent << "char " << name << "[320];\n";
+    body_ << indent << "snprintf(" << name << ", sizeof(" << name << "), "
+          << (v.t == value::vtype::l ? "\"%ld\"" : "\"%f\"") << ", " << v.v
+          << ");\n";
+    return value{value::vtype::s, name, "sizeof(" + name + ")", true, false};
+  }
+
+  value gen_field(FLDID32 fieldid, const std::string &oc,
+                  const std::string &indent) {
+    auto name = tmp();
+    std::string find = std::string("Ffind32(fbfr, ((FLDID32)") +
+                       std::to_string(fieldid) + ") /* " +
+                       c_comment(Fname32(fieldid)) + " */, " + oc;
+    switch (Fldtype32(fieldid)) {
+      case FLD_SHORT:
+        body_ << indent << "long " << name << " = " << use("_fux_short") << "("
+              << find << ", NULL));\n";
+        return value{value::vtype::l, name, "", false, false};
+      case FLD_LONG:
+        body_ << indent << "long " << name << " = " << use("_fux_long") << "("
+              << find << ", NULL));\n";
+        return value{value::vtype::l, name, "", false, false};
+      case FLD_FLOAT:
+        body_ << indent << "double " << name << " = " << use("_fux_float")
+              << "(" << find << ", NULL));\n";
+        return value{value::vtype::d, name, "", false, false};
+      case FLD_DOUBLE:
+        body_ << indent << "double " << name << " = " << use("_fux_double")
+              << "(" << find << ", NULL));\n";
+        return value{value::vtype::d, name, "", false, false};
+      case FLD_CHAR:
+      case FLD_STRING:
+      case FLD_CARRAY: {
+        auto len = "n" + name.substr(1);
+        body_ << indent << "FLDLEN32 " << len << ";\n";
+        body_ << indent << "const char *" << name << " = " << use("_fux_str")
+              << "(" << find << ", &" << len << "), &" << len << ");\n";
+        return value{value::vtype::s, name, len,
+                     Fldtype32(fieldid) == FLD_STRING, false};
+      }
+      default:
+        fail("unsupported field type");
+    }
+  }
+
+  std::string cmp(int op, const value &lhs, const value &rhs,
+                  const std::string &indent) {
+    if (op == matches || op == not_matches) {
+      if (lhs.t != value::vtype::s) {
+        fail("left hand side of %% and !% must be a string");
+      }
+      if (!rhs.is_const) {
+        fail("right hand side of %% and !% must be a string");
+      }
+      return use("_fux_match") + "(&_fux_re[" +
+             std::to_string(regex(rhs.v)) + "], " + lhs.v + ", " + lhs.n +
+             ", " + (op == not_matches ? "1" : "0") + ")";
+    }
+
+    static const char *ops[] = {"<", ">", "<=", ">=", "==", "!="};
+    auto cop = std::string(" ") + ops[op - less_than] + " ";
+
+    auto lexical_compare =
+        lhs.is_const || rhs.is_const ||
+        (lhs.t == value::vtype::s && rhs.t == value::vtype::s);
+    if (lexical_compare) {
+      auto l = as_string(lhs, indent);
+      auto r = as_string(rhs, indent);
+      if (l.cstr && r.cstr) {
+        return "strcmp(" + l.v + ", " + r.v + ")" + cop + "0";
+      }
+      return use("_fux_strcmp") + "(" + l.v + ", " + l.n + ", " + r.v + ", " +
+             r.n + ")" + cop + "0";
+    }
+    if (lhs.t == value::vtype::d || rhs.t == value::vtype::d) {
+      return as_double(lhs) + cop + as_double(rhs);
+    }
+    return as_long(lhs) + cop + as_long(rhs);
+  }
+
+  size_t regex(const std::string &literal) {
+    // literal is a C string literal of the pattern; recover the pattern
+    auto it = literals_.find(literal);
+    if (it == literals_.end()) {
+      fail("regular expression must be a string constant");
+    }
+    regex_t re;
+    if (regcomp(&re, it->second.c_str(), 0) != 0) {
+      fail("invalid regular expression '" + it->second + "'");
+    }
+    regfree(&re);
+    for (size_t i = 0; i < regexes_.size(); i++) {
+      if (regexes_[i] == it->second) {
+        return i;
+      }
+    }
+    regexes_.push_back(it->second);
+    return regexes_.size() - 1;
+  }
+
+  value gen(char *&tree, const std::string &indent) {
+    uint8_t op = static_cast<uint8_t>(*tree++);
+    if (op == const_long) {
+      return value{value::vtype::l,
+                   std::to_string(take<long>(tree)) + "L", "", false, false};
+    } else if (op == const_double) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "%.17g", take<double>(tree));
+      std::string v = buf;
+      if (v.find_first_of(".eEn") == std::string::npos) {
+        v += ".0";
+      }
+      return value{value::vtype::d, v, "", false, false};
+    } else if (op == const_string) {
+      std::string s = tree;
+      tree += s.size() + 1;
+      auto literal = c_string(s.c_str());
+      literals_.emplace(literal, s);
+      return value{value::vtype::s, literal, std::to_string(s.size() + 1),
+                   true, true};
+    } else if (op == field) {
+      auto fieldid = take<FLDID32>(tree);
+      auto oc = take<FLDOCC32>(tree);
+      return gen_field(fieldid, std::to_string(oc), indent);
+    } else if (op == field_any) {
+      fail("unsupported use of '?' field subscript");
+    } else if (op >= unary_minus && op <= bitwise_negation) {
+      auto val = gen(tree, indent);
+      auto name = tmp();
+      static const char *ops[] = {"-", "!", "~"};
+      body_ << indent << "long " << name << " = " << ops[op - unary_minus]
+            << "(" << as_long(val) << ");\n";
+      return value{value::vtype::l, name, "", false, false};
+    } else if (op == logical_and || op == logical_or) {
+      auto lhs = gen(tree, indent);
+      // Right hand side is generated aside and evaluated only if needed
+      auto code = body_.str();
+      body_.str("");
+      auto rhs = gen(tree, indent + "  ");
+      auto rhs_code = body_.str();
+      body_.str("");
+      body_ << code;
+
+      auto use_double =
+          lhs.t == value::vtype::d || rhs.t == value::vtype::d;
+      auto number = [&](const value &v) {
+        return use_double ? as_double(v) : as_long(v);
+      };
+      auto name = tmp();
+      body_ << indent << "long " << name << " = "
+            << (op == logical_and ? "0" : "1") << ";\n";
+      body_ << indent << "if (" << number(lhs)
+            << (op == logical_and ? " != 0" : " == 0") << ") {\n";
+      body_ << rhs_code;
+      body_ << indent << "  " << name << " = " << number(rhs) << " != 0;\n";
+      body_ << indent << "}\n";
+      return value{value::vtype::l, name, "", false, false};
+    } else if (op >= multiplication && op < less_than) {
+      auto lhs = gen(tree, indent);
+      auto rhs = gen(tree, indent);
+      auto name = tmp();
+      static const char *ops[] = {"*", "/", "%", "+", "-", "^"};
+      auto cop = std::string(" ") + ops[op - multiplication] + " ";
+
+      if (op == modulus || op == exclusive_or) {
+        body_ << indent << "long " << name << " = " << as_long(lhs) << cop
+              << as_long(rhs) << ";\n";
+        return value{value::vtype::l, name, "", false, false};
+      }
+      auto use_double =
+          lhs.t == value::vtype::d || rhs.t == value::vtype::d;
+      std::string expr;
+      if (use_double) {
+        expr = as_double(lhs) + cop + as_double(rhs);
+      } else {
+        expr = as_long(lhs) + cop + as_long(rhs);
+      }
+      if (use_double) {
+        body_ << indent << "double " << name << " = " << expr << ";\n";
+        return value{value::vtype::d, name, "", false, false};
+      }
+      body_ << indent << "long " << name << " = " << expr << ";\n";
+      return value{value::vtype::l, name, "", false, false};
+    } else if (op >= less_than && op < last_invalid) {
+      if (*tree == field_any) {
+        tree++;
+        auto fieldid = take<FLDID32>(tree);
+        auto rhs = gen(tree, indent);
+        auto name = tmp();
+        auto oc = "o" + name.substr(1);
+        auto count = "c" + name.substr(1);
+        body_ << indent << "long " << name << " = 0;\n";
+        body_ << indent << "FLDOCC32 " << oc << ", " << count
+              << " = Foccur32(fbfr, ((FLDID32)" << fieldid << ") /* "
+              << c_comment(Fname32(fieldid)) << " */);\n";
+        body_ << indent << "for (" << oc << " = 0; " << name << " == 0 && "
+              << oc << " < " << count << "; " << oc << "++) {\n";
+        auto inner = indent + "  ";
+        auto lhs = gen_field(fieldid, oc, inner);
+        auto c = cmp(op, lhs, rhs, inner);
+        body_ << inner << name << " = " << c << ";\n";
+        body_ << indent << "}\n";
+        return value{value::vtype::l, name, "", false, false};
+      }
+      auto lhs = gen(tree, indent);
+      auto rhs = gen(tree, indent);
+      auto c = cmp(op, lhs, rhs, indent);
+      auto name = tmp();
+      body_ << indent << "long " << name << " = " << c << ";\n";
+      return value{value::vtype::l, name, "", false, false};
+    }
+    fail("unsupported opcode");
+  }
+
+  // Returns tree after a constant expression or nullptr if it uses fields
+  static char *skip(char *tree) {
+    uint8_t op = static_cast<uint8_t>(*tree++);
+    if (op == const_long) {
+      return tree + sizeof(long);
+    } else if (op == const_double) {
+      return tree + sizeof(double);
+    } else if (op == const_string) {
+      return tree + strlen(tree) + 1;
+    } else if (op >= unary_minus && op <= bitwise_negation) {
+      return skip(tree);
+    } else if (op >= multiplication && op < last_invalid) {
+      auto rhs = skip(tree);
+      return rhs == nullptr ? nullptr : skip(rhs);
+    }
+    return nullptr;
+  }
+
+  std::string name_;
+  int tmp_;
+  std::ostringstream body_;
+  std::string code_;
+  std::vector<std::string> functions_;
+  std::vector<std::string> regexes_;
+  std::map<std::string, std::string> literals_;
+  std::set<std::string> used_;
+};
+
+static std::string trim(const std::string &s) {
+  auto first = s.find_first_not_of(" \t\r");
+  if (first == std::string::npos) {
+    return "";
+  }
+  return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+}
+
+static bool is_identifier(const std::string &s) {
+  if (s.empty() || !(isalpha(s[0]) || s[0] == '_')) {
+    return false;
+  }
+  for (auto c : s) {
+    if (!(isalnum(c) || c == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void process_file(const std::string &file, const std::string &outfile) {
+  std::ifstream fin;
+  fin.exceptions(std::ifstream::badbit);
+  fin.open(file);
+  if (!fin) {
+    throw std::system_error(errno, std::system_category(), file);
+  }
+
+  generator gen;
+  std::set<std::string> names;
+  std::string line;
+  int row = 0;
+  while (std::getline(fin, line)) {
+    row++;
+    auto start = line.find_first_not_of(" \t");
+    if (start == std::string::npos || line[start] == '#') {
+      continue;
+    }
+    auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      throw std::invalid_argument(file + ":" + std::to_string(row) +
+                                  ": expected 'name: expression'");
+    }
+    auto name = trim(line.substr(0, colon));
+    if (!is_identifier(name)) {
+      throw std::invalid_argument(file + ":" + std::to_string(row) +
+                                  ": invalid function name '" + name + "'");
+    }
+    if (!names.insert(name).second) {
+      throw std::invalid_argument(file + ":" + std::to_string(row) +
+                                  ": duplicate function name '" + name + "'");
+    }
+    gen.function(name, trim(line.substr(colon + 1)));
+  }
+
+  FILE *fout = fopen(outfile.c_str(), "w");
+  if (fout == nullptr) {
+    throw std::system_error(errno, std::system_category(), outfile);
+  }
+  gen.write(fout, file);
+  if (fclose(fout) != 0) {
+    throw std::system_error(errno, std::system_category(), outfile);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  bool show_help = false;
+
+  std::string outfile;
+  std::string file;
+
+  auto parser =
+      clara::Help(show_help) |
+      clara::Opt(outfile, "outfile")["-o"]("output file name") |
+      clara::Arg(file, "file")("named boolean expressions").required();
+
+  auto result = parser.parse(clara::Args(argc, argv));
+  if (!result || result.value().type() != clara::ParseResultType::Matched ||
+      file.empty()) {
+    std::cerr << parser;
+    return -1;
+  }
+  if (outfile.empty()) {
+    outfile = file + ".c";
+  }
+
+  try {
+    process_file(file, outfile);
+  } catch (const std::system_error &e) {
+    std::cerr << e.what() << std::endl;
+    return -1;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
@@ -5,14 +5,28 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <stdexcept>
 #include <string>
 #include <system_error>
 #include <vector>
 
 #include "fieldtbl32.h"
+#include "fieldtbl32bin.h"
+
+enum class output { header, compiled, cpp };
+
+static const std::map<int, std::string> cpp_types = {
+    {FLD_SHORT, "short"},
+    {FLD_LONG, "long"},
+    {FLD_CHAR, "char"},
+    {FLD_FLOAT, "float"},
+    {FLD_DOUBLE, "double"},
+    {FLD_STRING, "std::string_view"},
+    {FLD_CARRAY, "fux::carray_view"},
+    {FLD_FML32, "FBFR32 *"}};
 
 static void process_file(const std::string &file,
-                         const std::string &output_directory) {
+                         const std::string &output_directory, output mode) {
   std::ifstream fin;
   fin.exceptions(std::ifstream::failbit | std::ifstream::badbit);
   fin.open(file);
@@ -31,12 +45,39 @@ static void process_file(const std::string &file,
     slash = 0;
   }
   fout.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-  fout.open(output_directory + "/" + file.substr(slash) + ".h");
+  if (mode == output::compiled) {
+    std::vector<std::pair<std::string, FLDID32>> fields;
+    for (auto &f : p.fields()) {
+      fields.emplace_back(f.name, f.fieldid);
+    }
+    fout.open(output_directory + "/" + file.substr(slash) + ".fb32",
+              std::ios::binary);
+    fout << fux::fml32::fldtbl32_build(fields);
+    return;
+  }
+  if (mode == output::cpp) {
+    fout.open(output_directory + "/" + file.substr(slash) + ".hpp");
+    fout << "#pragma once" << std::endl << "#include <fux.h>" << std::endl;
+  } else {
+    fout.open(output_directory + "/" + file.substr(slash) + ".h");
+  }
   for (auto &i : p.entries()) {
     if (i.c && !i.c->empty()) {
       fout << "// " << *(i.c) << std::endl;
     } else if (i.r) {
       fout << *(i.r) << std::endl;
+    } else if (i.f && mode == output::cpp) {
+      auto type = cpp_types.find(Fldtype32(i.f->fieldid));
+      if (type == cpp_types.end()) {
+        throw std::invalid_argument(
+            file + ": field " + i.f->name + " of type " +
+            field_type_names[Fldtype32(i.f->fieldid)] + " has no C++ type");
+      }
+      fout << "inline constexpr fux::fld<" << type->second << ", "
+           << i.f->fieldid << "> " << i.f->name << ";\t// " << i.f->name << "\t"
+           << Fldno32(i.f->fieldid) << "\t"
+           << field_type_names[Fldtype32(i.f->fieldid)] << "\t" << i.f->comment
+           << std::endl;
     } else if (i.f) {
       fout << "#define " << i.f->name << "\t((FLDID32)" << i.f->fieldid
            << ")\t\t// " << i.f->name << "\t" << Fldno32(i.f->fieldid) << "\t"
@@ -48,6 +89,8 @@ static void process_file(const std::string &file,
 
 int main(int argc, char *argv[]) {
   bool show_help = false;
+  bool compiled = false;
+  bool cpp = false;
 
   std::string output_directory = ".";
   std::vector<std::string> files;
@@ -56,6 +99,10 @@ int main(int argc, char *argv[]) {
       clara::Help(show_help) |
       clara::Opt(output_directory,
                  "output_directory")["-d"]("output directory") |
+      clara::Opt(compiled)["-b"](
+          "write compiled field table instead of C header") |
+      clara::Opt(cpp)["-c"](
+          "write C++ header with typed field descriptors") |
       clara::Arg(files, "field_table")("field tables to process").required();
 
   auto result = parser.parse(clara::Args(argc, argv));
@@ -63,10 +110,15 @@ int main(int argc, char *argv[]) {
     std::cerr << parser;
     return -1;
   }
+  if (compiled && cpp) {
+    std::cerr << "-b and -c can't be used together" << std::endl;
+    return -1;
+  }
+  auto mode = compiled ? output::compiled : cpp ? output::cpp : output::header;
 
   try {
     for (auto &file : files) {
-      process_file(file, output_directory);
+      process_file(file, output_directory, mode);
     }
   } catch (const std::system_error &e) {
     std::cerr << e.code().message() << std::endl;
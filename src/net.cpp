@@ -0,0 +1,187 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include "net.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <system_error>
+
+namespace fux::net {
+
+using addrinfo_ptr = std::unique_ptr<addrinfo, decltype(&freeaddrinfo)>;
+
+static addrinfo_ptr resolve(const std::string &naddr) {
+  auto addr = naddr.compare(0, 2, "//") == 0 ? naddr.substr(2) : naddr;
+  auto colon = addr.rfind(':');
+  if (colon == std::string::npos) {
+    throw std::invalid_argument("Invalid network address " + naddr);
+  }
+  auto host = addr.substr(0, colon);
+  auto port = addr.substr(colon + 1);
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo *result;
+  if (int n = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                          &hints, &result);
+      n != 0) {
+    throw std::invalid_argument("Invalid network address " + naddr + ": " +
+                                gai_strerror(n));
+  }
+  return addrinfo_ptr(result, &freeaddrinfo);
+}
+
+int listen(const std::string &naddr) {
+  auto ai = resolve(naddr);
+  int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    throw std::system_error(errno, std::system_category(), "socket failed");
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+      ::listen(fd, SOMAXCONN) == -1) {
+    auto e = errno;
+    close(fd);
+    throw std::system_error(e, std::system_category(),
+                            "Failed to listen on " + naddr);
+  }
+  return fd;
+}
+
+int connect(const std::string &naddr, int flags) {
+  auto ai = resolve(naddr);
+  int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  // Frames are batched by the sender
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 &&
+      !((flags & SOCK_NONBLOCK) && errno == EINPROGRESS)) {
+    auto e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+  return fd;
+}
+
+void send_fd(int sock, int fd) {
+  char byte = 0;
+  iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+    throw std::system_error(errno, std::system_category(), "sendmsg failed");
+  }
+}
+
+int recv_fd(int sock) {
+  char byte;
+  iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int))];
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (n == -1) {
+    throw std::system_error(errno, std::system_category(), "recvmsg failed");
+  } else if (n == 0) {
+    return -1;
+  }
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) {
+    throw std::runtime_error("File descriptor expected");
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+void connection::append(frame_kind kind, const char *data, size_t len) {
+  frame_header h{uint32_t(len), kind};
+  out.append(reinterpret_cast<char *>(&h), sizeof(h));
+  out.append(data, len);
+}
+
+bool connection::flush(int epfd) {
+  while (out_pos < out.size()) {
+    ssize_t n =
+        send(fd, out.data() + out_pos, out.size() - out_pos, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+      }
+      break;
+    }
+    out_pos += n;
+  }
+  if (out_pos == out.size()) {
+    out.clear();
+    out_pos = 0;
+  }
+  bool pending = !out.empty();
+  if (pending != writing) {
+    epoll_event ev;
+    ev.events = pending ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.u64 = id;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    writing = pending;
+  }
+  return true;
+}
+
+bool connection::read_some() {
+  constexpr size_t chunk = 64 * 1024;
+  while (true) {
+    auto used = in.size();
+    in.resize(used + chunk);
+    ssize_t n = recv(fd, &in[used], chunk, 0);
+    in.resize(used + std::max(n, ssize_t(0)));
+    if (n > 0) {
+      return true;
+    } else if (n == 0) {
+      throw std::runtime_error("connection closed");
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return false;
+    } else if (errno != EINTR) {
+      throw std::system_error(errno, std::system_category(), "recv failed");
+    }
+  }
+}
+
+}  // namespace fux::net
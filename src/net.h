@@ -0,0 +1,84 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// TCP connections of BRIDGE, WSH and workstation clients. Everything on
+// the wire is a frame: header followed by len bytes, mostly a msgmem.
+
+namespace fux::net {
+
+enum class frame_kind : uint32_t { hello, services, request, reply };
+
+struct frame_header {
+  uint32_t len;  // bytes after the header
+  frame_kind kind;
+};
+
+constexpr uint32_t max_frame = 1 << 30;
+
+// Listening socket for NADDR //host:port or host:port
+int listen(const std::string &naddr);
+// Connects to NADDR, for SOCK_NONBLOCK returns the socket with connect in
+// progress. Returns -1 and sets errno if connect fails.
+int connect(const std::string &naddr, int flags);
+
+// Passes a file descriptor over a Unix domain socket
+void send_fd(int sock, int fd);
+// Returns -1 if the other side closed the socket
+int recv_fd(int sock);
+
+// Non-blocking socket of an epoll loop with buffered frames
+struct connection {
+  uint64_t id;
+  int fd;
+  bool writing;  // waiting for EPOLLOUT
+  std::string in;
+  std::string out;
+  size_t out_pos;
+  uint32_t max_len;  // of frames received
+
+  connection(uint64_t id, int fd)
+      : id(id), fd(fd), writing(false), out_pos(0), max_len(max_frame) {}
+  virtual ~connection() = default;
+
+  void append(frame_kind kind, const char *data, size_t len);
+  // Writes as much as the socket takes and waits for EPOLLOUT if something
+  // is left. Returns false on errors.
+  bool flush(int epfd);
+  // Reads what is available and calls handle(kind, data, len) for each
+  // complete frame. Throws when the connection is closed or fails.
+  template <typename F>
+  void receive(F &&handle);
+
+ private:
+  // Returns false when there is nothing more to read
+  bool read_some();
+};
+
+template <typename F>
+void connection::receive(F &&handle) {
+  while (read_some()) {
+    size_t pos = 0;
+    frame_header h;
+    while (in.size() - pos >= sizeof(h)) {
+      in.copy(reinterpret_cast<char *>(&h), sizeof(h), pos);
+      if (h.len > max_len) {
+        throw std::runtime_error("frame too big");
+      }
+      if (in.size() - pos - sizeof(h) < h.len) {
+        break;
+      }
+      handle(h.kind, &in[pos + sizeof(h)], size_t(h.len));
+      pos += sizeof(h) + h.len;
+    }
+    in.erase(0, pos);
+  }
+}
+
+}  // namespace fux::net
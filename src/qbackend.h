@@ -0,0 +1,43 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <cstddef>
+
+#include "ipc.h"
+
+namespace fux::ipc {
+
+// Queue implementation behind qcreate/qsend/qrecv/qdelete. Messages start
+// with long mtype and sizes do not include it, just like msgsnd/msgrcv.
+class qbackend {
+ public:
+  virtual ~qbackend() {}
+
+  virtual int create() = 0;
+  virtual void remove(int id) = 0;
+  virtual bool exists(int id) = 0;
+  // Biggest message the queue itself can carry
+  virtual size_t msgmax() = 0;
+  // Number of messages waiting in the queue
+  virtual size_t length(int id) = 0;
+  // Returns false if the queue stays full for msec or with noblock
+  virtual bool send(int id, const void *ptr, size_t len, enum flags flag,
+                    long msec) = 0;
+  // Blocks unless flags has IPC_NOWAIT, for msec if it is not 0. msgtype
+  // selects messages like msgrcv, returns message size. Fails with ENOMSG
+  // when there is no message.
+  virtual size_t recv(int id, void *ptr, size_t len, long msgtype, int flags,
+                      long msec) = 0;
+};
+
+// System V message queues, ids are msqids
+qbackend &msgq_backend();
+// Rings in the shared heap, ids are below -1
+qbackend &ring_backend();
+
+inline qbackend &backend_of(int id) {
+  return id < -1 ? ring_backend() : msgq_backend();
+}
+
+}  // namespace fux::ipc
@@ -1,3 +1,4 @@
+#pragma once
 // This file is part of Fuxedo
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
@@ -11,9 +12,14 @@ class responses {
   struct response {
     flags status;
     fux::ipc::msg res;
+    uint64_t arrival;
+    // Fiber of a server that made the call, 0 if none
+    uint64_t owner;
   };
   std::map<int, response> calls_;
   int seq_;
+  // Replies are buffered in batches, TPGETANY takes them in arrival order
+  uint64_t arrivals_;
 
   // cycle [1..INT_MAX]
   // 0 is reserved as cd for tpacall(..., TPNOREPLY)
@@ -26,9 +32,9 @@ class responses {
   }
 
  public:
-  responses() : seq_(0) {}
+  responses() : seq_(0), arrivals_(0) {}
 
-  int allocate() {
+  int allocate(uint64_t owner = 0) {
     // Tuxedo has larger messages, increase limits to have similar test results
     // if (calls_.size() > 128) {
     if (calls_.size() > 1024) {
@@ -40,7 +46,7 @@ class responses {
       // If cd wrapped around and cd has still no response
       // assume it will never come
     }
-    calls_[cd] = response{flags::none, {}};
+    calls_[cd] = response{flags::none, {}, 0, owner};
     return cd;
   }
 
@@ -53,18 +59,31 @@ class responses {
     return 0;
   }
 
-  int any_buffered() {
-    for (auto it : calls_) {
-      if (it.second.status == flags::buffered) {
-        return it.first;
+  // TPGETANY of a fiber takes only replies to its own calls
+  int any_buffered(uint64_t owner = 0) {
+    int cd = -1;
+    uint64_t first = 0;
+    for (const auto &it : calls_) {
+      if (it.second.status == flags::buffered && it.second.owner == owner &&
+          (cd == -1 || it.second.arrival < first)) {
+        cd = it.first;
+        first = it.second.arrival;
       }
     }
-    return -1;
+    return cd;
+  }
+
+  // Takes the message, res gets the empty buffer of the call
+  void buffer(fux::ipc::msg &res) {
+    auto &call = calls_[res->cd];
+    call.res.swap(res);
+    call.status = flags::buffered;
+    call.arrival = arrivals_++;
   }
 
-  void buffer(fux::ipc::msg &&res) {
-    calls_[res->cd].res = res;
-    calls_[res->cd].status = flags::buffered;
+  bool owned(int cd, uint64_t owner) {
+    auto it = calls_.find(cd);
+    return it != calls_.end() && it->second.owner == owner;
   }
 
   bool is_buffered(int cd) { return calls_[cd].status == flags::buffered; }
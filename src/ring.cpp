@@ -0,0 +1,368 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/ipc.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+
+#include "qbackend.h"
+#include "shmheap.h"
+
+// Bounded MPMC ring in the shared heap, every cell carries its own sequence
+// number (Dmitry Vyukov's queue). Producers and consumers never take a lock,
+// futexes are used only when a queue is full or empty and somebody waits.
+// Consumers may take any message between tail and head, a cell goes back to
+// producers when tail moves past it.
+
+namespace fux::ipc {
+
+constexpr uint64_t ring_magic = 0x474e495258554621;  // "!FUXRING"
+constexpr size_t ring_cells = 64;
+constexpr size_t cell_data = 1024 - 2 * sizeof(uint64_t);
+
+// Cell states of ring position pos, seq grows with every lap
+static constexpr uint64_t empty(uint64_t pos) { return 4 * pos; }
+static constexpr uint64_t full(uint64_t pos) { return 4 * pos + 1; }
+static constexpr uint64_t claimed(uint64_t pos) { return 4 * pos + 2; }
+static constexpr uint64_t consumed(uint64_t pos) { return 4 * pos + 3; }
+
+struct ringcell {
+  std::atomic<uint64_t> seq;
+  uint64_t len;
+  char data[cell_data];
+};
+
+struct ringmem {
+  uint64_t magic;
+  std::atomic<uint32_t> deleted;
+  alignas(64) std::atomic<uint64_t> head;  // next cell to fill
+  alignas(64) std::atomic<uint64_t> tail;  // oldest cell not consumed
+  // Futex words bumped on every push and every time cells are freed
+  alignas(64) std::atomic<uint32_t> pushes;
+  std::atomic<uint32_t> readers;
+  alignas(64) std::atomic<uint32_t> pops;
+  std::atomic<uint32_t> writers;
+  alignas(64) ringcell cells[ring_cells];
+};
+
+static int futex_wait(std::atomic<uint32_t> *addr, uint32_t val,
+                      const struct timespec *timeout) {
+  return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> *addr, int n) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, n, nullptr, nullptr, 0);
+}
+
+// Ring ids encode the heap offset, blocks are 16 byte aligned
+static int ring_id(long off) { return -2 - int(off / 16); }
+static long ring_off(int id) { return long(-2 - id) * 16; }
+
+static bool push(ringmem *r, const void *ptr, size_t len) {
+  const auto mask = ring_cells - 1;
+  auto pos = r->head.load(std::memory_order_relaxed);
+  ringcell *cell;
+  while (true) {
+    cell = &r->cells[pos & mask];
+    auto seq = cell->seq.load(std::memory_order_acquire);
+    auto diff = int64_t(seq) - int64_t(empty(pos));
+    if (diff == 0) {
+      if (r->head.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = r->head.load(std::memory_order_relaxed);
+    }
+  }
+  cell->len = len;
+  std::copy_n(static_cast<const char *>(ptr), sizeof(long) + len, cell->data);
+  cell->seq.store(full(pos), std::memory_order_release);
+
+  // Readers may wait for different types, all of them look
+  r->pushes.fetch_add(1);
+  if (r->readers.load() > 0) {
+    futex_wake(&r->pushes, INT_MAX);
+  }
+  return true;
+}
+
+static bool matches(long mtype, long msgtype) {
+  if (msgtype == 0) {
+    return true;
+  } else if (msgtype > 0) {
+    return mtype == msgtype;
+  }
+  return mtype <= (msgtype == LONG_MIN ? LONG_MAX : -msgtype);
+}
+
+// Moves tail over consumed cells and gives them back to producers. Both
+// sides use sequentially consistent operations so a cell consumed while
+// another thread moves tail is freed by one of them.
+static void advance(ringmem *r) {
+  const auto mask = ring_cells - 1;
+  auto pos = r->tail.load();
+  int freed = 0;
+  while (r->cells[pos & mask].seq.load() == consumed(pos)) {
+    if (r->tail.compare_exchange_weak(pos, pos + 1)) {
+      r->cells[pos & mask].seq.store(empty(pos + ring_cells),
+                                     std::memory_order_release);
+      pos++;
+      freed++;
+    }
+  }
+  if (freed > 0) {
+    r->pops.fetch_add(1);
+    if (r->writers.load() > 0) {
+      futex_wake(&r->pops, freed);
+    }
+  }
+}
+
+// Takes the oldest message matching msgtype like msgrcv: for a negative
+// msgtype the oldest one of the lowest type. Messages of other types are
+// skipped and keep their place. Returns false if none matches.
+static bool pop(ringmem *r, void *ptr, size_t &len, long msgtype) {
+  const auto mask = ring_cells - 1;
+  while (true) {
+    auto tail = r->tail.load();
+    auto head = r->head.load();
+    ringcell *found = nullptr;
+    uint64_t found_pos = 0;
+    long found_type = 0;
+    for (auto pos = tail; pos < head; pos++) {
+      auto cell = &r->cells[pos & mask];
+      auto seq = cell->seq.load(std::memory_order_acquire);
+      if (seq != full(pos)) {
+        continue;
+      }
+      long mtype;
+      std::copy_n(cell->data, sizeof(mtype), reinterpret_cast<char *>(&mtype));
+      // The type is valid only if nobody took the cell while reading it
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (cell->seq.load(std::memory_order_relaxed) != seq ||
+          !matches(mtype, msgtype)) {
+        continue;
+      }
+      if (found == nullptr || mtype < found_type) {
+        found = cell;
+        found_pos = pos;
+        found_type = mtype;
+      }
+      if (msgtype >= 0) {
+        break;
+      }
+    }
+    if (found == nullptr) {
+      return false;
+    }
+
+    auto seq = full(found_pos);
+    if (!found->seq.compare_exchange_strong(seq, claimed(found_pos),
+                                            std::memory_order_acquire)) {
+      continue;
+    }
+    len = found->len;
+    std::copy_n(found->data, sizeof(long) + len, static_cast<char *>(ptr));
+    found->seq.store(consumed(found_pos));
+    advance(r);
+    return true;
+  }
+}
+
+class deadline {
+ public:
+  explicit deadline(long msec)
+      : at_(std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(msec)) {}
+
+  // Returns false if the deadline has passed
+  bool remaining(struct timespec &ts) const {
+    auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    at_ - std::chrono::steady_clock::now())
+                    .count();
+    if (left <= 0) {
+      return false;
+    }
+    ts.tv_sec = left / 1000000000;
+    ts.tv_nsec = left % 1000000000;
+    return true;
+  }
+
+ private:
+  std::chrono::steady_clock::time_point at_;
+};
+
+// Sleeps until word changes from val, waiters tells the other side to wake
+static void wait_for(std::atomic<uint32_t> &word,
+                     std::atomic<uint32_t> &waiters, uint32_t val,
+                     const struct timespec *timeout) {
+  waiters.fetch_add(1);
+  int rc = 0;
+  if (word.load() == val) {
+    rc = futex_wait(&word, val, timeout);
+  }
+  auto e = errno;
+  waiters.fetch_sub(1);
+  if (rc == -1 && e == EINTR) {
+    throw std::system_error(e, std::system_category());
+  }
+}
+
+class ring : public qbackend {
+ public:
+  int create() override {
+    auto heap = fux::mem::shmheap::current();
+    if (heap == nullptr) {
+      throw std::runtime_error("Ring queues need the shared heap");
+    }
+    auto r = static_cast<ringmem *>(heap->allocate(sizeof(ringmem)));
+    if (r == nullptr) {
+      throw std::system_error(ENOSPC, std::system_category(),
+                              "Failed to create ring queue");
+    }
+    heap->pin(r);
+
+    new (r) ringmem();
+    for (size_t i = 0; i < ring_cells; i++) {
+      r->cells[i].seq.store(empty(i), std::memory_order_relaxed);
+    }
+    r->magic = ring_magic;
+    return ring_id(heap->offset(r));
+  }
+
+  void remove(int id) override {
+    auto r = get(id);
+    r->magic = 0;
+    r->deleted = 1;
+    r->pushes.fetch_add(1);
+    r->pops.fetch_add(1);
+    futex_wake(&r->pushes, INT_MAX);
+    futex_wake(&r->pops, INT_MAX);
+    fux::mem::shmheap::current()->deallocate(r);
+  }
+
+  bool exists(int id) override {
+    auto heap = fux::mem::shmheap::current();
+    try {
+      return heap != nullptr &&
+             static_cast<ringmem *>(heap->pointer(ring_off(id)))->magic ==
+                 ring_magic;
+    } catch (const std::out_of_range &) {
+      return false;
+    }
+  }
+
+  size_t msgmax() override { return cell_data - sizeof(long); }
+
+  size_t length(int id) override {
+    auto r = get(id);
+    check(r);
+    // Consumed cells behind an older message are not counted
+    const auto mask = ring_cells - 1;
+    auto tail = r->tail.load();
+    auto head = r->head.load();
+    size_t n = 0;
+    for (auto pos = tail; pos < head; pos++) {
+      auto seq = r->cells[pos & mask].seq.load();
+      if (seq == full(pos) || seq == claimed(pos)) {
+        n++;
+      }
+    }
+    return n;
+  }
+
+  bool send(int id, const void *ptr, size_t len, enum flags flag,
+            long msec) override {
+    if (len > msgmax()) {
+      throw std::system_error(EINVAL, std::system_category());
+    }
+    auto r = get(id);
+    deadline until(msec);
+    while (true) {
+      check(r);
+      auto seen = r->pops.load();
+      if (push(r, ptr, len)) {
+        return true;
+      }
+      if (flag == noblock) {
+        return false;
+      }
+      struct timespec ts;
+      if (flag == notime) {
+        wait_for(r->pops, r->writers, seen, nullptr);
+      } else if (until.remaining(ts)) {
+        wait_for(r->pops, r->writers, seen, &ts);
+      } else {
+        return false;
+      }
+    }
+  }
+
+  size_t recv(int id, void *ptr, size_t len, long msgtype, int flags,
+              long msec) override {
+    if (len < msgmax()) {
+      throw std::system_error(E2BIG, std::system_category());
+    }
+    auto r = get(id);
+    deadline until(msec);
+    while (true) {
+      check(r);
+      auto pushed = r->pushes.load();
+      size_t n;
+      if (pop(r, ptr, n, msgtype)) {
+        return n;
+      }
+      if (flags & IPC_NOWAIT) {
+        throw std::system_error(ENOMSG, std::system_category());
+      }
+      struct timespec ts;
+      const struct timespec *timeout = nullptr;
+      if (msec > 0) {
+        if (!until.remaining(ts)) {
+          throw std::system_error(ENOMSG, std::system_category());
+        }
+        timeout = &ts;
+      }
+      wait_for(r->pushes, r->readers, pushed, timeout);
+    }
+  }
+
+ private:
+  ringmem *get(int id) {
+    auto heap = fux::mem::shmheap::current();
+    if (heap == nullptr) {
+      throw std::system_error(EINVAL, std::system_category());
+    }
+    auto r = static_cast<ringmem *>(heap->pointer(ring_off(id)));
+    if (r->magic != ring_magic) {
+      throw std::system_error(EINVAL, std::system_category());
+    }
+    return r;
+  }
+
+  static void check(ringmem *r) {
+    if (r->deleted) {
+      throw std::system_error(EIDRM, std::system_category());
+    }
+  }
+};
+
+qbackend &ring_backend() {
+  static ring q;
+  return q;
+}
+
+}  // namespace fux::ipc
@@ -1,22 +1,32 @@
 // This file is part of Fuxedo
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
+#include <pthread.h>
 #include <setjmp.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
 #include <userlog.h>
 #include <xa.h>
 #include <xatmi.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <clara.hpp>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <system_error>
 #include <thread>
 #include <vector>
 
+#include "batch.h"
 #include "fields.h"
 #include "fux.h"
 #include "ipc.h"
@@ -34,7 +44,8 @@ int _tmstartserver(int argc, char **argv, struct tmsvrargs_t *tmsvrargs);
 }
 #endif
 
-static void dispatch();
+static bool dispatch();
+static void *pool_thread(void *);
 
 int tprminit(char *, void *) { return 0; }
 int tpsvrinit(int, char **) {
@@ -64,13 +75,27 @@ void tpsvrthrdone() {
 
 void ubb2mib(ubbconfig &u, mib &m);
 
-int get_queue(const char *svc);
+int get_queue(const char *svc, service_options *options, int *service);
+namespace fux {
+extern thread_local int last_priority;
+bool await_reply(long msec, std::vector<int> &cds);
+int reply_queue();
+}  // namespace fux
+
+// Priorities of requests are split into bands of 25, from the highest. A
+// band gets this many requests taken by priority in a row before the
+// oldest waiting message is taken, so lower bands get a share too.
+constexpr int band_credits[] = {8, 4, 2, 1};
+constexpr long band_size = 25;
 
 struct server_main {
   uint16_t srvid;
   uint16_t grpno;
 
   int request_queue;
+  bool subqueues;
+  // BBL starts more servers of the set while requests wait in the queue
+  bool autoscaled;
 
   size_t mib_server;
   size_t mib_queue;
@@ -78,19 +103,133 @@ struct server_main {
   int argc;
   char **argv;
   struct tmsvrargs_t *tmsvrargs;
+  bool arena;
+
+  struct advertised {
+    const char *name;
+    size_t slot;  // in MIB services
+    void (*func)(TPSVCINFO *);
+    service_options options;
+  };
 
+  // Protects advertisements, dispatch threads use slots without it
   std::mutex mutex;
-  std::map<const char *, void (*)(TPSVCINFO *), cmp_cstr> advertisements;
+  std::map<const char *, advertised, cmp_cstr> advertisements;
+  // Advertisements indexed by MIB service slot, requests carry the slot
+  std::vector<std::atomic<advertised *>> slots;
+  // Held by the dispatch thread waiting in the request queue
+  std::timed_mutex wait_mutex;
+
+  // Dispatch threads are started while all are busy and requests wait,
+  // threads idle for a while leave down to min_threads
+  int min_threads;
+  int max_threads;
+  size_t stacksize;
+  // Requests each dispatch thread serves at once on fibers, 0 for none
+  int fibers;
 
   mib &m_;
   std::atomic<bool> stop;
 
-  server_main(mib &m) : m_(m), stop(false), req_counter_(0) {
-    mtype_ = std::numeric_limits<long>::min();
-  }
+  server_main(mib &m)
+      : subqueues(false),
+        autoscaled(false),
+        arena(false),
+        slots(m.services().size()),
+        min_threads(1),
+        max_threads(1),
+        stacksize(0),
+        fibers(0),
+        m_(m),
+        stop(false),
+        mtype_(std::numeric_limits<long>::min()),
+        oldest_(false),
+        next_sibling_(0),
+        threads_(0),
+        running_(0),
+        busy_(0) {}
 
   void active() { m_.servers().at(mib_server).state = state_t::active; }
 
+  // Starts a dispatch thread, false if it failed
+  bool spawn() {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    return spawn_locked();
+  }
+
+  // Called by a dispatch thread when it takes a request
+  void busy() {
+    busy_++;
+    if (busy_ >= threads_ && threads_ < max_threads) {
+      std::lock_guard<std::mutex> lock(pool_mutex_);
+      if (busy_ >= threads_ && threads_ < max_threads && !stop &&
+          fux::ipc::qlength(request_queue) > 0) {
+        spawn_locked();
+      }
+    }
+    publish();
+  }
+  void idle() {
+    busy_--;
+    publish();
+  }
+
+  bool elastic() const { return threads_ > min_threads; }
+
+  // No other dispatch thread is idle and no more can be started. Requests
+  // stay in the queue if other servers of the set may take them: stolen
+  // from subqueues, by servers BBL starts when it sees them waiting or by
+  // idle servers sharing the queue.
+  bool saturated() {
+    if (subqueues || autoscaled || busy_ + 1 < threads_ ||
+        threads_ < max_threads) {
+      return false;
+    }
+    for (auto &sibling : *find_siblings()) {
+      auto &server = m_.servers().at(sibling.server);
+      if (server.state == state_t::active &&
+          server.busy_threads < server.threads) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Removes an idle thread from the pool unless it is at min_threads
+  bool retire() {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    if (threads_ <= min_threads) {
+      return false;
+    }
+    threads_--;
+    publish();
+    return true;
+  }
+
+  // Called by each dispatch thread at the end
+  void exited(bool retired) {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    if (!retired) {
+      threads_--;
+    }
+    running_--;
+    publish();
+    pool_done_.notify_all();
+  }
+
+  // Dispatch runs in the main thread of a server built without threads
+  void single_threaded() {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    min_threads = max_threads = 1;
+    threads_ = 1;
+    publish();
+  }
+
+  void wait_threads() {
+    std::unique_lock<std::mutex> lock(pool_mutex_);
+    pool_done_.wait(lock, [this] { return running_ == 0; });
+  }
+
   int tpadvertise(const char *svcname, void (*func)(TPSVCINFO *)) {
     fux::scoped_fuxlock lock(mutex);
 
@@ -115,19 +254,28 @@ struct server_main {
     auto it = advertisements.find(svcname);
 
     if (it != advertisements.end()) {
-      if (it->second != func) {
+      if (it->second.func != func) {
         TPERROR(TPEMATCH, "svcname advertised with a different func");
         return -1;
       }
     } else {
+      size_t slot;
+      service_options options;
       try {
         auto lock = m_.data_lock();
         m_.advertise(svcname, mib_queue, mib_server);
+        slot = m_.find_service(svcname);
+        options = m_.services().at(slot).options;
       } catch (const std::out_of_range &e) {
         TPERROR(TPELIMIT, "%s", e.what());
         return -1;
       }
-      advertisements.insert(std::make_pair(strdup(svcname), func));
+      auto name = strdup(svcname);
+      auto &adv = advertisements
+                      .insert(std::make_pair(
+                          name, advertised{name, slot, func, options}))
+                      .first->second;
+      slots[slot] = &adv;
     }
     return 0;
   }
@@ -142,6 +290,7 @@ struct server_main {
 
     if (it != advertisements.end()) {
       auto freeme = it->first;
+      slots[it->second.slot] = nullptr;
       advertisements.erase(it);
       free(const_cast<char *>(freeme));
       m_.unadvertise(svcname, mib_queue, mib_server);
@@ -152,10 +301,23 @@ struct server_main {
     return 0;
   }
 
+  // Requests name the service by slot, the name is used for requests
+  // without one
+  advertised *find(fux::ipc::msg &req) {
+    if (req->service >= 0 && size_t(req->service) < slots.size()) {
+      if (auto adv = slots[req->service].load()) {
+        return adv;
+      }
+    }
+    fux::scoped_fuxlock lock(mutex);
+    auto it = advertisements.find(req->servicename);
+    return it != advertisements.end() ? &it->second : nullptr;
+  }
+
+  // Called by the dispatch thread holding wait_mutex
   bool handle(long mtype, fux::fml32buf &buf) {
     // Do not want to see this message again
     mtype_ = -(mtype - 1);
-    req_counter_ = 0;
 
     if (buf.get<long>(FUX_SRVID, 0) == srvid &&
         buf.get<long>(FUX_GRPNO, 0) == grpno) {
@@ -165,22 +327,166 @@ struct server_main {
     return false;
   }
 
-  long mtype() {
-    req_counter_ = (req_counter_ + 1) % 8;
-    if (req_counter_ == 0) {
-      // every nth message screw priorities and read first message from queue
+  // Message type to receive the next message with. Requests are taken by
+  // priority unless it is the turn of the oldest message, admin messages
+  // only by the thread waiting in the queue.
+  long mtype(bool admin) {
+    if (oldest_.exchange(false)) {
       return 0;
     }
-    return mtype_;
+    return admin ? mtype_.load()
+                 : -fux::ipc::priority_mtype(fux::ipc::min_priority);
+  }
+
+  // Charges the band of a request taken from the queue
+  void taken(long mtype) {
+    auto band = std::min<size_t>(
+        (fux::ipc::max_priority - fux::ipc::mtype_priority(mtype)) / band_size,
+        std::size(band_credits) - 1);
+    if (++band_taken_[band] % band_credits[band] == 0) {
+      oldest_ = true;
+    }
+  }
+
+  // Takes a request without blocking, in the same order as the thread
+  // waiting in the queue. Admin messages are put back for it.
+  bool take(int msqid, fux::ipc::msg &req) {
+    auto type = mtype(false);
+    while (true) {
+      try {
+        fux::ipc::qrecv(msqid, req, type, IPC_NOWAIT);
+      } catch (const std::system_error &e) {
+        if (e.code().value() != ENOMSG) {
+          throw;
+        }
+        return false;
+      }
+      if (req->cat != fux::ipc::admin) {
+        taken(req->mtype);
+        return true;
+      }
+      fux::ipc::qsend(msqid, req, 0, fux::ipc::flags::notime);
+      type = -fux::ipc::priority_mtype(fux::ipc::min_priority);
+    }
+  }
+
+  // Takes a request from the subqueue of another server in the set. Only
+  // servers with every dispatch thread busy leave requests waiting, the
+  // others are not looked at.
+  bool steal(fux::ipc::msg &req) {
+    auto siblings = find_siblings();
+    for (size_t i = 0; i < siblings->size(); i++) {
+      auto &sibling = (*siblings)[next_sibling_++ % siblings->size()];
+      auto &server = m_.servers().at(sibling.server);
+      if (sibling.subq == -1 || server.threads == 0 ||
+          server.busy_threads < server.threads) {
+        continue;
+      }
+      try {
+        // Admin messages are for the owner
+        if (take(sibling.subq, req)) {
+          return true;
+        }
+      } catch (const std::system_error &e) {
+        if (e.code().value() != ENOMSG) {
+          // Owner restarted with a new queue
+          std::lock_guard<std::mutex> lock(siblings_mutex_);
+          siblings_found_ = {};
+        }
+      }
+    }
+    return false;
   }
 
  private:
-  long mtype_;
-  int req_counter_;
+  // Other servers receiving from the same queue
+  struct sibling {
+    size_t server;
+    int subq;
+  };
+
+  // Looked up in the MIB at most once a second
+  std::shared_ptr<const std::vector<sibling>> find_siblings() {
+    std::lock_guard<std::mutex> lock(siblings_mutex_);
+    auto now = std::chrono::steady_clock::now();
+    if (now - siblings_found_ <= std::chrono::seconds(1)) {
+      return siblings_;
+    }
+    auto siblings = std::make_shared<std::vector<sibling>>();
+    {
+      auto lock = m_.data_lock();
+      auto servers = m_.servers();
+      auto rqaddr = servers.at(mib_server).rqaddr;
+      for (size_t i = 0; i < servers->len; i++) {
+        auto &s = servers.at(i);
+        if (i != mib_server && s.rqaddr == rqaddr) {
+          siblings->push_back({i, s.subq});
+        }
+      }
+    }
+    siblings_ = siblings;
+    siblings_found_ = now;
+    return siblings_;
+  }
+
+  std::atomic<long> mtype_;
+  // Requests taken from each band and whether the oldest message is next
+  std::atomic<unsigned> band_taken_[std::size(band_credits)] = {};
+  std::atomic<bool> oldest_;
+  std::atomic<size_t> next_sibling_;
+  bool spawn_locked() {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (stacksize != 0) {
+      if (int err = pthread_attr_setstacksize(&attr, stacksize); err != 0) {
+        userlog("Invalid THREADSTACKSIZE %zu: %s", stacksize, strerror(err));
+      }
+    }
+    pthread_t tid;
+    int err = pthread_create(&tid, &attr, pool_thread, nullptr);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+      userlog("Failed to start dispatch thread: %s", strerror(err));
+      return false;
+    }
+    threads_++;
+    running_++;
+    publish();
+    return true;
+  }
+
+  void publish() {
+    auto &server = m_.servers().at(mib_server);
+    server.threads = threads_;
+    server.busy_threads = busy_;
+  }
+
+  std::mutex pool_mutex_;
+  std::condition_variable pool_done_;
+  std::atomic<int> threads_;  // in the pool, changed with pool_mutex_
+  int running_;               // started and not exited yet
+  std::atomic<int> busy_;
+
+  std::mutex siblings_mutex_;
+  std::shared_ptr<const std::vector<sibling>> siblings_;
+  std::chrono::steady_clock::time_point siblings_found_;
 };
 
 static std::unique_ptr<server_main> main_ptr;
 
+// Milliseconds an idle server with subqueues waits on its own before
+// looking at the others again
+constexpr long steal_interval = 20;
+// Milliseconds an extra dispatch thread stays idle before it leaves
+constexpr long thread_idle_timeout = 10000;
+// Requests a dispatch thread takes from the queue at once when saturated
+constexpr size_t drain_limit = 16;
+// Microseconds a reply waits for replies of the other drained requests
+constexpr long drain_linger = 1000;
+// Bytes of fiber stacks if THREADSTACKSIZE is not set
+constexpr size_t default_fiber_stack = 256 * 1024;
+
 namespace fux {
 bool is_server() { return main_ptr.get() != nullptr; }
 }  // namespace fux
@@ -190,8 +496,27 @@ int _tmrunserver(int) {
   return 0;
 }
 
+// Request detached from its dispatch thread, see tpdetach
+struct tpsvcctx_t {
+  int replyq;
+  int cd;
+  service_options options;
+  // Arena buffers of the service, released after the reply is sent
+  fux::mem::arena buffers;
+};
+
 struct server_thread {
-  server_thread() : atmibuf(nullptr) {}
+  server_thread()
+      : batch_pos(0),
+        drained(drain_limit),
+        drained_pos(0),
+        drained_len(0),
+        replies(true),
+        held_replyq(-1),
+        options{0, 0, fux::ipc::default_priority},
+        atmibuf(nullptr),
+        detached(false),
+        retired(false) {}
 
   void prepare() {
     if (atmibuf == nullptr) {
@@ -202,8 +527,206 @@ struct server_thread {
 
   fux::ipc::msg req;
   fux::ipc::msg res;
+  // Last batch of requests received and position of the next one
+  fux::ipc::msg batch;
+  size_t batch_pos;
+  // Requests taken from the queue after the last one received
+  std::vector<fux::ipc::msg> drained;
+  size_t drained_pos;
+  size_t drained_len;
+  fux::ipc::batcher replies;
+  // Queue with replies held for the next drained requests, -1 if none
+  int held_replyq;
+  // Of the service being called
+  service_options options;
   char *atmibuf;
   jmp_buf tpreturn_env;
+  // Buffers allocated by the service routine, released after each request
+  fux::mem::arena arena;
+  // The service being called detached its request
+  bool detached;
+  // Left the pool while idle
+  bool retired;
+
+  // Takes the next request from the last batch received
+  bool next_batched() {
+    return batch_pos != 0 && fux::ipc::qnext(batch, batch_pos, req);
+  }
+
+  // Takes the next request drained from the queue
+  bool next_drained() {
+    if (drained_pos == drained_len) {
+      return false;
+    }
+    req.swap(drained[drained_pos++]);
+    unpack();
+    return true;
+  }
+
+  // Requests received but not processed yet
+  bool pending() const { return batch_pos != 0 || drained_pos != drained_len; }
+
+  // Reply queue of the next request already received, -1 if none
+  int next_replyq() {
+    const fux::ipc::msgmem *next = nullptr;
+    if (batch_pos != 0) {
+      next = fux::ipc::qpeek(batch, batch_pos);
+    }
+    if (next == nullptr && drained_pos != drained_len) {
+      auto &m = drained[drained_pos];
+      next = m->ttype == fux::ipc::frames ? fux::ipc::qpeek(m, 0)
+                                          : &m.as_msgmem();
+    }
+    return next != nullptr ? next->replyq : -1;
+  }
+
+  // After a wake-up a saturated server takes the requests already waiting
+  // without going back to the queue for each one. Idle threads and threads
+  // yet to be started get them from the queue instead.
+  void drain(int msqid) {
+    drained_pos = drained_len = 0;
+    if (!main_ptr->saturated()) {
+      return;
+    }
+    while (drained_len < drained.size() - 1 &&
+           main_ptr->take(msqid, drained[drained_len])) {
+      drained_len++;
+    }
+  }
+
+  void unpack() {
+    if (req->ttype == fux::ipc::frames) {
+      batch.swap(req);
+      batch_pos = 0;
+      if (!fux::ipc::qnext(batch, batch_pos, req)) {
+        throw std::runtime_error("Empty batch message");
+      }
+    }
+  }
+
+  // Returns false if there is no message
+  bool try_receive(int msqid, long mtype, int flags, long timeout = 0) {
+    try {
+      fux::ipc::qrecv(msqid, req, mtype, flags, timeout);
+      if (req->cat != fux::ipc::admin) {
+        main_ptr->taken(req->mtype);
+      }
+      return true;
+    } catch (const std::system_error &e) {
+      if (e.code().value() != ENOMSG) {
+        throw;
+      }
+      return false;
+    }
+  }
+
+  // Threads take waiting requests concurrently. Only one thread at a time
+  // waits in the queue and only it receives admin messages, so after a
+  // shutdown the others find stop set instead of blocking in the queue.
+  // Returns false if the server is stopping or the thread retired.
+  bool receive(int msqid) {
+    if (!main_ptr->take(msqid, req)) {
+      std::unique_lock<std::timed_mutex> lock(main_ptr->wait_mutex,
+                                              std::defer_lock);
+      while (!lock.try_lock_for(
+          std::chrono::milliseconds(thread_idle_timeout))) {
+        if (main_ptr->retire()) {
+          retired = true;
+          return false;
+        }
+      }
+      while (true) {
+        if (main_ptr->stop) {
+          return false;
+        }
+        auto mtype = main_ptr->mtype(true);
+        if (!try_receive(msqid, mtype, IPC_NOWAIT)) {
+          // Send batched replies before waiting for more requests
+          replies.flush();
+          if (!wait(msqid, mtype)) {
+            retired = true;
+            return false;
+          }
+        }
+        if (req->cat != fux::ipc::admin) {
+          break;
+        }
+        handle_admin(msqid);
+      }
+    }
+    drain(msqid);
+    unpack();
+    return true;
+  }
+
+  // Waits for a message, returns false if the thread retired while idle
+  bool wait(int msqid, long mtype) {
+    auto idle_since = std::chrono::steady_clock::now();
+    while (true) {
+      if (main_ptr->subqueues) {
+        // Clients pass over busy servers, requests wait in their subqueues
+        // only if they became busy in the meantime
+        if (main_ptr->steal(req) ||
+            try_receive(msqid, mtype, 0, steal_interval)) {
+          return true;
+        }
+      } else if (main_ptr->elastic()) {
+        if (try_receive(msqid, mtype, 0, thread_idle_timeout)) {
+          return true;
+        }
+      } else if (try_receive(msqid, mtype, 0)) {
+        return true;
+      }
+      if (std::chrono::steady_clock::now() - idle_since >=
+              std::chrono::milliseconds(thread_idle_timeout) &&
+          main_ptr->retire()) {
+        return false;
+      }
+    }
+  }
+
+  void handle_admin(int msqid) {
+    TPSVCINFO tpsvcinfo;
+    prepare();
+    req.get_data(&atmibuf);
+    tpsvcinfo.data = atmibuf;
+    fux::fml32buf buf(&tpsvcinfo);
+
+    userlog("Received admin message");
+    if (!main_ptr->handle(req->mtype, buf)) {
+      // return for processing by other MSSQ servers
+      userlog("Not the target receiver of message, put back in queue");
+      // Buffer was taken from the message by get_data
+      req.set_data(tpsvcinfo.data, 0);
+      fux::ipc::qsend(msqid, req, 0, fux::ipc::flags::notime);
+    }
+  }
+
+  tpsvcctx_t *tpdetach(long flags) {
+    if (flags != 0) {
+      TPERROR(TPEINVAL, "Invalid flags passed to tpdetach(%ld)", flags);
+      return nullptr;
+    }
+    if (detached) {
+      TPERROR(TPEPROTO, "Request already detached");
+      return nullptr;
+    }
+    // The transaction branch is associated with the dispatch thread
+    if (fux::tx::transactional()) {
+      TPERROR(TPEPROTO, "Transactional request can't be detached");
+      return nullptr;
+    }
+    // Buffers allocated so far and the request buffer stay valid until
+    // tpreturn_ctx, new ones come from the heap
+    auto ctx = new tpsvcctx_t{req->replyq, req->cd, options, std::move(arena)};
+    fux::mem::use_arena(nullptr);
+    fux::mem::setowner(atmibuf, nullptr);
+    atmibuf = nullptr;
+    // tpreturn of the service only ends the call now
+    req->replyq = -1;
+    detached = true;
+    return ctx;
+  }
 
   void tpforward(char *svc, char *data, long len, long flags) {
     auto gttid = fux::tx::gttid();
@@ -211,10 +734,10 @@ struct server_thread {
       fux::tx_end(true);
     }
 
-    int msqid = get_queue(svc);
-    res.set_data(data, len);
-
-    if (data != nullptr && data != atmibuf) {
+    service_options target;
+    int msqid = get_queue(svc, &target, &res->service);
+    if (!res.give_data(data, len, target.cmplimit) && data != nullptr &&
+        data != atmibuf) {
       tpfree(data);
     }
 
@@ -224,7 +747,7 @@ struct server_thread {
     checked_copy(svc, res->servicename);
     res->flags = flags;
     res->replyq = req->replyq;
-    res->mtype = req->cd;
+    res->mtype = req->mtype;
     res->cd = req->cd;
     res->gttid = gttid;
 
@@ -238,13 +761,11 @@ struct server_thread {
       fux::tx_end(rval == TPSUCCESS);
     }
 
+    if ((req->replyq == -1 || !res.give_data(data, len, options.cmplimit)) &&
+        data != nullptr && data != atmibuf) {
+      tpfree(data);
+    }
     if (req->replyq != -1) {
-      res.set_data(data, len);
-
-      if (data != nullptr && data != atmibuf) {
-        tpfree(data);
-      }
-
       if (flags != 0) {
         userlog("tpreturn with flags!=0");
         res->rval = TPESVCERR;
@@ -253,94 +774,474 @@ struct server_thread {
       }
       res->rcode = rcode;
       res->flags = flags;
+      // Left from tpforward, replies do not need them
+      res->servicename[0] = '\0';
+      res->service = -1;
       res->mtype = req->cd;
       res->cd = req->cd;
 
-      fux::ipc::qsend(req->replyq, res, 0, fux::ipc::flags::notime);
+      send_reply(req->replyq);
     }
 
     longjmp(tpreturn_env, 1);
   }
+
+  // Replies to requests received together go together when they share the
+  // reply queue, the last one sends all of them
+  void send_reply(int replyq) {
+    auto next = next_replyq();
+    bool together =
+        options.linger == 0 && (next == replyq || held_replyq == replyq);
+    auto linger =
+        std::chrono::microseconds(together ? drain_linger : options.linger);
+    if (linger.count() > 0 && replies.add(replyq, res, linger)) {
+      held_replyq = next == replyq ? replyq : -1;
+      if (together && held_replyq == -1) {
+        replies.flush(replyq);
+      }
+      return;
+    }
+    held_replyq = -1;
+    replies.flush(replyq);
+    fux::ipc::qsend(replyq, res, 0, fux::ipc::flags::notime);
+  }
 };
 
 static thread_local std::unique_ptr<server_thread> thread_ptr;
 
-static void dispatch() {
-  thread_ptr = std::make_unique<server_thread>();
+// Calls the service for the request taken into thread_ptr
+static void serve() {
+  TPSVCINFO tpsvcinfo;
+  thread_ptr->prepare();
+  // Requests of workstation clients and other machines may be malformed,
+  // they fail without calling the service
+  bool imported = true;
+  try {
+    thread_ptr->req.get_data(&thread_ptr->atmibuf);
+  } catch (const std::exception &e) {
+    userlog("Invalid request: %s", e.what());
+    imported = false;
+  }
+  tpsvcinfo.data = thread_ptr->atmibuf;
 
-  while (true) {
-    if (main_ptr->stop) {
-      break;
+  auto adv = main_ptr->find(thread_ptr->req);
+  checked_copy(adv != nullptr ? adv->name : "", tpsvcinfo.name);
+  tpsvcinfo.flags = thread_ptr->req->flags;
+  tpsvcinfo.len = thread_ptr->req.size_data();
+  tpsvcinfo.cd = thread_ptr->req->cd;
+  fux::last_priority = fux::ipc::mtype_priority(thread_ptr->req->mtype);
+
+  if (thread_ptr->req->flags & TPTRAN) {
+    fux::tx_join(thread_ptr->req->gttid);
+  }
+
+  main_ptr->busy();
+  thread_ptr->detached = false;
+  if (main_ptr->arena) {
+    fux::mem::use_arena(&thread_ptr->arena);
+  }
+  thread_ptr->options =
+      adv != nullptr ? adv->options
+                     : service_options{0, 0, fux::ipc::default_priority};
+  if (setjmp(thread_ptr->tpreturn_env) == 0) {
+    if (adv == nullptr) {
+      userlog("Service %s not advertised", thread_ptr->req->servicename);
+      thread_ptr->tpreturn(TPESVCERR, 0, nullptr, 0, 0);
+    } else if (!imported) {
+      thread_ptr->tpreturn(TPESVCERR, 0, nullptr, 0, 0);
+    } else {
+      adv->func(&tpsvcinfo);
     }
+  } else {
+  }
+  // Reply was already copied into the message by tpreturn/tpforward
+  fux::mem::use_arena(nullptr);
+  thread_ptr->arena.reset();
+  main_ptr->idle();
+}
 
-    TPSVCINFO tpsvcinfo;
-    {
-      fux::scoped_fuxlock lock(main_ptr->mutex);
-      if (main_ptr->stop) {
-        break;
-      }
+// Requests served on fibers of a dispatch thread. A service waiting in
+// tpgetrply parks its fiber and the thread goes on with other requests.
+// Replies to calls of all fibers come to the reply queue of the thread and
+// are told apart by cd. Transactional requests are served on the thread.
+struct fiber {
+  explicit fiber(size_t stack_size)
+      : page(sysconf(_SC_PAGESIZE)),
+        size((stack_size + page - 1) / page * page) {
+    // Overflowing the stack faults on the guard page below it instead of
+    // overwriting other memory
+    auto p = mmap(nullptr, page + size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Failed to allocate fiber stack");
+    }
+    guard = static_cast<char *>(p);
+    if (mprotect(guard, page, PROT_NONE) == -1) {
+      auto e = errno;
+      munmap(guard, page + size);
+      throw std::system_error(e, std::generic_category(),
+                              "Failed to protect fiber stack");
+    }
+    stack = guard + page;
+  }
+  ~fiber() { munmap(guard, page + size); }
+  fiber(const fiber &) = delete;
+  fiber &operator=(const fiber &) = delete;
+
+  ucontext_t ctx;
+  ucontext_t *main;
+  const size_t page;
+  const size_t size;
+  char *guard;
+  char *stack;
+  // The request being served, swapped with thread_ptr while running
+  std::unique_ptr<server_thread> state;
+  // Of the request being served, owns the calls it makes
+  uint64_t id;
+  int cd;  // waited for while parked, 0 for any call of the fiber
+  std::chrono::steady_clock::time_point deadline;
+  bool done;
+};
 
-      fux::ipc::qrecv(main_ptr->request_queue, thread_ptr->req,
-                      main_ptr->mtype(), 0);
-
-      thread_ptr->prepare();
-      thread_ptr->req.get_data(&thread_ptr->atmibuf);
-      tpsvcinfo.data = thread_ptr->atmibuf;
-      if (thread_ptr->req->cat == fux::ipc::admin) {
-        fux::fml32buf buf(&tpsvcinfo);
-
-        userlog("Received admin message");
-        if (!main_ptr->handle(thread_ptr->req->mtype, buf)) {
-          // return for processing by other MSSQ servers
-          userlog("Not the target receiver of message, put back in queue");
-          fux::ipc::qsend(main_ptr->request_queue, thread_ptr->req, 0,
-                          fux::ipc::flags::notime);
-        }
-        continue;
+static thread_local fiber *current_fiber = nullptr;
+
+class fiber_pool {
+ public:
+  fiber_pool(size_t max, size_t stack_size)
+      : max_(max), stack_size_(stack_size) {}
+
+  bool empty() const { return parked_.empty(); }
+  bool full() const { return parked_.size() >= max_; }
+
+  // Serves the request taken into thread_ptr on a fiber
+  void start() {
+    static std::atomic<uint64_t> ids(0);
+    std::unique_ptr<fiber> f;
+    if (free_.empty()) {
+      f = std::make_unique<fiber>(stack_size_);
+      f->state = std::make_unique<server_thread>();
+      f->main = &main_;
+    } else {
+      f = std::move(free_.back());
+      free_.pop_back();
+    }
+    f->state->req.swap(thread_ptr->req);
+    f->id = ++ids;
+    f->done = false;
+    init(f.get());
+    resume(std::move(f));
+  }
+
+  // Blocks in the reply queue of the thread until a message comes or the
+  // deadline of a parked fiber passes. Fibers waiting for the replies
+  // received or out of time are resumed, those waiting for any call are
+  // resumed to look at what came.
+  void wait() {
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    for (auto &f : parked_) {
+      deadline = std::min(deadline, f->deadline);
+    }
+    long msec = 0;
+    if (deadline != std::chrono::steady_clock::time_point::max()) {
+      msec = std::max<long>(
+          1, std::chrono::ceil<std::chrono::milliseconds>(deadline - now)
+                 .count());
+    }
+    received_.clear();
+    fux::await_reply(msec, received_);
+    now = std::chrono::steady_clock::now();
+
+    auto parked = std::move(parked_);
+    parked_.clear();
+    for (auto &f : parked) {
+      if (now >= f->deadline || (f->cd == 0 && !received_.empty()) ||
+          std::find(received_.begin(), received_.end(), f->cd) !=
+              received_.end()) {
+        resume(std::move(f));
       } else {
-        // else continue processing without global lock
+        parked_.push_back(std::move(f));
       }
     }
+  }
 
-    checked_copy(thread_ptr->req->servicename, tpsvcinfo.name);
-    tpsvcinfo.flags = thread_ptr->req->flags;
-    tpsvcinfo.len = thread_ptr->req.size_data();
-    tpsvcinfo.cd = thread_ptr->req->cd;
+  // Resumes every parked fiber once, for replies taken by tpgetrply of a
+  // request served on the thread
+  void wake_all() {
+    auto parked = std::move(parked_);
+    parked_.clear();
+    for (auto &f : parked) {
+      resume(std::move(f));
+    }
+  }
 
-    if (thread_ptr->req->flags & TPTRAN) {
-      fux::tx_join(thread_ptr->req->gttid);
+  // Called on the fiber waiting for the reply to cd
+  static void park(int cd, std::chrono::steady_clock::time_point deadline) {
+    auto f = current_fiber;
+    auto prio = fux::last_priority;
+    f->cd = cd;
+    f->deadline = deadline;
+    main_ptr->idle();
+    swapcontext(&f->ctx, f->main);
+    main_ptr->busy();
+    fux::last_priority = prio;
+    if (main_ptr->arena && !thread_ptr->detached) {
+      fux::mem::use_arena(&thread_ptr->arena);
     }
+  }
+
+ private:
+  // getcontext returns twice, locals of the caller would be clobbered
+  __attribute__((noinline)) static void init(fiber *f) {
+    getcontext(&f->ctx);
+    f->ctx.uc_stack.ss_sp = f->stack;
+    f->ctx.uc_stack.ss_size = f->size;
+    f->ctx.uc_link = f->main;
+    makecontext(&f->ctx, &fiber_pool::run, 0);
+  }
+
+  static void run() {
+    serve();
+    current_fiber->done = true;
+  }
 
-    auto it = main_ptr->advertisements.find(tpsvcinfo.name);
-    if (setjmp(thread_ptr->tpreturn_env) == 0) {
-      it->second(&tpsvcinfo);
+  void resume(std::unique_ptr<fiber> f) {
+    current_fiber = f.get();
+    thread_ptr.swap(f->state);
+    swapcontext(&main_, &f->ctx);
+    thread_ptr.swap(f->state);
+    current_fiber = nullptr;
+    fux::mem::use_arena(nullptr);
+    if (f->done) {
+      free_.push_back(std::move(f));
     } else {
+      parked_.push_back(std::move(f));
+    }
+  }
+
+  size_t max_;
+  size_t stack_size_;
+  ucontext_t main_;
+  std::vector<std::unique_ptr<fiber>> parked_;
+  std::vector<std::unique_ptr<fiber>> free_;
+  std::vector<int> received_;
+};
+
+namespace fux {
+bool in_fiber() { return current_fiber != nullptr; }
+uint64_t fiber_id() { return current_fiber != nullptr ? current_fiber->id : 0; }
+void park_fiber(int cd, std::chrono::steady_clock::time_point deadline) {
+  fiber_pool::park(cd, deadline);
+}
+}  // namespace fux
+
+// A dispatch thread with fibers waits in its reply queue for replies to
+// the parked ones. Requests are taken from the request queue by a thread
+// of its own, which hands them over one at a time while the dispatch
+// thread has room for them and wakes it with a message in the reply queue.
+class request_pump {
+ public:
+  explicit request_pump(int replyq)
+      : replyq_(replyq),
+        wanted_(false),
+        ready_(false),
+        waiting_(false),
+        ended_(false),
+        retired_(false),
+        state_(std::make_unique<server_thread>()),
+        thread_(&request_pump::run, this) {}
+  ~request_pump() { thread_.join(); }
+
+  // The dispatch thread can serve more requests or not
+  void want(bool more) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (wanted_ != more) {
+      wanted_ = more;
+      cv_.notify_all();
+    }
+  }
+
+  // Takes the request handed over into req, false if there is none
+  bool take(fux::ipc::msg &req) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ready_) {
+      return false;
+    }
+    req.swap(handed_);
+    ready_ = false;
+    cv_.notify_all();
+    return true;
+  }
+
+  // No more requests come, the server is stopping or the thread retired
+  bool ended() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ended_ && !ready_;
+  }
+  bool retired() const { return retired_; }
+
+  // Called before the dispatch thread waits in the reply queue, false if a
+  // request is ready or none will come. The next one handed over wakes it.
+  bool idle() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    waiting_ = !ready_ && !ended_;
+    return waiting_;
+  }
+
+ private:
+  void run() {
+    auto msqid = main_ptr->request_queue;
+    while (state_->receive(msqid)) {
+      do {
+        hand_over();
+      } while (state_->next_batched() || state_->next_drained());
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired_ = state_->retired;
+    ended_ = true;
+    wake();
+  }
+
+  // Waits until the dispatch thread has room for the request
+  void hand_over() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return wanted_ && !ready_; });
+    handed_.swap(state_->req);
+    ready_ = true;
+    wake();
+  }
+
+  // Called with mutex_ held. A full reply queue wakes the dispatch thread
+  // anyway.
+  void wake() {
+    if (waiting_) {
+      waiting_ = false;
+      wake_->cat = fux::ipc::admin;
+      fux::ipc::qsend(replyq_, wake_, 0, fux::ipc::flags::noblock);
+    }
+  }
+
+  int replyq_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool wanted_;
+  bool ready_;
+  bool waiting_;
+  bool ended_;
+  std::atomic<bool> retired_;
+  fux::ipc::msg handed_;
+  fux::ipc::msg wake_;
+  std::unique_ptr<server_thread> state_;
+  std::thread thread_;
+};
+
+// Returns true if the thread retired from the pool
+static bool dispatch_fibers() {
+  fiber_pool fibers(main_ptr->fibers, main_ptr->stacksize != 0
+                                          ? main_ptr->stacksize
+                                          : default_fiber_stack);
+  request_pump pump(fux::reply_queue());
+
+  while (true) {
+    pump.want(!fibers.full());
+    if (!fibers.full() && pump.take(thread_ptr->req)) {
+      // Receives without a global lock, tpimport of data is not serialized
+      if (thread_ptr->req->flags & TPTRAN) {
+        serve();
+        fibers.wake_all();
+      } else {
+        fibers.start();
+      }
+      continue;
+    }
+    // Requests already taken from the queue are served before stopping
+    if (pump.ended()) {
+      if (fibers.empty()) {
+        break;
+      }
+      fibers.wait();
+    } else if (pump.idle()) {
+      fibers.wait();
+    }
+  }
+  return pump.retired();
+}
+
+// Returns true if the thread retired from the pool
+static bool dispatch() {
+  thread_ptr = std::make_unique<server_thread>();
+  if (main_ptr->fibers > 0) {
+    bool retired = dispatch_fibers();
+    thread_ptr.reset();
+    return retired;
+  }
+
+  while (true) {
+    // Requests already taken from the queue are served before stopping
+    if (main_ptr->stop && !thread_ptr->pending()) {
+      break;
     }
+    if (!thread_ptr->next_batched() && !thread_ptr->next_drained() &&
+        !thread_ptr->receive(main_ptr->request_queue)) {
+      break;
+    }
+    // Receives without a global lock, tpimport of data is not serialized
+    serve();
   }
 
+  bool retired = thread_ptr->retired;
   thread_ptr.reset();
+  return retired;
 }
 
-static void thread_dispatch(tmsvrargs_t *tmsvrargs, int argc, char *argv[]) {
-  if (int n = tmsvrargs->svrthrinit(argc, argv); n != 0) {
+static void *pool_thread(void *) {
+  bool retired = false;
+  auto tmsvrargs = main_ptr->tmsvrargs;
+  if (int n = tmsvrargs->svrthrinit(main_ptr->argc, main_ptr->argv); n != 0) {
     userlog("tpsvrthrinit() = %d", n);
-    return;
+  } else {
+    retired = dispatch();
+    tmsvrargs->svrthrdone();
   }
-  dispatch();
-  tmsvrargs->svrthrdone();
+  main_ptr->exited(retired);
+  return nullptr;
 }
 
 namespace fux::glob {
 extern xa_switch_t *xasw;
 }
 
+// tmboot does not pass CLOPT, dispatch thread options given there are read
+// from the MIB. Options on the command line take precedence.
+static void clopt_threads(const char *clopt, int &min_threads,
+                          int &max_threads, long &stacksize, int &fibers) {
+  auto args = fux::split(clopt, " ");
+  for (size_t i = 0; i + 1 < args.size() && args[i] != "--"; i++) {
+    if (args[i] == "--min-threads" && min_threads == -1) {
+      min_threads = std::stoi(args[++i]);
+    } else if (args[i] == "--max-threads" && max_threads == -1) {
+      max_threads = std::stoi(args[++i]);
+    } else if (args[i] == "--stack-size" && stacksize == -1) {
+      stacksize = std::stol(args[++i]);
+    } else if (args[i] == "--fibers" && fibers == -1) {
+      fibers = std::stoi(args[++i]);
+    }
+  }
+}
+
 int _tmstartserver(int argc, char **argv, struct tmsvrargs_t *tmsvrargs) {
   bool show_help = false;
   bool verbose = false;
 
   bool all = false;
+  bool arena = false;
   int grpno = -1;
   int srvid = -1;
+  int min_threads = -1;
+  int max_threads = -1;
+  long stacksize = -1;
+  int fibers = -1;
   std::vector<std::string> services;
 
   auto parser =
@@ -349,6 +1250,17 @@ int _tmstartserver(int argc, char **argv, struct tmsvrargs_t *tmsvrargs) {
       clara::Opt(grpno, "GRPNO")["-g"]("server's GRPNO in TUXCONFIG") |
       clara::Opt(services, "SERVICES")["-s"]("services to advertise") |
       clara::Opt(all)["-A"]("advertise all services") |
+      clara::Opt(arena)["-a"](
+          "allocate service buffers from an arena, they must not outlive "
+          "the call") |
+      clara::Opt(min_threads, "N")["--min-threads"](
+          "dispatch threads started, MINDISPATCHTHREADS") |
+      clara::Opt(max_threads, "N")["--max-threads"](
+          "dispatch threads while busy, MAXDISPATCHTHREADS") |
+      clara::Opt(stacksize, "BYTES")["--stack-size"](
+          "stack size of dispatch threads, THREADSTACKSIZE") |
+      clara::Opt(fibers, "N")["--fibers"](
+          "requests served at once on fibers by each dispatch thread") |
       clara::Opt(verbose)["-v"]("display built-in services");
 
   int sep = 0;
@@ -390,15 +1302,51 @@ int _tmstartserver(int argc, char **argv, struct tmsvrargs_t *tmsvrargs) {
     return -1;
   }
 
+  {
+    // CLOPT overrides the SERVERS section
+    auto &server = m.servers().at(main_ptr->mib_server);
+    try {
+      clopt_threads(server.clopt, min_threads, max_threads, stacksize,
+                    fibers);
+    } catch (const std::logic_error &e) {
+      userlog("Invalid dispatch thread option in CLOPT: %s", e.what());
+      return -1;
+    }
+    auto &pool = *main_ptr;
+    pool.autoscaled = server.scaleup > 0;
+    pool.min_threads = min_threads != -1 ? min_threads : server.min_threads;
+    pool.max_threads = max_threads != -1 ? max_threads : server.max_threads;
+    pool.stacksize = stacksize != -1 ? stacksize : server.stacksize;
+    pool.fibers = std::max(fibers, 0);
+    if (min_threads != -1 && max_threads == -1) {
+      pool.max_threads = std::max(pool.max_threads, min_threads);
+    } else if (max_threads != -1 && min_threads == -1) {
+      pool.min_threads = std::min(pool.min_threads, max_threads);
+    }
+    if (pool.min_threads < 1 || pool.max_threads < pool.min_threads ||
+        stacksize < -1 || fibers < -1) {
+      userlog("Invalid dispatch thread options");
+      return -1;
+    }
+  }
+
   main_ptr->srvid = srvid;
   main_ptr->grpno = grpno;
   fux::tx::grpno = grpno;
 
-  main_ptr->request_queue = m.make_service_rqaddr(main_ptr->mib_server);
+  {
+    auto lock = m.data_lock();
+    main_ptr->request_queue = m.make_service_rqaddr(main_ptr->mib_server);
+    if (int subq = m.make_server_subq(main_ptr->mib_server); subq != -1) {
+      main_ptr->request_queue = subq;
+      main_ptr->subqueues = true;
+    }
+  }
   main_ptr->mib_queue = m.servers().at(main_ptr->mib_server).rqaddr;
   main_ptr->argc = argc;
   main_ptr->argv = argv;
   main_ptr->tmsvrargs = tmsvrargs;
+  main_ptr->arena = arena;
   fux::glob::xasw = tmsvrargs->xa_switch;
 
   if (int n = tmsvrargs->svrinit(argc, argv); n != 0) {
@@ -421,15 +1369,12 @@ int _tmstartserver(int argc, char **argv, struct tmsvrargs_t *tmsvrargs) {
   main_ptr->active();
 
   if (_tmbuilt_with_thread_option) {
-    std::vector<std::thread> threads;
-    for (int i = 0; i < 3; i++) {
-      threads.emplace_back(std::thread(thread_dispatch, tmsvrargs, argc, argv));
-    }
-
-    for (auto &t : threads) {
-      t.join();
+    for (int i = 0; i < main_ptr->min_threads; i++) {
+      main_ptr->spawn();
     }
+    main_ptr->wait_threads();
   } else {
+    main_ptr->single_threaded();
     dispatch();
   }
 
@@ -455,26 +1400,74 @@ int tpunadvertise(char *svcname) {
   return main_ptr->tpunadvertise(svcname);
 }
 
-void tpreturn(int rval, long rcode, char *data, long len, long flags) try {
-  if (!main_ptr) {
-    TPERROR(TPEPROTO, "%s can't be called from client", __func__);
-    abort();
-  }
+// rval of tpreturn as seen by the caller
+static int reply_rval(int rval) {
   if (rval == TPSUCCESS) {
-    rval = TPMINVAL;
+    return TPMINVAL;
   } else if (rval == TPFAIL) {
-    rval = TPESVCFAIL;
+    return TPESVCFAIL;
   } else if (rval == TPEXIT) {
-    rval = TPESVCERR;
+    return TPESVCERR;
   } else {
-    rval = TPESVCERR;
+    return TPESVCERR;
+  }
+}
+
+void tpreturn(int rval, long rcode, char *data, long len, long flags) try {
+  if (!main_ptr) {
+    TPERROR(TPEPROTO, "%s can't be called from client", __func__);
+    abort();
   }
-  return thread_ptr->tpreturn(rval, rcode, data, len, flags);
+  return thread_ptr->tpreturn(reply_rval(rval), rcode, data, len, flags);
 } catch (...) {
   userlog("tpreturn failed");
   longjmp(thread_ptr->tpreturn_env, -1);
 }
 
+TPSVCCTX *tpdetach(long flags) {
+  if (!main_ptr || !thread_ptr) {
+    TPERROR(TPEPROTO, "%s can only be called from a service", __func__);
+    return nullptr;
+  }
+  return fux::atmi::exception_boundary(
+      [&] { return thread_ptr->tpdetach(flags); }, nullptr);
+}
+
+int tpreturn_ctx(TPSVCCTX *ctx, int rval, long rcode, char *data, long len,
+                 long flags) {
+  return fux::atmi::exception_boundary(
+      [&] {
+        std::unique_ptr<tpsvcctx_t> owner(ctx);
+        if (ctx == nullptr) {
+          TPERROR(TPEINVAL, "ctx is NULL");
+          return -1;
+        }
+        fux::ipc::msg res;
+        if ((ctx->replyq == -1 ||
+             !res.give_data(data, len, ctx->options.cmplimit)) &&
+            data != nullptr && !(thread_ptr && data == thread_ptr->atmibuf)) {
+          tpfree(data);
+        }
+        if (ctx->replyq == -1) {
+          return 0;
+        }
+
+        if (flags != 0) {
+          userlog("tpreturn_ctx with flags!=0");
+          res->rval = TPESVCERR;
+        } else {
+          res->rval = reply_rval(rval);
+        }
+        res->rcode = rcode;
+        res->flags = flags;
+        res->mtype = ctx->cd;
+        res->cd = ctx->cd;
+        fux::ipc::qsend(ctx->replyq, res, 0, fux::ipc::flags::notime);
+        return 0;
+      },
+      -1);
+}
+
 void tpforward(char *svc, char *data, long len, long flags) try {
   if (!main_ptr) {
     TPERROR(TPEPROTO, "%s can't be called from client", __func__);
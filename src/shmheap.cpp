@@ -0,0 +1,289 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include "shmheap.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <stdexcept>
+#include <system_error>
+
+namespace fux::mem {
+
+constexpr int min_shift = 8;  // 256 bytes including block header
+constexpr int max_shift = 40;
+constexpr int nclasses = max_shift - min_shift + 1;
+
+struct blockhdr {
+  uint32_t sclass;
+  uint32_t state;
+  pid_t pid;  // holder when held
+  int msqid;  // queue when queued
+};
+static_assert(sizeof(blockhdr) == 16);
+
+// Offsets are relative to the start of the segment, 0 means no block
+struct shmheapmem {
+  pthread_mutex_t mutex;
+  uint64_t size;
+  uint64_t start;  // first block
+  uint64_t top;    // space above top was never used
+  uint64_t blocks;
+  uint64_t free[nclasses];
+};
+
+static uint64_t class_size(uint32_t sclass) {
+  return uint64_t(1) << (sclass + min_shift);
+}
+
+static long size_class(size_t size) {
+  if (size <= class_size(0)) {
+    return 0;
+  }
+  long sclass = (sizeof(unsigned long) * 8 - __builtin_clzl(size - 1)) -
+                min_shift;
+  return sclass < nclasses ? sclass : -1;
+}
+
+class scoped_heaplock {
+ public:
+  explicit scoped_heaplock(pthread_mutex_t *m) : m_(m) {
+    auto rc = pthread_mutex_lock(m_);
+    if (rc == EOWNERDEAD) {
+      // Lists are changed with a couple of stores, carry on
+      pthread_mutex_consistent(m_);
+    } else if (rc != 0) {
+      throw std::system_error(rc, std::system_category(),
+                              "pthread_mutex_lock failed");
+    }
+  }
+  ~scoped_heaplock() { pthread_mutex_unlock(m_); }
+
+ private:
+  pthread_mutex_t *m_;
+  scoped_heaplock(const scoped_heaplock &) = delete;
+  scoped_heaplock &operator=(const scoped_heaplock &) = delete;
+};
+
+static char *base(shmheapmem *mem) { return reinterpret_cast<char *>(mem); }
+
+static blockhdr *header(const void *ptr) {
+  return reinterpret_cast<blockhdr *>(const_cast<char *>(
+             static_cast<const char *>(ptr))) -
+         1;
+}
+
+static uint64_t &next(shmheapmem *mem, uint64_t off) {
+  return *reinterpret_cast<uint64_t *>(base(mem) + off + sizeof(blockhdr));
+}
+
+int shmheap::create(size_t size) {
+  int shmid = shmget(IPC_PRIVATE, size, 0600 | IPC_CREAT);
+  if (shmid == -1) {
+    throw std::system_error(errno, std::system_category(), "shmget failed");
+  }
+  auto mem = reinterpret_cast<shmheapmem *>(shmat(shmid, nullptr, 0));
+  if (mem == reinterpret_cast<void *>(-1)) {
+    auto e = errno;
+    shmctl(shmid, IPC_RMID, nullptr);
+    throw std::system_error(e, std::system_category(), "shmat failed");
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&mem->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  mem->size = size;
+  mem->start =
+      (sizeof(shmheapmem) + class_size(0) - 1) & ~(class_size(0) - 1);
+  mem->top = mem->start;
+  mem->blocks = 0;
+  std::fill_n(mem->free, nclasses, 0);
+
+  shmdt(mem);
+  return shmid;
+}
+
+static std::atomic<shmheap *> _current{nullptr};
+static std::atomic<bool> _buffers{false};
+
+shmheap *shmheap::attach(int shmid, bool buffers) {
+  auto mem = reinterpret_cast<shmheapmem *>(shmat(shmid, nullptr, 0));
+  if (mem == reinterpret_cast<void *>(-1)) {
+    throw std::system_error(errno, std::system_category(), "shmat failed");
+  }
+  auto heap = new shmheap(mem);
+  _buffers = buffers;
+  if (auto old = _current.exchange(heap)) {
+    shmdt(old->mem_);
+    delete old;
+  }
+  return heap;
+}
+
+void shmheap::detach() {
+  _buffers = false;
+  if (auto old = _current.exchange(nullptr)) {
+    shmdt(old->mem_);
+    delete old;
+  }
+}
+
+shmheap *shmheap::current() {
+  return _current.load(std::memory_order_acquire);
+}
+
+shmheap *shmheap::buffers() {
+  return _buffers.load(std::memory_order_relaxed) ? current() : nullptr;
+}
+
+void *shmheap::allocate(size_t size) {
+  auto sclass = size_class(size + sizeof(blockhdr));
+  if (sclass == -1) {
+    return nullptr;
+  }
+
+  auto pid = getpid();
+  // Header is written under the lock, reclaim() walks all blocks
+  scoped_heaplock lock(&mem_->mutex);
+  uint64_t off = mem_->free[sclass];
+  if (off != 0) {
+    mem_->free[sclass] = next(mem_, off);
+  } else if (mem_->top + class_size(sclass) <= mem_->size) {
+    off = mem_->top;
+    mem_->top += class_size(sclass);
+  } else {
+    return nullptr;
+  }
+  mem_->blocks++;
+
+  auto hdr = reinterpret_cast<blockhdr *>(base(mem_) + off);
+  hdr->sclass = sclass;
+  hdr->state = held;
+  hdr->pid = pid;
+  hdr->msqid = -1;
+  return hdr + 1;
+}
+
+void shmheap::deallocate(void *ptr) {
+  auto hdr = header(ptr);
+  uint64_t off = reinterpret_cast<char *>(hdr) - base(mem_);
+
+  scoped_heaplock lock(&mem_->mutex);
+  if (hdr->state == unused) {
+    throw std::logic_error("Shared heap block freed twice");
+  }
+  hdr->state = unused;
+  next(mem_, off) = mem_->free[hdr->sclass];
+  mem_->free[hdr->sclass] = off;
+  mem_->blocks--;
+}
+
+size_t shmheap::capacity(const void *ptr) const {
+  return class_size(header(ptr)->sclass) - sizeof(blockhdr);
+}
+
+bool shmheap::contains(const void *ptr) const {
+  auto p = static_cast<const char *>(ptr);
+  return p >= base(mem_) + mem_->start && p < base(mem_) + mem_->size;
+}
+
+long shmheap::offset(const void *ptr) const {
+  return static_cast<const char *>(ptr) - base(mem_);
+}
+
+void *shmheap::pointer(long off) const {
+  uint64_t blk = off - sizeof(blockhdr);
+  if (off < long(sizeof(blockhdr)) || blk < mem_->start ||
+      blk >= mem_->top || (blk - mem_->start) % class_size(0) != 0) {
+    throw std::out_of_range("Invalid shared heap offset");
+  }
+  auto hdr = reinterpret_cast<blockhdr *>(base(mem_) + blk);
+  if (hdr->state == unused || hdr->sclass >= nclasses ||
+      blk + class_size(hdr->sclass) > mem_->top) {
+    throw std::out_of_range("Invalid shared heap block");
+  }
+  return hdr + 1;
+}
+
+void shmheap::hold(void *ptr) {
+  auto hdr = header(ptr);
+  auto pid = getpid();
+  scoped_heaplock lock(&mem_->mutex);
+  if (hdr->state == unused) {
+    throw std::logic_error("Shared heap block was reclaimed");
+  }
+  hdr->pid = pid;
+  hdr->msqid = -1;
+  hdr->state = held;
+}
+
+void shmheap::enqueue(void *ptr, int msqid) {
+  auto hdr = header(ptr);
+  scoped_heaplock lock(&mem_->mutex);
+  hdr->msqid = msqid;
+  hdr->pid = 0;
+  hdr->state = queued;
+}
+
+void shmheap::pin(void *ptr) {
+  auto hdr = header(ptr);
+  scoped_heaplock lock(&mem_->mutex);
+  hdr->pid = 0;
+  hdr->msqid = -1;
+  hdr->state = pinned;
+}
+
+size_t shmheap::reclaim(bool (*exists)(int msqid)) {
+  std::map<pid_t, bool> pids;
+  std::map<int, bool> queues;
+
+  scoped_heaplock lock(&mem_->mutex);
+  size_t freed = 0;
+  for (uint64_t off = mem_->start; off < mem_->top;) {
+    auto hdr = reinterpret_cast<blockhdr *>(base(mem_) + off);
+    bool lost = false;
+    if (hdr->state == held) {
+      auto it = pids.find(hdr->pid);
+      if (it == pids.end()) {
+        it = pids.emplace(hdr->pid, kill(hdr->pid, 0) == 0 || errno != ESRCH)
+                 .first;
+      }
+      lost = !it->second;
+    } else if (hdr->state == queued) {
+      auto it = queues.find(hdr->msqid);
+      if (it == queues.end()) {
+        it = queues.emplace(hdr->msqid, exists(hdr->msqid)).first;
+      }
+      lost = !it->second;
+    }
+    if (lost) {
+      hdr->state = unused;
+      next(mem_, off) = mem_->free[hdr->sclass];
+      mem_->free[hdr->sclass] = off;
+      mem_->blocks--;
+      freed++;
+    }
+    off += class_size(hdr->sclass);
+  }
+  return freed;
+}
+
+shmheap::stats shmheap::statistics() {
+  scoped_heaplock lock(&mem_->mutex);
+  return stats{mem_->size - mem_->start, mem_->top - mem_->start,
+               mem_->blocks};
+}
+
+}  // namespace fux::mem
@@ -0,0 +1,73 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace fux::mem {
+
+struct shmheapmem;
+
+// Heap in a shared memory segment created next to the MIB. It carries IPC
+// messages too big for the kernel queue and, when SHMHEAP is set in
+// UBBCONFIG, typed buffers. Every process of the domain maps the segment at
+// a different address so blocks are passed between processes as offsets.
+// Blocks come from power-of-two size classes and are never split or merged.
+class shmheap {
+ public:
+  // Owner of the block, used to reclaim blocks of dead processes. Pinned
+  // blocks are only freed explicitly.
+  enum state : uint32_t { unused = 0, held = 1, queued = 2, pinned = 3 };
+
+  struct stats {
+    size_t capacity;  // bytes available for blocks
+    size_t carved;    // bytes ever taken from the segment
+    size_t blocks;    // blocks currently allocated
+  };
+
+  // Size of the segment when SHMHEAP is not set, for large messages only
+  static constexpr size_t default_size = 16 * 1024 * 1024;
+
+  // Creates and initializes a new segment of size bytes, returns shmid
+  static int create(size_t size);
+  // Maps the segment, tpalloc uses it if buffers is true
+  static shmheap *attach(int shmid, bool buffers);
+  static void detach();
+  // Heap attached by this process or nullptr
+  static shmheap *current();
+  // Heap for typed buffers or nullptr
+  static shmheap *buffers();
+
+  // Returns nullptr if there is no free block big enough
+  void *allocate(size_t size);
+  void deallocate(void *ptr);
+  // Usable size of the block
+  size_t capacity(const void *ptr) const;
+
+  bool contains(const void *ptr) const;
+  long offset(const void *ptr) const;
+  // Validates offset received from another process
+  void *pointer(long off) const;
+
+  // Block is held by the calling process
+  void hold(void *ptr);
+  // Block is in a message sent to msqid
+  void enqueue(void *ptr, int msqid);
+  // Block outlives the calling process
+  void pin(void *ptr);
+
+  // Frees blocks held by dead processes or sitting in queues for which
+  // exists returns false, returns the number of blocks freed
+  size_t reclaim(bool (*exists)(int msqid));
+
+  stats statistics();
+
+ private:
+  explicit shmheap(shmheapmem *mem) : mem_(mem) {}
+
+  shmheapmem *mem_;
+};
+
+}  // namespace fux::mem
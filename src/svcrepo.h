@@ -8,6 +8,7 @@
 struct queue_entry {
   int grpno;
   int msqid;
+  size_t server;
 };
 
 struct service_entry {
@@ -16,16 +17,29 @@ struct service_entry {
   uint64_t cached_revision;
   uint64_t *mib_revision;
   size_t mib_service;
+  service_options options;
 
-  service_entry() : current_queue(0) {}
+  service_entry()
+      : current_queue(0), options{0, 0, fux::ipc::default_priority} {}
 };
 
 class service_repository {
  public:
-  service_repository(mib &m) : m_(m) {}
-  int get_queue(int grpno, const char *svc) {
+  // Advertisements of server except are skipped
+  service_repository(mib &m, size_t except = mib::badoff)
+      : m_(m), except_(except) {}
+  // Service slot in the MIB is stored in service if not nullptr, it lets
+  // requests go without the service name
+  int get_queue(int grpno, const char *svc, service_options *options = nullptr,
+                int *service = nullptr) {
     auto &entry = get_entry(svc);
     refresh(entry);
+    if (options != nullptr) {
+      *options = entry.options;
+    }
+    if (service != nullptr) {
+      *service = entry.mib_service;
+    }
     return load_balance(entry, grpno);
   }
 
@@ -40,6 +54,7 @@ class service_repository {
         throw std::out_of_range(service_name);
       }
       entry.mib_revision = &(m_.services().at(entry.mib_service).revision);
+      entry.options = m_.services().at(entry.mib_service).options;
       entry.cached_revision = 0;
       it = services_.insert(std::make_pair(service_name, entry)).first;
     }
@@ -53,10 +68,12 @@ class service_repository {
       auto adv = m_.advertisements();
       for (size_t i = 0; i < adv->len; i++) {
         auto &a = adv.at(i);
-        if (a.service == entry.mib_service) {
-          auto msqid = m_.queues().at(a.queue).msqid;
-          auto grpno = m_.servers().at(a.server).grpno;
-          entry.queues.push_back({grpno, msqid});
+        if (a.service == entry.mib_service && a.server != except_) {
+          auto &server = m_.servers().at(a.server);
+          // Requests are spread over subqueues of the set
+          auto msqid = server.subq != -1 ? server.subq
+                                         : m_.queues().at(a.queue).msqid;
+          entry.queues.push_back({server.grpno, msqid, a.server});
         }
       }
       entry.cached_revision = *(entry.mib_revision);
@@ -68,8 +85,19 @@ class service_repository {
       throw std::out_of_range("no queue");
     }
     if (grpno == -1) {
-      entry.current_queue = (entry.current_queue + 1) % entry.queues.size();
-      return entry.queues[entry.current_queue].msqid;
+      // Servers with every dispatch thread busy are passed over while
+      // others can take the request at once
+      auto n = entry.queues.size();
+      auto next = (entry.current_queue + 1) % n;
+      for (size_t i = 0; i < n; i++) {
+        auto q = (next + i) % n;
+        if (!busy(entry.queues[q].server)) {
+          next = q;
+          break;
+        }
+      }
+      entry.current_queue = next;
+      return entry.queues[next].msqid;
     } else {
       for (auto &e : entry.queues) {
         if (e.grpno == grpno) {
@@ -80,6 +108,12 @@ class service_repository {
     throw std::out_of_range("no queue");
   }
 
+  bool busy(size_t server) {
+    auto &s = m_.servers().at(server);
+    return s.threads != 0 && s.busy_threads >= s.threads;
+  }
+
   mib &m_;
+  size_t except_;
   std::map<std::string, service_entry, std::less<void>> services_;
 };
@@ -41,21 +41,8 @@ static void start(server &srv, bool no, bool d1) {
   }
 
   srv.state = state_t::inactive;
-  auto pid = fork();
-  if (pid == 0) {
-    argv.push_back(nullptr);
-
-    if (freopen("/dev/null", "r", stdin) == nullptr ||
-        freopen("stdout", "a", stdout) == nullptr ||
-        freopen("stderr", "a", stderr) == nullptr) {
-      exit(-1);
-    }
-
-    if (execvp(srv.servername, (char *const *)&argv[0]) == -1) {
-      // perror("AAAAAAAA");
-      exit(-1);
-    }
-  } else if (pid > 0) {
+  auto pid = exec_server(srv);
+  if (pid > 0) {
     srv.pid = pid;
     for (;;) {
       if (srv.state == state_t::active) {
@@ -82,6 +82,7 @@ int main(int argc, char *argv[]) {
     tuxcfg.maxqueues = require(config.resources, "MAXQUEUES", 1, 8192, 50);
     tuxcfg.maxaccessers =
         require(config.resources, "MAXACCESSERS", 1, 32768, 100);
+    tuxcfg.shmheap = require(config.resources, "SHMHEAP", 0, 4194304, 0);
 
     std::ofstream fout(outfile, std::ios::binary);
     fout.write(reinterpret_cast<char *>(&tuxcfg), sizeof(tuxcfg));
@@ -67,7 +67,8 @@ int main(int argc, char *argv[]) {
       userlog("Requesting %s -g %d -i %d to shutdown", server.servername,
               server.grpno, server.srvid);
 
-      fux::ipc::qsend(queue.msqid, req, 0, fux::ipc::flags::notime);
+      fux::ipc::qsend(server.subq != -1 ? server.subq : queue.msqid, req, 0,
+                      fux::ipc::flags::notime);
 
       std::cout << "\tServer Id = " << server.srvid
                 << " Group Id = " << server.grpno << ":  shutdown succeeded"
@@ -18,6 +18,7 @@ static void manage_group(const std::string &operation, fml32buf &in,
   tuxcfg.maxservices = 1;
   tuxcfg.maxgroups = 1;
   tuxcfg.maxqueues = 1;
+  tuxcfg.shmheap = 0;
   mib m(tuxcfg, fux::mib::in_heap());
 
   auto groups = m.groups();
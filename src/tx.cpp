@@ -389,7 +389,11 @@ void tx_join(fux::gttid gttid) {
 }
 namespace tx {
 fux::gttid gttid() { return getctxt().gttid; }
-bool transactional() { return !(getctxt().info.xid.formatID == -1); }
+// Without context there is no transaction, workstation clients never attach
+// to the MIB
+bool transactional() {
+  return txctxt.get() && !(getctxt().info.xid.formatID == -1);
+}
 }  // namespace tx
 };  // namespace fux
 
@@ -16,6 +16,7 @@ struct ubbconfig {
   ubb_section groups;
   ubb_section servers;
   ubb_section services;
+  ubb_section network;
 
   ubbconfig()
       : resources{
@@ -26,6 +27,9 @@ struct ubbconfig {
         } {}
 };
 
+// MACHINES entry of this machine, see ubb2mib.cpp
+const ubb_line &local_machine(const ubbconfig &u);
+
 // "Binary" version of ubbconfig
 // Really just some significant info at fixed offsets and then the text version
 // ubbconfig
@@ -37,5 +41,6 @@ struct tuxconfig {
   uint16_t maxqueues;
   uint16_t maxgroups;
   uint16_t maxaccessers;
+  uint32_t shmheap;  // KiB, 0 if typed buffers are not in shared memory
   //  char ubb[];
 };
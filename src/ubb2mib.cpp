@@ -1,9 +1,13 @@
 // This file is part of Fuxedo
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
+#include <limits.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cstdlib>
 #include <functional>  //std::hash
 #include <iostream>
+#include <set>
 
 #include "mib.h"
 #include "misc.h"
@@ -34,15 +38,59 @@ static long checked_get(T &dict, const std::string &key, long min, long max,
   return value;
 }
 
-void ubb2mib(ubbconfig &u, mib &m) {
-  if (u.machines.size() != 1) {
-    throw std::logic_error("Exactly one MACHINE entry supported");
+static fux::ipc::backend checked_transport(const std::string &value,
+                                           fux::ipc::backend defvalue) {
+  if (value.empty()) {
+    return defvalue;
+  } else if (value == "MSGQ") {
+    return fux::ipc::backend::msgq;
+  } else if (value == "RING") {
+    return fux::ipc::backend::ring;
+  }
+  throw std::out_of_range("TRANSPORT must be MSGQ or RING");
+}
+
+template <typename T>
+static bool checked_flag(T &dict, const std::string &key) {
+  auto value = dict[key];
+  if (value.empty() || value == "N") {
+    return false;
+  } else if (value == "Y") {
+    return true;
+  }
+  throw std::out_of_range(key + " must be Y or N");
+}
+
+// Machines are told apart by TUXCONFIG, several machines with different
+// TUXCONFIG may run on one host
+const ubb_line &local_machine(const ubbconfig &u) {
+  auto tuxconfig = std::getenv("TUXCONFIG");
+  char host[HOST_NAME_MAX + 1] = {0};
+  gethostname(host, sizeof(host) - 1);
+
+  const ubb_line *found = nullptr;
+  for (auto &mach : u.machines) {
+    auto it = mach.second.find("TUXCONFIG");
+    if (tuxconfig == nullptr || it == mach.second.end() ||
+        it->second != tuxconfig) {
+      continue;
+    }
+    if (found == nullptr || mach.first == host) {
+      found = &mach;
+    }
   }
-  auto &mach = u.machines[0];
-  if (mach.second.at("TUXCONFIG") != std::getenv("TUXCONFIG")) {
+  if (found == nullptr) {
     throw std::logic_error(
         "TUXCONFIG in configuration file and environment do not match");
   }
+  return *found;
+}
+
+void ubb2mib(ubbconfig &u, mib &m) {
+  if (u.machines.empty()) {
+    throw std::logic_error("MACHINES entry required");
+  }
+  auto mach = local_machine(u);
 
   srand(time(nullptr));
   m->host = std::hash<std::string>()(mach.first);
@@ -75,6 +123,8 @@ void ubb2mib(ubbconfig &u, mib &m) {
   }
 
   m.mach().blocktime = std::stol(blocktime) * std::stol(scanunit);
+  m.mach().transport =
+      checked_transport(u.resources["TRANSPORT"], fux::ipc::backend::msgq);
 
   std::map<std::string, uint16_t> group_ids;
   auto groups = m.groups();
@@ -85,7 +135,29 @@ void ubb2mib(ubbconfig &u, mib &m) {
     server.autostart = true;
   }
 
+  // Other machines are reached through the bridge
+  if (u.machines.size() > 1) {
+    for (auto &machconf : u.machines) {
+      auto lmid = machconf.second["LMID"];
+      auto it = std::find_if(u.network.begin(), u.network.end(),
+                             [&](auto &net) { return net.first == lmid; });
+      if (it == u.network.end() || it->second["NADDR"].empty()) {
+        throw std::out_of_range("NADDR required for LMID " + lmid +
+                                " in NETWORK section");
+      }
+    }
+    auto &server =
+        servers.at(m.make_server(1, 0, "BRIDGE", "-A", ".BRIDGE"));
+    server.autostart = true;
+  }
+
+  std::set<std::string> remote_groups;
   for (auto &grpconf : u.groups) {
+    auto lmid = grpconf.second["LMID"];
+    if (!lmid.empty() && lmid != m.mach().lmid) {
+      remote_groups.insert(grpconf.first);
+      continue;
+    }
     auto grpno = checked_get(grpconf.second, "GRPNO", 1, 30000);
 
     auto &group = groups.at(
@@ -106,6 +178,9 @@ void ubb2mib(ubbconfig &u, mib &m) {
   }
 
   for (auto &srvconf : u.servers) {
+    if (remote_groups.count(srvconf.second["SRVGRP"]) > 0) {
+      continue;
+    }
     auto basesrvid = checked_get(srvconf.second, "SRVID", 1, 30000);
     auto min = checked_get(srvconf.second, "MIN", 1, 1000, 1);
     auto max = checked_get(srvconf.second, "MAX", 1, 1000, 1);
@@ -120,6 +195,35 @@ void ubb2mib(ubbconfig &u, mib &m) {
       auto &server = servers.at(m.make_server(srvid, grpno, srvconf.first,
                                               srvconf.second["CLOPT"], rqaddr));
       server.autostart = n < min;
+      auto &queue = m.queues().at(server.rqaddr);
+      queue.backend =
+          checked_transport(srvconf.second["TRANSPORT"], m.mach().transport);
+      queue.subqueues = checked_flag(srvconf.second, "SUBQUEUES");
+
+      server.max_threads = checked_get(srvconf.second, "MAXDISPATCHTHREADS", 1,
+                                       1000, default_dispatch_threads);
+      server.min_threads = checked_get(
+          srvconf.second, "MINDISPATCHTHREADS", 1, server.max_threads,
+          std::min(default_dispatch_threads, server.max_threads));
+      server.stacksize =
+          checked_get(srvconf.second, "THREADSTACKSIZE", 0,
+                      std::numeric_limits<long>::max(), 0);
+      server.basesrvid = basesrvid;
+      server.scaleup = checked_get(srvconf.second, "SCALEUP", 0, 10000, 0);
+      server.cooldown = checked_get(srvconf.second, "COOLDOWN", 1, 86400,
+                                    default_cooldown);
     }
   }
+
+  auto services = m.services();
+  for (auto &svcconf : u.services) {
+    auto &service = services.at(m.make_service(svcconf.first));
+    service.options.linger =
+        checked_get(svcconf.second, "LINGER", 0, 1000000, 0);
+    service.options.cmplimit = checked_get(
+        svcconf.second, "CMPLIMIT", 0, std::numeric_limits<long>::max(), 0);
+    service.options.prio =
+        checked_get(svcconf.second, "PRIO", fux::ipc::min_priority,
+                    fux::ipc::max_priority, fux::ipc::default_priority);
+  }
 }
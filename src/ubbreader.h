@@ -46,6 +46,10 @@ class ubbreader : public basic_parser {
             config.groups.push_back(std::make_pair(object, ubbparams));
           } else if (section == "MACHINES") {
             config.machines.push_back(std::make_pair(object, ubbparams));
+          } else if (section == "SERVICES") {
+            config.services.push_back(std::make_pair(object, ubbparams));
+          } else if (section == "NETWORK") {
+            config.network.push_back(std::make_pair(object, ubbparams));
           }
         }
         object.clear();
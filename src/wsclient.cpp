@@ -0,0 +1,203 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <userlog.h>
+#include <xatmi.h>
+
+#include <cstring>
+#include <system_error>
+
+#include "client.h"
+#include "misc.h"
+#include "net.h"
+
+using fux::net::frame_kind;
+using fux::net::frame_header;
+
+// Workstation client, calls go to WSH over a single connection and WSH
+// sends them to server queues on its machine
+class wsclient : public client_base {
+ public:
+  wsclient(const std::string &wsnaddr) : blocktime_(0) {
+    fd_ = fux::net::connect(wsnaddr, 0);
+    if (fd_ == -1) {
+      throw std::system_error(errno, std::system_category(),
+                              "Failed to connect to " + wsnaddr);
+    }
+    // Handler tells the default block time first
+    if (!receive(rs, 10000) || rs.size() != sizeof(blocktime_)) {
+      close(fd_);
+      throw std::runtime_error("Workstation handler did not respond");
+    }
+    std::copy_n(rs.buf(), sizeof(blocktime_),
+                reinterpret_cast<char *>(&blocktime_));
+  }
+
+  ~wsclient() { close(fd_); }
+
+  int tpacall(int, const char *svc, char *data, long len,
+              long flags) override {
+    if (tptypes(data, nullptr, nullptr) == -1) {
+      return -1;
+    }
+
+    rq.set_data(data, len);
+    // Handler applies the service's priority unless it was set, relative
+    // priorities are relative to the default
+    rq->mtype = prio_set ? next_mtype(fux::ipc::default_priority) : 0;
+    checked_copy(svc, rq->servicename);
+    if (flags & TPNOREPLY) {
+      rq->replyq = -1;
+      rq->cd = 0;
+    } else {
+      // Any queue, handler replaces it with its own
+      rq->replyq = 0;
+      rq->cd = cds.allocate();
+      if (rq->cd == -1) {
+        return -1;
+      }
+    }
+    // Transactions are not supported for workstation clients
+    rq->flags = 0;
+    rq->gttid = fux::bad_gttid;
+
+    send(frame_kind::request, rq.buf(), rq.size());
+    fux::atmi::reset_tperrno();
+    return rq->cd;
+  }
+
+  int tpgetrply(int *cd, char **data, long *len, long flags) override {
+    if (data == nullptr) {
+      TPERROR(TPEINVAL, "data is null");
+      return -1;
+    }
+    if (tptypes(*data, nullptr, nullptr) == -1) {
+      return -1;
+    }
+
+    auto timeout = (flags & TPNOTIME) ? -1 : next_blocktime();
+    while (true) {
+      bool has_res = false;
+      if (flags & TPGETANY) {
+        int c = cds.any_buffered();
+        if (c != -1) {
+          rs.swap(cds.buffered(c));
+          has_res = true;
+        }
+      } else {
+        if (cds.check(*cd) == -1) {
+          return -1;
+        }
+        if (cds.is_buffered(*cd)) {
+          rs.swap(cds.buffered(*cd));
+          has_res = true;
+        }
+      }
+
+      if (!has_res) {
+        if (!receive(rs, timeout)) {
+          if (flags & TPGETANY) {
+            *cd = 0;
+          }
+          TPERROR(TPETIME, "No reply within timeout");
+          return -1;
+        }
+        if (rs.size() < sizeof(fux::ipc::msgmem) || rs->heapoff != -1) {
+          throw std::runtime_error("Invalid reply from workstation handler");
+        }
+        if (!(flags & TPGETANY) && *cd != rs->cd) {
+          cds.buffer(rs);
+          continue;
+        }
+      }
+      return complete(rs, cd, data, len);
+    }
+  }
+
+  // Requests are sent immediately
+  int tpflush(long flags) override {
+    if (flags != 0) {
+      TPERROR(TPEINVAL, "Invalid flags passed to tpflush(%ld)", flags);
+      return -1;
+    }
+    fux::atmi::reset_tperrno();
+    return 0;
+  }
+
+ protected:
+  long default_blocktime() override { return blocktime_; }
+
+ private:
+  void send(frame_kind kind, const char *data, size_t len) {
+    frame_header h{uint32_t(len), kind};
+    write_all(reinterpret_cast<char *>(&h), sizeof(h));
+    write_all(data, len);
+  }
+
+  void write_all(const char *data, size_t len) {
+    while (len > 0) {
+      ssize_t n = ::send(fd_, data, len, MSG_NOSIGNAL);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::system_error(errno, std::system_category(), "send failed");
+      }
+      data += n;
+      len -= n;
+    }
+  }
+
+  void read_all(char *data, size_t len) {
+    while (len > 0) {
+      ssize_t n = recv(fd_, data, len, 0);
+      if (n == 0) {
+        throw std::runtime_error("Workstation handler closed connection");
+      } else if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::system_error(errno, std::system_category(), "recv failed");
+      }
+      data += n;
+      len -= n;
+    }
+  }
+
+  // Waits up to msec milliseconds (forever if negative) for a frame,
+  // the frame is read as a whole once it starts
+  bool receive(fux::ipc::msg &m, long msec) {
+    pollfd pfd = {fd_, POLLIN, 0};
+    int n;
+    do {
+      n = poll(&pfd, 1, msec);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+      throw std::system_error(errno, std::system_category(), "poll failed");
+    } else if (n == 0) {
+      return false;
+    }
+
+    frame_header h;
+    read_all(reinterpret_cast<char *>(&h), sizeof(h));
+    if (h.len > fux::net::max_frame) {
+      throw std::runtime_error("Invalid frame from workstation handler");
+    }
+    m.resize(h.len);
+    read_all(m.buf(), h.len);
+    return true;
+  }
+
+  int fd_;
+  long blocktime_;
+  fux::ipc::msg rq;
+  fux::ipc::msg rs;
+};
+
+std::unique_ptr<client_base> make_wsclient(const std::string &wsnaddr) {
+  return std::make_unique<wsclient>(wsnaddr);
+}
@@ -2,6 +2,7 @@
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
 #include <catch.hpp>
+#include <random>
 #include <string>
 
 // for base64 prototypes
@@ -69,3 +70,89 @@ TEST_CASE("decode strings", "[base64]") {
   REQUIRE_THROWS_AS(b64decode("123"), std::logic_error);
   REQUIRE_THROWS_AS(b64decode("===="), std::logic_error);
 }
+
+static std::string random_bytes(std::mt19937 &gen, size_t n) {
+  std::uniform_int_distribution<int> dist(0, 255);
+  std::string s;
+  for (size_t i = 0; i < n; i++) {
+    s += static_cast<char>(dist(gen));
+  }
+  return s;
+}
+
+static const base64isa kernels[] = {base64isa::scalar, base64isa::sse41,
+                                     base64isa::avx2};
+
+TEST_CASE("SIMD kernels match scalar code", "[base64]") {
+  std::mt19937 gen(42);
+  for (auto isa : kernels) {
+    if (!base64supported(isa)) {
+      WARN("instruction set not supported, skipping");
+      continue;
+    }
+    for (size_t n = 0; n < 300; n++) {
+      auto input = random_bytes(gen, n);
+
+      std::string expected(base64chars(n), '\0');
+      std::string encoded(base64chars(n), '\0');
+      REQUIRE(base64encode(base64isa::scalar, input.data(), n, &expected[0],
+                           expected.size()) == expected.size());
+      REQUIRE(base64encode(isa, input.data(), n, &encoded[0],
+                           encoded.size()) == encoded.size());
+      REQUIRE(encoded == expected);
+
+      // Exact output size leaves the last blocks to scalar code
+      std::string decoded(n + 2, '\0');
+      REQUIRE(base64decode(isa, encoded.data(), encoded.size(), &decoded[0],
+                           decoded.size()) == n);
+      REQUIRE(decoded.substr(0, n) == input);
+
+      std::string roomy(n + 64, '\0');
+      REQUIRE(base64decode(isa, encoded.data(), encoded.size(), &roomy[0],
+                           roomy.size()) == n);
+      REQUIRE(roomy.substr(0, n) == input);
+    }
+  }
+}
+
+TEST_CASE("SIMD kernels reject invalid characters", "[base64]") {
+  std::string encoded(128, 'A');
+  std::string output(128, '\0');
+  for (auto isa : kernels) {
+    if (!base64supported(isa)) {
+      continue;
+    }
+    for (size_t i = 0; i < encoded.size(); i++) {
+      for (char c : {'=', '-', '_', ' ', '\x80', '\xff', '@', '[', '`', '{'}) {
+        if (c == '=' && i >= encoded.size() - 2) {
+          // padding
+          continue;
+        }
+        auto bad = encoded;
+        bad[i] = c;
+        REQUIRE_THROWS_AS(base64decode(isa, bad.data(), bad.size(),
+                                       &output[0], output.size()),
+                          std::invalid_argument);
+      }
+    }
+  }
+}
+
+TEST_CASE("streaming encoder", "[base64]") {
+  std::mt19937 gen(7);
+  auto input = random_bytes(gen, 1000);
+  std::string expected = b64encode(input);
+
+  for (size_t split : {0, 1, 2, 3, 4, 5, 100, 998, 999}) {
+    std::string output(base64chars(input.size()), '\0');
+    base64stream stream(&output[0], output.size());
+    stream.write(input.data(), split);
+    stream.write(input.data() + split, 1);
+    stream.write(input.data() + split + 1, 0);
+    if (split + 1 < input.size()) {
+      stream.write(input.data() + split + 1, input.size() - split - 1);
+    }
+    REQUIRE(stream.finish() == expected.size());
+    REQUIRE(output == expected);
+  }
+}
@@ -0,0 +1,114 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <catch.hpp>
+
+#include <fml32.h>
+#include <xatmi.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "misc.h"
+
+// Functions are generated by mkboolfn32 from tests/boolfns
+static auto expressions() {
+  std::vector<std::pair<std::string, std::string>> result;
+  std::ifstream fin("tests/boolfns");
+  REQUIRE(fin);
+  std::string line;
+  while (std::getline(fin, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    auto colon = line.find(':');
+    REQUIRE(colon != std::string::npos);
+    result.emplace_back(line.substr(0, colon), line.substr(colon + 2));
+  }
+  return result;
+}
+
+static FBFR32 *employee(const char *name, const char *firstname, char sex,
+                        short age, long dept, float salary, const char *empid,
+                        FLDLEN32 empidlen) {
+  auto fbfr = (FBFR32 *)tpalloc(DECONST("FML32"), DECONST("*"), 1024);
+  REQUIRE(fbfr != nullptr);
+  if (name != nullptr) {
+    REQUIRE(Fchg32(fbfr, Fldid32(DECONST("NAME")), 0, DECONST(name), 0) !=
+            -1);
+  }
+  if (firstname != nullptr) {
+    REQUIRE(Fchg32(fbfr, Fldid32(DECONST("FIRSTNAME")), 0, DECONST(firstname),
+                   0) != -1);
+  }
+  REQUIRE(Fchg32(fbfr, Fldid32(DECONST("SEX")), 0, &sex, 0) != -1);
+  REQUIRE(Fchg32(fbfr, Fldid32(DECONST("AGE")), 0,
+                 reinterpret_cast<char *>(&age), 0) != -1);
+  REQUIRE(Fchg32(fbfr, Fldid32(DECONST("DEPT")), 0,
+                 reinterpret_cast<char *>(&dept), 0) != -1);
+  REQUIRE(Fchg32(fbfr, Fldid32(DECONST("SALARY")), 0,
+                 reinterpret_cast<char *>(&salary), 0) != -1);
+  if (empid != nullptr) {
+    REQUIRE(Fchg32(fbfr, Fldid32(DECONST("EMPID")), 0, DECONST(empid),
+                   empidlen) != -1);
+  }
+  return fbfr;
+}
+
+TEST_CASE("generated boolean functions", "[fml32]") {
+  std::vector<FBFR32 *> fbfrs;
+  fbfrs.push_back((FBFR32 *)tpalloc(DECONST("FML32"), DECONST("*"), 1024));
+  fbfrs.push_back(
+      employee("John", "John", 'M', 30, 10, 1234.5, "E001", 5));
+  fbfrs.push_back(
+      employee("Smith", "Jane", 'F', 17, 20, 999.25, "E0001", 5));
+  fbfrs.push_back(employee("smith", "Jon", '1', 65, 11, 1000.5, "E01x", 4));
+  fbfrs.push_back(employee("Doe", "Joan", '\0', -5, -10, -0.5, "\0E1", 3));
+  fbfrs.push_back(employee(nullptr, "Ann", 'M', 64, 0, 0, "12", 2));
+
+  auto f = employee("John", "Jim", 'M', 45, 10, 1000.75, "A", 1);
+  REQUIRE(Fchg32(f, Fldid32(DECONST("NAME")), 1, DECONST("Smith"), 0) != -1);
+  long dept = 16;
+  REQUIRE(Fchg32(f, Fldid32(DECONST("DEPT")), 1,
+                 reinterpret_cast<char *>(&dept), 0) != -1);
+  REQUIRE(Fchg32(f, Fldid32(DECONST("VALUE")), 0, DECONST("000001"), 0) != -1);
+  fbfrs.push_back(f);
+
+  f = (FBFR32 *)tpalloc(DECONST("FML32"), DECONST("*"), 1024);
+  REQUIRE(Fchg32(f, Fldid32(DECONST("VALUE")), 0, DECONST("-2.5"), 0) != -1);
+  fbfrs.push_back(f);
+
+  for (const auto &e : expressions()) {
+    INFO(e.first << ": " << e.second);
+    auto fn = Fboolfn32(e.first.c_str());
+    REQUIRE(fn != nullptr);
+    char *tree;
+    REQUIRE((tree = Fboolco32(DECONST(e.second.c_str()))) != nullptr);
+    for (size_t i = 0; i < fbfrs.size(); i++) {
+      INFO("buffer " << i);
+      REQUIRE(fn(fbfrs[i]) == Fboolev32(fbfrs[i], tree));
+    }
+    free(tree);
+  }
+
+  for (auto fbfr : fbfrs) {
+    tpfree(reinterpret_cast<char *>(fbfr));
+  }
+}
+
+TEST_CASE("generated boolean function registry", "[fml32]") {
+  REQUIRE(Fboolfn32("no_such_function") == nullptr);
+  REQUIRE(Ferror32 == FBADNAME);
+  REQUIRE(Fboolfn32(nullptr) == nullptr);
+  REQUIRE(Ferror32 == FEINVAL);
+  REQUIRE(Fboolreg32("no_function", nullptr) == -1);
+  REQUIRE(Ferror32 == FEINVAL);
+
+  auto fn = Fboolfn32("dept_eq");
+  REQUIRE(fn != nullptr);
+  REQUIRE(Fboolreg32("dept_eq_alias", fn) == 0);
+  REQUIRE(Fboolfn32("dept_eq_alias") == fn);
+}
@@ -0,0 +1,131 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <catch.hpp>
+
+#include <fml32.h>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../src/fieldtbl32.h"
+#include "../src/fieldtbl32bin.h"
+#include "misc.h"
+
+using fux::fml32::fldtbl32_build;
+using fux::fml32::fldtbl32_view;
+
+TEST_CASE("compiled field table lookup", "[fml32]") {
+  std::vector<std::pair<std::string, FLDID32>> fields;
+  for (int i = 1; i <= 10000; i++) {
+    fields.emplace_back("FIELD_" + std::to_string(i),
+                        Fmkfldid32(i % 2 == 0 ? FLD_LONG : FLD_STRING, i));
+  }
+  auto data = fldtbl32_build(fields);
+  fldtbl32_view view(data.data(), data.size());
+
+  for (auto &f : fields) {
+    REQUIRE(view.fldid(f.first) == f.second);
+    REQUIRE(view.name(f.second) == f.first);
+  }
+  REQUIRE(view.fldid("FIELD_0") == BADFLDID);
+  REQUIRE(view.fldid("FIELD_10001") == BADFLDID);
+  REQUIRE(view.fldid("") == BADFLDID);
+  REQUIRE(view.name(Fmkfldid32(FLD_LONG, 10001)) == nullptr);
+  REQUIRE(view.name(Fmkfldid32(FLD_LONG, 1)) == nullptr);
+}
+
+TEST_CASE("compiled field table duplicates", "[fml32]") {
+  auto data = fldtbl32_build({{"A", Fmkfldid32(FLD_LONG, 1)},
+                              {"B", Fmkfldid32(FLD_LONG, 1)},
+                              {"A", Fmkfldid32(FLD_LONG, 2)}});
+  fldtbl32_view view(data.data(), data.size());
+  REQUIRE(view.fldid("A") == Fmkfldid32(FLD_LONG, 1));
+  REQUIRE(view.fldid("B") == Fmkfldid32(FLD_LONG, 1));
+  REQUIRE(view.name(Fmkfldid32(FLD_LONG, 1)) == std::string("A"));
+  REQUIRE(view.name(Fmkfldid32(FLD_LONG, 2)) == std::string("A"));
+
+  auto empty = fldtbl32_build({});
+  fldtbl32_view empty_view(empty.data(), empty.size());
+  REQUIRE(empty_view.fldid("A") == BADFLDID);
+  REQUIRE(empty_view.name(Fmkfldid32(FLD_LONG, 1)) == nullptr);
+}
+
+TEST_CASE("compiled field table validation", "[fml32]") {
+  auto data = fldtbl32_build({{"A", Fmkfldid32(FLD_LONG, 1)}});
+  REQUIRE_THROWS(fldtbl32_view(data.data(), 10));
+  REQUIRE_THROWS(fldtbl32_view(data.data(), data.size() - 1));
+  data[0] = 'X';
+  REQUIRE_THROWS(fldtbl32_view(data.data(), data.size()));
+}
+
+TEST_CASE("compiled field table file", "[fml32]") {
+  std::ifstream fin("tests/fields");
+  REQUIRE(fin);
+  field_table_parser p(fin);
+  p.parse();
+  std::vector<std::pair<std::string, FLDID32>> fields;
+  for (auto &f : p.fields()) {
+    fields.emplace_back(f.name, f.fieldid);
+  }
+  auto data = fldtbl32_build(fields);
+
+  tempfile tbl(__LINE__);
+  REQUIRE(fwrite(data.data(), 1, data.size(), tbl.f) == data.size());
+  fclose(tbl.f);
+
+  std::string fieldtbls32 = getenv("FIELDTBLS32");
+  std::string fldtbldir32 = getenv("FLDTBLDIR32");
+  setenv("FIELDTBLS32", tbl.name.c_str(), 1);
+  setenv("FLDTBLDIR32", ".", 1);
+  Fidnm_unload32();
+  Fnmid_unload32();
+
+  for (auto &f : p.fields()) {
+    REQUIRE(Fldid32(DECONST(f.name.c_str())) == f.fieldid);
+    REQUIRE(Fname32(f.fieldid) == f.name);
+  }
+  REQUIRE(Fldid32(DECONST("NO_SUCH_FIELD")) == BADFLDID);
+  REQUIRE(Ferror32 == FBADNAME);
+  REQUIRE(Fname32(Fmkfldid32(FLD_LONG, 999)) == nullptr);
+  REQUIRE(Ferror32 == FBADFLD);
+
+  // Unchanged file is mapped once and reused after unloading
+  auto name = Fname32(p.fields().front().fieldid);
+  Fidnm_unload32();
+  REQUIRE(Fname32(p.fields().front().fieldid) == name);
+
+  setenv("FIELDTBLS32", fieldtbls32.c_str(), 1);
+  setenv("FLDTBLDIR32", fldtbldir32.c_str(), 1);
+  Fidnm_unload32();
+  Fnmid_unload32();
+  REQUIRE(Fldid32(DECONST("FCHAR")) == Fmkfldid32(FLD_CHAR, 11));
+}
+
+TEST_CASE("corrupt compiled field table file", "[fml32]") {
+  std::vector<std::pair<std::string, FLDID32>> fields = {
+      {"FIELD", Fmkfldid32(FLD_LONG, 1)}};
+  auto data = fldtbl32_build(fields);
+
+  tempfile tbl(__LINE__);
+  REQUIRE(fwrite(data.data(), 1, data.size() - 1, tbl.f) == data.size() - 1);
+  fclose(tbl.f);
+
+  std::string fieldtbls32 = getenv("FIELDTBLS32");
+  std::string fldtbldir32 = getenv("FLDTBLDIR32");
+  setenv("FIELDTBLS32", tbl.name.c_str(), 1);
+  setenv("FLDTBLDIR32", ".", 1);
+  Fidnm_unload32();
+  Fnmid_unload32();
+
+  REQUIRE(Fldid32(DECONST("FIELD")) == BADFLDID);
+  REQUIRE(Ferror32 == FFTSYNTAX);
+  REQUIRE(Fname32(Fmkfldid32(FLD_LONG, 1)) == nullptr);
+  REQUIRE(Ferror32 == FFTSYNTAX);
+
+  setenv("FIELDTBLS32", fieldtbls32.c_str(), 1);
+  setenv("FLDTBLDIR32", fldtbldir32.c_str(), 1);
+  Fidnm_unload32();
+  Fnmid_unload32();
+  REQUIRE(Fldid32(DECONST("FCHAR")) == Fmkfldid32(FLD_CHAR, 11));
+}
@@ -0,0 +1,74 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <catch.hpp>
+
+#include <fml32.h>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include <fux.h>
+#include "fields.hpp"
+#include "misc.h"
+
+static_assert(std::is_same<decltype(fld_long)::type, long>::value);
+static_assert(std::is_same<decltype(fld_string)::type, std::string_view>::value);
+static_assert(std::is_same<decltype(fld_carray)::type, fux::carray_view>::value);
+static_assert(fld_short.id == ((FLD_SHORT << 24) | 100));
+
+TEST_CASE("typed field descriptors", "[fux]") {
+  REQUIRE(FLDID32(NAME) == Fldid32(DECONST("NAME")));
+  REQUIRE(FLDID32(fld_carray) == Fldid32(DECONST("fld_carray")));
+  REQUIRE(Fname32(DEPT) == std::string("DEPT"));
+}
+
+TEST_CASE("typed field access", "[fux]") {
+  fux::fml32buf buf;
+
+  buf.put(fld_short, 0, 1)
+      .put(fld_long, 0, 2)
+      .put(fld_char, 0, 'c')
+      .put(fld_float, 0, 4.5)
+      .put(fld_double, 0, 5.25)
+      .put(fld_string, 0, "foo")
+      .put(fld_string, 1, std::string("bar"))
+      .put(fld_string, 2, std::string_view("bazooka", 3))
+      .put(fld_carray, 0, fux::carray_view("a\0b", 3));
+
+  REQUIRE(buf.get(fld_short, 0) == 1);
+  REQUIRE(buf.get(fld_long, 0) == 2);
+  REQUIRE(buf.get<long>(fld_long, 0) == 2);
+  REQUIRE(buf.get(fld_char, 0) == 'c');
+  REQUIRE(buf.get(fld_float, 0) == 4.5);
+  REQUIRE(buf.get(fld_double, 0) == 5.25);
+  REQUIRE(buf.get(fld_string, 0) == "foo");
+  REQUIRE(buf.get(fld_string, 1) == "bar");
+  REQUIRE(buf.get(fld_string, 2) == "baz");
+  REQUIRE(buf.get(fld_carray, 0) == fux::carray_view("a\0b", 3));
+  REQUIRE(buf.get(fld_carray, 0).size() == 3);
+
+  // Zero-copy, points into the buffer
+  auto s = buf.get(fld_string, 0);
+  REQUIRE(s.data() == Ffind32(buf.ptr(), fld_string, 0, nullptr));
+
+  REQUIRE(buf.get(fld_long, 1, 42) == 42);
+  REQUIRE(buf.get(fld_string, 3, "none") == "none");
+  REQUIRE_THROWS_AS(buf.get(fld_long, 1), fux::fml32buf_error);
+
+  // Untyped API works with descriptors
+  REQUIRE(buf.get<std::string>(FLDID32(fld_long), 0) == "2");
+  REQUIRE(Foccur32(buf.ptr(), fld_string) == 3);
+}
+
+TEST_CASE("typed embedded buffer", "[fux]") {
+  fux::fml32buf inner;
+  inner.put(NAME, 0, "John");
+
+  fux::fml32buf buf;
+  buf.put(ARGS, 0, inner.ptr());
+
+  fux::fml32buf copy;
+  Fcpy32(copy.ptr(), buf.get(ARGS, 0));
+  REQUIRE(copy.get(NAME, 0) == "John");
+}
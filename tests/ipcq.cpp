@@ -3,9 +3,15 @@
 
 #include <algorithm>
 #include <catch.hpp>
+#include <chrono>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
+#include <thread>
 
+#include <xatmi.h>
+
+#include "../src/batch.h"
 #include "../src/ipc.h"
 
 struct queue_fixture {
@@ -48,6 +54,7 @@ TEST_CASE_METHOD(queue_fixture, "send multiple and receive by id", "[ipc]") {
   }
 
   REQUIRE(i > 2);
+  REQUIRE(fux::ipc::qlength(msqid) == size_t(i));
 
   while (i > 0) {
     fux::ipc::qrecv(msqid, rs, i, 0);
@@ -56,8 +63,29 @@ TEST_CASE_METHOD(queue_fixture, "send multiple and receive by id", "[ipc]") {
   }
 }
 
+TEST_CASE_METHOD(queue_fixture, "higher priorities are received first",
+                 "[ipc]") {
+  for (long prio : {10, 50, 90, 50}) {
+    rq->mtype = fux::ipc::priority_mtype(prio);
+    rq->cd = prio;
+    fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  }
+  // Admin messages come after all requests
+  rq->mtype = std::numeric_limits<long>::max();
+  rq->cd = 0;
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+
+  for (long prio : {90, 50, 50, 10}) {
+    fux::ipc::qrecv(msqid, rs, std::numeric_limits<long>::min(), 0);
+    REQUIRE(fux::ipc::mtype_priority(rs->mtype) == prio);
+    REQUIRE(rs->cd == prio);
+  }
+  fux::ipc::qrecv(msqid, rs, std::numeric_limits<long>::min(), 0);
+  REQUIRE(rs->cd == 0);
+}
+
 TEST_CASE_METHOD(queue_fixture, "send and receive file message", "[ipc]") {
-  rq.resize(10240);
+  rq.resize(fux::ipc::qmsgmax() + 2048);
   rq->mtype = 1;
   std::copy_n("ServiceName", sizeof("ServiceName"), rq->servicename);
   rq->flags = 1;
@@ -73,3 +101,310 @@ TEST_CASE_METHOD(queue_fixture, "send and receive file message", "[ipc]") {
   REQUIRE(rs->flags == 1);
   REQUIRE(rs->cd == 2);
 }
+
+TEST_CASE_METHOD(queue_fixture, "timed send to full queue", "[ipc]") {
+  rq.resize(512);
+  rq->mtype = 1;
+  while (fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noblock)) {
+  }
+
+  SECTION("times out") {
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE(!fux::ipc::qsend(msqid, rq, 50, fux::ipc::flags::noflags));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    REQUIRE(elapsed >= std::chrono::milliseconds(50));
+    // Only that it does not hang, loaded machines are slow to wake up
+    REQUIRE(elapsed < std::chrono::milliseconds(2000));
+  }
+
+  SECTION("without timeout fails at once") {
+    REQUIRE(!fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags));
+  }
+
+  SECTION("wakes up when space frees up") {
+    std::thread t([this] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      fux::ipc::msg m;
+      fux::ipc::qrecv(msqid, m, 0, 0);
+    });
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE(fux::ipc::qsend(msqid, rq, 5000, fux::ipc::flags::noflags));
+    REQUIRE(std::chrono::steady_clock::now() - start <
+            std::chrono::milliseconds(2500));
+    t.join();
+  }
+}
+
+TEST_CASE_METHOD(queue_fixture, "timed receive", "[ipc]") {
+  SECTION("times out") {
+    auto start = std::chrono::steady_clock::now();
+    try {
+      fux::ipc::qrecv(msqid, rs, 0, 0, 50);
+      FAIL("message received");
+    } catch (const std::system_error &e) {
+      REQUIRE(e.code().value() == ENOMSG);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    REQUIRE(elapsed >= std::chrono::milliseconds(50));
+    // Only that it does not hang, loaded machines are slow to wake up
+    REQUIRE(elapsed < std::chrono::milliseconds(2000));
+  }
+
+  SECTION("wakes up when message arrives") {
+    std::thread t([this] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      rq->cd = 3;
+      fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+    });
+    fux::ipc::qrecv(msqid, rs, 0, 0, 5000);
+    REQUIRE(rs->cd == 3);
+    t.join();
+  }
+}
+
+TEST_CASE_METHOD(queue_fixture, "message buffers are reused", "[ipc]") {
+  rq.resize_data(100);
+  rq->cd = 1;
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  REQUIRE(rs.size_data() == 100);
+  REQUIRE(rs.capacity() >= fux::ipc::qmsgmax());
+
+  auto buf = rs.buf();
+  rq.resize_data(1000);
+  rq->cd = 2;
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  REQUIRE(rs.buf() == buf);
+  REQUIRE(rs.size_data() == 1000);
+  REQUIRE(rs->cd == 2);
+
+  // Shrinking keeps the header
+  rs.resize_data(0);
+  rs.resize_data(10);
+  REQUIRE(rs.buf() == buf);
+  REQUIRE(rs->cd == 2);
+}
+
+TEST_CASE_METHOD(queue_fixture, "compact header", "[ipc]") {
+  rq.resize_data(5);
+  std::copy_n("data", 5, rq->data);
+  std::copy_n("SVC", sizeof("SVC"), rq->servicename);
+  rq->mtype = 7;
+  rq->cd = 3;
+  rq->replyq = 4;
+  rq->flags = TPNOREPLY;
+  rq->gttid = fux::bad_gttid;
+  rq->rval = TPFAIL;
+  rq->rcode = -6;
+
+  SECTION("requests with service slot drop the name") {
+    rq->service = 8;
+    fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+
+    char raw[1024];
+    REQUIRE(msgrcv(msqid, raw, sizeof(raw) - sizeof(long), 0, IPC_NOWAIT) ==
+            sizeof(fux::ipc::msgcompact) - sizeof(long) + 5);
+    REQUIRE(reinterpret_cast<fux::ipc::msgcompact *>(raw)->version ==
+            fux::ipc::compact_version);
+    REQUIRE(std::string(raw + sizeof(fux::ipc::msgcompact)) == "data");
+    // The header was written over the sent message and put back
+    REQUIRE(rq->heapoff == -1);
+    REQUIRE(rq->rawlen == 0);
+    REQUIRE(rq->rcode == -6);
+    REQUIRE(std::string(rq->data) == "data");
+    REQUIRE(msgsnd(msqid, raw,
+                   sizeof(fux::ipc::msgcompact) - sizeof(long) + 5, 0) == 0);
+
+    fux::ipc::qrecv(msqid, rs, 0, 0);
+    REQUIRE(rs->ttype == fux::ipc::queue);
+    REQUIRE(rs->servicename == std::string());
+    REQUIRE(rs->service == 8);
+    REQUIRE(rs->rcode == -6);
+  }
+
+  SECTION("name is kept without service slot") {
+    rq->service = -1;
+    fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+    fux::ipc::qrecv(msqid, rs, 0, 0);
+    REQUIRE(rs->servicename == std::string("SVC"));
+    REQUIRE(rs->service == -1);
+  }
+
+  SECTION("fields that do not fit need the full header") {
+    rq->service = 8;
+    rq->rcode = std::numeric_limits<long>::max();
+    fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+    fux::ipc::qrecv(msqid, rs, 0, 0);
+    REQUIRE(rs->servicename == std::string("SVC"));
+    REQUIRE(rs->rcode == std::numeric_limits<long>::max());
+  }
+
+  SECTION("transactions need the full header") {
+    rq->service = 8;
+    rq->gttid = 5;
+    fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+    fux::ipc::qrecv(msqid, rs, 0, 0);
+    REQUIRE(rs->servicename == std::string("SVC"));
+    REQUIRE(rs->gttid == 5);
+    rs->gttid = fux::bad_gttid;
+  }
+
+  REQUIRE(rs.size_data() == 5);
+  REQUIRE(rs->data == std::string("data"));
+  REQUIRE(rs->mtype == 7);
+  REQUIRE(rs->cd == 3);
+  REQUIRE(rs->replyq == 4);
+  REQUIRE(rs->flags == TPNOREPLY);
+  REQUIRE(rs->gttid == fux::bad_gttid);
+  REQUIRE(rs->rval == TPFAIL);
+  REQUIRE(rs->heapoff == -1);
+  REQUIRE(rs->rawlen == 0);
+}
+
+TEST_CASE_METHOD(queue_fixture, "send and receive batch", "[ipc]") {
+  fux::ipc::batch b;
+  rq.resize_data(100);
+  int n = 0;
+  while (true) {
+    rq->cd = n + 1;
+    if (!b.add(msqid, rq)) {
+      break;
+    }
+    n++;
+  }
+  REQUIRE(n > 2);
+  REQUIRE(b.frames() == size_t(n));
+  rq->cat = fux::ipc::admin;
+  REQUIRE(!b.add(msqid, rq));
+
+  REQUIRE(b.send(msqid, 0, fux::ipc::flags::noflags));
+  REQUIRE(b.frames() == 0);
+
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  REQUIRE(rs->ttype == fux::ipc::frames);
+  fux::ipc::msg m;
+  size_t pos = 0;
+  for (int i = 1; i <= n; i++) {
+    REQUIRE(fux::ipc::qpeek(rs, pos) != nullptr);
+    REQUIRE(fux::ipc::qpeek(rs, pos)->cd == i);
+    REQUIRE(fux::ipc::qnext(rs, pos, m));
+    REQUIRE(m->cd == i);
+    REQUIRE(m.size_data() == 100);
+  }
+  REQUIRE(fux::ipc::qpeek(rs, pos) == nullptr);
+  REQUIRE(!fux::ipc::qnext(rs, pos, m));
+  REQUIRE(pos == 0);
+}
+
+TEST_CASE_METHOD(queue_fixture, "batch of replies to different calls",
+                 "[ipc]") {
+  fux::ipc::batch requests;
+  fux::ipc::batch replies(true);
+  rq.resize_data(10);
+  for (int cd = 1; cd <= 3; cd++) {
+    rq->mtype = cd;
+    rq->cd = cd;
+    REQUIRE(replies.add(msqid, rq));
+    REQUIRE(requests.add(msqid, rq) == (cd == 1));
+  }
+  REQUIRE(replies.frames() == 3);
+  REQUIRE(requests.frames() == 1);
+
+  REQUIRE(replies.send(msqid, 0, fux::ipc::flags::noflags));
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  fux::ipc::msg m;
+  size_t pos = 0;
+  for (int cd = 1; cd <= 3; cd++) {
+    REQUIRE(fux::ipc::qnext(rs, pos, m));
+    REQUIRE(m->mtype == cd);
+    REQUIRE(m->cd == cd);
+  }
+  REQUIRE(!fux::ipc::qnext(rs, pos, m));
+}
+
+TEST_CASE_METHOD(queue_fixture, "replies to a client go in one message",
+                 "[ipc]") {
+  fux::ipc::batcher b(true);
+  rq.resize_data(10);
+  for (int cd = 1; cd <= 5; cd++) {
+    rq->mtype = cd;
+    rq->cd = cd;
+    REQUIRE(b.add(msqid, rq, std::chrono::microseconds(10000000)));
+  }
+  REQUIRE(fux::ipc::qlength(msqid) == 0);
+  b.flush(msqid);
+  REQUIRE(fux::ipc::qlength(msqid) == 1);
+
+  fux::ipc::qrecv(msqid, rs, 0, IPC_NOWAIT);
+  REQUIRE(rs->ttype == fux::ipc::frames);
+  fux::ipc::msg m;
+  size_t pos = 0;
+  int n = 0;
+  while (fux::ipc::qnext(rs, pos, m)) {
+    REQUIRE(m->cd == ++n);
+  }
+  REQUIRE(n == 5);
+}
+
+// The batch is cleared right after it is sent and may already be received
+static void wait_sent(fux::ipc::batcher &b) {
+  auto start = std::chrono::steady_clock::now();
+  while (!b.empty() && std::chrono::steady_clock::now() - start <
+                           std::chrono::seconds(1)) {
+    std::this_thread::yield();
+  }
+  REQUIRE(b.empty());
+}
+
+TEST_CASE_METHOD(queue_fixture, "batches are sent after linger", "[ipc]") {
+  fux::ipc::batcher b;
+  rq.resize_data(10);
+  rq->cd = 1;
+  REQUIRE(b.add(msqid, rq, std::chrono::microseconds(20000)));
+  rq->cd = 2;
+  REQUIRE(b.add(msqid, rq, std::chrono::microseconds(20000)));
+  REQUIRE(!b.empty());
+  REQUIRE_THROWS_AS(fux::ipc::qrecv(msqid, rs, 0, IPC_NOWAIT),
+                    std::system_error);
+
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  wait_sent(b);
+  fux::ipc::msg m;
+  size_t pos = 0;
+  REQUIRE(fux::ipc::qnext(rs, pos, m));
+  REQUIRE(m->cd == 1);
+  REQUIRE(fux::ipc::qnext(rs, pos, m));
+  REQUIRE(m->cd == 2);
+  REQUIRE(!fux::ipc::qnext(rs, pos, m));
+
+  rq->cd = 3;
+  REQUIRE(b.add(msqid, rq, std::chrono::microseconds(10000000)));
+  b.flush();
+  fux::ipc::qrecv(msqid, rs, 0, IPC_NOWAIT);
+  REQUIRE(fux::ipc::qnext(rs, pos, m));
+  REQUIRE(m->cd == 3);
+}
+
+TEST_CASE_METHOD(queue_fixture, "lingering batch waits for room", "[ipc]") {
+  fux::ipc::batcher b;
+  rq.resize_data(10);
+  rq->cd = 0;
+  size_t queued = 0;
+  while (fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noblock)) {
+    queued++;
+  }
+
+  rq->cd = 1;
+  REQUIRE(b.add(msqid, rq, std::chrono::microseconds(1000)));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  REQUIRE(!b.empty());
+
+  for (size_t i = 0; i < queued; i++) {
+    fux::ipc::qrecv(msqid, rs, 0, IPC_NOWAIT);
+    REQUIRE(rs->cd == 0);
+  }
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  REQUIRE(rs->ttype == fux::ipc::frames);
+  wait_sent(b);
+}
@@ -0,0 +1,198 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <catch.hpp>
+
+#include <fml32.h>
+#include <sys/msg.h>
+#include <xatmi.h>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "../src/ipc.h"
+#include "../src/misc.h"
+#include "misc.h"
+
+static std::string roundtrip(const std::string &s) {
+  std::string packed;
+  packed.resize(s.size() + s.size() / 255 + 16);
+  auto n = lzcompress(s.data(), s.size(), &packed[0], packed.size());
+  REQUIRE(n > 0);
+  std::string result;
+  result.resize(s.size());
+  REQUIRE(lzdecompress(packed.data(), n, &result[0], result.size()) ==
+          s.size());
+  return result;
+}
+
+// Mostly text with some numbers, like documents returned by services
+static std::string document(size_t size, unsigned seed) {
+  static const char *words[] = {
+      "invoice", "customer", "account", "balance", "payment", "due",
+      "total",   "amount",   "the",     "of",      "and",     "address",
+      "street",  "number",   "date",    "status",  "pending", "approved"};
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<size_t> word(0, std::size(words) - 1);
+  std::uniform_int_distribution<int> digits(0, 99999);
+  std::string s;
+  while (s.size() < size) {
+    s += words[word(gen)];
+    s += (gen() % 8 == 0) ? " " + std::to_string(digits(gen)) + "\n" : " ";
+  }
+  s.resize(size);
+  return s;
+}
+
+static std::string random_bytes(size_t size, unsigned seed) {
+  std::mt19937 gen(seed);
+  std::string s;
+  for (size_t i = 0; i < size; i++) {
+    s += char(gen());
+  }
+  return s;
+}
+
+TEST_CASE("lz round trip", "[lz]") {
+  REQUIRE(roundtrip("").empty());
+  REQUIRE(roundtrip("a") == "a");
+  REQUIRE(roundtrip("abcdefghijklmnopqrstuvwxyz") ==
+          "abcdefghijklmnopqrstuvwxyz");
+
+  std::string runs(100000, 'x');
+  REQUIRE(roundtrip(runs) == runs);
+  runs += "abcabcabcabcabcabcabcabcabcabc" + std::string(300, 'y');
+  REQUIRE(roundtrip(runs) == runs);
+
+  auto doc = document(300000, 1);
+  REQUIRE(roundtrip(doc) == doc);
+  auto bytes = random_bytes(10000, 2);
+  REQUIRE(roundtrip(bytes) == bytes);
+}
+
+TEST_CASE("lz compresses text", "[lz]") {
+  auto doc = document(100000, 3);
+  std::string packed(doc.size(), '\0');
+  auto n = lzcompress(doc.data(), doc.size(), &packed[0], packed.size());
+  REQUIRE(n > 0);
+  REQUIRE(n < doc.size() / 2);
+
+  // Does not fit
+  auto bytes = random_bytes(10000, 4);
+  REQUIRE(lzcompress(bytes.data(), bytes.size(), &packed[0],
+                     bytes.size() - 100) == 0);
+}
+
+TEST_CASE("lz rejects invalid input", "[lz]") {
+  auto doc = document(10000, 5);
+  std::string packed(doc.size(), '\0');
+  auto n = lzcompress(doc.data(), doc.size(), &packed[0], packed.size());
+  std::string out(doc.size(), '\0');
+
+  REQUIRE_THROWS_AS(lzdecompress(packed.data(), n, &out[0], out.size() - 1),
+                    std::range_error);
+  // Match before the start of output
+  const char bad[] = {0x00, 0x10, 0x00};
+  REQUIRE_THROWS_AS(lzdecompress(bad, sizeof(bad), &out[0], out.size()),
+                    std::invalid_argument);
+  const char truncated[] = {char(0xf0)};
+  REQUIRE_THROWS_AS(
+      lzdecompress(truncated, sizeof(truncated), &out[0], out.size()),
+      std::invalid_argument);
+}
+
+static FBFR32 *document_fml32(size_t size, unsigned seed) {
+  auto fld_string = Fmkfldid32(FLD_STRING, 105);
+  auto fld_long = Fmkfldid32(FLD_LONG, 101);
+  auto fbfr = reinterpret_cast<FBFR32 *>(
+      tpalloc(DECONST("FML32"), nullptr, size + size / 4 + 1024));
+  auto text = document(size, seed);
+  for (size_t pos = 0, i = 0; pos < text.size(); pos += 200, i++) {
+    auto line = text.substr(pos, 200);
+    REQUIRE(Fadd32(fbfr, fld_string, DECONST(line.c_str()), 0) != -1);
+    long n = i;
+    REQUIRE(Fadd32(fbfr, fld_long, reinterpret_cast<char *>(&n), 0) != -1);
+  }
+  return fbfr;
+}
+
+TEST_CASE("compressed messages", "[lz]") {
+  auto fbfr = document_fml32(50000, 6);
+  auto msqid = fux::ipc::qcreate();
+  fux::ipc::msg rq, rs;
+
+  rq.set_data(reinterpret_cast<char *>(fbfr), 0, 100000000);
+  REQUIRE(rq->rawlen == 0);
+  auto plain = rq.size();
+
+  rq.set_data(reinterpret_cast<char *>(fbfr), 0, 1024);
+  REQUIRE(rq->rawlen > 0);
+  REQUIRE(rq.size_data() == size_t(rq->rawlen));
+  REQUIRE(rq.size() < plain / 2);
+
+  REQUIRE(fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags));
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  auto out = tpalloc(DECONST("FML32"), nullptr, 1024);
+  rs.get_data(&out);
+  auto received = reinterpret_cast<FBFR32 *>(out);
+  auto fld_string = Fmkfldid32(FLD_STRING, 105);
+  REQUIRE(Foccur32(received, fld_string) == Foccur32(fbfr, fld_string));
+  for (auto oc : {0, 100, Foccur32(fbfr, fld_string) - 1}) {
+    REQUIRE(strcmp(Ffind32(received, fld_string, oc, nullptr),
+                   Ffind32(fbfr, fld_string, oc, nullptr)) == 0);
+  }
+
+  tpfree(out);
+  tpfree(reinterpret_cast<char *>(fbfr));
+  fux::ipc::qdelete(msqid);
+}
+
+// Bytes moved versus CPU spent, run with: tests/lz "[benchmark]"
+TEST_CASE("compression benchmark", "[.][benchmark]") {
+  using clock = std::chrono::steady_clock;
+  for (size_t size : {200 * 1024, 1024 * 1024, 5 * 1024 * 1024}) {
+    auto fbfr = document_fml32(size, 7);
+    fux::ipc::msg plain, packed;
+    const int rounds = 10;
+
+    auto start = clock::now();
+    for (int i = 0; i < rounds; i++) {
+      plain.set_data(reinterpret_cast<char *>(fbfr), 0);
+    }
+    auto exported = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < rounds; i++) {
+      packed.set_data(reinterpret_cast<char *>(fbfr), 0, 1);
+    }
+    auto compressed = clock::now() - start;
+
+    auto out = tpalloc(DECONST("FML32"), nullptr, 1024);
+    start = clock::now();
+    for (int i = 0; i < rounds; i++) {
+      packed.get_data(&out);
+    }
+    auto decompressed = clock::now() - start;
+    start = clock::now();
+    for (int i = 0; i < rounds; i++) {
+      plain.get_data(&out);
+    }
+    auto imported = clock::now() - start;
+
+    auto usec = [&](clock::duration d) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(d).count() /
+             rounds;
+    };
+    std::cout << "FML32 " << size / 1024 << " KiB: " << plain.size()
+              << " bytes plain, " << packed.size() << " compressed; send "
+              << usec(exported) << " us plain, " << usec(compressed)
+              << " us compressed; receive " << usec(imported)
+              << " us plain, " << usec(decompressed) << " us compressed"
+              << std::endl;
+
+    tpfree(out);
+    tpfree(reinterpret_cast<char *>(fbfr));
+  }
+}
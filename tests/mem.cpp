@@ -0,0 +1,170 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <catch.hpp>
+
+#include <fml32.h>
+#include <xatmi.h>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "../src/misc.h"
+#include "misc.h"
+
+static char *alloc(long size) {
+  return tpalloc(DECONST("CARRAY"), DECONST("*"), size);
+}
+
+TEST_CASE("pooled buffers are reused", "[mem]") {
+  auto buf = alloc(100);
+  REQUIRE(buf != nullptr);
+  tpfree(buf);
+
+  auto before = fux::mem::stats();
+  auto again = alloc(100);
+  REQUIRE(again == buf);
+  auto after = fux::mem::stats();
+  REQUIRE(after.allocs == before.allocs + 1);
+  REQUIRE(after.cache_hits == before.cache_hits + 1);
+  REQUIRE(after.system_allocs == before.system_allocs);
+  tpfree(again);
+}
+
+TEST_CASE("tprealloc grows in place within size class", "[mem]") {
+  auto buf = alloc(300);
+  memset(buf, 'x', 300);
+
+  auto before = fux::mem::stats();
+  auto same = tprealloc(buf, 400);
+  REQUIRE(same == buf);
+  REQUIRE(fux::mem::stats().inplace_grows == before.inplace_grows + 1);
+
+  auto bigger = tprealloc(same, 64 * 1024);
+  REQUIRE(bigger != nullptr);
+  for (int i = 0; i < 300; i++) {
+    REQUIRE(bigger[i] == 'x');
+  }
+
+  auto huge = tprealloc(bigger, 4 * 1024 * 1024);
+  REQUIRE(huge != nullptr);
+  REQUIRE(huge[0] == 'x');
+  REQUIRE(huge[299] == 'x');
+  huge[4 * 1024 * 1024 - 1] = 'y';
+
+  auto small = tprealloc(huge, 10);
+  REQUIRE(small != nullptr);
+  REQUIRE(small[9] == 'x');
+  tpfree(small);
+}
+
+TEST_CASE("pooled buffers keep type and size", "[mem]") {
+  auto buf = tpalloc(DECONST("STRING"), nullptr, 10);
+  strcpy(buf, "hello");
+  buf = tprealloc(buf, 2000);
+  REQUIRE(strcmp(buf, "hello") == 0);
+
+  char type[8], subtype[16];
+  REQUIRE(tptypes(buf, type, subtype) == 0);
+  REQUIRE(strcmp(type, "STRING") == 0);
+  tpfree(buf);
+}
+
+TEST_CASE("pooled buffers across threads", "[mem]") {
+  constexpr int n = 1000;
+  std::vector<char *> bufs(n);
+  std::thread producer([&] {
+    for (int i = 0; i < n; i++) {
+      bufs[i] = alloc(128 + i);
+      memset(bufs[i], i & 0xff, 128 + i);
+    }
+  });
+  producer.join();
+  for (int i = 0; i < n; i++) {
+    REQUIRE(static_cast<unsigned char>(bufs[i][127 + i]) == (i & 0xff));
+  }
+
+  std::thread consumer([&] {
+    for (int i = 0; i < n; i++) {
+      tpfree(bufs[i]);
+    }
+  });
+  consumer.join();
+
+  auto s = fux::mem::stats();
+  REQUIRE(s.depot_puts > 0);
+  REQUIRE(s.frees <= s.allocs);
+
+  // Batches released by the consumer thread are reused here
+  auto before = fux::mem::stats();
+  std::vector<char *> again;
+  for (int i = 0; i < 64; i++) {
+    again.push_back(alloc(200));
+  }
+  REQUIRE(fux::mem::stats().depot_gets > before.depot_gets);
+  for (auto buf : again) {
+    tpfree(buf);
+  }
+}
+
+TEST_CASE("arena buffers", "[mem]") {
+  fux::mem::arena arena;
+  auto heap = alloc(100);
+
+  fux::mem::use_arena(&arena);
+  auto before = fux::mem::stats();
+  auto a = alloc(100);
+  auto b = alloc(100);
+  REQUIRE(fux::mem::stats().allocs == before.allocs);
+  REQUIRE(b > a);
+
+  // Most recent allocation is given back and grows in place
+  tpfree(b);
+  REQUIRE(alloc(100) == b);
+  memset(b, 'x', 100);
+  REQUIRE(tprealloc(b, 1000) == b);
+  REQUIRE(b[99] == 'x');
+
+  // Older buffers are moved
+  memset(a, 'y', 100);
+  auto moved = tprealloc(a, 1000);
+  REQUIRE(moved != a);
+  REQUIRE(moved[99] == 'y');
+
+  auto big = alloc(1024 * 1024);
+  REQUIRE(big != nullptr);
+  big[1024 * 1024 - 1] = 'z';
+
+  // Heap buffers stay on the heap
+  REQUIRE(tprealloc(heap, 200) == heap);
+  tpfree(heap);
+  REQUIRE(fux::mem::stats().frees == before.frees + 1);
+
+  arena.reset();
+  REQUIRE(alloc(100) == a);
+  arena.reset();
+  fux::mem::use_arena(nullptr);
+
+  auto after = alloc(100);
+  REQUIRE(fux::mem::stats().allocs == before.allocs + 1);
+  tpfree(after);
+}
+
+TEST_CASE("arena FML32 buffers", "[mem]") {
+  fux::mem::arena arena;
+  fux::mem::use_arena(&arena);
+  auto fld = Fmkfldid32(FLD_LONG, 10);
+  auto fbfr = reinterpret_cast<FBFR32 *>(
+      tpalloc(DECONST("FML32"), DECONST("*"), 1024));
+  for (long i = 0; i < 10000; i++) {
+    if (Fadd32(fbfr, fld, reinterpret_cast<char *>(&i), 0) == -1) {
+      REQUIRE(Ferror32 == FNOSPACE);
+      fbfr = reinterpret_cast<FBFR32 *>(
+          tprealloc(reinterpret_cast<char *>(fbfr), Fsizeof32(fbfr) * 2));
+      i--;
+    }
+  }
+  REQUIRE(Foccur32(fbfr, fld) == 10000);
+  tpfree(reinterpret_cast<char *>(fbfr));
+  fux::mem::use_arena(nullptr);
+}
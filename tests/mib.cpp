@@ -2,11 +2,15 @@
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
 #include <catch.hpp>
+#include <cstdlib>
+#include <sstream>
 #include <stdexcept>
 
 #include "../src/mib.h"
 #include "../src/ubbreader.h"
 
+void ubb2mib(ubbconfig &u, mib &m);
+
 TEST_CASE("services can be advertised", "[mib]") {
   tuxconfig tuxcfg;
   tuxcfg.size = 0;
@@ -22,8 +26,18 @@ TEST_CASE("services can be advertised", "[mib]") {
 
   m.advertise("service", q, srv);
   REQUIRE_THROWS_AS(m.advertise("service", q, srv), std::logic_error);
+  REQUIRE(m.services().at(m.find_service("service")).options.prio ==
+          fux::ipc::default_priority);
   m.unadvertise("service", q, srv);
   REQUIRE_THROWS_AS(m.unadvertise("service", q, srv), std::logic_error);
+
+  m.advertise("service", q, srv);
+  m.advertise("service2", q, srv);
+  auto revision = m.services().at(m.find_service("service")).revision;
+  m.unadvertise(srv);
+  REQUIRE(m.services().at(m.find_service("service")).revision > revision);
+  REQUIRE_THROWS_AS(m.unadvertise("service2", q, srv), std::logic_error);
+  m.advertise("service", q, srv);
 }
 
 SCENARIO("servers can be added", "[mib]") {
@@ -60,3 +74,141 @@ SCENARIO("servers can be added", "[mib]") {
     }
   }
 }
+
+TEST_CASE("servers of other machines are reached through bridge", "[mib]") {
+  std::istringstream ubb(R"(
+*RESOURCES
+IPCKEY 32769
+*MACHINES
+host LMID=SITE1 TUXCONFIG="/tmp/site1" TUXDIR="/" APPDIR="/tmp"
+host LMID=SITE2 TUXCONFIG="/tmp/site2" TUXDIR="/" APPDIR="/tmp"
+*GROUPS
+GROUP1 LMID=SITE1 GRPNO=1
+GROUP2 LMID=SITE2 GRPNO=2
+*SERVERS
+server1 SRVGRP=GROUP1 SRVID=1
+server2 SRVGRP=GROUP2 SRVID=1
+*NETWORK
+SITE1 NADDR="//127.0.0.1:42001"
+SITE2 NADDR="//127.0.0.1:42002"
+)");
+  ubbreader reader(ubb);
+  auto u = reader.parse();
+
+  tuxconfig tuxcfg;
+  tuxcfg.size = 0;
+  tuxcfg.ipckey = 0;
+  tuxcfg.maxservers = 5;
+  tuxcfg.maxservices = 5;
+  tuxcfg.maxgroups = 5;
+  tuxcfg.maxqueues = 5;
+  tuxcfg.maxaccessers = 5;
+  mib m(tuxcfg, fux::mib::in_heap());
+
+  setenv("TUXCONFIG", "/tmp/site2", 1);
+  REQUIRE(std::string(local_machine(u).second.at("LMID")) == "SITE2");
+  ubb2mib(u, m);
+  REQUIRE(std::string(m.mach().lmid) == "SITE2");
+  auto bridge = m.find_server(1, 0);
+  REQUIRE(bridge != mib::badoff);
+  REQUIRE(std::string(m.servers().at(bridge).servername) == "BRIDGE");
+  REQUIRE(m.find_server(1, 1) == mib::badoff);
+  REQUIRE(m.find_server(1, 2) != mib::badoff);
+
+  setenv("TUXCONFIG", "/tmp/site3", 1);
+  REQUIRE_THROWS_AS(local_machine(u), std::logic_error);
+
+  u.network.pop_back();
+  setenv("TUXCONFIG", "/tmp/site1", 1);
+  mib m2(tuxcfg, fux::mib::in_heap());
+  REQUIRE_THROWS_AS(ubb2mib(u, m2), std::out_of_range);
+}
+
+TEST_CASE("dispatch threads of servers", "[mib]") {
+  std::istringstream ubb(R"(
+*RESOURCES
+IPCKEY 32769
+*MACHINES
+host LMID=SITE1 TUXCONFIG="/tmp/site1" TUXDIR="/" APPDIR="/tmp"
+*GROUPS
+GROUP1 LMID=SITE1 GRPNO=1
+*SERVERS
+server1 SRVGRP=GROUP1 SRVID=1
+server2 SRVGRP=GROUP1 SRVID=2 MAXDISPATCHTHREADS=64 THREADSTACKSIZE=1048576
+server3 SRVGRP=GROUP1 SRVID=3 MINDISPATCHTHREADS=1 MAXDISPATCHTHREADS=1
+)");
+  ubbreader reader(ubb);
+  auto u = reader.parse();
+
+  tuxconfig tuxcfg;
+  tuxcfg.size = 0;
+  tuxcfg.ipckey = 0;
+  tuxcfg.maxservers = 5;
+  tuxcfg.maxservices = 5;
+  tuxcfg.maxgroups = 5;
+  tuxcfg.maxqueues = 5;
+  tuxcfg.maxaccessers = 5;
+  mib m(tuxcfg, fux::mib::in_heap());
+
+  setenv("TUXCONFIG", "/tmp/site1", 1);
+  ubb2mib(u, m);
+  auto &server1 = m.servers().at(m.find_server(1, 1));
+  REQUIRE(server1.min_threads == default_dispatch_threads);
+  REQUIRE(server1.max_threads == default_dispatch_threads);
+  REQUIRE(server1.stacksize == 0);
+  auto &server2 = m.servers().at(m.find_server(2, 1));
+  REQUIRE(server2.min_threads == default_dispatch_threads);
+  REQUIRE(server2.max_threads == 64);
+  REQUIRE(server2.stacksize == 1048576);
+  auto &server3 = m.servers().at(m.find_server(3, 1));
+  REQUIRE(server3.min_threads == 1);
+  REQUIRE(server3.max_threads == 1);
+
+  u.servers.back().second["MINDISPATCHTHREADS"] = "2";
+  mib m2(tuxcfg, fux::mib::in_heap());
+  REQUIRE_THROWS_AS(ubb2mib(u, m2), std::out_of_range);
+}
+
+TEST_CASE("autoscaling of servers", "[mib]") {
+  std::istringstream ubb(R"(
+*RESOURCES
+IPCKEY 32769
+*MACHINES
+host LMID=SITE1 TUXCONFIG="/tmp/site1" TUXDIR="/" APPDIR="/tmp"
+*GROUPS
+GROUP1 LMID=SITE1 GRPNO=1
+*SERVERS
+server1 SRVGRP=GROUP1 SRVID=1
+server2 SRVGRP=GROUP1 SRVID=10 MIN=1 MAX=3 RQADDR=Q2 SCALEUP=4 COOLDOWN=5
+)");
+  ubbreader reader(ubb);
+  auto u = reader.parse();
+
+  tuxconfig tuxcfg;
+  tuxcfg.size = 0;
+  tuxcfg.ipckey = 0;
+  tuxcfg.maxservers = 5;
+  tuxcfg.maxservices = 5;
+  tuxcfg.maxgroups = 5;
+  tuxcfg.maxqueues = 5;
+  tuxcfg.maxaccessers = 5;
+  mib m(tuxcfg, fux::mib::in_heap());
+
+  setenv("TUXCONFIG", "/tmp/site1", 1);
+  ubb2mib(u, m);
+  auto &server1 = m.servers().at(m.find_server(1, 1));
+  REQUIRE(server1.scaleup == 0);
+  REQUIRE(server1.cooldown == default_cooldown);
+  REQUIRE(server1.basesrvid == 1);
+  for (uint16_t srvid = 10; srvid < 13; srvid++) {
+    auto &server = m.servers().at(m.find_server(srvid, 1));
+    REQUIRE(server.basesrvid == 10);
+    REQUIRE(server.scaleup == 4);
+    REQUIRE(server.cooldown == 5);
+    REQUIRE(server.autostart == (srvid == 10));
+  }
+
+  u.servers.back().second["COOLDOWN"] = "0";
+  mib m2(tuxcfg, fux::mib::in_heap());
+  REQUIRE_THROWS_AS(ubb2mib(u, m2), std::out_of_range);
+}
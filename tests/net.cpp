@@ -0,0 +1,73 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <catch.hpp>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "../src/net.h"
+
+using fux::net::frame_kind;
+
+TEST_CASE("frames split across reads", "[net]") {
+  int sv[2];
+  REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+  int epfd = epoll_create1(0);
+  REQUIRE(epfd != -1);
+
+  fux::net::connection out(1, sv[0]), in(2, sv[1]);
+  out.append(frame_kind::request, "hello", 5);
+  out.append(frame_kind::reply, "", 0);
+  std::string big(100000, 'x');
+  out.append(frame_kind::services, big.data(), big.size());
+
+  std::vector<std::pair<frame_kind, std::string>> frames;
+  auto handle = [&](frame_kind kind, const char *data, size_t len) {
+    frames.emplace_back(kind, std::string(data, len));
+  };
+  // Socket buffer takes only a part of the last frame
+  while (!out.out.empty()) {
+    REQUIRE(out.flush(epfd));
+    in.receive(handle);
+  }
+
+  REQUIRE(frames.size() == 3);
+  REQUIRE(frames[0].first == frame_kind::request);
+  REQUIRE(frames[0].second == "hello");
+  REQUIRE(frames[1].first == frame_kind::reply);
+  REQUIRE(frames[1].second.empty());
+  REQUIRE(frames[2].second == big);
+  REQUIRE(in.in.empty());
+
+  close(sv[0]);
+  REQUIRE_THROWS(in.receive(handle));
+  close(sv[1]);
+  close(epfd);
+}
+
+TEST_CASE("file descriptors passed over socket", "[net]") {
+  int sv[2], p[2];
+  REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  REQUIRE(pipe(p) == 0);
+
+  fux::net::send_fd(sv[0], p[1]);
+  int fd = fux::net::recv_fd(sv[1]);
+  REQUIRE(fd != -1);
+  REQUIRE(fd != p[1]);
+  REQUIRE(write(fd, "x", 1) == 1);
+  char c;
+  REQUIRE(read(p[0], &c, 1) == 1);
+  REQUIRE(c == 'x');
+
+  close(sv[0]);
+  REQUIRE(fux::net::recv_fd(sv[1]) == -1);
+  close(sv[1]);
+  close(fd);
+  close(p[0]);
+  close(p[1]);
+}
@@ -0,0 +1,216 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <catch.hpp>
+
+#include <sys/shm.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "../src/ipc.h"
+#include "../src/shmheap.h"
+
+using fux::mem::shmheap;
+
+struct ring_fixture {
+  int shmid;
+  int ringid;
+  fux::ipc::msg rq, rs;
+  ring_fixture() {
+    shmid = shmheap::create(4 * 1024 * 1024);
+    shmheap::attach(shmid, false);
+    ringid = fux::ipc::qcreate(fux::ipc::backend::ring);
+  }
+  ~ring_fixture() {
+    if (fux::ipc::qexists(ringid)) {
+      fux::ipc::qdelete(ringid);
+    }
+    shmheap::detach();
+    shmctl(shmid, IPC_RMID, nullptr);
+  }
+};
+
+TEST_CASE_METHOD(ring_fixture, "send and receive ring message", "[ring]") {
+  REQUIRE(ringid < -1);
+  REQUIRE(fux::ipc::qexists(ringid));
+
+  rq.resize(512);
+  rq->mtype = 1;
+  std::copy_n("ServiceName", sizeof("ServiceName"), rq->servicename);
+  rq->cd = 2;
+  REQUIRE(fux::ipc::qsend(ringid, rq, 0, fux::ipc::flags::noflags));
+  rq->cd = 3;
+  REQUIRE(fux::ipc::qsend(ringid, rq, 0, fux::ipc::flags::noflags));
+
+  REQUIRE(fux::ipc::qlength(ringid) == 2);
+
+  fux::ipc::qrecv(ringid, rs, 0, 0);
+  REQUIRE(rs.size() == rq.size());
+  REQUIRE(rs->ttype == fux::ipc::queue);
+  REQUIRE(strcmp(rs->servicename, "ServiceName") == 0);
+  REQUIRE(rs->cd == 2);
+  fux::ipc::qrecv(ringid, rs, 0, 0);
+  REQUIRE(rs->cd == 3);
+
+  REQUIRE_THROWS_AS(fux::ipc::qrecv(ringid, rs, 0, IPC_NOWAIT),
+                    std::system_error);
+}
+
+TEST_CASE_METHOD(ring_fixture, "ring full and receive by id", "[ring]") {
+  rq.resize(512);
+
+  int i = 1;
+  while (true) {
+    rq->mtype = i;
+    if (!fux::ipc::qsend(ringid, rq, 0, fux::ipc::flags::noblock)) {
+      i--;
+      break;
+    }
+    i++;
+  }
+  REQUIRE(i > 2);
+
+  rq->mtype = i + 1;
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(!fux::ipc::qsend(ringid, rq, 50, fux::ipc::flags::noflags));
+  REQUIRE(std::chrono::steady_clock::now() - start >=
+          std::chrono::milliseconds(50));
+
+  // Other types are skipped, the freed cell is not the oldest one so the
+  // ring stays full until that is taken
+  fux::ipc::qrecv(ringid, rs, 2, IPC_NOWAIT);
+  REQUIRE(rs->mtype == 2);
+  REQUIRE(fux::ipc::qlength(ringid) == size_t(i - 1));
+  REQUIRE(!fux::ipc::qsend(ringid, rq, 0, fux::ipc::flags::noblock));
+  for (int j = i; j >= 1; j--) {
+    if (j != 2) {
+      fux::ipc::qrecv(ringid, rs, j, 0);
+      REQUIRE(rs->mtype == j);
+    }
+  }
+  REQUIRE(fux::ipc::qlength(ringid) == 0);
+  REQUIRE(fux::ipc::qsend(ringid, rq, 0, fux::ipc::flags::noblock));
+}
+
+TEST_CASE_METHOD(ring_fixture, "ring receive skips other types", "[ring]") {
+  rq.resize(64);
+  for (long mtype : {5, 1, 3, 1}) {
+    rq->mtype = mtype;
+    fux::ipc::qsend(ringid, rq, 0, fux::ipc::flags::noflags);
+  }
+
+  // Negative type takes the lowest type first like msgrcv
+  fux::ipc::qrecv(ringid, rs, -4, 0);
+  REQUIRE(rs->mtype == 1);
+  fux::ipc::qrecv(ringid, rs, 3, 0);
+  REQUIRE(rs->mtype == 3);
+  fux::ipc::qrecv(ringid, rs, -4, 0);
+  REQUIRE(rs->mtype == 1);
+  REQUIRE_THROWS_AS(fux::ipc::qrecv(ringid, rs, -4, IPC_NOWAIT),
+                    std::system_error);
+
+  long received = 0;
+  std::thread t([&] {
+    fux::ipc::msg m;
+    fux::ipc::qrecv(ringid, m, 7, 0);
+    received = m->mtype;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  rq->mtype = 7;
+  fux::ipc::qsend(ringid, rq, 0, fux::ipc::flags::noflags);
+  t.join();
+  REQUIRE(received == 7);
+  fux::ipc::qrecv(ringid, rs, 0, 0);
+  REQUIRE(rs->mtype == 5);
+  REQUIRE_THROWS_AS(fux::ipc::qrecv(ringid, rs, 0, IPC_NOWAIT),
+                    std::system_error);
+}
+
+TEST_CASE_METHOD(ring_fixture, "large ring message", "[ring]") {
+  auto heap = shmheap::current();
+  rq.resize_data(fux::ipc::qmsgmax() * 2);
+  for (size_t i = 0; i < rq.size_data(); i++) {
+    rq->data[i] = i % 251;
+  }
+  REQUIRE(fux::ipc::qsend(ringid, rq, 0, fux::ipc::flags::noflags));
+  REQUIRE(heap->statistics().blocks == 2);
+  fux::ipc::qrecv(ringid, rs, 0, 0);
+  REQUIRE(heap->statistics().blocks == 1);
+  REQUIRE(rs->ttype == fux::ipc::shm);
+  REQUIRE(rs.size() == rq.size());
+  REQUIRE(memcmp(rs->data, rq->data, rq.size_data()) == 0);
+}
+
+TEST_CASE_METHOD(ring_fixture, "ring wakes up waiters", "[ring]") {
+  SECTION("receiver") {
+    std::thread t([this] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      fux::ipc::msg m;
+      m.resize_data(128);
+      m->cd = 7;
+      fux::ipc::qsend(ringid, m, 0, fux::ipc::flags::noflags);
+    });
+    fux::ipc::qrecv(ringid, rs, 0, 0);
+    REQUIRE(rs->cd == 7);
+    t.join();
+  }
+
+  SECTION("timed receiver") {
+    auto start = std::chrono::steady_clock::now();
+    try {
+      fux::ipc::qrecv(ringid, rs, 0, 0, 30);
+      FAIL("message received");
+    } catch (const std::system_error &e) {
+      REQUIRE(e.code().value() == ENOMSG);
+    }
+    REQUIRE(std::chrono::steady_clock::now() - start >=
+            std::chrono::milliseconds(30));
+  }
+
+  SECTION("deleted") {
+    std::thread t([this] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      fux::ipc::qdelete(ringid);
+    });
+    REQUIRE_THROWS_AS(fux::ipc::qrecv(ringid, rs, 0, 0), std::system_error);
+    t.join();
+    REQUIRE(!fux::ipc::qexists(ringid));
+  }
+}
+
+TEST_CASE_METHOD(ring_fixture, "ring with many producers and consumers",
+                 "[ring]") {
+  constexpr int threads = 4;
+  constexpr int count = 10000;
+  std::atomic<long> sum{0};
+  std::vector<std::thread> workers;
+
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([this] {
+      fux::ipc::msg m;
+      m.resize_data(64);
+      for (int i = 1; i <= count; i++) {
+        m->cd = i;
+        fux::ipc::qsend(ringid, m, 0, fux::ipc::flags::notime);
+      }
+    });
+    workers.emplace_back([this, &sum] {
+      fux::ipc::msg m;
+      for (int i = 0; i < count; i++) {
+        fux::ipc::qrecv(ringid, m, 0, 0);
+        sum += m->cd;
+      }
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  REQUIRE(sum == long(threads) * count * (count + 1) / 2);
+  REQUIRE_THROWS_AS(fux::ipc::qrecv(ringid, rs, 0, IPC_NOWAIT),
+                    std::system_error);
+}
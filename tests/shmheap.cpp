@@ -0,0 +1,224 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <catch.hpp>
+
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <xatmi.h>
+#include <cstring>
+#include <vector>
+
+#include "../src/ipc.h"
+#include "../src/misc.h"
+#include "../src/shmheap.h"
+#include "misc.h"
+
+using fux::mem::shmheap;
+
+struct heap_fixture {
+  int shmid;
+  shmheap *heap;
+  heap_fixture() {
+    shmid = shmheap::create(1024 * 1024);
+    heap = shmheap::attach(shmid, true);
+  }
+  ~heap_fixture() {
+    shmheap::detach();
+    shmctl(shmid, IPC_RMID, nullptr);
+  }
+};
+
+TEST_CASE_METHOD(heap_fixture, "shared heap blocks", "[shmheap]") {
+  REQUIRE(shmheap::current() == heap);
+  auto stats = heap->statistics();
+  REQUIRE(stats.capacity > 1000 * 1024);
+  REQUIRE(stats.carved == 0);
+  REQUIRE(stats.blocks == 0);
+
+  auto a = heap->allocate(100);
+  auto b = heap->allocate(1000);
+  REQUIRE(a != nullptr);
+  REQUIRE(b != nullptr);
+  REQUIRE(heap->capacity(a) >= 100);
+  REQUIRE(heap->capacity(b) >= 1000);
+  REQUIRE(heap->contains(a));
+  REQUIRE(heap->statistics().blocks == 2);
+
+  REQUIRE(heap->pointer(heap->offset(a)) == a);
+  REQUIRE(heap->pointer(heap->offset(b)) == b);
+  REQUIRE_THROWS_AS(heap->pointer(0), std::out_of_range);
+  REQUIRE_THROWS_AS(heap->pointer(heap->offset(b) + 8), std::out_of_range);
+  REQUIRE_THROWS_AS(heap->pointer(1024 * 1024 * 1024), std::out_of_range);
+
+  auto off = heap->offset(a);
+  heap->deallocate(a);
+  REQUIRE_THROWS_AS(heap->pointer(off), std::out_of_range);
+  REQUIRE_THROWS_AS(heap->deallocate(a), std::logic_error);
+  // Freed blocks are reused
+  REQUIRE(heap->allocate(50) == a);
+
+  REQUIRE(heap->allocate(2 * 1024 * 1024) == nullptr);
+  std::vector<void *> blocks;
+  while (auto p = heap->allocate(32 * 1024)) {
+    blocks.push_back(p);
+  }
+  REQUIRE(blocks.size() >= 14);
+  REQUIRE(heap->statistics().blocks == blocks.size() + 2);
+  for (auto p : blocks) {
+    heap->deallocate(p);
+  }
+  REQUIRE(heap->statistics().blocks == 2);
+}
+
+TEST_CASE_METHOD(heap_fixture, "typed buffers in shared heap", "[shmheap]") {
+  auto buf = tpalloc(DECONST("STRING"), nullptr, 100);
+  REQUIRE(buf != nullptr);
+  REQUIRE(heap->contains(buf));
+  REQUIRE(heap->statistics().blocks == 1);
+  strcpy(buf, "hello");
+
+  auto same = tprealloc(buf, 110);
+  REQUIRE(same == buf);
+  buf = tprealloc(buf, 100 * 1024);
+  REQUIRE(heap->contains(buf));
+  REQUIRE(strcmp(buf, "hello") == 0);
+  REQUIRE(heap->statistics().blocks == 1);
+
+  // Too big for the heap, moved to private memory
+  buf = tprealloc(buf, 2 * 1024 * 1024);
+  REQUIRE(buf != nullptr);
+  REQUIRE(!heap->contains(buf));
+  REQUIRE(strcmp(buf, "hello") == 0);
+  REQUIRE(heap->statistics().blocks == 0);
+  tpfree(buf);
+
+  buf = tpalloc(DECONST("FML32"), nullptr, 1024);
+  REQUIRE(heap->contains(buf));
+  tpfree(buf);
+  REQUIRE(heap->statistics().blocks == 0);
+}
+
+TEST_CASE_METHOD(heap_fixture, "messages pass shared heap buffers",
+                 "[shmheap]") {
+  int msqid = fux::ipc::qcreate();
+  auto buf = tpalloc(DECONST("STRING"), nullptr, 100);
+  strcpy(buf, "hello");
+  auto out = tpalloc(DECONST("STRING"), nullptr, 10);
+  fux::mem::setowner(out, &out);
+  REQUIRE(heap->statistics().blocks == 2);
+
+  SECTION("copy") {
+    fux::ipc::msg rq;
+    rq.set_data(buf, 0);
+    REQUIRE(rq.size_data() == 24 + 6);
+    REQUIRE(heap->statistics().blocks == 3);
+    REQUIRE(fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags));
+    tpfree(buf);
+
+    fux::ipc::msg rs;
+    fux::ipc::qrecv(msqid, rs, 0, 0);
+    REQUIRE(rs.size_data() == 24 + 6);
+    auto old = out;
+    rs.get_data(&out);
+    REQUIRE(out != old);
+    REQUIRE(strcmp(out, "hello") == 0);
+    REQUIRE_THROWS_AS(rs.get_data(&out), std::logic_error);
+    REQUIRE_THROWS_AS(fux::ipc::qsend(msqid, rs, 0, fux::ipc::flags::noflags),
+                      std::logic_error);
+  }
+
+  SECTION("ownership transfer") {
+    fux::ipc::msg rq;
+    REQUIRE(rq.give_data(buf, 0));
+    REQUIRE(heap->statistics().blocks == 2);
+    REQUIRE(fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags));
+
+    fux::ipc::msg rs;
+    fux::ipc::qrecv(msqid, rs, 0, 0);
+    rs.get_data(&out);
+    REQUIRE(out == buf);
+    REQUIRE(strcmp(out, "hello") == 0);
+  }
+
+  SECTION("unsent buffers are released") {
+    {
+      fux::ipc::msg rq;
+      REQUIRE(rq.give_data(buf, 0));
+      rq.set_data(out, 0);
+      REQUIRE(heap->statistics().blocks == 2);
+    }
+    REQUIRE(heap->statistics().blocks == 1);
+  }
+
+  SECTION("unreceived buffers are released") {
+    fux::ipc::msg rq;
+    rq.set_data(buf, 0);
+    tpfree(buf);
+    REQUIRE(fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags));
+    fux::ipc::msg rs;
+    fux::ipc::qrecv(msqid, rs, 0, 0);
+    REQUIRE(heap->statistics().blocks == 2);
+    rs = fux::ipc::msg();
+    REQUIRE(heap->statistics().blocks == 1);
+  }
+
+  tpfree(out);
+  REQUIRE(heap->statistics().blocks == 0);
+  fux::ipc::qdelete(msqid);
+}
+
+TEST_CASE_METHOD(heap_fixture, "large messages go through shared heap",
+                 "[shmheap]") {
+  int msqid = fux::ipc::qcreate();
+  fux::ipc::msg rq, rs;
+  rq.resize_data(fux::ipc::qmsgmax() + 1000);
+  rq->cat = fux::ipc::admin;
+  rq->cd = 42;
+  for (size_t i = 0; i < rq.size_data(); i++) {
+    rq->data[i] = i % 251;
+  }
+
+  REQUIRE(fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags));
+  REQUIRE(heap->statistics().blocks == 1);
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  REQUIRE(heap->statistics().blocks == 0);
+
+  REQUIRE(rs->ttype == fux::ipc::shm);
+  REQUIRE(rs->cat == fux::ipc::admin);
+  REQUIRE(rs->cd == 42);
+  REQUIRE(rs.size() == rq.size());
+  REQUIRE(memcmp(rs->data, rq->data, rq.size_data()) == 0);
+  fux::ipc::qdelete(msqid);
+}
+
+TEST_CASE_METHOD(heap_fixture, "lost blocks are reclaimed", "[shmheap]") {
+  auto mine = heap->allocate(100);
+  REQUIRE(heap->reclaim(fux::ipc::qexists) == 0);
+
+  SECTION("queue removed") {
+    int msqid = fux::ipc::qcreate();
+    auto p = heap->allocate(100);
+    heap->enqueue(p, msqid);
+    REQUIRE(heap->reclaim(fux::ipc::qexists) == 0);
+    fux::ipc::qdelete(msqid);
+    REQUIRE(heap->reclaim(fux::ipc::qexists) == 1);
+  }
+
+  SECTION("holder exited") {
+    auto pid = fork();
+    if (pid == 0) {
+      heap->allocate(100);
+      _exit(0);
+    }
+    REQUIRE(pid > 0);
+    int status;
+    waitpid(pid, &status, 0);
+    REQUIRE(heap->statistics().blocks == 2);
+    REQUIRE(heap->reclaim(fux::ipc::qexists) == 1);
+  }
+
+  REQUIRE(heap->statistics().blocks == 1);
+  heap->deallocate(mine);
+}
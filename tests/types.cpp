@@ -0,0 +1,166 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <catch.hpp>
+
+#include <tmtypes.h>
+#include <xatmi.h>
+#include <cstring>
+
+#include "../src/ipc.h"
+#include "misc.h"
+
+// String buffer sent as hex digits, encoded form is bigger than the buffer
+static int inits = 0;
+static int uninits = 0;
+static int recvs = 0;
+
+static int hex_initbuf(char *ptr, long) {
+  inits++;
+  ptr[0] = '\0';
+  return 1;
+}
+
+static int hex_uninitbuf(char *, long) {
+  uninits++;
+  return 1;
+}
+
+static long hex_presend(char *ptr, long, long) { return strlen(ptr) + 1; }
+
+static long hex_postrecv(char *, long dlen, long) {
+  recvs++;
+  return dlen;
+}
+
+static long hex_encdec(int op, char *encobj, long elen, char *obj, long olen) {
+  static const char digits[] = "0123456789abcdef";
+  if (op == TMENCODE) {
+    if (olen * 2 > elen) {
+      return olen * 2;
+    }
+    for (long i = 0; i < olen; i++) {
+      encobj[i * 2] = digits[(obj[i] >> 4) & 0xf];
+      encobj[i * 2 + 1] = digits[obj[i] & 0xf];
+    }
+    return olen * 2;
+  }
+  if (elen / 2 > olen) {
+    return elen / 2;
+  }
+  for (long i = 0; i < elen / 2; i++) {
+    auto hi = strchr(digits, encobj[i * 2]) - digits;
+    auto lo = strchr(digits, encobj[i * 2 + 1]) - digits;
+    obj[i] = hi << 4 | lo;
+  }
+  return elen / 2;
+}
+
+static void register_hex() {
+  static bool done = false;
+  if (!done) {
+    tmtype_sw_t sw = {"HEXSTR",      "*",          64,
+                      hex_initbuf,   nullptr,      hex_uninitbuf,
+                      hex_presend,   nullptr,      hex_postrecv,
+                      hex_encdec};
+    REQUIRE(tpregtype(&sw) == 0);
+    done = true;
+  }
+}
+
+TEST_CASE("tpregtype errors", "[types]") {
+  register_hex();
+  REQUIRE(tpregtype(nullptr) == -1);
+  REQUIRE(tperrno == TPEINVAL);
+
+  tmtype_sw_t sw = {};
+  REQUIRE(tpregtype(&sw) == -1);
+  REQUIRE(tperrno == TPEINVAL);
+
+  strcpy(sw.type, "STRING");
+  strcpy(sw.subtype, "*");
+  REQUIRE(tpregtype(&sw) == -1);
+  REQUIRE(tperrno == TPEMATCH);
+
+  strcpy(sw.type, "HEXSTR");
+  REQUIRE(tpregtype(&sw) == -1);
+  REQUIRE(tperrno == TPEMATCH);
+}
+
+TEST_CASE("user buffer type", "[types]") {
+  register_hex();
+  auto before = inits;
+  auto buf = tpalloc(DECONST("HEXSTR"), nullptr, 0);
+  REQUIRE(buf != nullptr);
+  REQUIRE(inits == before + 1);
+  REQUIRE(buf[0] == '\0');
+
+  char type[8], subtype[16];
+  REQUIRE(tptypes(buf, type, subtype) == 0);
+  REQUIRE(strcmp(type, "HEXSTR") == 0);
+
+  buf = tprealloc(buf, 1000);
+  REQUIRE(buf != nullptr);
+  REQUIRE(tptypes(buf, type, subtype) == 0);
+  REQUIRE(strcmp(type, "HEXSTR") == 0);
+
+  before = uninits;
+  tpfree(buf);
+  REQUIRE(uninits == before + 1);
+}
+
+TEST_CASE("user buffer type export and import", "[types]") {
+  register_hex();
+  auto buf = tpalloc(DECONST("HEXSTR"), nullptr, 0);
+  strcpy(buf, "hello");
+  auto copy = tpalloc(DECONST("STRING"), nullptr, 0);
+
+  SECTION("binary") {
+    char ostr[1024];
+    long olen = 10;
+    REQUIRE(tpexport(buf, 0, ostr, &olen, 0) == -1);
+    REQUIRE(tperrno == TPELIMIT);
+    REQUIRE(olen == 24 + 12);
+
+    olen = sizeof(ostr);
+    REQUIRE(tpexport(buf, 0, ostr, &olen, 0) == 0);
+    REQUIRE(olen == 24 + 12);
+    REQUIRE(strcmp(ostr, "HEXSTR") == 0);
+    REQUIRE(memcmp(ostr + 24, "68656c6c6f00", 12) == 0);
+
+    auto before = recvs;
+    REQUIRE(tpimport(ostr, olen, &copy, &olen, 0) == 0);
+    REQUIRE(recvs == before + 1);
+    REQUIRE(olen == 6);
+  }
+
+  SECTION("string") {
+    char ostr[1024];
+    long olen = sizeof(ostr);
+    REQUIRE(tpexport(buf, 0, ostr, &olen, TPEX_STRING) == 0);
+    REQUIRE(tpimport(ostr, 0, &copy, &olen, TPEX_STRING) == 0);
+  }
+
+  REQUIRE(strcmp(copy, "hello") == 0);
+  char type[8];
+  REQUIRE(tptypes(copy, type, nullptr) == 0);
+  REQUIRE(strcmp(type, "HEXSTR") == 0);
+  tpfree(buf);
+  tpfree(copy);
+}
+
+TEST_CASE("user buffer type in ipc message", "[types]") {
+  register_hex();
+  auto buf = tpalloc(DECONST("HEXSTR"), nullptr, 0);
+  strcpy(buf, "a longer string to send");
+
+  fux::ipc::msg m;
+  m.set_data(buf, 0);
+  REQUIRE(m.size_data() == 24 + 2 * (strlen(buf) + 1));
+
+  auto copy = tpalloc(DECONST("CARRAY"), nullptr, 1);
+  m.get_data(&copy);
+  REQUIRE(strcmp(copy, buf) == 0);
+  tpfree(buf);
+  tpfree(copy);
+}